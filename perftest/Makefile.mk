@@ -1,4 +1,4 @@
-check_PROGRAMS += logperf
+check_PROGRAMS += logperf queueperf
 
 # TESTS += logperf$(EXEEXT)
 
@@ -15,3 +15,28 @@ logperf_LDADD = \
 
 logperf_LDFLAGS = \
  -pthread
+
+queueperf_SOURCES = \
+ perftest/queueperf.cc
+
+queueperf_LDADD = \
+ libserver.a \
+ libhttpserver.a \
+ librest.a \
+ libjsonxapian.a \
+ libngramcat.a \
+ libjsonmanip.a \
+ libcjktokenizer.a \
+ libdbgroup.a \
+ libutils.a \
+ libjsoncpp.a \
+ liblogger.a \
+ libpostingsources.a \
+ libmatchspies.a \
+ libgeospatial.a \
+ libxapiancommon.a \
+ libs/libmicrohttpd/src/daemon/libmicrohttpd.la \
+ $(XAPIAN_LIBS)
+
+queueperf_LDFLAGS = \
+ -pthread
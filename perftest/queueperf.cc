@@ -0,0 +1,177 @@
+/** @file queueperf.cc
+ * @brief Performance test for popping tasks from a task queue group.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Pushes small tasks onto a task queue group from one thread, while a number
+ * of threads pop and perform them, and reports the rate at which tasks are
+ * performed.  Each thread count is run with threads popping one task at a
+ * time (as processing threads do), and with threads popping as workers (as
+ * search threads do).
+ *
+ * Usage: queueperf [TASKS [WORK [MAX_THREADS]]]
+ *
+ * WORK is the number of iterations of a busy loop performed for each task.
+ */
+
+#include <config.h>
+#include "server/task_queue_group.h"
+
+#include "realtime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "utils/threading.h"
+#include <vector>
+
+/** A task which does nothing but count.
+ */
+class CountTask : public Task {
+  public:
+    unsigned long work;
+
+    CountTask(unsigned long work_) : Task(), work(work_) {}
+
+    /** Perform the task.
+     */
+    void perform() const {
+	volatile unsigned long counter = 0;
+	for (unsigned long i = 0; i != work; ++i) {
+	    counter = counter + 1;
+	}
+    }
+};
+
+/** A thread popping tasks from a group until it is closed and empty.
+ */
+class PopThread : public Thread {
+    TaskQueueGroup & group;
+    TaskQueueGroup::Worker * worker;
+  public:
+    unsigned long performed;
+
+    PopThread(TaskQueueGroup & group_, bool use_worker)
+	    : Thread(), group(group_), worker(NULL), performed(0)
+    {
+	if (use_worker) {
+	    worker = new TaskQueueGroup::Worker;
+	    group.add_worker(*worker);
+	}
+    }
+
+    ~PopThread() {
+	stop();
+	join();
+	if (worker != NULL) {
+	    group.remove_worker(*worker, NULL);
+	    delete worker;
+	}
+    }
+
+    void run() {
+	std::string key;
+	Task * task = NULL;
+	while (true) {
+	    Task * newtask;
+	    if (worker != NULL) {
+		newtask = group.pop_any(*worker, key, task);
+	    } else {
+		newtask = group.pop_any(key, task);
+	    }
+	    delete task;
+	    task = newtask;
+	    if (task == NULL) {
+		return;
+	    }
+	    static_cast<CountTask *>(task)->perform();
+	    ++performed;
+	}
+    }
+};
+
+/** Run the test with a given number of threads, and return the time taken.
+ */
+static double
+run_test(unsigned threads, bool use_worker, unsigned long tasks,
+	 unsigned long work)
+{
+    TaskQueueGroup group(tasks + 1, tasks + 1);
+    std::vector<PopThread *> poppers;
+    for (unsigned i = 0; i != threads; ++i) {
+	poppers.push_back(new PopThread(group, use_worker));
+    }
+
+    double start(RealTime::now());
+    for (unsigned i = 0; i != threads; ++i) {
+	if (!poppers[i]->start()) {
+	    fprintf(stderr, "Couldn't start thread\n");
+	    exit(1);
+	}
+    }
+    for (unsigned long i = 0; i != tasks; ++i) {
+	(void) group.push("search", new CountTask(work), false);
+    }
+    group.close();
+
+    unsigned long performed = 0;
+    for (unsigned i = 0; i != threads; ++i) {
+	poppers[i]->join();
+	performed += poppers[i]->performed;
+    }
+    double end(RealTime::now());
+
+    for (unsigned i = 0; i != threads; ++i) {
+	delete poppers[i];
+    }
+    if (performed != tasks) {
+	fprintf(stderr, "Performed %lu tasks, but pushed %lu\n",
+		performed, tasks);
+	exit(1);
+    }
+    return end - start;
+}
+
+int main(int argc, const char ** argv) {
+    unsigned long tasks = 200000;
+    unsigned long work = 1000;
+    unsigned max_threads = 16;
+    if (argc > 1) {
+	tasks = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+	work = strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+	max_threads = strtoul(argv[3], NULL, 10);
+    }
+
+    printf("%lu tasks, %lu iterations of work per task\n", tasks, work);
+    printf("threads  pop_any (tasks/s)  worker (tasks/s)\n");
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+	double single = run_test(threads, false, tasks, work);
+	double worker = run_test(threads, true, tasks, work);
+	printf("%7u  %17.0f  %16.0f\n", threads,
+	       tasks / single, tasks / worker);
+    }
+
+    return 0;
+}
@@ -27,12 +27,111 @@
 #include "cli.h"
 #include "str.h"
 
+#include <algorithm>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
+#include "json/value.h"
 #include <getopt.h>
 #include <iostream>
+#include "loadfile.h"
+#include "safeerrno.h"
+#include "server/task_manager.h"
+#include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
+#include "utils/utils.h"
+#include <vector>
 #include <xapian.h>
 
+/* Codes for options which have no short form. */
+enum {
+    OPT_INDEXING_THREADS = 300,
+    OPT_COLLECTION_WRITERS,
+    OPT_PROCESSING_THREADS,
+    OPT_SEARCH_THREADS,
+    OPT_MAX_SEARCH_THREADS,
+    OPT_MATCH_THREADS,
+    OPT_INDEXING_QUEUE_SIZE,
+    OPT_PROCESSING_QUEUE_SIZE,
+    OPT_SEARCH_QUEUE_SIZE,
+    OPT_LOAD_FILE,
+    OPT_LOAD_THREADS,
+    OPT_JOURNAL,
+    OPT_RESULT_CACHE_SIZE,
+    OPT_FILTER_CACHE_SIZE
+};
+
+static const struct option longopts[] = {
+    { "help",       no_argument,            NULL, 'h' },
+    { "version",    no_argument,            NULL, 'v' },
+    { "datadir",    required_argument,      NULL, 'd' },
+    { "action",     required_argument,      NULL, 'a' },
+    { "config",     required_argument,      NULL, 'c' },
+
+    { "port",       required_argument,      NULL, 'p' },
+    { "pedantic",   no_argument,            NULL, 'P' },
+    { "http_threads", required_argument,    NULL, 't' },
+    { "max_body_size", required_argument,   NULL, 'B' },
+    { "compress_level", required_argument,  NULL, 'z' },
+    { "compress_min_size", required_argument, NULL, 'Z' },
+    { "indexing_threads", required_argument, NULL, OPT_INDEXING_THREADS },
+    { "collection_writers", required_argument, NULL, OPT_COLLECTION_WRITERS },
+    { "processing_threads", required_argument, NULL, OPT_PROCESSING_THREADS },
+    { "search_threads", required_argument,  NULL, OPT_SEARCH_THREADS },
+    { "max_search_threads", required_argument, NULL, OPT_MAX_SEARCH_THREADS },
+    { "match_threads", required_argument,   NULL, OPT_MATCH_THREADS },
+    { "indexing_queue_size", required_argument, NULL, OPT_INDEXING_QUEUE_SIZE },
+    { "processing_queue_size", required_argument, NULL,
+	OPT_PROCESSING_QUEUE_SIZE },
+    { "search_queue_size", required_argument, NULL, OPT_SEARCH_QUEUE_SIZE },
+    { "journal",    no_argument,            NULL, OPT_JOURNAL },
+    { "result_cache_size", required_argument, NULL, OPT_RESULT_CACHE_SIZE },
+    { "filter_cache_size", required_argument, NULL, OPT_FILTER_CACHE_SIZE },
+
+    { "dbname",     required_argument,      NULL, 'n' },
+    { "searchfile", required_argument,      NULL, 'f' },
+    { "loadfile",   required_argument,      NULL, OPT_LOAD_FILE },
+    { "load_threads", required_argument,    NULL, OPT_LOAD_THREADS },
+
+#ifdef __WIN32__
+    { "install",    no_argument,            NULL, 256 },
+    { "remove",     no_argument,            NULL, 257 },
+    { "reinstall",  no_argument,            NULL, 258 },
+    { "serviceName", required_argument,     NULL, 259 },
+
+    // Internal option, used when called by service manager.
+    { "service", no_argument,               NULL, 260 },
+#endif
+
+    { "mongo_import", required_argument,    NULL, 'm' },
+    { 0, 0, NULL, 0 }
+};
+
+/** Parse a positive (or, if allow_zero is set, non-negative) count given
+ *  for an option.
+ *
+ *  Returns false (after displaying a message) if the value is invalid.
+ */
+static bool
+parse_count(const char * progname, const char * name, const char * arg,
+	    size_t & result, bool allow_zero = false)
+{
+    char * end;
+    errno = 0;
+    // strtoul() accepts (and negates) a leading minus sign, so check that
+    // the value starts with a digit.
+    unsigned long value = strtoul(arg, &end, 10);
+    if (*arg < '0' || *arg > '9' || *end != '\0' || errno != 0 ||
+	(value == 0 && !allow_zero) || value > UINT_MAX) {
+	std::cerr << progname << ": " << name << " must be a " <<
+		(allow_zero ? "non-negative" : "positive") << " integer" <<
+		std::endl;
+	return false;
+    }
+    result = value;
+    return true;
+}
+
 RestPose::CliOptions::CliOptions()
 	:
 #ifdef __WIN32__
@@ -42,8 +141,27 @@ RestPose::CliOptions::CliOptions()
 	  action(ACT_DEFAULT),
 	  port(7777),
 	  pedantic(false),
+	  http_threads(0),
+	  max_body_size(64 * 1024 * 1024),
+	  compress_level(6),
+	  compress_min_size(1024),
+	  indexing_threads(0),
+	  collection_writers(0),
+	  processing_threads(0),
+	  search_threads(0),
+	  max_search_threads(0),
+	  match_threads(0),
+	  indexing_queue_size(0),
+	  processing_queue_size(0),
+	  search_queue_size(0),
+	  journal(false),
+	  result_cache_size(32 * 1024 * 1024),
+	  filter_cache_size(8 * 1024 * 1024),
+	  config_file(),
 	  dbname(),
 	  searchfiles(),
+	  loadfile(),
+	  load_threads(0),
 	  languages(),
 	  mongo_import()
 {
@@ -60,6 +178,48 @@ RestPose::CliOptions::service_command_opts() const
     if (pedantic) {
 	result.append(" --pedantic");
     }
+    if (http_threads != 0) {
+	result.append(" --http_threads=" + str(http_threads));
+    }
+    result.append(" --max_body_size=" + str(max_body_size));
+    result.append(" --compress_level=" + str(compress_level));
+    result.append(" --compress_min_size=" + str(compress_min_size));
+    if (indexing_threads != 0) {
+	result.append(" --indexing_threads=" + str(indexing_threads));
+    }
+    if (collection_writers != 0) {
+	result.append(" --collection_writers=" + str(collection_writers));
+    }
+    if (processing_threads != 0) {
+	result.append(" --processing_threads=" + str(processing_threads));
+    }
+    if (search_threads != 0) {
+	result.append(" --search_threads=" + str(search_threads));
+    }
+    if (max_search_threads != 0) {
+	result.append(" --max_search_threads=" + str(max_search_threads));
+    }
+    if (match_threads != 0) {
+	result.append(" --match_threads=" + str(match_threads));
+    }
+    if (indexing_queue_size != 0) {
+	result.append(" --indexing_queue_size=" + str(indexing_queue_size));
+    }
+    if (processing_queue_size != 0) {
+	result.append(" --processing_queue_size=" +
+		      str(processing_queue_size));
+    }
+    if (search_queue_size != 0) {
+	result.append(" --search_queue_size=" + str(search_queue_size));
+    }
+    if (journal) {
+	result.append(" --journal");
+    }
+    result.append(" --result_cache_size=" + str(result_cache_size));
+    result.append(" --filter_cache_size=" + str(filter_cache_size));
+    if (!config_file.empty()) {
+	result.append(" --config=\"" + config_file + "\"");
+    }
     if (!service_name.empty()) {
 	result.append(" --serviceName=\"" + service_name + "\"");
     }
@@ -70,38 +230,57 @@ RestPose::CliOptions::service_command_opts() const
 int
 RestPose::CliOptions::parse(const char * progname, int argc, char * const* argv)
 {
-    static const struct option longopts[] = {
-	{ "help",       no_argument,            NULL, 'h' },
-	{ "version",    no_argument,            NULL, 'v' },
-	{ "datadir",    required_argument,      NULL, 'd' },
-	{ "action",     required_argument,      NULL, 'a' },
-
-	{ "port",       required_argument,      NULL, 'p' },
-	{ "pedantic",   no_argument,            NULL, 'P' },
+    // Options given on the command line, which take precedence over those in
+    // a config file.
+    std::vector<int> given;
 
-	{ "dbname",     required_argument,      NULL, 'n' },
-	{ "searchfile", required_argument,      NULL, 'f' },
+    int getopt_ret;
+    while ((getopt_ret = getopt_long(argc, argv, "hvd:a:c:p:t:n:s:i:f:Im:l:",
+					 longopts, NULL)) != -1) {
+	if (getopt_ret == ':' || getopt_ret == '?') {
+	    return 1;
+	}
+	int ret = set_option(progname, getopt_ret, optarg);
+	if (ret != 0) {
+	    return ret;
+	}
+	given.push_back(getopt_ret);
+    }
 
-#ifdef __WIN32__
-	{ "install",    no_argument,            NULL, 256 },
-	{ "remove",     no_argument,            NULL, 257 },
-	{ "reinstall",  no_argument,            NULL, 258 },
-	{ "serviceName", required_argument,     NULL, 259 },
+    if (optind < argc) {
+	std::cerr << progname << ": excess parameters" << std::endl;
+	return 1;
+    }
 
-	// Internal option, used when called by service manager.
-	{ "service", no_argument,               NULL, 260 },
-#endif
+    if (!config_file.empty()) {
+	int ret = read_config(progname, config_file, given);
+	if (ret != 0) {
+	    return ret;
+	}
+    }
 
-	{ "mongo_import", required_argument,    NULL, 'm' },
-	{ 0, 0, NULL, 0 }
-    };
+    if (action == ACT_DEFAULT) {
+	action = ACT_SERVE;
+    }
+    if (datadir.empty()) {
+	datadir = "rspdbs";
+    }
+    if (action == ACT_LOAD && (dbname.empty() || loadfile.empty())) {
+	std::cerr << progname << ": \"load\" action requires --dbname and "
+		"--loadfile" << std::endl;
+	return 1;
+    }
+    return 0;
+}
 
-    int getopt_ret;
-    while ((getopt_ret = getopt_long(argc, argv, "hvd:a:p:n:s:i:f:Im:l:",
-					 longopts, NULL)) != -1) {
-	switch (getopt_ret) {
-	    case 'h':
-		std::cout << progname << " - RESTfull search server\n\n"
+int
+RestPose::CliOptions::set_option(const char * progname, int code,
+				 const char * arg)
+{
+    size_t count;
+    switch (code) {
+	case 'h':
+	    std::cout << progname << " - RESTfull search server\n\n"
 "Usage: " << progname << " [OPTIONS]\n\n"
 "Options:\n"
 "  -h, --help             display usage help\n"
@@ -111,11 +290,54 @@ RestPose::CliOptions::parse(const char * progname, int argc, char * const* argv)
 "                         \"server\" (default) to run a server\n"
 "                         \"search\" to perform a command immediately\n"
 "                         \"train\" to train a classifier\n"
+"                         \"load\" to load documents into a collection in\n"
+"                         bulk\n"
+"  -c, --config=FILE      read options from FILE, holding a JSON object\n"
+"                         mapping long option names to values; options\n"
+"                         given on the command line take precedence\n"
 "\n"
 "Options for \"server\" action\n"
 "  -p, --port=PORT        port number to listen on\n"
 "  -P, --pedantic         specify to be pedantic about request handling; use\n"
 "                         for testing clients.\n"
+"  -t, --http_threads=N   serve HTTP requests with a thread for each\n"
+"                         connection, for up to N connections at once\n"
+"                         (default 0: serve requests from the main select\n"
+"                         loop)\n"
+"  --max_body_size=BYTES  largest JSON request body to accept (default\n"
+"                         64MB; 0 for no limit)\n"
+"  --compress_level=N     gzip compression level (1-9) for responses to\n"
+"                         clients which accept it (default 6; 0 disables)\n"
+"  --compress_min_size=BYTES  smallest response body to compress (default\n"
+"                         1024)\n"
+"  --search_threads=N     threads for performing searches (default: the\n"
+"                         number of processors)\n"
+"  --max_search_threads=N if greater than search_threads, add search threads\n"
+"                         (up to N) while searches are waiting, and retire\n"
+"                         them again when idle\n"
+"  --match_threads=N      threads shared by searches for matching the\n"
+"                         database fragments of a collection in parallel\n"
+"                         (default: none; fragments are matched serially)\n"
+"  --processing_threads=N threads for processing documents (default: the\n"
+"                         number of processors)\n"
+"  --indexing_threads=N   threads for indexing (default 2)\n"
+"  --collection_writers=N maximum indexing threads writing to a single\n"
+"                         collection at once (default 1)\n"
+"  --search_queue_size=N  maximum searches waiting on each queue (default\n"
+"                         2000)\n"
+"  --processing_queue_size=N  maximum documents waiting to be processed for\n"
+"                         each collection (default 101000)\n"
+"  --indexing_queue_size=N  maximum documents waiting to be indexed for each\n"
+"                         collection (default 101000)\n"
+"  --journal              record accepted changes to documents in a journal\n"
+"                         for each collection, and replay any which weren't\n"
+"                         committed when the server next starts\n"
+"  --result_cache_size=BYTES  memory to use for caching search results until\n"
+"                         the collection is next committed (default 32MB;\n"
+"                         0 disables the cache)\n"
+"  --filter_cache_size=BYTES  memory to use in each reader of a collection\n"
+"                         for caching the documents matching frequently\n"
+"                         used filters (default 8MB; 0 disables the cache)\n"
 "  -m, --mongo_import=CFG start a mongo importer, with some JSON config\n"
 "\n"
 #ifdef __WIN32__
@@ -134,85 +356,280 @@ RestPose::CliOptions::parse(const char * progname, int argc, char * const* argv)
 "  -f, --searchfile=PATH  perform a search stored in a file\n"
 "                         (or - to read from stdin)\n"
 "\n"
+"Options for \"load\" action\n"
+"  -n, --dbname=DBNAME    name of the collection to load documents into; it\n"
+"                         must not contain any documents, and mustn't be\n"
+"                         in use by a server\n"
+"  --loadfile=PATH        file to read documents from, one JSON object per\n"
+"                         line (or - to read from stdin)\n"
+"  --load_threads=N       threads for processing documents (default: the\n"
+"                         number of processors)\n"
+"\n"
 "Options for \"train\" action\n"
 "  -l, --lang=LANGUAGE    a language to train\n"
 "\n";
-		return -1; // -1 to exit, but not return an error code.
-	    case 'v':
-		std::cout << progname << " version: " << PACKAGE_VERSION << "\n"
-			     "xapian version: " << Xapian::version_string() <<
-			     "\n";
-		return -1; // -1 to exit, but not return an error code.
-	    case 'd':
-		datadir = optarg;
-		break;
-            case 'a':
-		if (action != ACT_DEFAULT) {
-		    std::cerr << progname << ": action must only be specified once" << std::endl;
-		    return 1;
-		}
-		if (strcmp(optarg, "server") == 0) {
-		    action = ACT_SERVE;
-		} else if (strcmp(optarg, "search") == 0) {
-		    action = ACT_SEARCH;
-		} else if (strcmp(optarg, "train") == 0) {
-		    action = ACT_TRAIN;
-		} else {
-		    std::cerr << progname << ": invalid action specified" << std::endl;
-		    return 1;
-		}
-		break;
-	    case 'p':
-		port = atoi(optarg);
-		break;
-	    case 'P':
-		pedantic = true;
-		break;
-	    case 'n':
-		dbname = optarg;
-		break;
-	    case 'f':
-		searchfiles.push_back(optarg);
-		break;
-	    case 'm':
-		mongo_import = optarg;
-		break;
-	    case 'l':
-		languages.push_back(optarg);
-		break;
-	    case ':':
+	    return -1; // -1 to exit, but not return an error code.
+	case 'v':
+	    std::cout << progname << " version: " << PACKAGE_VERSION << "\n"
+			 "xapian version: " << Xapian::version_string() <<
+			 "\n";
+	    return -1; // -1 to exit, but not return an error code.
+	case 'd':
+	    datadir = arg;
+	    break;
+	case 'a':
+	    if (action != ACT_DEFAULT) {
+		std::cerr << progname << ": action must only be specified once" << std::endl;
+		return 1;
+	    }
+	    if (strcmp(arg, "server") == 0) {
+		action = ACT_SERVE;
+	    } else if (strcmp(arg, "search") == 0) {
+		action = ACT_SEARCH;
+	    } else if (strcmp(arg, "train") == 0) {
+		action = ACT_TRAIN;
+	    } else if (strcmp(arg, "load") == 0) {
+		action = ACT_LOAD;
+	    } else {
+		std::cerr << progname << ": invalid action specified" << std::endl;
+		return 1;
+	    }
+	    break;
+	case 'p':
+	    port = atoi(arg);
+	    break;
+	case 'P':
+	    pedantic = true;
+	    break;
+	case 't':
+	    if (!parse_count(progname, "http_threads", arg, count, true)) {
+		return 1;
+	    }
+	    http_threads = count;
+	    break;
+	case 'B':
+	    max_body_size = strtoul(arg, NULL, 10);
+	    break;
+	case 'z':
+	    compress_level = atoi(arg);
+	    if (compress_level < 0 || compress_level > 9) {
+		std::cerr << progname << ": compress_level must be between 0 and 9" << std::endl;
+		return 1;
+	    }
+	    break;
+	case 'Z':
+	    compress_min_size = strtoul(arg, NULL, 10);
+	    break;
+	case 'n':
+	    dbname = arg;
+	    break;
+	case 'f':
+	    searchfiles.push_back(arg);
+	    break;
+	case 'm':
+	    mongo_import = arg;
+	    break;
+	case 'l':
+	    languages.push_back(arg);
+	    break;
+	case 'c':
+	    config_file = arg;
+	    break;
+	case OPT_JOURNAL:
+	    journal = true;
+	    break;
+	case OPT_RESULT_CACHE_SIZE:
+	    result_cache_size = strtoul(arg, NULL, 10);
+	    break;
+	case OPT_FILTER_CACHE_SIZE:
+	    filter_cache_size = strtoul(arg, NULL, 10);
+	    break;
+	case OPT_LOAD_FILE:
+	    loadfile = arg;
+	    break;
+	case OPT_LOAD_THREADS:
+	    if (!parse_count(progname, "load_threads", arg, count)) {
+		return 1;
+	    }
+	    load_threads = count;
+	    break;
+	case OPT_INDEXING_THREADS:
+	    if (!parse_count(progname, "indexing_threads", arg, count)) {
+		return 1;
+	    }
+	    indexing_threads = count;
+	    break;
+	case OPT_COLLECTION_WRITERS:
+	    if (!parse_count(progname, "collection_writers", arg, count)) {
+		return 1;
+	    }
+	    collection_writers = count;
+	    break;
+	case OPT_PROCESSING_THREADS:
+	    if (!parse_count(progname, "processing_threads", arg, count)) {
+		return 1;
+	    }
+	    processing_threads = count;
+	    break;
+	case OPT_SEARCH_THREADS:
+	    if (!parse_count(progname, "search_threads", arg, count)) {
+		return 1;
+	    }
+	    search_threads = count;
+	    break;
+	case OPT_MAX_SEARCH_THREADS:
+	    if (!parse_count(progname, "max_search_threads", arg, count)) {
 		return 1;
-	    case '?':
+	    }
+	    max_search_threads = count;
+	    break;
+	case OPT_MATCH_THREADS:
+	    if (!parse_count(progname, "match_threads", arg, count)) {
 		return 1;
+	    }
+	    match_threads = count;
+	    break;
+	case OPT_INDEXING_QUEUE_SIZE:
+	    if (!parse_count(progname, "indexing_queue_size", arg,
+			     indexing_queue_size)) {
+		return 1;
+	    }
+	    break;
+	case OPT_PROCESSING_QUEUE_SIZE:
+	    if (!parse_count(progname, "processing_queue_size", arg,
+			     processing_queue_size)) {
+		return 1;
+	    }
+	    break;
+	case OPT_SEARCH_QUEUE_SIZE:
+	    if (!parse_count(progname, "search_queue_size", arg,
+			     search_queue_size)) {
+		return 1;
+	    }
+	    break;
+	default:
+	    return 1;
 #ifdef __WIN32__
-	    case 256:
-		service_action = SRVACT_INSTALL;
-		break;
-	    case 257:
-		service_action = SRVACT_REMOVE;
-		break;
-	    case 258:
-		service_action = SRVACT_REINSTALL;
-		break;
-	    case 259:
-		service_name = optarg;
-		break;
-	    case 260:
-		service_action = SRVACT_RUN_SERVICE;
+	case 256:
+	    service_action = SRVACT_INSTALL;
+	    break;
+	case 257:
+	    service_action = SRVACT_REMOVE;
+	    break;
+	case 258:
+	    service_action = SRVACT_REINSTALL;
+	    break;
+	case 259:
+	    service_name = arg;
+	    break;
+	case 260:
+	    service_action = SRVACT_RUN_SERVICE;
 #endif
-	}
     }
+    return 0;
+}
 
-    if (optind < argc) {
-	std::cerr << progname << ": excess parameters" << std::endl;
+int
+RestPose::CliOptions::read_config(const char * progname,
+				  const std::string & path,
+				  const std::vector<int> & given)
+{
+    std::string config_str;
+    if (!load_file(path, config_str)) {
+	std::cerr << progname << ": unable to read config file \"" << path <<
+		"\": " << get_sys_error(errno) << std::endl;
 	return 1;
     }
-
-    if (action == ACT_DEFAULT) {
-	action = ACT_SERVE;
+    Json::Value config;
+    try {
+	json_unserialise(config_str, config);
+    } catch(const RestPose::Error & e) {
+	std::cerr << progname << ": invalid config file \"" << path <<
+		"\": " << e.what() << std::endl;
+	return 1;
     }
-    if (datadir.empty()) {
-	datadir = "rspdbs";
+    if (!config.isObject()) {
+	std::cerr << progname << ": config file \"" << path <<
+		"\" must hold a JSON object" << std::endl;
+	return 1;
+    }
+
+    Json::Value::Members names(config.getMemberNames());
+    for (Json::Value::Members::const_iterator i = names.begin();
+	 i != names.end(); ++i) {
+	const struct option * opt = longopts;
+	while (opt->name != NULL && *i != opt->name) {
+	    ++opt;
+	}
+	if (opt->name == NULL || opt->val == 'c' || opt->val == 'h' ||
+	    opt->val == 'v') {
+	    std::cerr << progname << ": unknown option \"" << *i <<
+		    "\" in config file \"" << path << "\"" << std::endl;
+	    return 1;
+	}
+	if (std::find(given.begin(), given.end(), opt->val) != given.end()) {
+	    continue;
+	}
+
+	const Json::Value & value = config[*i];
+	std::string arg;
+	if (opt->has_arg == no_argument) {
+	    if (!value.isBool()) {
+		std::cerr << progname << ": option \"" << *i <<
+			"\" in config file must be true or false" << std::endl;
+		return 1;
+	    }
+	    if (!value.asBool()) {
+		continue;
+	    }
+	} else if (value.isString()) {
+	    arg = value.asString();
+	} else if (value.isIntegral()) {
+	    arg = json_serialise(value);
+	} else {
+	    std::cerr << progname << ": option \"" << *i <<
+		    "\" in config file must be a string or an integer" <<
+		    std::endl;
+	    return 1;
+	}
+	int ret = set_option(progname, opt->val, arg.c_str());
+	if (ret != 0) {
+	    return ret;
+	}
     }
     return 0;
 }
+
+void
+RestPose::CliOptions::apply_task_sizes(TaskManagerSizes & sizes) const
+{
+    if (indexing_threads != 0) {
+	sizes.indexing_threads = indexing_threads;
+    }
+    if (collection_writers != 0) {
+	sizes.collection_writers = collection_writers;
+    }
+    if (processing_threads != 0) {
+	sizes.processing_threads = processing_threads;
+    }
+    if (search_threads != 0) {
+	sizes.search_threads = search_threads;
+    }
+    if (max_search_threads != 0) {
+	sizes.max_search_threads = max_search_threads;
+    }
+    if (match_threads != 0) {
+	sizes.match_threads = match_threads;
+    }
+    if (indexing_queue_size != 0) {
+	sizes.indexing_queue_size = indexing_queue_size;
+    }
+    if (processing_queue_size != 0) {
+	sizes.processing_queue_size = processing_queue_size;
+    }
+    if (search_queue_size != 0) {
+	sizes.search_queue_size = search_queue_size;
+    }
+    sizes.result_cache_size = result_cache_size;
+    sizes.filter_cache_size = filter_cache_size;
+}
@@ -28,6 +28,8 @@
 #include <string>
 #include <vector>
 
+struct TaskManagerSizes;
+
 namespace RestPose {
 
 struct CliOptions {
@@ -43,6 +45,32 @@ struct CliOptions {
      */
     int parse(const char * progname, int argc, char * const* argv);
 
+    /** Set an option.
+     *
+     *  @param code The code for the option, as returned by getopt_long().
+     *  @param arg The argument for the option (NULL if it has none).
+     *
+     *  Returns values as for parse().
+     */
+    int set_option(const char * progname, int code, const char * arg);
+
+    /** Read options from a configuration file.
+     *
+     *  The file holds a JSON object, whose members are long option names,
+     *  with the option values.  Options which were given on the command line
+     *  (as listed in @a given) are skipped.
+     *
+     *  Returns values as for parse().
+     */
+    int read_config(const char * progname, const std::string & path,
+		    const std::vector<int> & given);
+
+    /** Apply the thread and queue size options to a set of sizes.
+     *
+     *  Sizes which weren't specified are left unchanged.
+     */
+    void apply_task_sizes(TaskManagerSizes & sizes) const;
+
 #ifdef __WIN32__
     /** Get the command to use when running as a service.
      */
@@ -69,15 +97,46 @@ struct CliOptions {
 	ACT_DEFAULT,
 	ACT_SERVE,
 	ACT_SEARCH,
-	ACT_TRAIN
+	ACT_TRAIN,
+	ACT_LOAD
     };
 
     std::string datadir;
     action_type action;
     int port;
     bool pedantic;
+    unsigned http_threads;
+    size_t max_body_size;
+    int compress_level;
+    size_t compress_min_size;
+
+    /* Thread and queue sizes: 0 to use the default. */
+    unsigned indexing_threads;
+    unsigned collection_writers;
+    unsigned processing_threads;
+    unsigned search_threads;
+    unsigned max_search_threads;
+    unsigned match_threads;
+    size_t indexing_queue_size;
+    size_t processing_queue_size;
+    size_t search_queue_size;
+
+    /// Whether to journal accepted changes.
+    bool journal;
+
+    /// Maximum size of the search result cache, in bytes (0 to disable).
+    size_t result_cache_size;
+
+    /** Maximum size of the filter cache of each collection reader, in
+     *  bytes (0 to disable).
+     */
+    size_t filter_cache_size;
+
+    std::string config_file;
     std::string dbname;
     std::vector<std::string> searchfiles;
+    std::string loadfile;
+    unsigned load_threads;
     std::vector<std::string> languages;
     std::string mongo_import;
 };
@@ -1,7 +1,9 @@
 noinst_LIBRARIES += libdbgroup.a
 
 noinst_HEADERS += \
- src/dbgroup/dbgroup.h
+ src/dbgroup/dbgroup.h \
+ src/dbgroup/idfilter.h
 
 libdbgroup_a_SOURCES = \
- src/dbgroup/dbgroup.cc
+ src/dbgroup/dbgroup.cc \
+ src/dbgroup/idfilter.cc
@@ -30,34 +30,303 @@
 #include <xapian.h>
 #include "utils/io_wrappers.h"
 #include "utils/jsonutils.h"
+#include "utils/rmdir.h"
 #include "utils/rsperrors.h"
 #include "jsonxapian/doctojson.h"
 #include "safeerrno.h"
+#include "serialise.h"
 #include "str.h"
 
+#include <algorithm>
+#include <climits>
+#include <map>
 #include <set>
 
 using namespace std;
 using namespace RestPose;
 
+/// The prefix which idterms recorded in the ID filters start with.
+#define IDTERM_PREFIX "\t"
+
+/// The metadata key that fragments store their ID filter's header in.
+#define IDFILTER_KEY "_idfilter"
+
+/// The prefix of the metadata keys that fragments store ID filter chunks in.
+#define IDFILTER_CHUNK_PREFIX "_idfilter_"
+
+/// The number of fragments of similar size which are merged together.
+#define MERGE_FACTOR 4
+
+/// The partition given to merged fragments, which new documents never use.
+#define MERGED_PARTITION UINT_MAX
+
+/// Mutex protecting last_group_id.
+static Mutex group_id_mutex;
+
+/// The last identifier given to a group opened for writing.
+static unsigned long last_group_id = 0;
+
+/// Mutex protecting frag_handles.
+static Mutex frag_handles_mutex;
+
+/// The number of DbFragment objects in the process for each fragment path.
+static std::map<std::string, unsigned> frag_handles;
+
+/** Check if any DbFragment object in the process refers to a fragment.
+ */
+static bool
+frag_in_use(const std::string & path)
+{
+    ContextLocker lock(frag_handles_mutex);
+    return frag_handles.find(path) != frag_handles.end();
+}
+
+/** Get the size tier of a fragment holding a given number of documents.
+ *
+ *  Fragments in the same tier are within a factor of MERGE_FACTOR in size.
+ */
+static unsigned
+size_tier(Xapian::doccount doccount)
+{
+    unsigned tier = 0;
+    while (doccount >= MERGE_FACTOR) {
+	doccount /= MERGE_FACTOR;
+	++tier;
+    }
+    return tier;
+}
+
+/** Check if an idterm is one which is recorded in the ID filters.
+ */
+static inline bool
+filtered_idterm(const std::string & idterm)
+{
+    return !idterm.empty() && idterm[0] == IDTERM_PREFIX[0];
+}
+
+/** Read the header of a stored ID filter.
+ *
+ *  The header holds the serial number of the last store of the filter, the
+ *  filter's capacity and item count, and for each chunk the serial number of
+ *  the store which last wrote it.
+ *
+ *  @returns false if no filter is stored.  Throws UnserialisationError if
+ *  the header is invalid.
+ */
+static bool
+read_idfilter_header(Xapian::Database & db, unsigned long & serial,
+		     size_t & capacity, size_t & items,
+		     std::vector<unsigned long> & versions)
+{
+    std::string header = db.get_metadata(IDFILTER_KEY);
+    if (header.empty()) {
+	return false;
+    }
+    const char * pos = header.data();
+    const char * end = pos + header.size();
+    serial = rsp_decode_length(&pos, end, false);
+    capacity = rsp_decode_length(&pos, end, false);
+    items = rsp_decode_length(&pos, end, false);
+    versions.clear();
+    while (pos != end) {
+	versions.push_back(rsp_decode_length(&pos, end, false));
+    }
+    return true;
+}
+
 void
 DbFragment::invalidate_cache() const
 {
 }
 
+void
+DbFragment::load_idfilter()
+{
+    if (idfilter_current) {
+	return;
+    }
+    try {
+	if (read_idfilter()) {
+	    idfilter_missing = false;
+	    idfilter_current = true;
+	    return;
+	}
+    } catch(const UnserialisationError &) {
+    }
+    if (state != OPEN_FOR_WRITING) {
+	// Fragment written before ID filters were used, or the filter is
+	// corrupt.  A reader can't store a rebuilt filter, so would have to
+	// rebuild it every time it reopened; assume any document may be
+	// present instead.
+	idfilter_missing = true;
+	idfilter_current = true;
+	return;
+    }
+    // Build one from the database contents, to be stored on commit.
+    rebuild_idfilter();
+}
+
+bool
+DbFragment::read_idfilter()
+{
+    Xapian::Database & db = get_db();
+    unsigned long serial;
+    size_t capacity, items;
+    std::vector<unsigned long> versions;
+    if (!read_idfilter_header(db, serial, capacity, items, versions)) {
+	return false;
+    }
+    if (idfilter_loaded && serial == idfilter_serial) {
+	// Unchanged since it was last read or stored.
+	return true;
+    }
+
+    // Until all the changed chunks have been read, the filter doesn't match
+    // any stored version.
+    bool read_all = !idfilter_loaded || idfilter.get_capacity() != capacity;
+    idfilter_loaded = false;
+    std::vector<unsigned long> old_versions;
+    old_versions.swap(idfilter_versions);
+    idfilter_versions.swap(versions);
+    idfilter_serial = serial;
+    if (read_all) {
+	idfilter.reset(capacity);
+    }
+    if (idfilter.get_capacity() != capacity ||
+	idfilter.get_chunk_count() != idfilter_versions.size()) {
+	throw UnserialisationError("Invalid stored ID filter header");
+    }
+    for (size_t chunk = 0; chunk != idfilter_versions.size(); ++chunk) {
+	if (read_all || chunk >= old_versions.size() ||
+	    old_versions[chunk] != idfilter_versions[chunk]) {
+	    idfilter.set_chunk(chunk,
+		db.get_metadata(IDFILTER_CHUNK_PREFIX + str(chunk)));
+	}
+    }
+    idfilter.set_items(items);
+    idfilter.clear_modified();
+    idfilter_loaded = true;
+    return true;
+}
+
+void
+DbFragment::rebuild_idfilter()
+{
+    Xapian::Database & db = get_db();
+    if (state == OPEN_FOR_WRITING) {
+	// Find the chunks already stored, so that the new filter replaces
+	// them, and readers see it as changed.  The stored filter may have
+	// been copied from the sources of a merge.
+	try {
+	    size_t capacity, items;
+	    unsigned long serial;
+	    std::vector<unsigned long> versions;
+	    if (read_idfilter_header(db, serial, capacity, items, versions)) {
+		idfilter_versions.swap(versions);
+		idfilter_serial = std::max(idfilter_serial, serial);
+	    }
+	} catch(const UnserialisationError &) {
+	}
+    }
+    idfilter.reset(db.get_doccount() * 2);
+    for (Xapian::TermIterator i = db.allterms_begin(IDTERM_PREFIX);
+	 i != db.allterms_end(IDTERM_PREFIX); ++i) {
+	idfilter.add(*i);
+    }
+    idfilter_current = true;
+    idfilter_missing = false;
+    // Only a writer can store the filter; a reader's filter no longer
+    // matches the stored one, so must be read in full next time.
+    idfilter_loaded = (state == OPEN_FOR_WRITING);
+    idfilter_modified = (state == OPEN_FOR_WRITING);
+}
+
+void
+DbFragment::store_missing_idfilter()
+{
+    bool was_writable = (state == OPEN_FOR_WRITING);
+    load_idfilter();
+    if (was_writable || !idfilter_missing) {
+	// A writer builds a missing filter when loading it, and stores it on
+	// the next commit.
+	return;
+    }
+    open_writable();
+    load_idfilter();
+    commit();
+    close();
+}
+
+void
+DbFragment::store_idfilter()
+{
+    if (state != OPEN_FOR_WRITING || !idfilter_modified) {
+	return;
+    }
+    unsigned long serial = idfilter_serial + 1;
+    size_t chunks = idfilter.get_chunk_count();
+    for (size_t chunk = chunks; chunk < idfilter_versions.size(); ++chunk) {
+	wrdb.set_metadata(IDFILTER_CHUNK_PREFIX + str(chunk), std::string());
+    }
+    idfilter_versions.resize(chunks, 0);
+
+    std::string header(encode_length(serial));
+    header.append(encode_length(idfilter.get_capacity()));
+    header.append(encode_length(idfilter.get_items()));
+    for (size_t chunk = 0; chunk != chunks; ++chunk) {
+	if (idfilter.is_chunk_modified(chunk)) {
+	    wrdb.set_metadata(IDFILTER_CHUNK_PREFIX + str(chunk),
+			      idfilter.get_chunk(chunk));
+	    idfilter_versions[chunk] = serial;
+	}
+	header.append(encode_length(idfilter_versions[chunk]));
+    }
+    wrdb.set_metadata(IDFILTER_KEY, header);
+    idfilter.clear_modified();
+    idfilter_serial = serial;
+    idfilter_modified = false;
+}
+
 DbFragment::DbFragment(const std::string & name_,
-		       const std::string & path_)
+		       const std::string & path_,
+		       unsigned partition_)
 	: state(CLOSED),
 	  name(name_),
-	  path(path_)
-{}
+	  path(path_),
+	  partition(partition_),
+	  idfilter(),
+	  idfilter_loaded(false),
+	  idfilter_current(false),
+	  idfilter_serial(0),
+	  idfilter_versions(),
+	  idfilter_modified(false),
+	  idfilter_missing(false),
+	  changes(0),
+	  committed_changes(0),
+	  mutex()
+{
+    ContextLocker lock(frag_handles_mutex);
+    ++frag_handles[path];
+}
+
+DbFragment::~DbFragment()
+{
+    ContextLocker lock(frag_handles_mutex);
+    std::map<std::string, unsigned>::iterator i = frag_handles.find(path);
+    if (i != frag_handles.end() && --(i->second) == 0) {
+	frag_handles.erase(i);
+    }
+}
 
 void
 DbFragment::close()
 {
     switch (state) {
 	case OPEN_FOR_WRITING:
+	    // Closing commits any pending changes, so store the filter first.
+	    store_idfilter();
 	    wrdb.close();
+	    committed_changes = changes;
 	    state = CLOSED;
 	    invalidate_cache();
 	    break;
@@ -69,6 +338,9 @@ DbFragment::close()
 	case CLOSED:
 	    break;
     }
+    idfilter_current = false;
+    idfilter_modified = false;
+    idfilter_missing = false;
 }
 
 void
@@ -78,6 +350,9 @@ DbFragment::open_writable()
 	return;
     }
     state = CLOSED;
+    idfilter_current = false;
+    idfilter_modified = false;
+    idfilter_missing = false;
     wrdb.close();
     wrdb = Xapian::WritableDatabase(path, Xapian::DB_CREATE_OR_OPEN);
     state = OPEN_FOR_WRITING;
@@ -87,6 +362,12 @@ void
 DbFragment::open_readonly()
 {
     invalidate_cache();
+    if (state == OPEN_FOR_WRITING) {
+	store_idfilter();
+    }
+    idfilter_current = false;
+    idfilter_modified = false;
+    idfilter_missing = false;
     if (state == OPEN_FOR_READING) {
 	rodb.reopen();
     } else {
@@ -121,10 +402,21 @@ DbFragment::add_doc(const Xapian::Document & doc, const std::string & idterm)
     }
 
     invalidate_cache();
+    ++changes;
     if (idterm.empty()) {
 	wrdb.add_document(doc);
     } else {
 	wrdb.replace_document(idterm, doc);
+	if (filtered_idterm(idterm)) {
+	    load_idfilter();
+	    if (!idfilter.may_contain(idterm)) {
+		idfilter.add(idterm);
+		idfilter_modified = true;
+		if (idfilter.is_full()) {
+		    rebuild_idfilter();
+		}
+	    }
+	}
     }
 }
 
@@ -137,9 +429,20 @@ DbFragment::delete_doc(const std::string & idterm)
     }
 
     invalidate_cache();
+    ++changes;
     wrdb.delete_document(idterm);
 }
 
+bool
+DbFragment::may_contain(const std::string & idterm)
+{
+    if (!filtered_idterm(idterm)) {
+	return true;
+    }
+    load_idfilter();
+    return idfilter_missing || idfilter.may_contain(idterm);
+}
+
 void
 DbFragment::set_metadata(const std::string & key, const std::string & value)
 {
@@ -154,7 +457,9 @@ void
 DbFragment::commit()
 {
     if (state == OPEN_FOR_WRITING) {
+	store_idfilter();
 	wrdb.commit();
+	committed_changes = changes;
     }
 }
 
@@ -175,6 +480,14 @@ DbGroup::init_frags()
     Json::Value fraglist;
     json_unserialise(fraglist_str, fraglist);
     json_check_array(fraglist, "stored list of fragments");
+
+    // Reuse the fragments which are still in the list; the list changes
+    // when fragments are merged.
+    std::map<std::string, DbFragment *> old_frags;
+    for (std::vector<DbFragment *>::iterator i = frags.begin();
+	 i != frags.end(); ++i) {
+	old_frags[(*i)->get_name()] = *i;
+    }
     frags.clear();
     for (Json::Value::iterator i = fraglist.begin();
 	 i != fraglist.end(); ++i) {
@@ -182,8 +495,24 @@ DbGroup::init_frags()
 	json_check_object(fraginfo, "stored fragment information");
 	std::string fragname = json_get_string_member(fraginfo, "name",
 						      std::string());
+	unsigned partition = json_get_uint64_member(fraginfo, "partition",
+						    UINT_MAX, 0);
+	std::map<std::string, DbFragment *>::iterator old =
+		old_frags.find(fragname);
 	frags.push_back(NULL);
-	frags.back() = new DbFragment(fragname, groupdir + "/" + fragname);
+	if (old != old_frags.end() &&
+	    old->second->get_partition() == partition) {
+	    frags.back() = old->second;
+	    old_frags.erase(old);
+	} else {
+	    frags.back() = new DbFragment(fragname,
+					  groupdir + "/" + fragname,
+					  partition);
+	}
+    }
+    for (std::map<std::string, DbFragment *>::iterator i = old_frags.begin();
+	 i != old_frags.end(); ++i) {
+	delete i->second;
     }
     last_fraglist_str = fraglist_str;
 
@@ -206,6 +535,9 @@ DbGroup::store_fraglist()
 	 i != frags.end(); ++i) {
 	Json::Value & fraginfo = fraglist.append(Json::objectValue);
 	fraginfo[Json::StaticString("name")] = (*i)->get_name();
+	if ((*i)->get_partition() != 0) {
+	    fraginfo[Json::StaticString("partition")] = (*i)->get_partition();
+	}
 	xapiandb_contents += "auto " + (*i)->get_name() + "\n";
     }
     control.set_metadata("_frags", json_serialise(fraglist));
@@ -259,25 +591,220 @@ DbGroup::invalidate_group_db() const
     }
 }
 
-void
-DbGroup::add_frag()
+std::string
+DbGroup::reserve_frag_name()
 {
-    invalidate_group_db();
     std::string fragname = "frag" + str(next_fragnum);
     next_fragnum += 1;
+    std::string fragdir = groupdir + "/" + fragname;
+    if (dir_exists(fragdir) && !frag_in_use(fragdir)) {
+	rmdir_recursive(fragdir);
+    }
+    return fragname;
+}
+
+DbFragment *
+DbGroup::add_frag(unsigned partition)
+{
+    invalidate_group_db();
+    std::string fragname = reserve_frag_name();
     frags.push_back(NULL);
-    frags.back() = new DbFragment(fragname, groupdir + "/" + fragname);
+    frags.back() = new DbFragment(fragname, groupdir + "/" + fragname,
+				  partition);
     frags.back()->open_writable();
 
     store_fraglist();
     control.commit();
+    return frags.back();
+}
+
+DbFragment *
+DbGroup::get_partition_frag(unsigned partition)
+{
+    ContextLocker lock(cond);
+    for (size_t i = frags.size(); i > 0; --i) {
+	DbFragment * ptr = frags[i - 1];
+	if (ptr->get_partition() == partition) {
+	    ContextLocker frag_lock(ptr->mutex);
+	    if (ptr->get_db().get_doccount() < max_newdb_docs) {
+		return ptr;
+	    }
+	    break;
+	}
+    }
+    return add_frag(partition);
+}
+
+DbFragment *
+DbGroup::find_doc_frag(const std::string & idterm)
+{
+    // Take a copy of the list of fragments, so that the group's lock isn't
+    // held while checking each fragment.  The caller is recorded as
+    // modifying the group, so complete_merge() won't remove any of them.
+    std::vector<DbFragment *> frags_copy;
+    {
+	ContextLocker lock(cond);
+	frags_copy = frags;
+    }
+    for (size_t i = frags_copy.size(); i > 0; --i) {
+	DbFragment * ptr = frags_copy[i - 1];
+	ContextLocker frag_lock(ptr->mutex);
+	if (ptr->may_contain(idterm) && ptr->get_db().term_exists(idterm)) {
+	    return ptr;
+	}
+    }
+    return NULL;
+}
+
+bool
+DbGroup::is_partition_frag(size_t index) const
+{
+    unsigned partition = frags[index]->get_partition();
+    if (partition >= partitions) {
+	return false;
+    }
+    for (size_t i = index + 1; i < frags.size(); ++i) {
+	if (frags[i]->get_partition() == partition) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+bool
+DbGroup::find_merge(std::vector<size_t> & run)
+{
+    run.clear();
+    unsigned run_tier = UINT_MAX;
+    for (size_t i = 0; i != frags.size(); ++i) {
+	if (is_partition_frag(i)) {
+	    // Never merged, but skipped over: with several write partitions,
+	    // the current fragments of the others lie between full ones.
+	    continue;
+	}
+	unsigned tier;
+	{
+	    ContextLocker frag_lock(frags[i]->mutex);
+	    tier = size_tier(frags[i]->get_db().get_doccount());
+	}
+	if (tier != run_tier) {
+	    if (run.size() >= MERGE_FACTOR) {
+		return true;
+	    }
+	    run.clear();
+	    run_tier = tier;
+	}
+	run.push_back(i);
+    }
+    return run.size() >= MERGE_FACTOR;
+}
+
+std::vector<std::string>
+DbGroup::get_obsolete_frags()
+{
+    std::vector<std::string> names;
+    std::string obsolete_str = control.get_db().get_metadata("_obsolete_frags");
+    if (obsolete_str.empty()) {
+	return names;
+    }
+    Json::Value obsolete;
+    json_unserialise(obsolete_str, obsolete);
+    json_check_array(obsolete, "stored list of obsolete fragments");
+    for (Json::Value::iterator i = obsolete.begin();
+	 i != obsolete.end(); ++i) {
+	json_check_string(*i, "obsolete fragment name");
+	names.push_back((*i).asString());
+    }
+    return names;
+}
+
+void
+DbGroup::remove_obsolete_frags()
+{
+    std::vector<std::string> names = get_obsolete_frags();
+    if (names.empty()) {
+	return;
+    }
+    std::vector<std::string> remaining;
+    for (std::vector<std::string>::const_iterator i = names.begin();
+	 i != names.end(); ++i) {
+	std::string fragdir = groupdir + "/" + *i;
+	if (frag_in_use(fragdir)) {
+	    // A reader may still open it; try again next time.
+	    remaining.push_back(*i);
+	    continue;
+	}
+	try {
+	    if (dir_exists(fragdir)) {
+		rmdir_recursive(fragdir);
+	    }
+	} catch(const SysError &) {
+	    // Possibly still open somewhere; try again next time.
+	    remaining.push_back(*i);
+	}
+    }
+    store_obsolete_frags(remaining);
+}
+
+void
+DbGroup::store_obsolete_frags(const std::vector<std::string> & names)
+{
+    if (names.empty()) {
+	control.set_metadata("_obsolete_frags", std::string());
+	return;
+    }
+    Json::Value obsolete(Json::arrayValue);
+    for (std::vector<std::string>::const_iterator i = names.begin();
+	 i != names.end(); ++i) {
+	obsolete.append(*i);
+    }
+    control.set_metadata("_obsolete_frags", json_serialise(obsolete));
+}
+
+DbFragment *
+DbGroup::find_doc_frag_readonly(const std::string & idterm) const
+{
+    if (!control.is_open()) {
+	throw InvalidStateError("Database must be open to look up documents");
+    }
+    for (size_t i = frags.size(); i > 0; --i) {
+	DbFragment * ptr = frags[i - 1];
+	if (ptr->may_contain(idterm) && ptr->get_db().term_exists(idterm)) {
+	    return ptr;
+	}
+    }
+    return NULL;
+}
+
+DbGroup::Modification::Modification(DbGroup & group_)
+	: group(group_)
+{
+    ContextLocker lock(group.cond);
+    while (group.swapping) {
+	group.cond.wait();
+    }
+    ++group.modifying;
+}
+
+DbGroup::Modification::~Modification()
+{
+    ContextLocker lock(group.cond);
+    if (--group.modifying == 0) {
+	group.cond.broadcast();
+    }
 }
 
 DbGroup::DbGroup(const std::string & groupdir_)
 	: max_newdb_docs(100000000),
+	  partitions(1),
+	  cond(),
+	  modifying(0),
+	  swapping(false),
 	  groupdir(groupdir_),
 	  control("control", groupdir_ + "/control"),
 	  next_fragnum(0),
+	  group_id(0),
+	  merging(false),
 	  group_db_valid(false)
 {
 }
@@ -290,9 +817,29 @@ DbGroup::~DbGroup()
     }
 }
 
+unsigned long
+DbGroup::idterm_hash(const std::string & idterm)
+{
+    unsigned long h = 1;
+    for (std::string::const_iterator i = idterm.begin();
+	 i != idterm.end(); ++i) {
+	h += (h << 5) + static_cast<unsigned char>(*i);
+    }
+    // Keep the result the same on platforms with 64 bit longs.
+    return h & 0xffffffffu;
+}
+
+void
+DbGroup::set_partitions(unsigned int partitions_)
+{
+    partitions = (partitions_ == 0) ? 1 : partitions_;
+}
+
 void
 DbGroup::close()
 {
+    group_id = 0;
+    merging = false;
     invalidate_group_db();
     last_fraglist_str.resize(0);
     control.close();
@@ -313,7 +860,7 @@ DbGroup::open_writable()
 
     // Make the top directory, if needed.
     if (!dir_exists(groupdir)) {
-	if (mkdir(groupdir, 0770) != 0) {
+	if (mkdir(groupdir, 0770) != 0 && errno != EEXIST) {
 	    throw SysError("Couldn't create directory '" + groupdir + "'",
 			   errno);
 	}
@@ -323,10 +870,23 @@ DbGroup::open_writable()
     control.open_writable();
     try {
 	init_frags();
+	// Any readers of fragments merged away by a previous writer in
+	// another process will have been closed by now.
+	remove_obsolete_frags();
+	control.commit();
+	// Store filters for fragments written before ID filters were used,
+	// so that readers don't have to check them for every document.
+	for (std::vector<DbFragment *>::iterator i = frags.begin();
+	     i != frags.end(); ++i) {
+	    (*i)->store_missing_idfilter();
+	}
     } catch(...) {
 	control.close();
 	throw;
     }
+    merging = false;
+    ContextLocker lock(group_id_mutex);
+    group_id = ++last_group_id;
 }
 
 void
@@ -338,6 +898,7 @@ DbGroup::open_readonly()
     // if so.
     invalidate_group_db();
 
+    group_id = 0;
     control.open_readonly();
     try {
 	init_frags();
@@ -360,24 +921,40 @@ DbGroup::get_db() const
     return group_db;
 }
 
+void
+DbGroup::get_fragment_dbs(std::vector<Xapian::Database> & dbs) const
+{
+    init_group_db();
+    dbs.clear();
+    dbs.reserve(frags.size());
+    for (std::vector<DbFragment *>::const_iterator i = frags.begin();
+	 i != frags.end(); ++i) {
+	dbs.push_back((*i)->get_db());
+    }
+}
+
 Xapian::Document
 DbGroup::get_document(const std::string & idterm, bool & found) const
 {
-    init_group_db();
-    Xapian::PostingIterator pl(group_db.postlist_begin(idterm));
-    if (pl == group_db.postlist_end(idterm)) {
+    DbFragment * ptr = find_doc_frag_readonly(idterm);
+    if (ptr == NULL) {
+	found = false;
+	return Xapian::Document();
+    }
+    Xapian::Database & db = ptr->get_db();
+    Xapian::PostingIterator pl(db.postlist_begin(idterm));
+    if (pl == db.postlist_end(idterm)) {
 	found = false;
 	return Xapian::Document();
     }
     found = true;
-    return group_db.get_document(*pl);
+    return db.get_document(*pl);
 }
 
 bool
 DbGroup::doc_exists(const std::string & idterm) const
 {
-    init_group_db();
-    return group_db.term_exists(idterm);
+    return find_doc_frag_readonly(idterm) != NULL;
 }
 
 Xapian::doccount
@@ -394,32 +971,24 @@ DbGroup::add_doc(const Xapian::Document & doc, const std::string & idterm)
 	throw InvalidStateError("Database group must be open to add document ");
     }
 
-    // Ensure there is at least one fragment.
-    if (frags.empty()) {
-	add_frag();
-    }
-
+    Modification modification(*this);
+    DbFragment * ptr = NULL;
+    unsigned partition = 0;
     if (!idterm.empty()) {
 	// Check existing fragments for the document ID.  If found, add to
 	// that fragment.
-	for (size_t i = frags.size(); i > 0; --i) {
-	    DbFragment * ptr = frags[i - 1];
-	    if (ptr->get_db().term_exists(idterm)) {
-		ptr->open_writable();
-		ptr->add_doc(doc, idterm);
-		return;
-	    }
-	}
+	ptr = find_doc_frag(idterm);
+	partition = idterm_hash(idterm) % partitions;
     }
 
-    // Document doesn't already exist, or no idterm - just add it to the last
-    // fragment.
-    Xapian::doccount docs = frags.back()->get_db().get_doccount();
-    if (docs >= max_newdb_docs) {
-	add_frag();
+    if (ptr == NULL) {
+	// Document doesn't already exist, or no idterm - add it to the
+	// fragment for its partition.
+	ptr = get_partition_frag(partition);
     }
-    frags.back()->open_writable();
-    frags.back()->add_doc(doc, idterm);
+    ContextLocker frag_lock(ptr->mutex);
+    ptr->open_writable();
+    ptr->add_doc(doc, idterm);
 }
 
 void
@@ -434,19 +1003,19 @@ DbGroup::delete_doc(const std::string & idterm)
 
     // Check existing fragments for the document ID.  If found, delete from
     // that fragment, and assume it's nowhere else.
-    for (size_t i = frags.size(); i > 0; --i) {
-	DbFragment * ptr = frags[i - 1];
-	if (ptr->get_db().term_exists(idterm)) {
-	    ptr->open_writable();
-	    ptr->delete_doc(idterm);
-	    return;
-	}
+    Modification modification(*this);
+    DbFragment * ptr = find_doc_frag(idterm);
+    if (ptr != NULL) {
+	ContextLocker frag_lock(ptr->mutex);
+	ptr->open_writable();
+	ptr->delete_doc(idterm);
     }
 }
 
 void
 DbGroup::set_metadata(const std::string & key, const std::string & value)
 {
+    ContextLocker lock(cond);
     control.set_metadata(key, value);
 }
 
@@ -459,10 +1028,326 @@ DbGroup::get_metadata(const std::string & key)
 void
 DbGroup::sync()
 {
-    // Commit all fragments.
+    // Commit all fragments.  The group's lock isn't held while doing this,
+    // so that documents can be added to fragments which have been committed.
+    Modification modification(*this);
+    std::vector<DbFragment *> frags_copy;
+    {
+	ContextLocker lock(cond);
+	frags_copy = frags;
+    }
+    for (std::vector<DbFragment *>::iterator i = frags_copy.begin();
+	 i != frags_copy.end(); ++i) {
+	ContextLocker frag_lock((*i)->mutex);
+	(*i)->commit();
+    }
+    ContextLocker lock(cond);
+    control.commit();
+}
+
+void
+DbGroup::refresh()
+{
+    if (is_writable()) {
+	sync();
+    } else {
+	open_readonly();
+    }
+}
+
+bool
+DbGroup::needs_merge()
+{
+    ContextLocker lock(cond);
+    if (merging || !control.is_writable()) {
+	return false;
+    }
+    std::vector<size_t> run;
+    return find_merge(run);
+}
+
+bool
+DbGroup::prepare_merge(DbGroupMerge & merge)
+{
+    // The sources can't be removed from the group until the merge
+    // completes, so the pointers stay valid outside the lock.
+    std::vector<DbFragment *> sources;
+    {
+	ContextLocker lock(cond);
+	if (merging || !control.is_writable()) {
+	    return false;
+	}
+	std::vector<size_t> run;
+	if (!find_merge(run)) {
+	    return false;
+	}
+	for (std::vector<size_t>::const_iterator i = run.begin();
+	     i != run.end(); ++i) {
+	    sources.push_back(frags[*i]);
+	}
+
+	// The previous merge's fragments have been out of use for a while, so
+	// remove them now.
+	remove_obsolete_frags();
+
+	// Reserve a name for the merged fragment, and record it as obsolete
+	// until the merge completes, so that it's removed if the merge never
+	// completes.  These changes are committed by the next sync().
+	merge.group_id = group_id;
+	merge.target = reserve_frag_name();
+	std::vector<std::string> obsolete = get_obsolete_frags();
+	obsolete.push_back(merge.target);
+	store_fraglist();
+	store_obsolete_frags(obsolete);
+	merging = true;
+    }
+
+    try {
+	Xapian::Compactor compactor;
+	compactor.set_destdir(groupdir + "/" + merge.target);
+	merge.sources.clear();
+	merge.source_changes.clear();
+	for (std::vector<DbFragment *>::iterator i = sources.begin();
+	     i != sources.end(); ++i) {
+	    // The compactor reads the last commit of each fragment, so any
+	    // changes since then would be lost: wait for them to be committed.
+	    ContextLocker frag_lock((*i)->mutex);
+	    if ((*i)->get_changes() != (*i)->get_committed_changes()) {
+		frag_lock.unlock();
+		abandon_merge(merge);
+		return false;
+	    }
+	    merge.sources.push_back((*i)->get_name());
+	    merge.source_changes.push_back((*i)->get_changes());
+	    compactor.add_source((*i)->get_path());
+	}
+
+	// Any modifications to the fragments from now on will abandon the
+	// merge, so it doesn't matter if the compactor sees them.
+	compactor.compact();
+
+	DbFragment merged(merge.target, groupdir + "/" + merge.target);
+	merged.open_writable();
+	merged.rebuild_idfilter();
+	merged.commit();
+	merged.close();
+    } catch(...) {
+	abandon_merge(merge);
+	throw;
+    }
+    return true;
+}
+
+bool
+DbGroup::complete_merge(const DbGroupMerge & merge)
+{
+    ContextLocker lock(cond);
+    if (!merging || merge.group_id != group_id || group_id == 0) {
+	// The group has been reopened since the merge was prepared, so we
+	// can't tell if the fragments have changed.  The merged fragment
+	// will be removed when the group is next opened for writing.
+	return false;
+    }
+
+    // Wait for modifications in progress to finish, since they may be
+    // using the fragments being replaced, and hold off new ones.
+    swapping = true;
+    while (modifying != 0) {
+	cond.wait();
+    }
+    bool swapped;
+    try {
+	swapped = swap_merged(merge);
+    } catch(...) {
+	swapping = false;
+	cond.broadcast();
+	throw;
+    }
+    swapping = false;
+    cond.broadcast();
+    if (!swapped) {
+	lock.unlock();
+	abandon_merge(merge);
+	return false;
+    }
+    return true;
+}
+
+bool
+DbGroup::swap_merged(const DbGroupMerge & merge)
+{
+    // Fragments are only removed by merges, so the merged fragments are
+    // still in the group, in the same order.
+    std::vector<size_t> run;
+    size_t index = 0;
+    for (std::vector<std::string>::const_iterator i = merge.sources.begin();
+	 i != merge.sources.end(); ++i) {
+	while (index != frags.size() && frags[index]->get_name() != *i) {
+	    ++index;
+	}
+	if (index == frags.size() ||
+	    frags[index]->get_changes() !=
+	    merge.source_changes[i - merge.sources.begin()]) {
+	    break;
+	}
+	run.push_back(index);
+    }
+    if (run.size() != merge.sources.size()) {
+	return false;
+    }
+
+    std::vector<std::string> obsolete = get_obsolete_frags();
+    obsolete.erase(std::remove(obsolete.begin(), obsolete.end(),
+			       merge.target),
+		   obsolete.end());
+    obsolete.insert(obsolete.end(), merge.sources.begin(),
+		    merge.sources.end());
+    DbFragment * merged = new DbFragment(merge.target,
+					 groupdir + "/" + merge.target,
+					 MERGED_PARTITION);
+    invalidate_group_db();
+    for (size_t i = run.size(); i > 1; --i) {
+	delete frags[run[i - 1]];
+	frags.erase(frags.begin() + run[i - 1]);
+    }
+    delete frags[run[0]];
+    frags[run[0]] = merged;
+    store_fraglist();
+    store_obsolete_frags(obsolete);
+    merging = false;
+    return true;
+}
+
+void
+DbGroup::abandon_merge(const DbGroupMerge & merge)
+{
+    ContextLocker lock(cond);
+    if (!merging || merge.group_id != group_id) {
+	// The target will be removed when the group is next opened for
+	// writing.
+	return;
+    }
+    std::string fragdir = groupdir + "/" + merge.target;
+    if (dir_exists(fragdir)) {
+	rmdir_recursive(fragdir);
+    }
+    merging = false;
+}
+
+void
+DbGroup::prepare_load(DbGroupLoad & load, unsigned count)
+{
+    ContextLocker lock(cond);
+    if (!control.is_writable()) {
+	throw InvalidStateError("Database must be open for writing to load documents");
+    }
+    if (merging) {
+	throw InvalidStateError("Can't load documents while fragments are being merged");
+    }
     for (std::vector<DbFragment *>::iterator i = frags.begin();
 	 i != frags.end(); ++i) {
-	(*i)->commit();
+	ContextLocker frag_lock((*i)->mutex);
+	if ((*i)->get_db().get_doccount() != 0) {
+	    throw InvalidStateError("Documents can only be loaded in bulk into an empty database");
+	}
+    }
+
+    // Record the reserved fragments as obsolete until the load completes,
+    // so that they're removed if it never completes.
+    std::vector<std::string> obsolete = get_obsolete_frags();
+    load.group_id = group_id;
+    load.sources.clear();
+    load.paths.clear();
+    for (unsigned i = 0; i != count; ++i) {
+	std::string fragname = reserve_frag_name();
+	load.sources.push_back(fragname);
+	load.paths.push_back(groupdir + "/" + fragname);
+	obsolete.push_back(fragname);
     }
+    load.target = reserve_frag_name();
+    obsolete.push_back(load.target);
+    store_fraglist();
+    store_obsolete_frags(obsolete);
     control.commit();
 }
+
+void
+DbGroup::complete_load(const DbGroupLoad & load)
+{
+    if (load.group_id != group_id || group_id == 0) {
+	throw InvalidStateError("Database was reopened during bulk load");
+    }
+
+    std::string targetdir = groupdir + "/" + load.target;
+    bool loaded = false;
+    try {
+	Xapian::Compactor compactor;
+	compactor.set_destdir(targetdir);
+	for (std::vector<std::string>::const_iterator i = load.paths.begin();
+	     i != load.paths.end(); ++i) {
+	    if (dir_exists(*i) && Xapian::Database(*i).get_doccount() != 0) {
+		compactor.add_source(*i);
+		loaded = true;
+	    }
+	}
+	if (loaded) {
+	    compactor.compact();
+
+	    DbFragment target(load.target, targetdir);
+	    target.open_writable();
+	    target.rebuild_idfilter();
+	    target.commit();
+	    target.close();
+	}
+    } catch(...) {
+	abandon_load(load);
+	throw;
+    }
+
+    ContextLocker lock(cond);
+    std::vector<std::string> obsolete = get_obsolete_frags();
+    if (loaded) {
+	invalidate_group_db();
+	frags.push_back(new DbFragment(load.target, targetdir,
+				       MERGED_PARTITION));
+	obsolete.erase(std::remove(obsolete.begin(), obsolete.end(),
+				   load.target),
+		       obsolete.end());
+    }
+
+    // The loaded fragments were never part of the group, so no reader can
+    // have them open: remove them now, rather than waiting for the next
+    // merge.
+    for (std::vector<std::string>::const_iterator i = load.sources.begin();
+	 i != load.sources.end(); ++i) {
+	std::string fragdir = groupdir + "/" + *i;
+	if (dir_exists(fragdir)) {
+	    rmdir_recursive(fragdir);
+	}
+	obsolete.erase(std::remove(obsolete.begin(), obsolete.end(), *i),
+		       obsolete.end());
+    }
+    store_fraglist();
+    store_obsolete_frags(obsolete);
+    control.commit();
+}
+
+void
+DbGroup::abandon_load(const DbGroupLoad & load)
+{
+    ContextLocker lock(cond);
+    std::vector<std::string> names(load.sources);
+    names.push_back(load.target);
+    for (std::vector<std::string>::const_iterator i = names.begin();
+	 i != names.end(); ++i) {
+	std::string fragdir = groupdir + "/" + *i;
+	try {
+	    if (dir_exists(fragdir)) {
+		rmdir_recursive(fragdir);
+	    }
+	} catch(const SysError &) {
+	    // Still recorded as obsolete, so will be removed next time the
+	    // group is opened for writing.
+	}
+    }
+}
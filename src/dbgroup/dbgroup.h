@@ -25,7 +25,10 @@
 #ifndef RESTPOSE_INCLUDED_DBGROUP_H
 #define RESTPOSE_INCLUDED_DBGROUP_H
 
+#include "dbgroup/idfilter.h"
 #include <string>
+#include "utils/threading.h"
+#include <vector>
 #include <xapian.h>
 
 namespace RestPose {
@@ -45,17 +48,114 @@ class DbFragment {
     std::string name;
     std::string path;
 
+    /** The write partition which new documents are added to this fragment
+     *  for.
+     */
+    unsigned partition;
+
+    /** Filter recording the document ID terms which may be in the fragment.
+     *
+     *  Loaded from the fragment's metadata when first needed, and stored
+     *  back to it when the fragment is committed.  It is stored in chunks,
+     *  so that only the chunks which have changed are written on commit, and
+     *  read when a reader reopens.
+     */
+    IdFilter idfilter;
+
+    /** True iff idfilter holds the stored filter with serial number
+     *  idfilter_serial, apart from any changes flagged by idfilter_modified.
+     */
+    bool idfilter_loaded;
+
+    /** True iff idfilter has been checked against the stored filter since
+     *  the database was last opened or reopened.
+     */
+    bool idfilter_current;
+
+    /** Serial number of the last store of the filter which has been read or
+     *  written.
+     */
+    unsigned long idfilter_serial;
+
+    /** Serial numbers of the stores which last wrote each chunk of the
+     *  filter, as of the store with serial number idfilter_serial.
+     */
+    std::vector<unsigned long> idfilter_versions;
+
+    /** True iff idfilter has changed since it was stored. */
+    bool idfilter_modified;
+
+    /** True iff the database is open for reading, and has no usable stored
+     *  ID filter, so any document may be in it.
+     *
+     *  Readers can't store a filter, so they don't build one; a writer
+     *  stores one when the group is next opened for writing.
+     */
+    bool idfilter_missing;
+
     void invalidate_cache() const;
 
+    /** Load the ID filter, if it's not already loaded.
+     */
+    void load_idfilter();
+
+    /** Read the stored ID filter, reading only the chunks which have changed
+     *  since it was last read or stored.
+     *
+     *  @returns false if no filter is stored.  Throws UnserialisationError
+     *  if the stored filter is invalid.
+     */
+    bool read_idfilter();
+
+    /** Store the ID filter in the database, if it's been modified.
+     */
+    void store_idfilter();
+
+    /** Count of the modifications made to the fragment since it was
+     *  created.
+     *
+     *  Used to check if a fragment has changed while it was being merged.
+     */
+    unsigned long changes;
+
+    /** The value of changes when the fragment was last committed.
+     */
+    unsigned long committed_changes;
+
     DbFragment(const DbFragment & other);
     void operator=(const DbFragment & other);
   public:
-    DbFragment(const std::string & name_, const std::string & path_);
+    /** Mutex held while using the fragment, when the group is being
+     *  modified by several threads.
+     */
+    Mutex mutex;
+
+    /** Create a handle on a fragment.
+     *
+     *  While any handle on a fragment exists in the process, the fragment's
+     *  directory won't be removed when the fragment is merged away.
+     */
+    DbFragment(const std::string & name_, const std::string & path_,
+	       unsigned partition_ = 0);
+
+    ~DbFragment();
 
     const std::string & get_name() const {
 	return name;
     }
 
+    unsigned get_partition() const {
+	return partition;
+    }
+
+    unsigned long get_changes() const {
+	return changes;
+    }
+
+    unsigned long get_committed_changes() const {
+	return committed_changes;
+    }
+
     const std::string & get_path() const {
 	return path;
     }
@@ -125,6 +225,29 @@ class DbFragment {
      */
     void delete_doc(const std::string & idterm);
 
+    /** Check if a document may be in the database, given its idterm.
+     *
+     *  @returns false if the document definitely isn't in the database, true
+     *  if it may be.
+     */
+    bool may_contain(const std::string & idterm);
+
+    /** Rebuild the ID filter from the ID terms in the database.
+     *
+     *  The filter is sized to allow for the database growing to twice its
+     *  current size.
+     */
+    void rebuild_idfilter();
+
+    /** Store an ID filter in the fragment, if it has none.
+     *
+     *  Fragments written before ID filters were used have none; building
+     *  one requires reading all the ID terms, so is only done once, by a
+     *  writer.  If the fragment wasn't already open for writing, it is
+     *  closed again afterwards.
+     */
+    void store_missing_idfilter();
+
     /** Set a piece of metadata in the database.
      *
      *  Database must be open for writing.
@@ -136,8 +259,72 @@ class DbFragment {
     void commit();
 };
 
+/** The state of a merge of fragments in a DbGroup, between preparing the
+ *  merged fragment and swapping it into the group.
+ */
+struct DbGroupMerge {
+    /** Identifier of the open group the merge was prepared for. */
+    unsigned long group_id;
+
+    /** Names of the fragments being merged, in order. */
+    std::vector<std::string> sources;
+
+    /** Modification counts of the fragments as of the commits which were
+     *  merged.
+     */
+    std::vector<unsigned long> source_changes;
+
+    /** Name of the merged fragment. */
+    std::string target;
+
+    DbGroupMerge() : group_id(0) {}
+};
+
+/** The state of a bulk load into a DbGroup, between reserving the fragments
+ *  to be built and adding them to the group.
+ */
+struct DbGroupLoad {
+    /** Identifier of the open group the load was prepared for. */
+    unsigned long group_id;
+
+    /** Names of the fragments to be built by the load. */
+    std::vector<std::string> sources;
+
+    /** Paths of the fragments to be built, in the same order as sources. */
+    std::vector<std::string> paths;
+
+    /** Name of the fragment the loaded fragments are compacted into. */
+    std::string target;
+
+    DbGroupLoad() : group_id(0) {}
+};
+
 /** A group of dbs, arranged to allow writing new documents to the end of small
  *  databases, and later merging them in.
+ *
+ *  New documents are split between a number of write partitions, by a hash of
+ *  their idterm, and each partition adds documents to its own fragment.
+ *  Updates and deletions go to the fragment which holds the document.  This
+ *  allows several threads to modify the group at once, using add_doc(),
+ *  delete_doc() and sync(), as long as no two threads modify the same
+ *  document at once.  Merges may also be prepared and completed meanwhile.
+ *  Other methods must not be called while the group is being modified.
+ *
+ *  Each fragment keeps a Bloom filter of the idterms it holds, so looking up
+ *  a document only needs to check the fragments which may hold it.  This
+ *  relies on idterms starting with a tab, as those generated by schemas do;
+ *  other idterms are looked up in every fragment.
+ *
+ *  Fragments are merged using a size-tiered policy: when enough fragments of
+ *  similar size build up in a row, skipping over the current fragments for
+ *  the write partitions, they are compacted into a single new fragment.  The
+ *  compaction (prepare_merge()) happens while the group is being modified;
+ *  the new fragment is then swapped in (complete_merge()) once no
+ *  modifications are in progress, and only if none of the merged fragments
+ *  changed since their last commit before the compaction.  The swap is
+ *  written to disk by the next sync().  The directories of merged fragments
+ *  are kept until the next merge, or longer while any handle in the process
+ *  (such as a reader's) is still open on them.
  */
 class DbGroup {
     /** The maximum number of documents to put into a new db, before starting
@@ -145,6 +332,42 @@ class DbGroup {
      */
     unsigned int max_newdb_docs;
 
+    /** The number of write partitions to split new documents between.
+     */
+    unsigned int partitions;
+
+    /** Lock protecting the list of fragments, the control database, and
+     *  the counts of modifications in progress, while the group is being
+     *  modified.
+     */
+    Condition cond;
+
+    /** The number of calls modifying the group which are in progress.
+     *
+     *  Fragments can't be removed from the list while this is non-zero,
+     *  since the calls use fragments outside the lock.
+     */
+    unsigned modifying;
+
+    /** True while complete_merge() is waiting for modifications to finish,
+     *  or swapping fragments; new modifications wait until it's done.
+     */
+    bool swapping;
+
+    /** Record that a modification of the group is in progress, while in
+     *  context.
+     */
+    class Modification {
+	DbGroup & group;
+
+	Modification(const Modification &);
+	void operator=(const Modification &);
+      public:
+	Modification(DbGroup & group_);
+	~Modification();
+    };
+    friend class Modification;
+
     std::string groupdir;
 
     /** A database holding control information about the group. */
@@ -156,6 +379,16 @@ class DbGroup {
     /** The next fragment number to use. */
     unsigned int next_fragnum;
 
+    /** Identifier of this group while it is open for writing.
+     *
+     *  Unique within the process; 0 if not open for writing.
+     */
+    unsigned long group_id;
+
+    /** True while a merge has been prepared, but not completed.
+     */
+    bool merging;
+
     /** The last stored fraglist value read.
      *
      *  This is used to avoid reopening when not needed.
@@ -184,9 +417,86 @@ class DbGroup {
      */
     void invalidate_group_db() const;
 
-    /** Add a fragment to the group.
+    /** Reserve a name for a new fragment.
+     *
+     *  Names past the last stored next fragment number may have been used
+     *  by a writer which didn't commit; any directory left with the name is
+     *  removed.
+     *
+     *  The lock on cond must be held.
+     */
+    std::string reserve_frag_name();
+
+    /** Add a fragment to the group, for a write partition.
+     *
+     *  The lock on cond must be held.
+     */
+    DbFragment * add_frag(unsigned partition);
+
+    /** Get the fragment which a new document in a write partition should be
+     *  added to, adding a fragment if needed.
+     */
+    DbFragment * get_partition_frag(unsigned partition);
+
+    /** Find the fragment holding a document, for modifying it.
+     *
+     *  @returns The fragment, or NULL if no fragment holds the document.
+     */
+    DbFragment * find_doc_frag(const std::string & idterm);
+
+    /** Check if a fragment is the one that new documents are added to for
+     *  a write partition.
+     *
+     *  The lock on cond must be held.
+     */
+    bool is_partition_frag(size_t index) const;
+
+    /** Find a run of fragments to merge.
+     *
+     *  The run may skip over the current fragments for write partitions,
+     *  which are never merged.
+     *
+     *  The lock on cond must be held.
+     *
+     *  @param run Set to the indices of the fragments to merge, in order.
+     *  @returns true if a run to merge was found.
+     */
+    bool find_merge(std::vector<size_t> & run);
+
+    /** Swap a merged fragment in for its sources, if they haven't changed.
+     *
+     *  The lock on cond must be held, and no modifications may be in
+     *  progress.
+     *
+     *  @returns true if the fragments were swapped.
+     */
+    bool swap_merged(const DbGroupMerge & merge);
+
+    /** Get the list of fragment directories which may be removed.
+     *
+     *  The lock on cond must be held.
+     */
+    std::vector<std::string> get_obsolete_frags();
+
+    /** Remove the directories of fragments which have been merged away.
+     *
+     *  Fragments which still have a handle open in the process are kept
+     *  until a later call.  The lock on cond must be held.  Doesn't commit
+     *  the change to the list of merged fragments.
+     */
+    void remove_obsolete_frags();
+
+    /** Set the list of fragment directories which may be removed.
+     *
+     *  The lock on cond must be held.  Doesn't commit the change.
+     */
+    void store_obsolete_frags(const std::vector<std::string> & names);
+
+    /** Find the fragment holding a document, for reading it.
+     *
+     *  @returns The fragment, or NULL if no fragment holds the document.
      */
-    void add_frag();
+    DbFragment * find_doc_frag_readonly(const std::string & idterm) const;
 
     DbGroup(const DbGroup & other);
     void operator=(const DbGroup & other);
@@ -194,6 +504,17 @@ class DbGroup {
     DbGroup(const std::string & groupdir_);
     ~DbGroup();
 
+    /** Calculate the hash of an idterm used to pick its write partition.
+     */
+    static unsigned long idterm_hash(const std::string & idterm);
+
+    /** Set the number of write partitions to split new documents between.
+     *
+     *  Documents already stored stay in their fragment, so this may be
+     *  changed at any time that the group isn't being modified.
+     */
+    void set_partitions(unsigned int partitions_);
+
     /** Close the databases in this group.
      */
     void close();
@@ -238,6 +559,19 @@ class DbGroup {
      */
     const Xapian::Database & get_db() const;
 
+    /** Get database objects for each of the fragments in this group.
+     *
+     *  The group's database interleaves the documents of these, in order:
+     *  the document with ID D in fragment F (where D counts from 1, as
+     *  Xapian document IDs do, and F is the index in dbs, counting from 0)
+     *  has ID (D - 1) * dbs.size() + F + 1 in the group's database.
+     *
+     *  Not valid after the same operations as get_db().  The objects share
+     *  state with the group's database, so mustn't be used by another
+     *  thread at the same time as it.
+     */
+    void get_fragment_dbs(std::vector<Xapian::Database> & dbs) const;
+
     /** Get a document, given its idterm string.
      *
      *  @param idterm The idterm to look for.
@@ -272,13 +606,80 @@ class DbGroup {
     /** Block until all modifications are written to persistent store. */
     void sync();
 
-#if 0
-    /** Block until all modifications are available for searching. */
-    void refresh();
+    /** Check if there are fragments which should be merged.
+     */
+    bool needs_merge();
+
+    /** Prepare a merge of fragments, compacting them into a new fragment.
+     *
+     *  Safe to call while the group is being modified, but only one merge
+     *  may be in progress at once: after this returns true,
+     *  complete_merge() or abandon_merge() must be called before preparing
+     *  another.  Only the committed contents of the fragments are merged;
+     *  nothing is committed.
+     *
+     *  @param merge Set to the state of the merge.
+     *  @returns false if there was nothing to merge (or a merge is already
+     *  in progress, or the fragments to merge have uncommitted changes).
+     */
+    bool prepare_merge(DbGroupMerge & merge);
+
+    /** Complete a prepared merge, swapping the new fragment in for the
+     *  fragments it was made from.
+     *
+     *  Waits until no modifications of the group are in progress, and holds
+     *  off new ones while swapping.  If any of the merged fragments have
+     *  changed since the merge was prepared, the merge is abandoned instead.
+     *  The new list of fragments is committed by the next sync().
+     *
+     *  @returns true if the merge was completed.
+     */
+    bool complete_merge(const DbGroupMerge & merge);
+
+    /** Abandon a prepared merge, removing the new fragment.
+     */
+    void abandon_merge(const DbGroupMerge & merge);
+
+    /** Prepare to load documents into the group in bulk.
+     *
+     *  Reserves directories for fragments which the caller builds directly,
+     *  without going through the group (and may build in parallel, without
+     *  syncing each change to disk).  The group must be open for writing,
+     *  and must not contain any documents, since documents in the loaded
+     *  fragments aren't checked against those already in the group.
+     *
+     *  After this returns, complete_load() or abandon_load() must be called.
+     *  If neither is, the reserved directories are removed when the group
+     *  is next opened for writing.
+     *
+     *  @param load Set to the state of the load.
+     *  @param count The number of fragments to reserve.
+     */
+    void prepare_load(DbGroupLoad & load, unsigned count);
 
-    /** Block until the database has been compacted, and fragments merged. */
-    void compact();
-#endif
+    /** Complete a bulk load, compacting the loaded fragments into a single
+     *  fragment and adding it to the group.
+     *
+     *  The loaded fragments must have been closed.  The compacted fragment
+     *  is committed to disk before being added to the group, and the group
+     *  is committed (including any other pending changes to its metadata),
+     *  so the loaded documents become visible in one step.
+     *
+     *  Must not be called while the group is being modified.
+     */
+    void complete_load(const DbGroupLoad & load);
+
+    /** Abandon a bulk load, removing the loaded fragments.
+     */
+    void abandon_load(const DbGroupLoad & load);
+
+    /** Make all modifications available for searching.
+     *
+     *  If the group is open for writing, commits all the fragments.
+     *  Otherwise, (re)opens the group for reading, so that it sees all the
+     *  committed modifications.
+     */
+    void refresh();
 };
 
 }
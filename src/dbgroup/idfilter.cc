@@ -0,0 +1,141 @@
+/** @file idfilter.cc
+ * @brief A filter recording which document IDs may be in a database.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "idfilter.h"
+
+#include "utils/rsperrors.h"
+
+#include <algorithm>
+
+using namespace RestPose;
+
+/// The smallest capacity a filter is given.
+#define MIN_CAPACITY 1024
+
+/// The number of bits in the filter for each ID it has capacity for.
+#define BITS_PER_ITEM 10
+
+/// The number of bits set for each ID; gives about 1% false positives.
+#define HASH_COUNT 7
+
+/// The number of bytes of filter bits in each chunk.
+#define CHUNK_BYTES 65536
+
+/** Calculate the two base hashes of an ID.
+ *
+ *  The hashes are kept to 32 bits, so that a serialised filter gives the same
+ *  results on platforms with 64 bit longs.
+ */
+static void
+id_hashes(const std::string & id, unsigned long & h1, unsigned long & h2)
+{
+    h1 = 2166136261u;
+    h2 = 5381;
+    for (std::string::const_iterator i = id.begin(); i != id.end(); ++i) {
+	unsigned char ch = static_cast<unsigned char>(*i);
+	h1 = ((h1 ^ ch) * 16777619u) & 0xffffffffu;
+	h2 = (h2 * 33 + ch) & 0xffffffffu;
+    }
+    // An odd step ensures the probes don't all land on the same bit.
+    h2 |= 1;
+}
+
+IdFilter::IdFilter()
+	: capacity(0),
+	  items(0),
+	  nbits(0),
+	  bits(),
+	  modified()
+{
+    reset(MIN_CAPACITY);
+}
+
+void
+IdFilter::reset(size_t capacity_)
+{
+    capacity = (capacity_ < MIN_CAPACITY) ? MIN_CAPACITY : capacity_;
+    items = 0;
+    bits.assign((capacity * BITS_PER_ITEM + 7) / 8, '\0');
+    nbits = bits.size() * 8;
+    modified.assign((bits.size() + CHUNK_BYTES - 1) / CHUNK_BYTES, true);
+}
+
+void
+IdFilter::add(const std::string & id)
+{
+    unsigned long h1, h2;
+    id_hashes(id, h1, h2);
+    bool added = false;
+    for (unsigned i = 0; i != HASH_COUNT; ++i) {
+	size_t bit = ((h1 + i * h2) & 0xffffffffu) % nbits;
+	unsigned char mask = static_cast<unsigned char>(1 << (bit & 7));
+	if ((bits[bit >> 3] & mask) == 0) {
+	    bits[bit >> 3] |= mask;
+	    modified[(bit >> 3) / CHUNK_BYTES] = true;
+	    added = true;
+	}
+    }
+    if (added) {
+	++items;
+    }
+}
+
+bool
+IdFilter::may_contain(const std::string & id) const
+{
+    unsigned long h1, h2;
+    id_hashes(id, h1, h2);
+    for (unsigned i = 0; i != HASH_COUNT; ++i) {
+	size_t bit = ((h1 + i * h2) & 0xffffffffu) % nbits;
+	unsigned char mask = static_cast<unsigned char>(1 << (bit & 7));
+	if ((bits[bit >> 3] & mask) == 0) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+void
+IdFilter::clear_modified()
+{
+    modified.assign(modified.size(), false);
+}
+
+std::string
+IdFilter::get_chunk(size_t chunk) const
+{
+    return bits.substr(chunk * CHUNK_BYTES, CHUNK_BYTES);
+}
+
+void
+IdFilter::set_chunk(size_t chunk, const std::string & data)
+{
+    size_t offset = chunk * CHUNK_BYTES;
+    if (chunk >= modified.size() ||
+	data.size() != std::min(bits.size() - offset, size_t(CHUNK_BYTES))) {
+	throw UnserialisationError("Invalid ID filter chunk");
+    }
+    bits.replace(offset, data.size(), data);
+}
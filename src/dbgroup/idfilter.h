@@ -0,0 +1,144 @@
+/** @file idfilter.h
+ * @brief A filter recording which document IDs may be in a database.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_IDFILTER_H
+#define RESTPOSE_INCLUDED_IDFILTER_H
+
+#include <string>
+#include <vector>
+
+namespace RestPose {
+
+/** A Bloom filter recording the document IDs which may be in a database.
+ *
+ *  may_contain() never returns false for an ID which has been added, but may
+ *  return true for IDs which haven't (about 1% of the time, until more IDs
+ *  than the filter's capacity have been added).  IDs can't be removed from
+ *  the filter; instead, the filter should be rebuilt from the database when
+ *  it becomes full.
+ *
+ *  The filter bits are split into fixed size chunks, so that a filter can be
+ *  stored and loaded a chunk at a time.  The chunks changed since the filter
+ *  was last stored are tracked, so that only those need to be rewritten.
+ */
+class IdFilter {
+    /** The number of IDs the filter is sized for. */
+    size_t capacity;
+
+    /** The number of distinct IDs which have been added. */
+    size_t items;
+
+    /** The number of bits in the filter. */
+    size_t nbits;
+
+    /** The filter bits, 8 per byte. */
+    std::string bits;
+
+    /** Flags for each chunk, true if the chunk has been modified since
+     *  clear_modified() was last called.
+     */
+    std::vector<bool> modified;
+
+  public:
+    /** Create an empty filter, with the minimum capacity.
+     */
+    IdFilter();
+
+    /** Empty the filter, and resize it to hold a given number of IDs.
+     *
+     *  All chunks are marked as modified.
+     */
+    void reset(size_t capacity_);
+
+    /** Add an ID to the filter.
+     */
+    void add(const std::string & id);
+
+    /** Check if an ID may have been added to the filter.
+     *
+     *  @returns false if the ID definitely hasn't been added, true if it
+     *  may have been.
+     */
+    bool may_contain(const std::string & id) const;
+
+    /** Get the number of IDs which have been added to the filter.
+     *
+     *  IDs for which may_contain() returned true when added aren't counted.
+     */
+    size_t get_items() const {
+	return items;
+    }
+
+    /** Set the number of IDs which have been added to the filter.
+     *
+     *  Used when loading a stored filter.
+     */
+    void set_items(size_t items_) {
+	items = items_;
+    }
+
+    /** Get the number of IDs the filter is sized for.
+     */
+    size_t get_capacity() const {
+	return capacity;
+    }
+
+    /** Check if more IDs than the filter's capacity have been added.
+     */
+    bool is_full() const {
+	return items > capacity;
+    }
+
+    /** Get the number of chunks the filter bits are split into.
+     */
+    size_t get_chunk_count() const {
+	return modified.size();
+    }
+
+    /** Check if a chunk has been modified since clear_modified() was last
+     *  called.
+     */
+    bool is_chunk_modified(size_t chunk) const {
+	return modified[chunk];
+    }
+
+    /** Mark all the chunks as unmodified.
+     */
+    void clear_modified();
+
+    /** Get the filter bits in a chunk.
+     */
+    std::string get_chunk(size_t chunk) const;
+
+    /** Set the filter bits in a chunk.
+     *
+     *  Throws UnserialisationError if the data isn't the right length for
+     *  the chunk.  Doesn't mark the chunk as modified.
+     */
+    void set_chunk(size_t chunk, const std::string & data);
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_IDFILTER_H */
@@ -1,17 +1,29 @@
 noinst_LIBRARIES += libfeatures.a
 
 noinst_HEADERS += \
+ src/features/bulk_handlers.h \
+ src/features/bulk_tasks.h \
  src/features/category_handlers.h \
  src/features/category_tasks.h \
  src/features/checkpoint_handlers.h \
  src/features/checkpoint_tasks.h \
  src/features/coll_handlers.h \
- src/features/coll_tasks.h
+ src/features/coll_tasks.h \
+ src/features/msearch_handlers.h \
+ src/features/msearch_tasks.h \
+ src/features/template_handlers.h \
+ src/features/template_tasks.h
 
 libfeatures_a_SOURCES = \
+ src/features/bulk_handlers.cc \
+ src/features/bulk_tasks.cc \
  src/features/category_handlers.cc \
  src/features/category_tasks.cc \
  src/features/checkpoint_handlers.cc \
  src/features/checkpoint_tasks.cc \
  src/features/coll_handlers.cc \
- src/features/coll_tasks.cc
+ src/features/coll_tasks.cc \
+ src/features/msearch_handlers.cc \
+ src/features/msearch_tasks.cc \
+ src/features/template_handlers.cc \
+ src/features/template_tasks.cc
@@ -0,0 +1,387 @@
+/** @file bulk_handlers.cc
+ * @brief Handlers related to bulk updates.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "features/bulk_handlers.h"
+
+#include <cctype>
+#include <cstring>
+#include "features/bulk_tasks.h"
+#include "httpserver/httpserver.h"
+#include "logger/logger.h"
+#include <microhttpd.h>
+#include "realtime.h"
+#include "server/journal.h"
+#include "server/task_manager.h"
+#include "server/tasks.h"
+#include "str.h"
+#include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
+#include "utils/validation.h"
+
+using namespace std;
+using namespace RestPose;
+
+/// Maximum number of actions to push onto the processing queue in one batch.
+static const size_t BULK_BATCH_SIZE = 100;
+
+/// Maximum length of a single line of a bulk request.
+static const size_t BULK_MAX_LINE_LENGTH = 16 * 1024 * 1024;
+
+/** Maximum number of errors to list in the response.
+ *
+ *  Further errors are only counted, so that a large request full of bad
+ *  lines doesn't build a huge response.
+ */
+static const unsigned BULK_MAX_ERRORS = 100;
+
+/** Time (in seconds) to wait for space on a full processing queue.
+ *
+ *  Only used when the handler is allowed to block.
+ */
+static const double BULK_PUSH_TIMEOUT = 30.0;
+
+Handler *
+CollBulkHandlerFactory::create(
+	const std::vector<std::string> & path_params) const
+{
+    string coll_name = path_params[0];
+    validate_collname_throw(coll_name);
+    return new CollBulkHandler(coll_name);
+}
+
+CollBulkHandler::CollBulkHandler(const string & coll_name_)
+	: Handler(),
+	  coll_name(coll_name_),
+	  inflater(),
+	  decode_error(),
+	  partial_line(),
+	  skipping_line(false),
+	  line_num(0),
+	  batch(new ProcessorBatchTask),
+	  batch_lines(),
+	  batch_records(),
+	  journalling(false),
+	  accepted(0),
+	  high_load(false),
+	  errors(Json::arrayValue),
+	  error_count(0),
+	  ack_level(ACK_QUEUED),
+	  resulthandle(),
+	  waiting(false)
+{
+}
+
+CollBulkHandler::~CollBulkHandler()
+{
+    if (waiting) {
+	resulthandle.cancel();
+    }
+}
+
+void
+CollBulkHandler::add_error(unsigned line, const string & msg)
+{
+    ++error_count;
+    if (errors.size() >= BULK_MAX_ERRORS) {
+	return;
+    }
+    Json::Value & error = errors.append(Json::objectValue);
+    error["line"] = line;
+    error["msg"] = msg;
+}
+
+void
+CollBulkHandler::process_line(const char * data, size_t len)
+{
+    // Ignore blank lines.
+    size_t i = 0;
+    while (i != len && isspace(static_cast<unsigned char>(data[i]))) {
+	++i;
+    }
+    if (i == len) {
+	return;
+    }
+
+    try {
+	Json::Value action;
+	json_unserialise(string(data, len), action);
+	if (!action.isObject()) {
+	    throw InvalidValueError("Bulk action must be a JSON object");
+	}
+	string action_type = json_get_string_member(action, "action",
+						    "index");
+	string doc_type = json_get_string_member(action, "type", string());
+	string doc_id = json_get_string_member(action, "id", string());
+
+	if (action_type == "index") {
+	    const Json::Value & doc = action["doc"];
+	    if (!doc.isObject()) {
+		throw InvalidValueError("Index action requires a \"doc\" "
+					"member holding a JSON object");
+	    }
+	    // The type and ID may be omitted, to be read from the document
+	    // when it's processed, but if given they are checked here, so
+	    // that errors are reported against the line.
+	    string msg;
+	    if (!doc_type.empty()) {
+		msg = validate_doc_type(doc_type);
+	    }
+	    if (msg.empty() && !doc_id.empty()) {
+		msg = validate_doc_id(doc_id);
+	    }
+	    if (!msg.empty()) {
+		throw InvalidValueError(msg);
+	    }
+	    batch->add(new ProcessorProcessDocumentTask(doc_type, doc_id, doc));
+	    if (journalling) {
+		JournalRecord::append_index(batch_records, doc_type, doc_id,
+					    doc);
+	    }
+	} else if (action_type == "delete") {
+	    string msg = validate_doc_type(doc_type);
+	    if (!msg.empty()) {
+		throw InvalidValueError(msg);
+	    }
+	    msg = validate_doc_id(doc_id);
+	    if (!msg.empty()) {
+		throw InvalidValueError(msg);
+	    }
+	    batch->add(new DelayedIndexingTask(
+		new DeleteDocumentTask(doc_type, doc_id)));
+	    if (journalling) {
+		JournalRecord::append_delete(batch_records, doc_type, doc_id);
+	    }
+	} else {
+	    throw InvalidValueError("Unknown bulk action \"" + action_type +
+				    "\"");
+	}
+	batch_lines.push_back(line_num);
+    } catch(const InvalidValueError & e) {
+	add_error(line_num, e.what());
+    }
+}
+
+void
+CollBulkHandler::flush_batch(ConnectionInfo & conn)
+{
+    if (batch->size() == 0) {
+	return;
+    }
+
+    double end_time = 0.0;
+    if (conn.blocking) {
+	end_time = RealTime::now() + BULK_PUSH_TIMEOUT;
+    }
+    Queue::QueueState state = taskman->queue_journalled(coll_name,
+	batch.release(), batch_records, false, end_time);
+    batch.reset(new ProcessorBatchTask);
+    batch_records.resize(0);
+
+    switch (state) {
+	case Queue::LOW_SPACE:
+	    high_load = true;
+	    // Fall through
+	case Queue::HAS_SPACE:
+	    accepted += batch_lines.size();
+	    break;
+	case Queue::FULL:
+	    for (vector<unsigned>::const_iterator
+		 i = batch_lines.begin(); i != batch_lines.end(); ++i) {
+		add_error(*i, "Too many active requests");
+	    }
+	    break;
+	case Queue::CLOSED:
+	    for (vector<unsigned>::const_iterator
+		 i = batch_lines.begin(); i != batch_lines.end(); ++i) {
+		add_error(*i, "Server is shutting down");
+	    }
+	    break;
+    }
+    batch_lines.clear();
+}
+
+void
+CollBulkHandler::handle_data(ConnectionInfo & conn,
+			     const char * data, size_t len)
+{
+    const char * end = data + len;
+    while (data != end) {
+	const char * nl = static_cast<const char *>(
+	    memchr(data, '\n', end - data));
+	if (nl == NULL) {
+	    // Keep the incomplete line for the next chunk.
+	    if (skipping_line) {
+		return;
+	    }
+	    if (partial_line.size() + (end - data) > BULK_MAX_LINE_LENGTH) {
+		add_error(line_num + 1, "Line too long");
+		partial_line.resize(0);
+		skipping_line = true;
+		return;
+	    }
+	    partial_line.append(data, end - data);
+	    return;
+	}
+
+	++line_num;
+	if (skipping_line) {
+	    skipping_line = false;
+	} else if (partial_line.empty()) {
+	    process_line(data, nl - data);
+	} else {
+	    partial_line.append(data, nl - data);
+	    process_line(partial_line.data(), partial_line.size());
+	    partial_line.resize(0);
+	}
+	if (batch->size() >= BULK_BATCH_SIZE) {
+	    flush_batch(conn);
+	}
+	data = nl + 1;
+    }
+}
+
+void
+CollBulkHandler::wait_for_ack(ConnectionInfo & conn,
+			      const Json::Value & result)
+{
+    // Push a barrier after the actions: it's performed once they've all
+    // been processed and applied.
+    Queue::QueueState state = taskman->queue_processing(coll_name,
+	new DelayedIndexingTask(new AckBarrierTask(
+	    new WriteAck(resulthandle, ack_level, result))),
+	false);
+    switch (state) {
+	case Queue::CLOSED:
+	    conn.respond(MHD_HTTP_INTERNAL_SERVER_ERROR, "{\"err\":\"Server is shutting down\"}", "application/json");
+	    return;
+	case Queue::FULL:
+	    conn.respond(MHD_HTTP_SERVICE_UNAVAILABLE, "{\"err\":\"Too many active requests\"}", "application/json");
+	    return;
+	default:
+	    break;
+    }
+    waiting = true;
+    if (conn.blocking) {
+	respond_when_ready(conn, resulthandle);
+    } else if (resulthandle.is_ready()) {
+	conn.respond(resulthandle);
+    }
+}
+
+void
+CollBulkHandler::handle(ConnectionInfo & conn)
+{
+    if (waiting) {
+	if (resulthandle.is_ready()) {
+	    conn.respond(resulthandle);
+	}
+	return;
+    }
+    if (conn.first_call) {
+	try {
+	    ack_level = get_ack_level(conn);
+	} catch(const InvalidValueError & e) {
+	    Json::Value result(Json::objectValue);
+	    result["err"] = e.what();
+	    conn.respond(400, json_serialise(result), "application/json");
+	    return;
+	}
+	if (ack_level != ACK_QUEUED && !conn.blocking) {
+	    resulthandle.set_nudge(taskman->get_nudge_fd(), 'H');
+	}
+	journalling = taskman->get_journals().is_enabled();
+	(void) open_body_decoder(conn, inflater);
+	return;
+    }
+    if (conn.responded) {
+	// The body was rejected on the first call.
+	*(conn.upload_data_size) = 0;
+	return;
+    }
+
+    if (*(conn.upload_data_size) != 0) {
+	size_t len = *(conn.upload_data_size);
+	*(conn.upload_data_size) = 0;
+	if (!decode_error.empty()) {
+	    // Discard the rest of a body which couldn't be decoded.
+	    return;
+	}
+	if (inflater.get() == NULL) {
+	    handle_data(conn, conn.upload_data, len);
+	    return;
+	}
+	try {
+	    inflater->set_input(conn.upload_data, len);
+	    string piece;
+	    while (inflater->read_output(piece)) {
+		handle_data(conn, piece.data(), piece.size());
+	    }
+	} catch(const CompressionError & e) {
+	    decode_error = e.what();
+	}
+	return;
+    }
+
+    // End of the request body: handle any final line without a newline.
+    if (decode_error.empty() && inflater.get() != NULL &&
+	!inflater->at_end()) {
+	decode_error = "unexpected end of data";
+    }
+    if (!decode_error.empty()) {
+	// Actions on lines after the error are lost, so report it against
+	// the next line.
+	partial_line.resize(0);
+	skipping_line = false;
+	add_error(line_num + 1,
+		  "Invalid compressed request body: " + decode_error);
+    } else if (skipping_line) {
+	++line_num;
+	skipping_line = false;
+    } else if (!partial_line.empty()) {
+	++line_num;
+	process_line(partial_line.data(), partial_line.size());
+	partial_line.resize(0);
+    }
+    flush_batch(conn);
+
+    LOG_DEBUG("Bulk update to '" + coll_name + "': " + str(accepted) +
+	      " actions queued, " + str(error_count) + " errors");
+
+    Json::Value result(Json::objectValue);
+    result["accepted"] = accepted;
+    result["errors"] = errors;
+    result["error_count"] = error_count;
+    if (high_load) {
+	result["high_load"] = 1;
+    }
+    if (ack_level == ACK_QUEUED) {
+	conn.respond(202, json_serialise(result), "application/json");
+    } else if (accepted == 0) {
+	// Nothing to wait for.
+	conn.respond(200, json_serialise(result), "application/json");
+    } else {
+	wait_for_ack(conn, result);
+    }
+}
@@ -0,0 +1,135 @@
+/** @file bulk_handlers.h
+ * @brief Handlers related to bulk updates.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef RESTPOSE_INCLUDED_BULK_HANDLERS_H
+#define RESTPOSE_INCLUDED_BULK_HANDLERS_H
+
+#include <memory>
+#include "rest/handler.h"
+#include "server/result_handle.h"
+#include "server/write_ack.h"
+#include <string>
+#include <vector>
+
+class ProcessorBatchTask;
+
+/** Apply a stream of updates to a collection.
+ *
+ *  Expects 1 path parameter:
+ *
+ *   - the collection name
+ *
+ *  The request body is a sequence of JSON objects, one per line, each
+ *  describing an action to perform.  Lines are parsed as they arrive, rather
+ *  than after the whole body has been received, and the resulting tasks are
+ *  pushed onto the processing queue for the collection in batches.  The body
+ *  may be gzip or deflate encoded.
+ *
+ *  If the request asks to wait for the actions to be processed or committed,
+ *  the response is sent once all the actions have reached that level.
+ */
+class CollBulkHandlerFactory : public HandlerFactory {
+  public:
+    Handler * create(const std::vector<std::string> & path_params) const;
+};
+class CollBulkHandler : public Handler {
+    std::string coll_name;
+
+    /// Decoder for the body, if it is compressed.
+    std::auto_ptr<ZlibInflater> inflater;
+
+    /** Error found when decoding the body.
+     *
+     *  If set, the rest of the body is ignored.
+     */
+    std::string decode_error;
+
+    /// Data received after the last complete line.
+    std::string partial_line;
+
+    /** True if the line currently being received was too long, and the rest
+     *  of it should be ignored.
+     */
+    bool skipping_line;
+
+    /// The number of the last line received (starting at 1).
+    unsigned line_num;
+
+    /// The batch currently being built.
+    std::auto_ptr<ProcessorBatchTask> batch;
+
+    /// Line numbers of the tasks in the current batch.
+    std::vector<unsigned> batch_lines;
+
+    /// Journal records for the tasks in the current batch.
+    std::string batch_records;
+
+    /// True if the changes are being journalled.
+    bool journalling;
+
+    /// The number of actions which have been queued.
+    unsigned accepted;
+
+    /// True if the processing queue has reported that it is busy.
+    bool high_load;
+
+    /// Errors found with individual lines (only the first few are kept).
+    Json::Value errors;
+
+    /// The number of errors found, including those not kept.
+    unsigned error_count;
+
+    /// The level at which to acknowledge the request.
+    RestPose::AckLevel ack_level;
+
+    /// Handle used to wait for the acknowledgement.
+    RestPose::ResultHandle resulthandle;
+
+    /// True if waiting for the acknowledgement.
+    bool waiting;
+
+    /** Wait for all the accepted actions to reach the acknowledgement
+     *  level, and then respond with result.
+     */
+    void wait_for_ack(ConnectionInfo & conn, const Json::Value & result);
+
+    /// Record an error for a line, keeping it if few have been recorded.
+    void add_error(unsigned line, const std::string & msg);
+
+    /// Parse a line, and add the resulting task to the current batch.
+    void process_line(const char * data, size_t len);
+
+    /// Push the current batch onto the processing queue.
+    void flush_batch(ConnectionInfo & conn);
+
+    /// Handle a chunk of the request body.
+    void handle_data(ConnectionInfo & conn, const char * data, size_t len);
+
+  public:
+    CollBulkHandler(const std::string & coll_name_);
+    ~CollBulkHandler();
+
+    void handle(ConnectionInfo & conn);
+};
+
+#endif /* RESTPOSE_INCLUDED_BULK_HANDLERS_H */
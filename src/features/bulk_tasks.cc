@@ -0,0 +1,69 @@
+/** @file bulk_tasks.cc
+ * @brief Tasks related to bulk updates.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "features/bulk_tasks.h"
+
+#include "logger/logger.h"
+#include <memory>
+#include "str.h"
+#include "utils/rsperrors.h"
+#include <xapian.h>
+
+using namespace std;
+using namespace RestPose;
+
+ProcessorBatchTask::~ProcessorBatchTask()
+{
+    for (vector<ProcessingTask *>::const_iterator
+	 i = tasks.begin(); i != tasks.end(); ++i) {
+	delete *i;
+    }
+}
+
+void
+ProcessorBatchTask::add(ProcessingTask * task)
+{
+    auto_ptr<ProcessingTask> taskptr(task);
+    tasks.push_back(NULL);
+    tasks.back() = taskptr.release();
+}
+
+void
+ProcessorBatchTask::perform(const string & coll_name,
+			    TaskManager * taskman)
+{
+    LOG_DEBUG("ProcessBatch of " + str(tasks.size()) + " tasks in '" +
+	      coll_name + "'");
+    for (vector<ProcessingTask *>::const_iterator
+	 i = tasks.begin(); i != tasks.end(); ++i) {
+	try {
+	    (*i)->perform(coll_name, taskman);
+	} catch(const RestPose::Error & e) {
+	    LOG_ERROR("Processing failed with", e);
+	} catch(const Xapian::Error & e) {
+	    LOG_ERROR("Processing failed with", e);
+	}
+    }
+}
@@ -0,0 +1,67 @@
+/** @file bulk_tasks.h
+ * @brief Tasks related to bulk updates.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef RESTPOSE_INCLUDED_BULK_TASKS_H
+#define RESTPOSE_INCLUDED_BULK_TASKS_H
+
+#include "server/basetasks.h"
+#include <string>
+#include <vector>
+
+/** A batch of processing tasks, performed in order.
+ *
+ *  This allows many documents to be pushed onto a processing queue as a
+ *  single entry, so that the queue locks are taken once per batch rather than
+ *  once per document.
+ */
+class ProcessorBatchTask : public ProcessingTask {
+    /// The tasks in the batch (owned by the batch).
+    std::vector<ProcessingTask *> tasks;
+
+    ProcessorBatchTask(const ProcessorBatchTask &);
+    void operator=(const ProcessorBatchTask &);
+  public:
+    ProcessorBatchTask() : ProcessingTask(), tasks() {}
+    ~ProcessorBatchTask();
+
+    /** Add a task to the end of the batch.
+     *
+     *  The batch takes ownership of the task.
+     */
+    void add(ProcessingTask * task);
+
+    /// Return the number of tasks in the batch.
+    size_t size() const {
+	return tasks.size();
+    }
+
+    /** Perform each of the tasks in the batch.
+     *
+     *  A failure in one task is logged, and does not prevent the remaining
+     *  tasks from being performed.
+     */
+    void perform(const std::string & coll_name,
+		 TaskManager * taskman);
+};
+
+#endif /* RESTPOSE_INCLUDED_BULK_TASKS_H */
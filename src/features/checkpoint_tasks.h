@@ -70,7 +70,9 @@ class CollGetCheckpointsTask : public ReadonlyTask {
 	    : ReadonlyTask(resulthandle_),
 	      coll_name(coll_name_),
 	      taskman(taskman_)
-    {}
+    {
+	priority = PRIORITY_ADMIN;
+    }
 
     void perform(RestPose::Collection * collection);
 };
@@ -94,7 +96,9 @@ class CollGetCheckpointTask : public ReadonlyTask {
 	      coll_name(coll_name_),
 	      taskman(taskman_),
 	      checkid(checkid_)
-    {}
+    {
+	priority = PRIORITY_ADMIN;
+    }
 
     void perform(RestPose::Collection * collection);
 };
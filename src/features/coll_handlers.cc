@@ -100,3 +100,23 @@ CollSetConfigHandler::enqueue(ConnectionInfo &,
 	new ProcessingCollSetConfigTask(body),
 	false);
 }
+
+Handler *
+CollRefreshHandlerFactory::create(
+	const std::vector<std::string> & path_params) const
+{
+    string coll_name = path_params[0];
+    validate_collname_throw(coll_name);
+    return new CollRefreshHandler(coll_name);
+}
+
+Queue::QueueState
+CollRefreshHandler::enqueue(ConnectionInfo &,
+			    const Json::Value &)
+{
+    // Go through the processing queue, so that the refresh happens after
+    // all the changes which have already been queued.
+    return taskman->queue_processing(coll_name,
+	new DelayedIndexingTask(new CollRefreshTask(resulthandle)),
+	false);
+}
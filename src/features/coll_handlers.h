@@ -87,4 +87,26 @@ class CollSetConfigHandler : public NoWaitQueuedHandler {
 };
 
 
+/** Make all the changes queued for a collection available for searching.
+ *
+ *  Expects 1 path parameter:
+ *
+ *   - the collection name
+ */
+class CollRefreshHandlerFactory : public HandlerFactory {
+  public:
+    Handler * create(const std::vector<std::string> & path_params) const;
+};
+
+class CollRefreshHandler : public QueuedHandler {
+    std::string coll_name;
+  public:
+    CollRefreshHandler(const std::string & coll_name_)
+	    : coll_name(coll_name_)
+    {}
+
+    Queue::QueueState enqueue(ConnectionInfo & conn,
+			      const Json::Value & body);
+};
+
 #endif /* RESTPOSE_INCLUDED_COLL_HANDLERS_H */
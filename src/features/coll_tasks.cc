@@ -117,3 +117,48 @@ CollSetConfigTask::clone() const
 {
     return new CollSetConfigTask(config);
 }
+
+
+void
+CollRefreshTask::perform_task(const string & coll_name,
+			      RestPose::Collection * & collection,
+			      TaskManager * taskman)
+{
+    if (collection == NULL) {
+	collection = taskman->get_collections().get_writable(coll_name);
+    }
+    collection->refresh();
+    refreshed = true;
+    if (collection->needs_merge()) {
+	taskman->queue_merge(coll_name);
+    }
+}
+
+void
+CollRefreshTask::info(string & description, string & doc_type,
+		      string & doc_id) const
+{
+    description = "Refreshing collection";
+    doc_type.resize(0);
+    doc_id.resize(0);
+}
+
+void
+CollRefreshTask::post_perform(const std::string &,
+			      RestPose::Collection *,
+			      TaskManager *)
+{
+    if (refreshed) {
+	resulthandle.response().set(Json::objectValue, 200);
+	resulthandle.set_ready();
+    } else {
+	// The error has been logged, and recorded for checkpoints.
+	resulthandle.failed("Refreshing collection failed", 500);
+    }
+}
+
+IndexingTask *
+CollRefreshTask::clone() const
+{
+    return new CollRefreshTask(resulthandle);
+}
@@ -36,7 +36,9 @@ class CollListTask : public ReadonlyTask {
 		 CollectionPool & collections_)
 	    : ReadonlyTask(resulthandle_),
 	      collections(collections_)
-    {}
+    {
+	priority = PRIORITY_ADMIN;
+    }
 
     void perform(RestPose::Collection * collection);
 };
@@ -46,7 +48,9 @@ class CollInfoTask : public ReadonlyCollTask {
     CollInfoTask(const RestPose::ResultHandle & resulthandle_,
 		 const std::string & coll_name_)
 	    : ReadonlyCollTask(resulthandle_, coll_name_)
-    {}
+    {
+	priority = PRIORITY_ADMIN;
+    }
 
     void perform(RestPose::Collection * collection);
 };
@@ -56,7 +60,9 @@ class CollGetConfigTask : public ReadonlyCollTask {
     CollGetConfigTask(const RestPose::ResultHandle & resulthandle_,
 		      const std::string & coll_name_)
 	    : ReadonlyCollTask(resulthandle_, coll_name_)
-    {}
+    {
+	priority = PRIORITY_ADMIN;
+    }
 
     void perform(RestPose::Collection * collection);
 };
@@ -91,5 +97,33 @@ class CollSetConfigTask : public IndexingTask {
 
     IndexingTask * clone() const;
 };
+/** Make all the changes made to a collection available for searching.
+ *
+ *  Replies to the request once the changes have been committed.
+ */
+class CollRefreshTask : public IndexingTask {
+    RestPose::ResultHandle resulthandle;
+    bool refreshed;
+  public:
+    CollRefreshTask(const RestPose::ResultHandle & resulthandle_)
+	    : IndexingTask(),
+	      resulthandle(resulthandle_),
+	      refreshed(false)
+    {}
+
+    void perform_task(const std::string & coll_name,
+		      RestPose::Collection * & collection,
+		      TaskManager * taskman);
+
+    void info(std::string & description,
+	      std::string & doc_type,
+	      std::string & doc_id) const;
+
+    void post_perform(const std::string & coll_name,
+		      RestPose::Collection * collection,
+		      TaskManager * taskman);
+
+    IndexingTask * clone() const;
+};
 
 #endif /* RESTPOSE_INCLUDED_COLL_TASKS_H */
@@ -0,0 +1,118 @@
+/** @file msearch_handlers.cc
+ * @brief Handlers for performing a batch of searches in parallel.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "features/msearch_handlers.h"
+
+#include "features/msearch_tasks.h"
+#include "httpserver/httpserver.h"
+#include "server/task_manager.h"
+#include "server/tasks.h"
+#include "str.h"
+#include "utils/rsperrors.h"
+#include "utils/validation.h"
+
+using namespace std;
+using namespace RestPose;
+
+/// Maximum number of searches allowed in a single batch.
+static const unsigned MSEARCH_MAX_SEARCHES = 100;
+
+Handler *
+MultiSearchHandlerFactory::create(
+	const std::vector<std::string> & path_params) const
+{
+    string coll_name = path_params[0];
+    validate_collname_throw(coll_name);
+    if (path_params.size() == 1) {
+	return new MultiSearchHandler(coll_name, string());
+    } else {
+	string doc_type = path_params[1];
+	return new MultiSearchHandler(coll_name, doc_type);
+    }
+}
+
+Queue::QueueState
+MultiSearchHandler::enqueue(ConnectionInfo &,
+			    const Json::Value & body)
+{
+    if (!body.isArray()) {
+	resulthandle.failed("Body of a multi-search must be an array of "
+			    "searches", 400);
+	return Queue::HAS_SPACE;
+    }
+    if (body.size() > MSEARCH_MAX_SEARCHES) {
+	resulthandle.failed("Too many searches in multi-search (maximum is " +
+			    str(MSEARCH_MAX_SEARCHES) + ")", 400);
+	return Queue::HAS_SPACE;
+    }
+
+    unsigned count = body.size();
+    if (count == 0) {
+	Json::Value response(Json::objectValue);
+	response["results"] = Json::arrayValue;
+	(void) resulthandle.set_ready_json(response, 200);
+	return Queue::HAS_SPACE;
+    }
+
+    vector<double> deadlines(count);
+    for (unsigned i = 0; i != count; ++i) {
+	try {
+	    deadlines[i] = search_deadline(body[i]);
+	} catch(const InvalidValueError & e) {
+	    resulthandle.failed("Search " + str(i) + ": " + e.what(), 400);
+	    return Queue::HAS_SPACE;
+	}
+    }
+
+    MultiSearchState * state = new MultiSearchState(resulthandle, count);
+    Queue::QueueState result = Queue::HAS_SPACE;
+    unsigned i = 0;
+    for (; i != count; ++i) {
+	Queue::QueueState pushstate = taskman->queue_readonly("search",
+	    new PerformMultiSearchTask(resulthandle, coll_name, state, i,
+				       body[i], doc_type, deadlines[i]));
+	if (pushstate == Queue::CLOSED || pushstate == Queue::FULL) {
+	    // The task which couldn't be pushed has been deleted, which
+	    // records an error for it.
+	    if (i == 0) {
+		// Nothing was queued, so report the failure for the whole
+		// request.
+		result = pushstate;
+	    }
+	    ++i;
+	    break;
+	}
+	if (pushstate == Queue::LOW_SPACE) {
+	    result = pushstate;
+	}
+    }
+    if (result != Queue::CLOSED && result != Queue::FULL) {
+	for (; i < count; ++i) {
+	    state->set_error(i, "Too many active requests");
+	}
+    }
+    state->decref();
+    return result;
+}
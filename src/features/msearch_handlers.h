@@ -0,0 +1,62 @@
+/** @file msearch_handlers.h
+ * @brief Handlers for performing a batch of searches in parallel.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef RESTPOSE_INCLUDED_MSEARCH_HANDLERS_H
+#define RESTPOSE_INCLUDED_MSEARCH_HANDLERS_H
+
+#include "rest/handler.h"
+#include <string>
+#include <vector>
+
+/** Perform a batch of searches on a collection.
+ *
+ *  Expects 1 or 2 path parameters:
+ *
+ *   - the collection name
+ *   - optionally, the document type to search within
+ *
+ *  The request body is an array of searches.  Each search is pushed onto the
+ *  search queue as a separate task, so that the searches are performed in
+ *  parallel by the search threads, and the results are returned together
+ *  once all of them have finished.
+ */
+class MultiSearchHandlerFactory : public HandlerFactory {
+  public:
+    Handler * create(const std::vector<std::string> & path_params) const;
+};
+
+class MultiSearchHandler : public QueuedHandler {
+    std::string coll_name;
+    std::string doc_type;
+  public:
+    MultiSearchHandler(const std::string & coll_name_,
+		       const std::string & doc_type_)
+	    : coll_name(coll_name_),
+	      doc_type(doc_type_)
+    {}
+
+    Queue::QueueState enqueue(ConnectionInfo & conn,
+			      const Json::Value & body);
+};
+
+#endif /* RESTPOSE_INCLUDED_MSEARCH_HANDLERS_H */
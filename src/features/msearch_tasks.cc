@@ -0,0 +1,171 @@
+/** @file msearch_tasks.cc
+ * @brief Tasks for performing a batch of searches in parallel.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "features/msearch_tasks.h"
+
+#include "jsonxapian/collection.h"
+#include "logger/logger.h"
+#include "server/tasks.h"
+#include "str.h"
+#include "utils/rsperrors.h"
+#include "utils/validation.h"
+#include <xapian.h>
+
+using namespace std;
+using namespace RestPose;
+
+MultiSearchState::MultiSearchState(const ResultHandle & resulthandle_,
+				   unsigned count)
+	: mutex(),
+	  ref_count(1),
+	  remaining(count),
+	  results(Json::arrayValue),
+	  resulthandle(resulthandle_)
+{
+    if (count != 0) {
+	results[count - 1] = Json::nullValue;
+    }
+}
+
+void
+MultiSearchState::incref()
+{
+    ContextLocker lock(mutex);
+    ++ref_count;
+}
+
+void
+MultiSearchState::decref()
+{
+    ContextLocker lock(mutex);
+    --ref_count;
+    if (ref_count == 0) {
+	lock.unlock();
+	delete this;
+    }
+}
+
+void
+MultiSearchState::set_result(unsigned index, Json::Value & result)
+{
+    ContextLocker lock(mutex);
+    results[index].swap(result);
+    --remaining;
+    if (remaining == 0) {
+	Json::Value response(Json::objectValue);
+	response["results"].swap(results);
+	lock.unlock();
+	(void) resulthandle.set_ready_json(response, 200);
+    }
+}
+
+void
+MultiSearchState::set_error(unsigned index, const string & msg)
+{
+    Json::Value result(Json::objectValue);
+    result["err"] = msg;
+    set_result(index, result);
+}
+
+PerformMultiSearchTask::PerformMultiSearchTask(
+	const ResultHandle & resulthandle_,
+	const string & coll_name_,
+	MultiSearchState * state_,
+	unsigned index_,
+	const Json::Value & search_,
+	const string & doc_type_,
+	double deadline_)
+	: ReadonlyCollTask(resulthandle_, coll_name_),
+	  state(state_),
+	  index(index_),
+	  search(search_),
+	  doc_type(doc_type_),
+	  done(false)
+{
+    deadline = deadline_;
+    state->incref();
+}
+
+PerformMultiSearchTask::~PerformMultiSearchTask()
+{
+    if (!done) {
+	state->set_error(index, "Search was not performed");
+    }
+    state->decref();
+}
+
+void
+PerformMultiSearchTask::expired()
+{
+    done = true;
+    state->set_error(index, "Search timed out before it was started");
+}
+
+double
+PerformMultiSearchTask::estimate_cost(Collection * collection) const
+{
+    if (!doc_type.empty() && !validate_doc_type(doc_type).empty()) {
+	return 0.0;
+    }
+    try {
+	return collection->estimate_search_cost(search, doc_type);
+    } catch(const RestPose::Error &) {
+	// Errors are reported for this search by perform().
+	return 0.0;
+    } catch(const Xapian::Error &) {
+	return 0.0;
+    }
+}
+
+void
+PerformMultiSearchTask::perform(Collection * collection)
+{
+    // Errors are reported in the result for this search, rather than
+    // failing the whole batch.
+    Json::Value result(Json::objectValue);
+    string error;
+    if (!doc_type.empty()) {
+	error = validate_doc_type(doc_type);
+    }
+    if (error.empty()) {
+	try {
+	    ResultHandleCancelCheck cancel(resulthandle);
+	    collection->perform_search(search, doc_type, result, NULL,
+				       deadline, &cancel);
+	    LOG_DEBUG("performed search " + str(index) + " of batch on '" +
+		      collection->get_name() + "'");
+	} catch(const RestPose::Error & e) {
+	    error = e.what();
+	} catch(const Xapian::Error & e) {
+	    error = e.get_description();
+	}
+    }
+    if (!error.empty()) {
+	result = Json::objectValue;
+	result["err"] = error;
+    }
+    done = true;
+    state->set_result(index, result);
+}
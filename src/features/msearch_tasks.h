@@ -0,0 +1,114 @@
+/** @file msearch_tasks.h
+ * @brief Tasks for performing a batch of searches in parallel.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef RESTPOSE_INCLUDED_MSEARCH_TASKS_H
+#define RESTPOSE_INCLUDED_MSEARCH_TASKS_H
+
+#include "json/value.h"
+#include "server/basetasks.h"
+#include <string>
+#include "utils/threading.h"
+
+/** The shared state of a batch of searches.
+ *
+ *  Holds the results of each search in the batch.  When the last result has
+ *  been set, the combined response is set in the result handle.
+ *
+ *  This is reference counted: each task holds a reference, and the state is
+ *  deleted when the last task releases it.
+ */
+class MultiSearchState {
+    Mutex mutex;
+    unsigned ref_count;
+
+    /// The number of searches which haven't finished yet.
+    unsigned remaining;
+
+    /// The results of the searches.
+    Json::Value results;
+
+    /// The handle to put the combined response into.
+    RestPose::ResultHandle resulthandle;
+
+    MultiSearchState(const MultiSearchState &);
+    void operator=(const MultiSearchState &);
+  public:
+    /** Create the state for a batch of searches.
+     *
+     *  The state is created with a reference count of 1.
+     */
+    MultiSearchState(const RestPose::ResultHandle & resulthandle_,
+		     unsigned count);
+
+    /// Add a reference to the state.
+    void incref();
+
+    /// Release a reference to the state; deletes it if it was the last one.
+    void decref();
+
+    /** Set the result of one of the searches.
+     *
+     *  The contents of result are swapped into the state (so result will be
+     *  modified).
+     */
+    void set_result(unsigned index, Json::Value & result);
+
+    /// Set the result of one of the searches to be an error.
+    void set_error(unsigned index, const std::string & msg);
+};
+
+/** Perform one of a batch of searches.
+ */
+class PerformMultiSearchTask : public ReadonlyCollTask {
+    MultiSearchState * state;
+    unsigned index;
+    Json::Value search;
+    std::string doc_type;
+    bool done;
+
+    PerformMultiSearchTask(const PerformMultiSearchTask &);
+    void operator=(const PerformMultiSearchTask &);
+  public:
+    PerformMultiSearchTask(const RestPose::ResultHandle & resulthandle_,
+			   const std::string & coll_name_,
+			   MultiSearchState * state_,
+			   unsigned index_,
+			   const Json::Value & search_,
+			   const std::string & doc_type_,
+			   double deadline_);
+
+    /** Release the task's reference to the state.
+     *
+     *  If the search was never performed (for example, because the queue
+     *  was closed), an error is recorded as its result.
+     */
+    ~PerformMultiSearchTask();
+
+    void perform(RestPose::Collection * collection);
+    double estimate_cost(RestPose::Collection * collection) const;
+
+    /// Report that this search timed out, without failing the batch.
+    void expired();
+};
+
+#endif /* RESTPOSE_INCLUDED_MSEARCH_TASKS_H */
@@ -0,0 +1,86 @@
+/** @file template_handlers.cc
+ * @brief Handlers related to search templates.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "features/template_handlers.h"
+
+#include "features/template_tasks.h"
+#include "jsonxapian/search_template.h"
+#include "realtime.h"
+#include "server/task_manager.h"
+#include "server/tasks.h"
+#include "utils/validation.h"
+
+using namespace std;
+using namespace RestPose;
+
+Handler *
+CollSetTemplateHandlerFactory::create(const vector<string> & path_params) const
+{
+    string coll_name = path_params[0];
+    string template_name = path_params[1];
+    validate_collname_throw(coll_name);
+    validate_template_name_throw(template_name);
+    return new CollSetTemplateHandler(coll_name, template_name);
+}
+
+Queue::QueueState
+CollSetTemplateHandler::enqueue(ConnectionInfo &,
+				const Json::Value & body)
+{
+    // Check the form of the template now, so that malformed templates are
+    // reported to the client.  It's checked against the collection's
+    // schemas when it's processed.
+    SearchTemplate search_template;
+    search_template.from_json(body);
+    return taskman->queue_processing(coll_name,
+	new ProcessingCollSetTemplateTask(template_name, body),
+	false);
+}
+
+Handler *
+TemplateSearchHandlerFactory::create(const vector<string> & path_params) const
+{
+    string coll_name = path_params[0];
+    validate_collname_throw(coll_name);
+    string doc_type;
+    string template_name;
+    if (path_params.size() == 2) {
+	template_name = path_params[1];
+    } else {
+	doc_type = path_params[1];
+	template_name = path_params[2];
+    }
+    validate_template_name_throw(template_name);
+    return new TemplateSearchHandler(coll_name, doc_type, template_name);
+}
+
+Queue::QueueState
+TemplateSearchHandler::enqueue(ConnectionInfo &,
+			       const Json::Value & body)
+{
+    return taskman->queue_readonly("search",
+	new PerformTemplateSearchTask(resulthandle, coll_name, template_name,
+				      body, doc_type, RealTime::now()));
+}
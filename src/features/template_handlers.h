@@ -0,0 +1,86 @@
+/** @file template_handlers.h
+ * @brief Handlers related to search templates.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_TEMPLATE_HANDLERS_H
+#define RESTPOSE_INCLUDED_TEMPLATE_HANDLERS_H
+
+#include "rest/handler.h"
+
+/** Set a search template.
+ *
+ *  Expects 2 path parameters:
+ *
+ *   - the collection name
+ *   - the template name
+ */
+class CollSetTemplateHandlerFactory : public HandlerFactory {
+  public:
+    Handler * create(const std::vector<std::string> & path_params) const;
+};
+class CollSetTemplateHandler : public NoWaitQueuedHandler {
+    std::string coll_name;
+    std::string template_name;
+  public:
+    CollSetTemplateHandler(const std::string & coll_name_,
+			   const std::string & template_name_)
+	    : coll_name(coll_name_),
+	      template_name(template_name_)
+    {}
+
+    Queue::QueueState enqueue(ConnectionInfo & conn,
+			      const Json::Value & body);
+};
+
+/** Perform a search using a search template.
+ *
+ *  The body holds the values of the template's parameters.
+ *
+ *  Expects 2 or 3 path parameters:
+ *
+ *   - the collection name
+ *   - the document type (if 3 parameters)
+ *   - the template name
+ */
+class TemplateSearchHandlerFactory : public HandlerFactory {
+  public:
+    Handler * create(const std::vector<std::string> & path_params) const;
+};
+class TemplateSearchHandler : public QueuedHandler {
+    std::string coll_name;
+    std::string doc_type;
+    std::string template_name;
+  public:
+    TemplateSearchHandler(const std::string & coll_name_,
+			  const std::string & doc_type_,
+			  const std::string & template_name_)
+	    : coll_name(coll_name_),
+	      doc_type(doc_type_),
+	      template_name(template_name_)
+    {}
+
+    Queue::QueueState enqueue(ConnectionInfo & conn,
+			      const Json::Value & body);
+};
+
+#endif /* RESTPOSE_INCLUDED_TEMPLATE_HANDLERS_H */
@@ -0,0 +1,97 @@
+/** @file template_tasks.cc
+ * @brief Tasks related to search templates.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "features/template_tasks.h"
+
+#include "jsonxapian/collection_pool.h"
+#include "jsonxapian/collconfigs.h"
+#include "jsonxapian/search_template.h"
+#include "logger/logger.h"
+#include <memory>
+#include "server/task_manager.h"
+#include "utils/rsperrors.h"
+#include <xapian.h>
+
+using namespace std;
+using namespace RestPose;
+
+void
+ProcessingCollSetTemplateTask::perform(const std::string & coll_name,
+				       TaskManager * taskman)
+{
+    auto_ptr<CollectionConfig> collconfig(taskman->get_collconfigs()
+					  .get(coll_name));
+    SearchTemplate search_template;
+    string error;
+    try {
+	search_template.from_json(tmpl);
+	collconfig->check_search_template(search_template);
+    } catch (const InvalidValueError & e) {
+	error = e.what();
+    } catch (const Xapian::Error & e) {
+	error = e.get_description();
+    }
+    if (!error.empty()) {
+	string msg("Setting search template '" + template_name +
+		   "' failed with " + error);
+	LOG_ERROR(msg);
+	taskman->get_checkpoints().append_error(coll_name, msg,
+						string(), string());
+	return;
+    }
+    collconfig->set_search_template(template_name, search_template);
+    taskman->get_collconfigs().set(coll_name, collconfig.release());
+    taskman->queue_indexing_from_processing(coll_name,
+	new CollSetTemplateTask(template_name, tmpl));
+}
+
+void
+CollSetTemplateTask::perform_task(const std::string & coll_name,
+				  RestPose::Collection * & collection,
+				  TaskManager * taskman)
+{
+    if (collection == NULL) {
+	collection = taskman->get_collections().get_writable(coll_name);
+    }
+    SearchTemplate search_template;
+    search_template.from_json(tmpl);
+    collection->set_search_template(template_name, search_template);
+}
+
+void
+CollSetTemplateTask::info(std::string & description,
+			  std::string & doc_type,
+			  std::string & doc_id) const
+{
+    description = "Setting search template";
+    doc_type.resize(0);
+    doc_id.resize(0);
+}
+
+IndexingTask *
+CollSetTemplateTask::clone() const
+{
+    return new CollSetTemplateTask(template_name, tmpl);
+}
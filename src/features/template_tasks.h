@@ -0,0 +1,71 @@
+/** @file template_tasks.h
+ * @brief Tasks related to search templates.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_TEMPLATE_TASKS_H
+#define RESTPOSE_INCLUDED_TEMPLATE_TASKS_H
+
+#include "json/value.h"
+#include "server/basetasks.h"
+#include <string>
+
+/** Set a search template, after checking it against the collection's
+ *  configuration.
+ */
+class ProcessingCollSetTemplateTask : public ProcessingTask {
+    const std::string template_name;
+    const Json::Value tmpl;
+  public:
+    ProcessingCollSetTemplateTask(const std::string & template_name_,
+				  const Json::Value & tmpl_)
+	    : ProcessingTask(false),
+	      template_name(template_name_),
+	      tmpl(tmpl_)
+    {}
+
+    void perform(const std::string & coll_name,
+		 TaskManager * taskman);
+};
+
+class CollSetTemplateTask : public IndexingTask {
+    const std::string template_name;
+    const Json::Value tmpl;
+  public:
+    CollSetTemplateTask(const std::string & template_name_,
+			const Json::Value & tmpl_)
+	    : template_name(template_name_),
+	      tmpl(tmpl_)
+    {}
+
+    void perform_task(const std::string & coll_name,
+		      RestPose::Collection * & collection,
+		      TaskManager * taskman);
+
+    void info(std::string & description,
+	      std::string & doc_type,
+	      std::string & doc_id) const;
+
+    IndexingTask * clone() const;
+};
+
+#endif /* RESTPOSE_INCLUDED_TEMPLATE_TASKS_H */
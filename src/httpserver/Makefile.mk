@@ -2,7 +2,9 @@ noinst_LIBRARIES += libhttpserver.a
 
 noinst_HEADERS += \
  src/httpserver/httpserver.h \
- src/httpserver/response.h
+ src/httpserver/response.h \
+ src/httpserver/response_stream.h
 
 libhttpserver_a_SOURCES = \
- src/httpserver/httpserver.cc
+ src/httpserver/httpserver.cc \
+ src/httpserver/response_stream.cc
@@ -25,9 +25,11 @@
 #include <config.h>
 #include "httpserver.h"
 #include "response.h"
+#include "response_stream.h"
 
 #include <cstdarg>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include "logger/logger.h"
 #include <microhttpd.h>
@@ -39,6 +41,7 @@
 #include <strings.h>
 #include <sys/types.h>
 #include "safesysselect.h"
+#include "utils/compression.h"
 #include "utils/jsonutils.h"
 #include "utils/rsperrors.h"
 #include <xapian.h>
@@ -46,9 +49,28 @@
 using namespace std;
 using namespace RestPose;
 
+/// Block size to request from libmicrohttpd for streamed responses.
+static const size_t STREAM_BLOCK_SIZE = 32 * 1024;
+
+static ssize_t
+read_stream_cb(void * cls, uint64_t, char * buf, size_t max)
+{
+    ResponseStream * stream = static_cast<ResponseStream *>(cls);
+    return stream->read(buf, max);
+}
+
+static void
+free_stream_cb(void * cls)
+{
+    ResponseStream * stream = static_cast<ResponseStream *>(cls);
+    delete stream;
+}
+
 Response::Response()
 	: response(NULL),
-	  status_code(MHD_HTTP_OK)
+	  status_code(MHD_HTTP_OK),
+	  have_data(false),
+	  stream(NULL)
 {}
 
 Response::~Response()
@@ -56,6 +78,7 @@ Response::~Response()
     if (response) {
 	MHD_destroy_response(response);
     }
+    delete stream;
 }
 
 void
@@ -70,14 +93,31 @@ Response::set_data(const string & outbuf_)
     // Copy the output buffer into the response object, so it is available
     // until after the response has been sent.
     outbuf = outbuf_;
+    have_data = true;
+    headers.clear();
+    delete stream;
+    stream = NULL;
+
+    if (response) {
+	MHD_destroy_response(response);
+	response = NULL;
+    }
+}
+
+void
+Response::set_stream(const ResponseStream & stream_)
+{
+    outbuf.resize(0);
+    have_data = true;
+    headers.clear();
+    delete stream;
+    stream = NULL;
+    stream = new ResponseStream(stream_);
 
     if (response) {
 	MHD_destroy_response(response);
 	response = NULL;
     }
-    response = MHD_create_response_from_buffer(outbuf.size(),
-	const_cast<char *>(outbuf.data()),
-	MHD_RESPMEM_PERSISTENT);
 }
 
 void
@@ -91,14 +131,17 @@ Response::set_content_type(string content_type)
 void
 Response::add_header(string header, string value)
 {
-    if (!response) {
+    if (!have_data) {
 	throw RestPose::HTTPServerError("Need to set response body before setting headers");
     }
-    if (MHD_add_response_header(response,
-				header.c_str(),
-				value.c_str()) == MHD_NO) {
-	throw RestPose::HTTPServerError("Can't set header '" + header + "' to '" + value + "'");
+    if (response) {
+	if (MHD_add_response_header(response,
+				    header.c_str(),
+				    value.c_str()) == MHD_NO) {
+	    throw RestPose::HTTPServerError("Can't set header '" + header + "' to '" + value + "'");
+	}
     }
+    headers.push_back(make_pair(header, value));
 }
 
 void
@@ -109,9 +152,57 @@ Response::set(const Json::Value & body, int status_code_)
     set_status(status_code_);
 }
 
+bool
+Response::gzip(int level)
+{
+    if (!have_data || response || stream) {
+	return false;
+    }
+    for (vector<pair<string, string> >::const_iterator
+	 i = headers.begin(); i != headers.end(); ++i) {
+	if (strcasecmp(i->first.c_str(), "Content-Encoding") == 0) {
+	    return false;
+	}
+    }
+
+    string compressed = ZlibDeflater(level).gzip(outbuf.data(), outbuf.size());
+    if (compressed.size() >= outbuf.size()) {
+	return false;
+    }
+    outbuf.swap(compressed);
+    headers.push_back(make_pair(string("Content-Encoding"), string("gzip")));
+    return true;
+}
+
 struct MHD_Response *
 Response::get_response()
 {
+    if (response || !have_data) {
+	return response;
+    }
+    if (stream) {
+	// The size is unknown, so the body will be sent with chunked
+	// encoding.  The callback gets its own reference to the stream.
+	response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN,
+	    STREAM_BLOCK_SIZE, &read_stream_cb, new ResponseStream(*stream),
+	    &free_stream_cb);
+    } else {
+	response = MHD_create_response_from_buffer(outbuf.size(),
+	    const_cast<char *>(outbuf.data()),
+	    MHD_RESPMEM_PERSISTENT);
+    }
+    if (!response) {
+	return NULL;
+    }
+    for (vector<pair<string, string> >::const_iterator
+	 i = headers.begin(); i != headers.end(); ++i) {
+	if (MHD_add_response_header(response,
+				    i->first.c_str(),
+				    i->second.c_str()) == MHD_NO) {
+	    throw RestPose::HTTPServerError("Can't set header '" + i->first +
+					    "' to '" + i->second + "'");
+	}
+    }
     return response;
 }
 
@@ -121,10 +212,22 @@ Response::get_status_code() const
     return status_code;
 }
 
+void
+Response::connection_closed()
+{
+    if (stream) {
+	stream->close_reader();
+    }
+}
+
 ConnectionInfo::ConnectionInfo(struct MHD_Connection *connection_,
 			       const char * method_,
 			       const char * url_,
-			       const char * version_)
+			       const char * version_,
+			       bool blocking_,
+			       size_t max_body_size_,
+			       int compress_level_,
+			       size_t compress_min_size_)
 	: connection(connection_),
 	  method(HTTP_UNKNOWN),
 	  url(url_),
@@ -132,6 +235,11 @@ ConnectionInfo::ConnectionInfo(struct MHD_Connection *connection_,
 
 	  first_call(true),
 	  responded(false),
+	  blocking(blocking_),
+	  max_body_size(max_body_size_),
+	  accept_gzip(false),
+	  compress_level(compress_level_),
+	  compress_min_size(compress_min_size_),
 	  handler(NULL)
 {
     // Assume that the methods are usually one of HEAD, GET, DELETE, POST,
@@ -149,6 +257,10 @@ ConnectionInfo::ConnectionInfo(struct MHD_Connection *connection_,
 
 ConnectionInfo::~ConnectionInfo()
 {
+    if (responded) {
+	// Stop any writer which is still producing the response.
+	resulthandle.response().connection_closed();
+    }
     delete handler;
 }
 
@@ -238,6 +350,20 @@ void
 ConnectionInfo::respond()
 {
     Response & response(resulthandle.response());
+    if (compress_level != 0 && response.get_data_size() != 0 &&
+	response.get_data_size() >= compress_min_size) {
+	// Caches must not serve a compressed response to clients which
+	// didn't ask for one, or vice versa.
+	response.add_header("Vary", "Accept-Encoding");
+	if (accept_gzip) {
+	    try {
+		(void) response.gzip(compress_level);
+	    } catch(const RestPose::CompressionError & e) {
+		// Just send the uncompressed response.
+		LOG_ERROR("Unable to compress response", e);
+	    }
+	}
+    }
     struct MHD_Response * response_ptr = response.get_response();
     if (!response_ptr) {
 	throw RestPose::HTTPServerError("No response to send");
@@ -291,6 +417,46 @@ ConnectionInfo::method_str() const
     }
 }
 
+/** Check if an Accept-Encoding header value allows gzip encoding.
+ *
+ *  The header is a comma separated list of codings, each optionally followed
+ *  by parameters.  A quality value of 0 means the coding is not acceptable.
+ */
+static bool
+accepts_gzip(const char * value)
+{
+    const char * pos = value;
+    while (*pos != '\0') {
+	while (*pos == ' ' || *pos == '\t' || *pos == ',') ++pos;
+	const char * start = pos;
+	while (*pos != '\0' && *pos != ',' && *pos != ';' &&
+	       *pos != ' ' && *pos != '\t') ++pos;
+	string coding(start, pos - start);
+
+	// Look for a quality parameter.
+	double quality = 1.0;
+	while (*pos != '\0' && *pos != ',') {
+	    if (*pos == ';') {
+		++pos;
+		while (*pos == ' ' || *pos == '\t') ++pos;
+		if ((pos[0] == 'q' || pos[0] == 'Q') && pos[1] == '=') {
+		    quality = strtod(pos + 2, NULL);
+		}
+	    } else {
+		++pos;
+	    }
+	}
+
+	if (quality > 0 &&
+	    (strcasecmp(coding.c_str(), "gzip") == 0 ||
+	     strcasecmp(coding.c_str(), "x-gzip") == 0 ||
+	     coding == "*")) {
+	    return true;
+	}
+    }
+    return false;
+}
+
 static int
 receive_header(void *cls,
 	       enum MHD_ValueKind,
@@ -299,6 +465,8 @@ receive_header(void *cls,
     ConnectionInfo * conn_info = static_cast<ConnectionInfo *>(cls);
     if (strcasecmp(key, "Host") == 0) {
 	conn_info->host = value;
+    } else if (strcasecmp(key, "Accept-Encoding") == 0) {
+	conn_info->accept_gzip = accepts_gzip(value);
     }
 
     return MHD_YES;
@@ -328,20 +496,25 @@ answer_connection_cb(void * cls,
 	HTTPServer * server = static_cast<HTTPServer *>(cls);
 	ConnectionInfo * conn_info;
 	if (*con_cls == NULL) {
-	    conn_info = new ConnectionInfo(connection, method, url, version);
+	    conn_info = new ConnectionInfo(connection, method, url, version,
+					   server->is_threaded(),
+					   server->get_max_body_size(),
+					   server->get_compress_level(),
+					   server->get_compress_min_size());
 	    *con_cls = conn_info;
+
+	    // The headers and arguments don't change between calls, so only
+	    // need to be read once (reading them again would also add
+	    // duplicate arguments for each chunk of the request body).
+	    MHD_get_connection_values(connection, MHD_HEADER_KIND,
+				      &receive_header, conn_info);
+	    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND,
+				      &receive_argument, conn_info);
 	} else {
 	    conn_info = static_cast<ConnectionInfo *>(*con_cls);
 	    conn_info->first_call = false;
 	}
 
-	MHD_get_connection_values(connection, MHD_HEADER_KIND,
-				  &receive_header, conn_info);
-	MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND,
-				  &receive_argument, conn_info);
-
-	// FIXME - are any of these always the same each time the callback is
-	// called, so can be initialised only once?
 	conn_info->upload_data = upload_data;
 	conn_info->upload_data_size = upload_data_size;
 
@@ -371,9 +544,17 @@ request_completed_cb(void * /* cls */,
 
 HTTPServer::HTTPServer(int port_,
 		       bool pedantic_,
-		       Router * router_)
+		       Router * router_,
+		       unsigned threads_,
+		       size_t max_body_size_,
+		       int compress_level_,
+		       size_t compress_min_size_)
 	: port(port_),
 	  pedantic(pedantic_),
+	  threads(threads_),
+	  max_body_size(max_body_size_),
+	  compress_level(compress_level_),
+	  compress_min_size(compress_min_size_),
 	  router(router_),
 	  daemon(NULL)
 {
@@ -394,6 +575,13 @@ HTTPServer::start()
     if (pedantic) {
 	flags |= MHD_USE_PEDANTIC_CHECKS;
     }
+    if (threads != 0) {
+	// Each connection gets its own thread, since handlers block the
+	// thread while waiting for results.  Use poll() rather than select()
+	// in the threads, so that we're not limited to file descriptors below
+	// FD_SETSIZE.
+	flags |= MHD_USE_THREAD_PER_CONNECTION | MHD_USE_POLL;
+    }
     daemon = MHD_start_daemon(flags,
 			      port,
 
@@ -410,12 +598,27 @@ HTTPServer::start()
 			      request_completed_cb,
 			      NULL,
 
+			      /* If threaded, the maximum number of
+			       * connections (and so of threads).  Further
+			       * connections wait to be accepted until one
+			       * closes.  Otherwise, the options end here, to
+			       * keep the default limit. */
+			      (threads != 0) ? MHD_OPTION_CONNECTION_LIMIT
+					     : MHD_OPTION_END,
+			      threads,
+
 			      MHD_OPTION_END);
 
     if (!daemon) {
 	throw RestPose::HTTPServerError("Unable to start HTTP daemon");
     }
-    LOG_INFO("Listening for HTTP connections on port " + str(port));
+    if (threads == 0) {
+	LOG_INFO("Listening for HTTP connections on port " + str(port));
+    } else {
+	LOG_INFO("Listening for HTTP connections on port " + str(port) +
+		 " with a thread for each of up to " + str(threads) +
+		 " connections");
+    }
 }
 
 void
@@ -435,6 +638,10 @@ HTTPServer::get_fdsets(fd_set * read_fd_set,
 		       bool * have_timeout,
 		       uint64_t * timeout)
 {
+    if (threads != 0) {
+	// The worker threads do their own polling.
+	return;
+    }
     if (MHD_get_fdset(daemon, read_fd_set, write_fd_set, except_fd_set,
 		      max_fd) != MHD_YES) {
 	throw RestPose::HTTPServerError("Unable to get fdset");
@@ -455,6 +662,9 @@ void
 HTTPServer::serve(fd_set *, fd_set *, fd_set *, bool)
 {
     //printf("HTTPServer::serve()\n");
+    if (threads != 0) {
+	return;
+    }
     if (MHD_run(daemon) != MHD_YES) {
 	throw RestPose::HTTPServerError("Can't poll server (MHD_run failed)");
     }
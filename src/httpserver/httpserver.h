@@ -78,6 +78,27 @@ class ConnectionInfo {
     /// True if a response has been sent.
     bool responded;
 
+    /** True if handlers may block the calling thread while waiting for a
+     *  result.
+     *
+     *  This is set when the HTTP server runs a thread for each
+     *  connection, so that the request will not be revisited when the
+     *  result is ready, and blocking holds up no other connection.
+     */
+    bool blocking;
+
+    /// The maximum size of request body to accept (0 for no limit).
+    size_t max_body_size;
+
+    /// True if the client accepts gzip encoded responses.
+    bool accept_gzip;
+
+    /// The compression level for responses (0 to disable compression).
+    int compress_level;
+
+    /// The minimum size of response body to compress.
+    size_t compress_min_size;
+
     /// The components of the url path, separated on /.
     std::vector<std::string> components;
 
@@ -90,7 +111,11 @@ class ConnectionInfo {
     ConnectionInfo(struct MHD_Connection * connection_,
 		   const char * method_,
 		   const char * url_,
-		   const char * version_);
+		   const char * version_,
+		   bool blocking_,
+		   size_t max_body_size_,
+		   int compress_level_,
+		   size_t compress_min_size_);
 
     ~ConnectionInfo();
 
@@ -153,13 +178,24 @@ class ConnectionInfo {
 
 /** The HTTP server.
  *
- *  This class wraps an HTTP server using libmicrohttpd.  It uses the
- *  external-select mode of libmicrohttpd, so the caller must take care of
- *  calling it from a select loop.
+ *  This class wraps an HTTP server using libmicrohttpd.
+ *
+ *  By default, it uses the external-select mode of libmicrohttpd, so the
+ *  caller must take care of calling it from a select loop.
+ *
+ *  If a number of threads is specified, libmicrohttpd instead runs a thread
+ *  for each connection, with its own poll() based event loop, for up to that
+ *  many connections at once.  Routing, parsing of request bodies and sending
+ *  of responses then happen in those threads, and the main select loop isn't
+ *  involved in serving requests.
  */
 class HTTPServer : public SubServer {
     	int port;
 	bool pedantic;
+	unsigned threads;
+	size_t max_body_size;
+	int compress_level;
+	size_t compress_min_size;
 	Router * router;
 	struct MHD_Daemon * daemon;
 
@@ -172,8 +208,24 @@ class HTTPServer : public SubServer {
 	 *  incoming connections (use for testing clients).
 	 *
 	 *  @param router_ The router to send requests to.
+	 *
+	 *  @param threads_ The maximum number of connections to serve at
+	 *  once, each with its own thread.  If 0, requests are served from
+	 *  the main select loop.
+	 *
+	 *  @param max_body_size_ The maximum size of request body which
+	 *  handlers should accept, in bytes.  If 0, there is no limit.
+	 *
+	 *  @param compress_level_ The zlib compression level to use for
+	 *  responses sent to clients which accept gzip encoding.  If 0,
+	 *  responses are never compressed.
+	 *
+	 *  @param compress_min_size_ The minimum size of response body, in
+	 *  bytes, which will be compressed.
 	 */
-	HTTPServer(int port_, bool pedantic_, Router * router_);
+	HTTPServer(int port_, bool pedantic_, Router * router_,
+		   unsigned threads_ = 0, size_t max_body_size_ = 0,
+		   int compress_level_ = 0, size_t compress_min_size_ = 0);
 
 	/** Destroy the server.
 	 *
@@ -194,7 +246,23 @@ class HTTPServer : public SubServer {
 
 	/** Join the server.
 	 */
-	void join() { /* Nothing to join for the current async HTTP server */ }
+	void join() { /* Connection threads are joined by stop() */ }
+
+	/** Return true if the server runs a thread for each connection.
+	 */
+	bool is_threaded() const { return threads != 0; }
+
+	/** Return the maximum size of request body to accept.
+	 */
+	size_t get_max_body_size() const { return max_body_size; }
+
+	/** Return the compression level for responses (0 if disabled).
+	 */
+	int get_compress_level() const { return compress_level; }
+
+	/** Return the minimum size of response body to compress.
+	 */
+	size_t get_compress_min_size() const { return compress_min_size; }
 
 	/** Get the active fdsets.
 	 */
@@ -30,6 +30,7 @@
 
 /* Forward declarations */
 struct MHD_Response;
+class ResponseStream;
 
 class Response {
     struct MHD_Response * response;
@@ -37,6 +38,15 @@ class Response {
 
     std::string outbuf;
 
+    /// True if the response body has been set.
+    bool have_data;
+
+    /// Headers to add to the response when it is built.
+    std::vector<std::pair<std::string, std::string> > headers;
+
+    /// The stream to read the body from, if the body is streamed.
+    ResponseStream * stream;
+
     Response(const Response &);
     void operator=(const Response &);
   public:
@@ -52,6 +62,14 @@ class Response {
      */
     void set_data(const std::string & outbuf_);
 
+    /** Set the response body to be read from a stream.
+     *
+     *  The body will be sent using chunked transfer encoding, as it is
+     *  written to the stream.  As for set_data(), this clears any headers
+     *  which have been set already.
+     */
+    void set_stream(const ResponseStream & stream_);
+
     /** Set the content type for the response.
      *
      *  This is just a shortcut for calling add_header to set the content type.
@@ -73,8 +91,40 @@ class Response {
      */
     void set(const Json::Value & body, int status_code_ = 200);
 
+    /** Get the size of the response body.
+     *
+     *  Returns 0 if the body is streamed.
+     */
+    size_t get_data_size() const { return outbuf.size(); }
+
+    /** Compress the response body with gzip.
+     *
+     *  This replaces the body with its gzip encoded form, and adds a
+     *  Content-Encoding header.  If compression doesn't make the body any
+     *  smaller, the body has already been encoded, or the body is streamed,
+     *  it is left unchanged.
+     *
+     *  This must be called before get_response().
+     *
+     *  @param level The zlib compression level to use (1 to 9).
+     *
+     *  @returns true if the body was compressed.
+     */
+    bool gzip(int level);
+
+    /** Get the response to send.
+     *
+     *  The response is built when this is first called; the body and
+     *  headers shouldn't be changed after this.
+     */
     struct MHD_Response * get_response();
     int get_status_code() const;
+
+    /** Notify the response that the connection it was sent on has closed.
+     *
+     *  If the body is being streamed, this tells the writer to stop.
+     */
+    void connection_closed();
 };
 
 #endif /* RESTPOSE_INCLUDED_RESPONSE_H */
@@ -0,0 +1,257 @@
+/** @file response_stream.cc
+ * @brief A bounded buffer for streaming the body of an HTTP response.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "httpserver/response_stream.h"
+
+#include <cstring>
+#include <microhttpd.h>
+#include "realtime.h"
+#include "utils/io_wrappers.h"
+#include "utils/threading.h"
+
+using namespace std;
+
+/** Time (in seconds) that a writer will wait for a full buffer to be read
+ *  from, before assuming that the reader has gone away.
+ */
+static const double STREAM_WRITE_TIMEOUT = 60.0;
+
+class ResponseStream::Internal {
+    Internal(const Internal &);
+    void operator=(const Internal &);
+  public:
+    enum state_type {
+	OPEN,
+	CLOSED,
+	ABORTED
+    };
+
+    Condition cond;
+    unsigned ref_count;
+    size_t capacity;
+
+    /// The buffered data.  Data before read_pos has already been read.
+    string buf;
+    size_t read_pos;
+
+    state_type state;
+    bool reader_closed;
+
+    int nudge_fd;
+    char nudge_byte;
+
+    /// True if the reader has found no data, and is waiting for a nudge.
+    bool reader_waiting;
+
+    Internal(size_t capacity_)
+	    : ref_count(1),
+	      capacity(capacity_),
+	      buf(),
+	      read_pos(0),
+	      state(OPEN),
+	      reader_closed(false),
+	      nudge_fd(-1),
+	      nudge_byte('\0'),
+	      reader_waiting(false) {}
+
+    /** Wake the reader, after more data (or the end of the stream) has
+     *  been made available.
+     *
+     *  Must be called with the lock held; returns the file descriptor to
+     *  nudge (or -1 if none), so that the nudge can be sent after the lock
+     *  has been released.
+     */
+    int wake_reader() {
+	cond.broadcast();
+	if (reader_waiting) {
+	    reader_waiting = false;
+	    return nudge_fd;
+	}
+	return -1;
+    }
+};
+
+ResponseStream::ResponseStream(size_t capacity)
+	: internal(new ResponseStream::Internal(capacity))
+{}
+
+ResponseStream::~ResponseStream()
+{
+    ContextLocker lock(internal->cond);
+    --(internal->ref_count);
+    if (internal->ref_count == 0) {
+	lock.unlock();
+	delete internal;
+    }
+}
+
+ResponseStream::ResponseStream(const ResponseStream & other)
+	: internal(NULL)
+{
+    ContextLocker lock(other.internal->cond);
+    internal = other.internal;
+    ++(internal->ref_count);
+}
+
+void
+ResponseStream::operator=(const ResponseStream & other)
+{
+    if (internal == other.internal) {
+	return;
+    }
+    {
+	ContextLocker lock(internal->cond);
+	--(internal->ref_count);
+	if (internal->ref_count == 0) {
+	    lock.unlock();
+	    delete internal;
+	}
+	internal = NULL;
+    }
+
+    {
+	ContextLocker lock(other.internal->cond);
+	internal = other.internal;
+	++(internal->ref_count);
+    }
+}
+
+void
+ResponseStream::set_nudge(int nudge_fd, char nudge_byte)
+{
+    ContextLocker lock(internal->cond);
+    internal->nudge_fd = nudge_fd;
+    internal->nudge_byte = nudge_byte;
+}
+
+bool
+ResponseStream::write(const string & data)
+{
+    ContextLocker lock(internal->cond);
+    while (!internal->reader_closed &&
+	   internal->buf.size() - internal->read_pos >= internal->capacity) {
+	if (internal->cond.timedwait(RealTime::end_time(STREAM_WRITE_TIMEOUT))) {
+	    // Nothing has been read for too long; give up.
+	    internal->reader_closed = true;
+	}
+    }
+    if (internal->reader_closed || internal->state != Internal::OPEN) {
+	return false;
+    }
+
+    if (internal->read_pos != 0 &&
+	internal->read_pos >= internal->buf.size() / 2) {
+	// Discard the data which has been read.
+	internal->buf.erase(0, internal->read_pos);
+	internal->read_pos = 0;
+    }
+    internal->buf.append(data);
+    int fd = internal->wake_reader();
+    char byte = internal->nudge_byte;
+    lock.unlock();
+    if (fd != -1) {
+	(void) io_send_byte(fd, byte);
+    }
+    return true;
+}
+
+void
+ResponseStream::close()
+{
+    ContextLocker lock(internal->cond);
+    if (internal->state == Internal::OPEN) {
+	internal->state = Internal::CLOSED;
+    }
+    int fd = internal->wake_reader();
+    char byte = internal->nudge_byte;
+    lock.unlock();
+    if (fd != -1) {
+	(void) io_send_byte(fd, byte);
+    }
+}
+
+void
+ResponseStream::abort()
+{
+    ContextLocker lock(internal->cond);
+    if (internal->state == Internal::OPEN) {
+	internal->state = Internal::ABORTED;
+    }
+    int fd = internal->wake_reader();
+    char byte = internal->nudge_byte;
+    lock.unlock();
+    if (fd != -1) {
+	(void) io_send_byte(fd, byte);
+    }
+}
+
+void
+ResponseStream::close_reader()
+{
+    ContextLocker lock(internal->cond);
+    internal->reader_closed = true;
+    internal->reader_waiting = false;
+    internal->buf.clear();
+    internal->read_pos = 0;
+    internal->cond.broadcast();
+}
+
+ssize_t
+ResponseStream::read(char * buf, size_t max)
+{
+    ContextLocker lock(internal->cond);
+    while (true) {
+	size_t avail = internal->buf.size() - internal->read_pos;
+	if (avail != 0) {
+	    if (avail > max) {
+		avail = max;
+	    }
+	    memcpy(buf, internal->buf.data() + internal->read_pos, avail);
+	    internal->read_pos += avail;
+	    if (internal->read_pos == internal->buf.size()) {
+		internal->buf.resize(0);
+		internal->read_pos = 0;
+	    }
+	    // Wake the writer, if it was waiting for space.
+	    internal->cond.broadcast();
+	    return avail;
+	}
+	switch (internal->state) {
+	    case Internal::CLOSED:
+		return MHD_CONTENT_READER_END_OF_STREAM;
+	    case Internal::ABORTED:
+		return MHD_CONTENT_READER_END_WITH_ERROR;
+	    case Internal::OPEN:
+		break;
+	}
+	if (internal->nudge_fd != -1) {
+	    // Return to the select loop; we'll be nudged when there is more
+	    // to read.
+	    internal->reader_waiting = true;
+	    return 0;
+	}
+	internal->cond.wait();
+    }
+}
@@ -0,0 +1,105 @@
+/** @file response_stream.h
+ * @brief A bounded buffer for streaming the body of an HTTP response.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef RESTPOSE_INCLUDED_RESPONSE_STREAM_H
+#define RESTPOSE_INCLUDED_RESPONSE_STREAM_H
+
+#include <string>
+#include <sys/types.h>
+
+/** A reference counted, bounded buffer holding the body of a response which
+ *  is sent as it is produced.
+ *
+ *  One thread (the writer) appends data to the stream with write(), and
+ *  finally calls close() (or abort(), if an error occurs).  The HTTP server
+ *  drains the stream with read(), sending the data using chunked transfer
+ *  encoding.  The writer blocks while the buffer is full, so the memory used
+ *  is bounded however large the response is.
+ *
+ *  If a nudge file descriptor is set, read() returns immediately when no
+ *  data is available, and the nudge byte is written when more data becomes
+ *  available.  Otherwise, read() blocks until there is data to return.
+ */
+class ResponseStream {
+    class Internal;
+
+    Internal * internal;
+
+  public:
+    /** Create a stream.
+     *
+     *  @param capacity The number of bytes which may be buffered before
+     *  write() blocks.
+     */
+    ResponseStream(size_t capacity = 1024 * 1024);
+    ~ResponseStream();
+    ResponseStream(const ResponseStream & other);
+    void operator=(const ResponseStream & other);
+
+    /** Set a file descriptor to nudge when data becomes available.
+     *
+     *  This should be called before the stream is passed to the reader.
+     */
+    void set_nudge(int nudge_fd, char nudge_byte);
+
+    /** Append data to the stream.
+     *
+     *  Blocks while the buffer is full.
+     *
+     *  @returns false if the reader has gone away (or stopped reading for
+     *  too long), in which case the writer should stop producing data.
+     */
+    bool write(const std::string & data);
+
+    /** Mark the end of the data.
+     */
+    void close();
+
+    /** Mark that an error occurred while producing the data.
+     *
+     *  The reader will close the connection after sending any data already
+     *  buffered, so that the client can tell that the response is
+     *  incomplete.
+     */
+    void abort();
+
+    /** Mark that the reader has gone away.
+     *
+     *  Any buffered data is discarded, and further writes will fail.
+     */
+    void close_reader();
+
+    /** Read data from the stream.
+     *
+     *  Suitable for use as a libmicrohttpd content reader callback.
+     *
+     *  @returns the number of bytes placed in buf, or
+     *  MHD_CONTENT_READER_END_OF_STREAM if the stream has been closed and all
+     *  data read, or MHD_CONTENT_READER_END_WITH_ERROR if the stream was
+     *  aborted.  Returns 0 if no data is available yet (only if a nudge file
+     *  descriptor has been set).
+     */
+    ssize_t read(char * buf, size_t max);
+};
+
+#endif /* RESTPOSE_INCLUDED_RESPONSE_STREAM_H */
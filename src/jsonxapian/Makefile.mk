@@ -2,10 +2,13 @@ noinst_LIBRARIES += libjsonxapian.a
 
 noinst_HEADERS += \
  src/jsonxapian/taxonomy.h \
+ src/jsonxapian/analysis.h \
+ src/jsonxapian/bulk_load.h \
  src/jsonxapian/collconfig.h \
  src/jsonxapian/collconfigs.h \
  src/jsonxapian/collection_pool.h \
  src/jsonxapian/collection.h \
+ src/jsonxapian/commit_policy.h \
  src/jsonxapian/docdata.h \
  src/jsonxapian/docvalues.h \
  src/jsonxapian/doctojson.h \
@@ -16,14 +19,18 @@ noinst_HEADERS += \
  src/jsonxapian/pipe.h \
  src/jsonxapian/query_builder.h \
  src/jsonxapian/schema.h \
+ src/jsonxapian/search_template.h \
  src/jsonxapian/slotname.h
 
 libjsonxapian_a_SOURCES = \
  src/jsonxapian/taxonomy.cc \
+ src/jsonxapian/analysis.cc \
+ src/jsonxapian/bulk_load.cc \
  src/jsonxapian/collconfig.cc \
  src/jsonxapian/collconfigs.cc \
  src/jsonxapian/collection_pool.cc \
  src/jsonxapian/collection.cc \
+ src/jsonxapian/commit_policy.cc \
  src/jsonxapian/docdata.cc \
  src/jsonxapian/docvalues.cc \
  src/jsonxapian/doctojson.cc \
@@ -34,4 +41,5 @@ libjsonxapian_a_SOURCES = \
  src/jsonxapian/pipe.cc \
  src/jsonxapian/query_builder.cc \
  src/jsonxapian/schema.cc \
+ src/jsonxapian/search_template.cc \
  src/jsonxapian/slotname.cc
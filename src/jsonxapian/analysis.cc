@@ -0,0 +1,117 @@
+/** @file analysis.cc
+ * @brief Per-thread contexts for analysing text.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "jsonxapian/analysis.h"
+
+#include <pthread.h>
+
+using namespace std;
+using namespace RestPose;
+
+/// Key for the thread-specific pointer to each thread's context.
+static pthread_key_t context_key;
+
+/// Control for creating context_key once.
+static pthread_once_t context_key_once = PTHREAD_ONCE_INIT;
+
+/// Delete a thread's context, when the thread exits.
+static void
+delete_context(void * context)
+{
+    delete static_cast<AnalysisContext *>(context);
+}
+
+static void
+create_context_key()
+{
+    (void) pthread_key_create(&context_key, delete_context);
+}
+
+AnalysisContext::AnalysisContext()
+	: stemmers(),
+	  termgenerators(),
+	  queryparsers(),
+	  cjk_tokenizer()
+{
+}
+
+AnalysisContext &
+AnalysisContext::for_thread()
+{
+    (void) pthread_once(&context_key_once, create_context_key);
+    AnalysisContext * context =
+	    static_cast<AnalysisContext *>(pthread_getspecific(context_key));
+    if (context == NULL) {
+	context = new AnalysisContext;
+	(void) pthread_setspecific(context_key, context);
+    }
+    return *context;
+}
+
+const Xapian::Stem &
+AnalysisContext::get_stemmer(const string & lang)
+{
+    map<string, Xapian::Stem>::const_iterator i = stemmers.find(lang);
+    if (i != stemmers.end()) {
+	return i->second;
+    }
+    // Build the stemmer before adding it, since an unknown language throws.
+    Xapian::Stem stemmer(lang);
+    return stemmers.insert(make_pair(lang, stemmer)).first->second;
+}
+
+Xapian::TermGenerator &
+AnalysisContext::get_termgenerator(const string & stem_lang)
+{
+    map<string, Xapian::TermGenerator>::iterator i =
+	    termgenerators.find(stem_lang);
+    if (i != termgenerators.end()) {
+	return i->second;
+    }
+    Xapian::TermGenerator tg;
+    tg.set_stemmer(get_stemmer(stem_lang));
+    return termgenerators.insert(make_pair(stem_lang, tg)).first->second;
+}
+
+Xapian::QueryParser &
+AnalysisContext::get_queryparser(const string & stem_lang)
+{
+    map<string, Xapian::QueryParser>::iterator i =
+	    queryparsers.find(stem_lang);
+    if (i == queryparsers.end()) {
+	Xapian::QueryParser qp;
+	if (!stem_lang.empty()) {
+	    qp.set_stemmer(get_stemmer(stem_lang));
+	}
+	i = queryparsers.insert(make_pair(stem_lang, qp)).first;
+    }
+    i->second.set_default_op(Xapian::Query::OP_OR);
+    if (stem_lang.empty()) {
+	i->second.set_stemming_strategy(Xapian::QueryParser::STEM_NONE);
+    } else {
+	i->second.set_stemming_strategy(Xapian::QueryParser::STEM_SOME);
+    }
+    return i->second;
+}
@@ -0,0 +1,100 @@
+/** @file analysis.h
+ * @brief Per-thread contexts for analysing text.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_ANALYSIS_H
+#define RESTPOSE_INCLUDED_ANALYSIS_H
+
+#include <cjk-tokenizer.h>
+#include <map>
+#include <string>
+#include <xapian.h>
+
+namespace RestPose {
+
+/** Objects used to analyse text when indexing documents and parsing
+ *  queries, kept for reuse by a single thread.
+ *
+ *  Building stemmers, term generators and query parsers is relatively
+ *  expensive, so each thread keeps a context holding the ones it has used,
+ *  keyed by stemming language.  The objects aren't threadsafe, so a context
+ *  must only be used by the thread which owns it: use for_thread() to get
+ *  the calling thread's context, which is created when first needed, and
+ *  deleted when the thread exits.
+ */
+class AnalysisContext {
+    /// Stemmers, keyed by language.
+    std::map<std::string, Xapian::Stem> stemmers;
+
+    /// Term generators, keyed by stemming language.
+    std::map<std::string, Xapian::TermGenerator> termgenerators;
+
+    /// Query parsers, keyed by stemming language.
+    std::map<std::string, Xapian::QueryParser> queryparsers;
+
+    /// Tokeniser for CJK text.
+    cjk::tokenizer cjk_tokenizer;
+
+    AnalysisContext(const AnalysisContext &);
+    void operator=(const AnalysisContext &);
+  public:
+    AnalysisContext();
+
+    /** Get the context for the calling thread.
+     */
+    static AnalysisContext & for_thread();
+
+    /** Get a stemmer for a language.
+     *
+     *  An empty language gives a stemmer which leaves words unchanged.
+     */
+    const Xapian::Stem & get_stemmer(const std::string & lang);
+
+    /** Get a term generator using the stemmer for a language.
+     *
+     *  The caller should set the document to index into before use, and
+     *  reset it to an empty document afterwards.  Other settings shouldn't
+     *  be changed.
+     */
+    Xapian::TermGenerator & get_termgenerator(const std::string & stem_lang);
+
+    /** Get a query parser using the stemmer for a language.
+     *
+     *  If the language is empty, no stemmer is set.  The default operator
+     *  and stemming strategy are reset to their defaults (OP_OR, and
+     *  STEM_SOME if there is a stemmer or STEM_NONE if not), but may be
+     *  changed by the caller for a single parse.
+     *  Other settings shouldn't be changed.
+     */
+    Xapian::QueryParser & get_queryparser(const std::string & stem_lang);
+
+    /** Get a tokeniser for CJK text.
+     */
+    cjk::tokenizer & get_cjk_tokenizer() {
+	return cjk_tokenizer;
+    }
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_ANALYSIS_H */
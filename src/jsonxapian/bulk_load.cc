@@ -0,0 +1,531 @@
+/** @file bulk_load.cc
+ * @brief Loading documents into a collection in bulk.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "jsonxapian/bulk_load.h"
+
+#include <deque>
+#include <istream>
+#include "jsonxapian/collconfigs.h"
+#include "jsonxapian/collection.h"
+#include "jsonxapian/indexing.h"
+#include <memory>
+#include "safeerrno.h"
+#include "str.h"
+#include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
+#include "utils/threading.h"
+#include <xapian.h>
+
+using namespace RestPose;
+using namespace std;
+
+/// The number of input lines handed to a loading thread at once.
+#define LOAD_BATCH_LINES 1000
+
+/// The maximum number of batches of input waiting to be processed.
+#define LOAD_MAX_BATCHES 16
+
+/// The maximum number of error messages to keep.
+#define LOAD_MAX_ERRORS 100
+
+/** Get the flags to open the fragments being loaded with.
+ */
+static int
+load_db_flags()
+{
+    int flags = Xapian::DB_CREATE_OR_OVERWRITE;
+#ifdef HAVE_XAPIAN_DB_NO_SYNC
+    // The fragments are compacted into a new fragment when the load
+    // completes, and thrown away if it fails, so there's no need to sync
+    // them to disk.
+    flags |= Xapian::DB_NO_SYNC;
+#endif
+    return flags;
+}
+
+/** Check if an input line holds nothing but whitespace.
+ */
+static bool
+blank_line(const string & line)
+{
+    return line.find_first_not_of(" \t\r\n") == string::npos;
+}
+
+namespace {
+
+/** A batch of input lines.
+ */
+struct LoadBatch {
+    /** The position of the batch in the input (counting from 0). */
+    uint64_t number;
+
+    /** The number of the first line in the batch (counting from 1). */
+    uint64_t first_line;
+
+    /** The lines in the batch. */
+    vector<string> lines;
+
+    LoadBatch(uint64_t number_, uint64_t first_line_)
+	    : number(number_), first_line(first_line_) {}
+};
+
+/** Documents to be added to a fragment, with their idterms.
+ */
+typedef vector<pair<string, Xapian::Document> > PendingDocs;
+
+/** The state shared by the threads performing a bulk load.
+ */
+class LoadState {
+    /** Condition protecting the input, the failure message, the result and
+     *  the batch each fragment is waiting for; signalled whenever these
+     *  change.
+     */
+    Condition cond;
+
+    /** Batches of input waiting to be processed. */
+    deque<LoadBatch *> batches;
+
+    /** True once all the input has been read. */
+    bool finished;
+
+    /** A message describing why the load failed; empty if it hasn't. */
+    string failure;
+
+    BulkLoadResult & result;
+
+    /** Mutex protecting the configuration. */
+    Mutex config_mutex;
+
+    /** The configuration to use for processing documents which don't
+     *  require it to change.
+     */
+    CollectionConfigSnapshot snapshot;
+
+    /** A modifiable copy of the configuration, used to process documents
+     *  which require it to change.
+     */
+    auto_ptr<CollectionConfig> config;
+
+    /** True if the configuration has changed. */
+    bool config_changed;
+
+    /** The fragments being built. */
+    vector<Xapian::WritableDatabase> dbs;
+
+    /** The number of the batch whose documents are to be added next to each
+     *  of the fragments being built.
+     *
+     *  Only the thread processing that batch may use the fragment.
+     */
+    vector<uint64_t> db_next_batch;
+
+    LoadState(const LoadState &);
+    void operator=(const LoadState &);
+  public:
+    LoadState(const CollectionConfig & config_, BulkLoadResult & result_)
+	    : finished(false),
+	      result(result_),
+	      snapshot(config_.clone()),
+	      config(config_.clone()),
+	      config_changed(false)
+    {
+	config->clear_changed();
+    }
+
+    ~LoadState() {
+	for (deque<LoadBatch *>::iterator i = batches.begin();
+	     i != batches.end(); ++i) {
+	    delete *i;
+	}
+    }
+
+    /** Open the fragments to build.
+     */
+    void open_dbs(const vector<string> & paths) {
+	for (vector<string>::const_iterator i = paths.begin();
+	     i != paths.end(); ++i) {
+	    dbs.push_back(Xapian::WritableDatabase(*i, load_db_flags()));
+	    db_next_batch.push_back(0);
+	}
+    }
+
+    /** Close the fragments, committing the documents added to them.
+     */
+    void close_dbs() {
+	for (vector<Xapian::WritableDatabase>::iterator i = dbs.begin();
+	     i != dbs.end(); ++i) {
+	    i->close();
+	}
+    }
+
+    size_t get_db_count() const {
+	return dbs.size();
+    }
+
+    /** Add the documents from a batch to a fragment.
+     *
+     *  Waits until the documents from all earlier batches have been added to
+     *  the fragment, so that the last version of a document in the input is
+     *  the one kept.  Must be called for every fragment for every batch,
+     *  even if there are no documents to add.
+     *
+     *  @returns false if the load has failed.
+     */
+    bool add_docs(size_t index, uint64_t batch_number,
+		  const PendingDocs & docs) {
+	{
+	    ContextLocker lock(cond);
+	    while (db_next_batch[index] != batch_number && failure.empty()) {
+		cond.wait();
+	    }
+	    if (!failure.empty()) {
+		return false;
+	    }
+	}
+	Xapian::WritableDatabase & db = dbs[index];
+	for (PendingDocs::const_iterator i = docs.begin();
+	     i != docs.end(); ++i) {
+	    if (i->first.empty()) {
+		db.add_document(i->second);
+	    } else {
+		db.replace_document(i->first, i->second);
+	    }
+	}
+	ContextLocker lock(cond);
+	++db_next_batch[index];
+	cond.broadcast();
+	return true;
+    }
+
+    /** Add a batch of input to be processed.
+     *
+     *  Waits while there are too many batches waiting.  Takes ownership of
+     *  the batch.
+     *
+     *  @returns false if the load has failed.
+     */
+    bool push(LoadBatch * batch) {
+	auto_ptr<LoadBatch> batch_ptr(batch);
+	ContextLocker lock(cond);
+	while (batches.size() >= LOAD_MAX_BATCHES && failure.empty()) {
+	    cond.wait();
+	}
+	if (!failure.empty()) {
+	    return false;
+	}
+	batches.push_back(batch_ptr.release());
+	cond.broadcast();
+	return true;
+    }
+
+    /** Get a batch of input to process.
+     *
+     *  Waits until a batch is available.
+     *
+     *  @returns the batch (which the caller takes ownership of), or NULL if
+     *  all the input has been processed, or the load has failed.
+     */
+    LoadBatch * pop() {
+	ContextLocker lock(cond);
+	while (batches.empty() && !finished && failure.empty()) {
+	    cond.wait();
+	}
+	if (batches.empty() || !failure.empty()) {
+	    return NULL;
+	}
+	LoadBatch * batch = batches.front();
+	batches.pop_front();
+	cond.broadcast();
+	return batch;
+    }
+
+    /** Mark the end of the input.
+     */
+    void finish() {
+	ContextLocker lock(cond);
+	finished = true;
+	cond.broadcast();
+    }
+
+    /** Mark the load as failed.
+     *
+     *  Only the first failure is recorded.
+     */
+    void fail(const string & msg) {
+	ContextLocker lock(cond);
+	if (failure.empty()) {
+	    failure = msg;
+	}
+	cond.broadcast();
+    }
+
+    string get_failure() {
+	ContextLocker lock(cond);
+	return failure;
+    }
+
+    /** Record an error processing a document.
+     *
+     *  @param line The number of the input line holding the document.
+     *  @param msg The error message.
+     *  @param doc_failed True if the document couldn't be loaded.
+     */
+    void add_error(uint64_t line, const string & msg, bool doc_failed) {
+	ContextLocker lock(cond);
+	if (doc_failed) {
+	    ++result.failed;
+	}
+	if (result.errors.size() < LOAD_MAX_ERRORS) {
+	    result.errors.push_back("line " + str(line) + ": " + msg);
+	}
+    }
+
+    /** Record documents which have been loaded.
+     */
+    void add_loaded(uint64_t count) {
+	ContextLocker lock(cond);
+	result.loaded += count;
+    }
+
+    /** Get the current configuration.
+     */
+    CollectionConfigSnapshot get_snapshot() {
+	ContextLocker lock(config_mutex);
+	return snapshot;
+    }
+
+    /** Process a document which requires the configuration to change.
+     */
+    Xapian::Document process_doc(Json::Value & doc, string & idterm,
+				 IndexingErrors & errors) {
+	ContextLocker lock(config_mutex);
+	bool new_fields(false);
+	Xapian::Document xdoc(config->process_doc(doc, string(), string(),
+						  idterm, errors,
+						  new_fields));
+	if (config->is_changed() || new_fields) {
+	    config_changed = true;
+	    config->clear_changed();
+	    snapshot = CollectionConfigSnapshot(config->clone());
+	}
+	return xdoc;
+    }
+
+    /** Get the changed configuration.
+     *
+     *  @returns false if the configuration hasn't changed.
+     */
+    bool get_changed_config(Json::Value & result_config) {
+	ContextLocker lock(config_mutex);
+	if (!config_changed) {
+	    return false;
+	}
+	config->to_json(result_config);
+	return true;
+    }
+};
+
+/** A thread processing documents for a bulk load.
+ */
+class LoadThread : public Thread {
+    LoadState & state;
+
+    /** Process a line of input.
+     *
+     *  @returns true if a document was loaded.
+     */
+    bool process_line(const CollectionConfig & config, uint64_t line_num,
+		      const string & line, vector<PendingDocs> & pending);
+  public:
+    LoadThread(LoadState & state_) : state(state_) {}
+
+    void run();
+};
+
+bool
+LoadThread::process_line(const CollectionConfig & config, uint64_t line_num,
+			 const string & line, vector<PendingDocs> & pending)
+{
+    Json::Value doc;
+    try {
+	json_unserialise(line, doc);
+	json_check_object(doc, "document");
+    } catch(const InvalidValueError & e) {
+	state.add_error(line_num, e.what(), true);
+	return false;
+    }
+
+    string idterm;
+    IndexingErrors errors;
+    Xapian::Document xdoc;
+    if (!config.process_doc_unchanged(doc, string(), string(), idterm,
+				      errors, xdoc)) {
+	xdoc = state.process_doc(doc, idterm, errors);
+    }
+    if (errors.total_failure) {
+	state.add_error(line_num, errors.errors[0].first + ": " +
+			errors.errors[0].second, true);
+	return false;
+    }
+    for (vector<pair<string, string> >::const_iterator
+	 i = errors.errors.begin(); i != errors.errors.end(); ++i) {
+	state.add_error(line_num, "Indexing error in field \"" + i->first +
+			"\": \"" + i->second + "\"", false);
+    }
+
+    // Documents with the same idterm must go to the same fragment, so that
+    // only the last of them is kept.
+    pending[DbGroup::idterm_hash(idterm) % pending.size()]
+	    .push_back(make_pair(idterm, xdoc));
+    return true;
+}
+
+void
+LoadThread::run()
+{
+    vector<PendingDocs> pending(state.get_db_count());
+    try {
+	while (true) {
+	    auto_ptr<LoadBatch> batch(state.pop());
+	    if (batch.get() == NULL) {
+		return;
+	    }
+	    CollectionConfigSnapshot snapshot(state.get_snapshot());
+	    uint64_t loaded = 0;
+	    for (size_t i = 0; i != batch->lines.size(); ++i) {
+		const string & line = batch->lines[i];
+		if (blank_line(line)) {
+		    continue;
+		}
+		if (process_line(*snapshot, batch->first_line + i, line,
+				 pending)) {
+		    ++loaded;
+		}
+	    }
+	    for (size_t i = 0; i != pending.size(); ++i) {
+		if (!state.add_docs(i, batch->number, pending[i])) {
+		    return;
+		}
+		pending[i].clear();
+	    }
+	    state.add_loaded(loaded);
+	}
+    } catch(const Xapian::Error & e) {
+	state.fail(e.get_description());
+    } catch(const RestPose::Error & e) {
+	state.fail(e.what());
+    } catch(const bad_alloc &) {
+	state.fail("Out of memory");
+    }
+}
+
+}
+
+/** Wait for the threads performing a bulk load to finish, and delete them.
+ */
+static void
+join_load_threads(LoadState & state, vector<LoadThread *> & threads)
+{
+    state.finish();
+    for (vector<LoadThread *>::iterator i = threads.begin();
+	 i != threads.end(); ++i) {
+	(*i)->join();
+	delete *i;
+    }
+    threads.clear();
+}
+
+void
+RestPose::bulk_load(Collection & collection, istream & input,
+		    unsigned threads, BulkLoadResult & result)
+{
+    if (threads == 0) {
+	threads = 1;
+    }
+    result = BulkLoadResult();
+    DbGroupLoad load;
+    collection.prepare_load(load, threads);
+
+    LoadState state(collection.get_config(), result);
+    vector<LoadThread *> workers;
+    try {
+	state.open_dbs(load.paths);
+	for (unsigned i = 0; i != threads; ++i) {
+	    workers.push_back(new LoadThread(state));
+	    if (!workers.back()->start()) {
+		throw ThreadError("Can't start bulk load thread");
+	    }
+	}
+
+	bool reading = true;
+	for (uint64_t batch_number = 0; reading; ++batch_number) {
+	    auto_ptr<LoadBatch> batch(new LoadBatch(batch_number,
+						    result.lines + 1));
+	    string line;
+	    while (batch->lines.size() < LOAD_BATCH_LINES) {
+		if (!getline(input, line)) {
+		    reading = false;
+		    break;
+		}
+		++result.lines;
+		batch->lines.push_back(string());
+		batch->lines.back().swap(line);
+	    }
+	    if (batch->lines.empty()) {
+		break;
+	    }
+	    if (!state.push(batch.release())) {
+		break;
+	    }
+	}
+	if (input.bad()) {
+	    throw SysError("Error reading documents to load", errno);
+	}
+	join_load_threads(state, workers);
+
+	string failure = state.get_failure();
+	if (!failure.empty()) {
+	    throw InvalidStateError("Bulk load failed: " + failure);
+	}
+	state.close_dbs();
+
+	Json::Value new_config;
+	if (state.get_changed_config(new_config)) {
+	    collection.from_json(new_config);
+	}
+    } catch(...) {
+	state.fail("Bulk load abandoned");
+	join_load_threads(state, workers);
+	try {
+	    state.close_dbs();
+	} catch(const Xapian::Error &) {
+	    // The fragments are being thrown away anyway.
+	}
+	collection.abandon_load(load);
+	throw;
+    }
+
+    collection.complete_load(load);
+}
@@ -0,0 +1,91 @@
+/** @file bulk_load.h
+ * @brief Loading documents into a collection in bulk.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_BULK_LOAD_H
+#define RESTPOSE_INCLUDED_BULK_LOAD_H
+
+#include <iosfwd>
+#include <string>
+#include "utils/safe_inttypes.h"
+#include <vector>
+
+namespace RestPose {
+
+class Collection;
+
+/** The outcome of a bulk load.
+ */
+struct BulkLoadResult {
+    /** The number of input lines read. */
+    uint64_t lines;
+
+    /** The number of documents loaded. */
+    uint64_t loaded;
+
+    /** The number of documents which couldn't be loaded. */
+    uint64_t failed;
+
+    /** Messages for the first errors which occurred, each starting with the
+     *  number of the input line which caused it.
+     *
+     *  Includes errors in fields of documents which were loaded anyway.
+     */
+    std::vector<std::string> errors;
+
+    BulkLoadResult() : lines(0), loaded(0), failed(0) {}
+};
+
+/** Load documents into an empty collection in bulk.
+ *
+ *  Reads documents from @a input, which holds one JSON object per line
+ *  (blank lines are ignored).  The type and ID of each document are read
+ *  from the fields configured in the collection for storing them, as for
+ *  documents posted to the collection without a type or ID.  If the input
+ *  holds several versions of a document, the last is kept.
+ *
+ *  The documents are processed by several threads, in batches of lines.
+ *  They are added to a set of new database fragments, without syncing the
+ *  fragments to disk: each document goes to the fragment picked by a hash of
+ *  its ID, and each fragment receives its documents in input order.  Once
+ *  the input has been read, the fragments are compacted into one, which is
+ *  added to the collection in a single commit, together with any changes to
+ *  the collection's configuration caused by new fields.  If the load fails,
+ *  the new fragments are removed, and the collection is left unchanged.
+ *
+ *  The collection must be open for writing, and must not contain any
+ *  documents.  Nothing else may modify the collection during the load.
+ *
+ *  @param collection The collection to load documents into.
+ *  @param input The stream to read documents from.
+ *  @param threads The number of threads to process documents with; this is
+ *  also the number of fragments built, though no thread has a fragment of
+ *  its own.
+ *  @param result Set to the outcome of the load.
+ */
+void bulk_load(Collection & collection, std::istream & input,
+	       unsigned threads, BulkLoadResult & result);
+
+}
+
+#endif /* RESTPOSE_INCLUDED_BULK_LOAD_H */
@@ -29,6 +29,8 @@
 #include "jsonxapian/doctojson.h"
 #include "jsonxapian/indexing.h"
 #include "jsonxapian/pipe.h"
+#include "jsonxapian/query_builder.h"
+#include "jsonxapian/search_template.h"
 #include "logger/logger.h"
 #include "str.h"
 #include "server/task_manager.h"
@@ -93,6 +95,15 @@ CollectionConfig::clear()
 	i->second = NULL;
     }
     taxonomies.clear();
+
+    for (map<string, SearchTemplate *>::iterator
+	 i = templates.begin(); i != templates.end(); ++i) {
+	delete i->second;
+	i->second = NULL;
+    }
+    templates.clear();
+
+    commit_policy = CommitPolicy();
 }
 
 void
@@ -275,6 +286,57 @@ CollectionConfig::categories_config_from_json(const Json::Value & value)
     }
 }
 
+void
+CollectionConfig::templates_config_to_json(Json::Value & value) const
+{
+    Json::Value & templates_obj(value["templates"]);
+    templates_obj = Json::objectValue;
+    for (map<string, SearchTemplate *>::const_iterator
+	 i = templates.begin(); i != templates.end(); ++i) {
+	Json::Value & template_obj = templates_obj[i->first];
+	i->second->to_json(template_obj);
+    }
+}
+
+void
+CollectionConfig::templates_config_from_json(const Json::Value & value)
+{
+    const Json::Value & templates_obj(value["templates"]);
+    if (!templates_obj.isNull()) {
+	json_check_object(templates_obj, "search templates definition");
+	for (Json::Value::iterator i = templates_obj.begin();
+	     i != templates_obj.end(); ++i) {
+	    SearchTemplate tmpl;
+	    tmpl.from_json(*i);
+	    set_search_template(i.memberName(), tmpl);
+	}
+    }
+}
+
+void
+CollectionConfig::clear_template_plans()
+{
+    for (map<string, SearchTemplate *>::const_iterator
+	 i = templates.begin(); i != templates.end(); ++i) {
+	i->second->clear_plans();
+    }
+}
+
+void
+CollectionConfig::commit_policy_to_json(Json::Value & value) const
+{
+    commit_policy.to_json(value["commit_policy"]);
+}
+
+void
+CollectionConfig::commit_policy_from_json(const Json::Value & value)
+{
+    const Json::Value & policy_obj(value["commit_policy"]);
+    if (!policy_obj.isNull()) {
+	commit_policy.from_json(policy_obj);
+    }
+}
+
 Taxonomy &
 CollectionConfig::get_or_add_taxonomy(const std::string & taxonomy_name)
 {
@@ -341,6 +403,12 @@ CollectionConfig::to_json(Json::Value & value) const
     if (!taxonomies.empty()) {
 	categories_config_to_json(value);
     }
+    if (!templates.empty()) {
+	templates_config_to_json(value);
+    }
+    if (!commit_policy.is_default()) {
+	commit_policy_to_json(value);
+    }
     value["format"] = CONFIG_FORMAT;
     return value;
 }
@@ -358,6 +426,8 @@ CollectionConfig::from_json(const Json::Value & value)
     pipes_config_from_json(value);
     categorisers_config_from_json(value);
     categories_config_from_json(value);
+    templates_config_from_json(value);
+    commit_policy_from_json(value);
 }
 
 Schema *
@@ -398,6 +468,7 @@ CollectionConfig::set_schema(const string & type,
     }
 
     schemaptr->merge_from(schema);
+    clear_template_plans();
     LOG_DEBUG("Config changed: schema for type '" + type + "' created or altered");
     changed = true;
 
@@ -512,6 +583,62 @@ CollectionConfig::remove_taxonomy(const string & taxonomy_name)
     changed = true;
 }
 
+const SearchTemplate &
+CollectionConfig::get_search_template(const string & template_name) const
+{
+    map<string, SearchTemplate *>::const_iterator i
+	    = templates.find(template_name);
+    if (i == templates.end()) {
+	throw InvalidValueError("No search template of requested name found");
+    }
+    return *(i->second);
+}
+
+void
+CollectionConfig::set_search_template(const string & template_name,
+				      const SearchTemplate & tmpl)
+{
+    validate_template_name_throw(template_name);
+
+    SearchTemplate * templateptr;
+    map<string, SearchTemplate *>::iterator i = templates.find(template_name);
+
+    if (i == templates.end()) {
+	pair<map<string, SearchTemplate *>::iterator, bool> ret;
+	pair<string, SearchTemplate *> item(template_name, NULL);
+	ret = templates.insert(item);
+	templateptr = new SearchTemplate();
+	ret.first->second = templateptr;
+    } else {
+	templateptr = i->second;
+    }
+    *templateptr = tmpl;
+    LOG_DEBUG("Config changed: search template '" + template_name + "' created or altered");
+    changed = true;
+}
+
+void
+CollectionConfig::check_search_template(const SearchTemplate & tmpl) const
+{
+    CollectionQueryBuilder builder(*this);
+    SearchTemplatePlan plan;
+    tmpl.compile(&builder, plan);
+}
+
+void
+CollectionConfig::remove_search_template(const string & template_name)
+{
+    map<string, SearchTemplate *>::iterator i
+	    = templates.find(template_name);
+    if (i == templates.end()) {
+	return;
+    }
+    delete i->second;
+    templates.erase(i);
+    LOG_DEBUG("Config changed: search template '" + template_name + "' removed");
+    changed = true;
+}
+
 Json::Value &
 CollectionConfig::get_taxonomy_names(Json::Value & result) const
 {
@@ -651,18 +778,16 @@ CollectionConfig::send_to_pipe(TaskManager * taskman,
     }
 }
 
-Xapian::Document
-CollectionConfig::process_doc(Json::Value & doc_obj,
-			      const string & doc_type,
-			      const string & doc_id,
-			      string & idterm,
-			      IndexingErrors & errors,
-			      bool & new_fields)
+bool
+CollectionConfig::check_doc(Json::Value & doc_obj,
+			    const string & doc_type,
+			    const string & doc_id,
+			    string & doc_type_,
+			    IndexingErrors & errors) const
 {
     json_check_object(doc_obj, "input document");
-    Xapian::Document doc;
 
-    string doc_type_(doc_type);
+    doc_type_ = doc_type;
     if (doc_type.empty()) {
 	// No document type supplied in URL - look for it in the document.
 	const Json::Value & type_obj = doc_obj[type_field];
@@ -670,7 +795,7 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 	    errors.append(type_field,
 			  "No document type supplied or stored in document.");
 	    errors.total_failure = true;
-	    return doc;
+	    return false;
 	}
 	if (type_obj.isArray()) {
 	    if (type_obj.size() == 1) {
@@ -679,18 +804,18 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 		if (!error.empty()) {
 		    errors.append(type_field, error);
 		    errors.total_failure = true;
-		    return doc;
+		    return false;
 		}
 	    } else if (type_obj.size() == 0) {
 		errors.append(type_field,
 			      "No document type stored in document.");
 		errors.total_failure = true;
-		return doc;
+		return false;
 	    } else {
 		errors.append(type_field,
 			      "Multiple document types stored in document.");
 		errors.total_failure = true;
-		return doc;
+		return false;
 	    }
 	} else {
 	    string error;
@@ -698,7 +823,7 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 	    if (!error.empty()) {
 		errors.append(type_field, error);
 		errors.total_failure = true;
-		return doc;
+		return false;
 	    }
 	}
     } else {
@@ -717,13 +842,13 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 		    if (!error.empty()) {
 			errors.append(type_field, error);
 			errors.total_failure = true;
-			return doc;
+			return false;
 		    }
 		} else if (type_obj.size() > 1) {
 		    errors.append(type_field,
 				  "Multiple document types stored in document.");
 		    errors.total_failure = true;
-		    return doc;
+		    return false;
 		}
 	    } else {
 		string error;
@@ -731,7 +856,7 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 		if (!error.empty()) {
 		    errors.append(type_field, error);
 		    errors.total_failure = true;
-		    return doc;
+		    return false;
 		}
 	    }
 	    if (!stored_type.empty() && doc_type != stored_type) {
@@ -739,7 +864,7 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 			      "Document type supplied differs from "
 			      "that inside document.");
 		errors.total_failure = true;
-		return doc;
+		return false;
 	    }
 	}
     }
@@ -752,7 +877,7 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 	    errors.append(id_field,
 			  "No document ID supplied or stored in document.");
 	    errors.total_failure = true;
-	    return doc;
+	    return false;
 	}
 	if (id_obj.isArray()) {
 	    if (id_obj.size() == 1) {
@@ -761,18 +886,18 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 		if (!error.empty()) {
 		    errors.append(id_field, error);
 		    errors.total_failure = true;
-		    return doc;
+		    return false;
 		}
 	    } else if (id_obj.size() == 0) {
 		errors.append(id_field,
 			      "No document ID stored in document.");
 		errors.total_failure = true;
-		return doc;
+		return false;
 	    } else {
 		errors.append(id_field,
 			      "Multiple ID values provided - must have only one");
 		errors.total_failure = true;
-		return doc;
+		return false;
 	    }
 	} else {
 	    string error;
@@ -780,7 +905,7 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 	    if (!error.empty()) {
 		errors.append(id_field, error);
 		errors.total_failure = true;
-		return doc;
+		return false;
 	    }
 	}
 
@@ -788,7 +913,7 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 	if (!error.empty()) {
 	    errors.append(id_field, error);
 	    errors.total_failure = true;
-	    return doc;
+	    return false;
 	}
     } else {
 	// Document id supplied in URL - check that it isn't different in
@@ -806,13 +931,13 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 		    if (!error.empty()) {
 			errors.append(id_field, error);
 			errors.total_failure = true;
-			return doc;
+			return false;
 		    }
 		} else if (id_obj.size() > 1) {
 		    errors.append(id_field,
 				  "Multiple ID values provided - must have only one");
 		    errors.total_failure = true;
-		    return doc;
+		    return false;
 		}
 	    } else {
 		string error;
@@ -820,7 +945,7 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 		if (!error.empty()) {
 		    errors.append(id_field, error);
 		    errors.total_failure = true;
-		    return doc;
+		    return false;
 		}
 	    }
 	    if (!stored_id.empty() && doc_id != stored_id) {
@@ -829,14 +954,14 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 			      "') differs from that inside document ('" +
 			      stored_id + "').");
 		errors.total_failure = true;
-		return doc;
+		return false;
 	    }
 	}
 	string error = validate_doc_id(doc_id);
 	if (!error.empty()) {
 	    errors.append(id_field, error);
 	    errors.total_failure = true;
-	    return doc;
+	    return false;
 	}
     }
 
@@ -845,15 +970,66 @@ CollectionConfig::process_doc(Json::Value & doc_obj,
 	if (!error.empty()) {
 	    errors.append(type_field, error);
 	    errors.total_failure = true;
-	    return doc;
+	    return false;
 	}
     }
+    return true;
+}
+
+Xapian::Document
+CollectionConfig::process_doc(Json::Value & doc_obj,
+			      const string & doc_type,
+			      const string & doc_id,
+			      string & idterm,
+			      IndexingErrors & errors,
+			      bool & new_fields)
+{
+    string doc_type_;
+    if (!check_doc(doc_obj, doc_type, doc_id, doc_type_, errors)) {
+	return Xapian::Document();
+    }
     Schema * schema = get_schema(doc_type_);
     if (schema == NULL) {
 	Schema newschema(doc_type_);
 	newschema.from_json(default_type_config);
 	schema = set_schema(doc_type_, newschema);
     }
-    doc = schema->process(doc_obj, *this, idterm, errors, new_fields);
+    Xapian::Document doc(schema->process(doc_obj, *this, idterm, errors,
+					 new_fields));
+    if (new_fields) {
+	clear_template_plans();
+    }
     return doc;
 }
+
+bool
+CollectionConfig::process_doc_unchanged(Json::Value & doc_obj,
+					const string & doc_type,
+					const string & doc_id,
+					string & idterm,
+					IndexingErrors & errors,
+					Xapian::Document & doc) const
+{
+    string doc_type_;
+    if (!check_doc(doc_obj, doc_type, doc_id, doc_type_, errors)) {
+	doc = Xapian::Document();
+	return true;
+    }
+    const Schema * schema = get_schema(doc_type_);
+    if (schema == NULL || schema->has_new_fields(doc_obj, meta_field)) {
+	return false;
+    }
+    doc = schema->index(doc_obj, *this, idterm, errors);
+    return true;
+}
+
+void
+CollectionConfig::build_indexers() const
+{
+    for (map<string, Schema *>::const_iterator i = types.begin();
+	 i != types.end(); ++i) {
+	if (i->second != NULL) {
+	    i->second->build_indexers();
+	}
+    }
+}
@@ -26,6 +26,7 @@
 #define RESTPOSE_INCLUDED_COLLCONFIG_H
 
 #include "taxonomy.h"
+#include "jsonxapian/commit_policy.h"
 #include "json/value.h"
 #include <map>
 #include <string>
@@ -39,6 +40,7 @@ class Categoriser;
 struct IndexingErrors;
 struct Pipe;
 class Schema;
+class SearchTemplate;
 
 /** All the configuration of the collection.
  *
@@ -72,6 +74,12 @@ class CollectionConfig {
     /// Named taxonomies.
     std::map<std::string, Taxonomy *> taxonomies;
 
+    /// Search templates, by name.
+    std::map<std::string, SearchTemplate *> templates;
+
+    /// The policy for committing changes to the collection.
+    CommitPolicy commit_policy;
+
     /// Map from taxonomy name to groups using that taxonomy.
     mutable std::map<std::string, std::set<std::string> > group_taxonomies;
 
@@ -124,9 +132,45 @@ class CollectionConfig {
      */
     void categories_config_from_json(const Json::Value & value);
 
+    /** Write the search templates configuration to a JSON value.
+     */
+    void templates_config_to_json(Json::Value & value) const;
+
+    /** Set the search templates configuration from a JSON value.
+     */
+    void templates_config_from_json(const Json::Value & value);
+
+    /** Discard the compiled plans of all the search templates.
+     *
+     *  Called when a schema changes, since the plans depend on the schemas.
+     */
+    void clear_template_plans();
+
+    /** Write the commit policy to a JSON value.
+     */
+    void commit_policy_to_json(Json::Value & value) const;
+
+    /** Set the commit policy from a JSON value.
+     */
+    void commit_policy_from_json(const Json::Value & value);
+
     /// Get a reference to a taxonomy, adding it if it doesn't already exist.
     Taxonomy & get_or_add_taxonomy(const std::string & taxonomy_name);
 
+    /** Check the type and ID of a JSON document, before processing it.
+     *
+     *  Sets the type and ID in the document if they were supplied
+     *  separately, and sets doc_type_ to the type of the document.
+     *
+     *  Returns false if the document can't be processed; the reasons are
+     *  appended to errors.
+     */
+    bool check_doc(Json::Value & doc_obj,
+		   const std::string & doc_type,
+		   const std::string & doc_id,
+		   std::string & doc_type_,
+		   IndexingErrors & errors) const;
+
   public:
     CollectionConfig(const std::string & coll_name_);
     ~CollectionConfig();
@@ -307,12 +351,46 @@ class CollectionConfig {
 	const std::string & parent_name,
 	Categories & modified);
 
+    /** Get a search template.
+     *
+     *  Raises an exception if the template is not known.
+     *
+     *  The returned reference is invalid after modifications have been made
+     *  to the collection's search template configuration.
+     */
+    const SearchTemplate & get_search_template(
+	const std::string & template_name) const;
+
+    /** Set a search template.
+     *
+     *  Takes a copy of the supplied template.
+     */
+    void set_search_template(const std::string & template_name,
+			     const SearchTemplate & tmpl);
+
+    /** Check a search template against the collection's schemas.
+     *
+     *  Raises InvalidValueError if the parts of the template's query which
+     *  don't depend on parameters are invalid.
+     */
+    void check_search_template(const SearchTemplate & tmpl) const;
+
+    /** Remove a search template.
+     */
+    void remove_search_template(const std::string & template_name);
+
     /** Get the fieldname used for storing meta information.
      */
     std::string get_meta_field() const {
 	return meta_field;
     }
 
+    /** Get the policy for committing changes to the collection.
+     */
+    const CommitPolicy & get_commit_policy() const {
+	return commit_policy;
+    }
+
     /** Categorise a piece of text.
      *
      *  @param categoriser_name The categoriser to use.
@@ -344,6 +422,28 @@ class CollectionConfig {
 				 std::string & idterm,
 				 IndexingErrors & errors,
 				 bool & new_fields);
+
+    /** Process a JSON document into a Xapian document, without modifying
+     *  the configuration.
+     *
+     *  Returns false, leaving doc unset, if the document's type has no
+     *  schema yet, or the document has fields which aren't in the schema.
+     *  In that case, the document must be processed with process_doc() on a
+     *  modifiable copy of the configuration instead.
+     */
+    bool process_doc_unchanged(Json::Value & doc_obj,
+			       const std::string & doc_type,
+			       const std::string & doc_id,
+			       std::string & idterm,
+			       IndexingErrors & errors,
+			       Xapian::Document & doc) const;
+
+    /** Build the cached indexers for all the fields in all the schemas.
+     *
+     *  This must be called before the configuration is shared between
+     *  threads, so that process_doc_unchanged() doesn't modify it.
+     */
+    void build_indexers() const;
 };
 
 }
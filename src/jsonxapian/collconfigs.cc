@@ -30,72 +30,144 @@
 using namespace std;
 using namespace RestPose;
 
-CollectionConfigs::~CollectionConfigs()
+class CollectionConfigSnapshot::Internal {
+    Internal(const Internal &);
+    void operator=(const Internal &);
+  public:
+    Mutex mutex;
+    unsigned ref_count;
+    const CollectionConfig * config;
+
+    Internal(const CollectionConfig * config_)
+	    : ref_count(1),
+	      config(config_) {}
+
+    ~Internal() {
+	delete config;
+    }
+};
+
+CollectionConfigSnapshot::CollectionConfigSnapshot(CollectionConfig * config)
+	: internal(NULL)
+{
+    auto_ptr<CollectionConfig> config_ptr(config);
+    // Build the indexers now, so that the schemas' caches aren't modified by
+    // the threads sharing the snapshot.
+    config_ptr->build_indexers();
+    internal = new Internal(config_ptr.get());
+    (void) config_ptr.release();
+}
+
+CollectionConfigSnapshot::CollectionConfigSnapshot(
+	const CollectionConfigSnapshot & other)
+	: internal(NULL)
+{
+    ContextLocker lock(other.internal->mutex);
+    internal = other.internal;
+    ++(internal->ref_count);
+}
+
+void
+CollectionConfigSnapshot::operator=(const CollectionConfigSnapshot & other)
 {
-    for (map<string, CollectionConfig *>::iterator i = configs.begin();
-	 i != configs.end(); ++i) {
-	delete i->second;
+    if (internal == other.internal) {
+	return;
+    }
+
+    {
+	ContextLocker lock(internal->mutex);
+	--(internal->ref_count);
+	if (internal->ref_count == 0) {
+	    lock.unlock();
+	    delete internal;
+	}
+	internal = NULL;
+    }
+
+    {
+	ContextLocker lock(other.internal->mutex);
+	internal = other.internal;
+	++(internal->ref_count);
     }
 }
 
-CollectionConfig *
-CollectionConfigs::get(const std::string & coll_name)
+CollectionConfigSnapshot::~CollectionConfigSnapshot()
 {
-    ContextLocker lock(mutex);
-    map<string, CollectionConfig *>::const_iterator i = configs.find(coll_name);
+    ContextLocker lock(internal->mutex);
+    --(internal->ref_count);
+    if (internal->ref_count == 0) {
+	lock.unlock();
+	delete internal;
+    }
+}
+
+const CollectionConfig &
+CollectionConfigSnapshot::operator*() const
+{
+    return *(internal->config);
+}
+
+const CollectionConfig *
+CollectionConfigSnapshot::operator->() const
+{
+    return internal->config;
+}
+
+
+const CollectionConfigSnapshot &
+CollectionConfigs::get_locked(const std::string & coll_name)
+{
+    map<string, CollectionConfigSnapshot>::const_iterator i
+	    = configs.find(coll_name);
     if (i == configs.end()) {
+	auto_ptr<CollectionConfig> config;
 	if (pool.exists(coll_name)) {
 	    auto_ptr<Collection> coll(pool.get_readonly(coll_name));
-	    auto_ptr<CollectionConfig> config(coll->get_config().clone());
+	    config.reset(coll->get_config().clone());
 	    pool.release(coll.release());
-
-	    pair<map<string, CollectionConfig *>::iterator, bool> ret;
-	    ret = configs.insert(pair<string, CollectionConfig *>(coll_name, NULL));
-	    ret.first->second = config.release();
-	    i = ret.first;
 	} else {
-	    auto_ptr<CollectionConfig> config(new CollectionConfig(coll_name));
+	    config.reset(new CollectionConfig(coll_name));
 	    config->set_default();
-
-	    pair<map<string, CollectionConfig *>::iterator, bool> ret;
-	    ret = configs.insert(pair<string, CollectionConfig *>(coll_name, NULL));
-	    ret.first->second = config.release();
-	    i = ret.first;
 	}
+
+	CollectionConfigSnapshot snapshot(config.release());
+	i = configs.insert(make_pair(coll_name, snapshot)).first;
     }
-    return i->second->clone();
+    return i->second;
+}
+
+CollectionConfigSnapshot
+CollectionConfigs::get_snapshot(const std::string & coll_name)
+{
+    ContextLocker lock(mutex);
+    return get_locked(coll_name);
+}
+
+CollectionConfig *
+CollectionConfigs::get(const std::string & coll_name)
+{
+    CollectionConfigSnapshot snapshot(get_snapshot(coll_name));
+    return snapshot->clone();
 }
 
 void
 CollectionConfigs::set(const std::string & coll_name,
 		       CollectionConfig * config)
 {
-    auto_ptr<CollectionConfig> config_ptr(config);
+    CollectionConfigSnapshot snapshot(config);
     ContextLocker lock(mutex);
-    map<string, CollectionConfig *>::iterator i = configs.find(coll_name);
+    map<string, CollectionConfigSnapshot>::iterator i = configs.find(coll_name);
     if (i == configs.end()) {
-	pair<map<string, CollectionConfig *>::iterator, bool> ret;
-	ret = configs.insert(pair<string, CollectionConfig *>(coll_name, NULL));
-	ret.first->second = config_ptr.release();
+	configs.insert(make_pair(coll_name, snapshot));
     } else {
-	delete i->second;
-	i->second = config_ptr.release();
+	i->second = snapshot;
     }
 }
 
 void
 CollectionConfigs::reset(const std::string & coll_name)
 {
-    ContextLocker lock(mutex);
-    map<string, CollectionConfig *>::iterator i = configs.find(coll_name);
-    if (i == configs.end()) {
-	pair<map<string, CollectionConfig *>::iterator, bool> ret;
-	ret = configs.insert(pair<string, CollectionConfig *>(coll_name, NULL));
-	ret.first->second = new CollectionConfig(coll_name);
-	ret.first->second->set_default();
-    } else {
-	delete i->second;
-	i->second = new CollectionConfig(coll_name);
-	i->second->set_default();
-    }
+    auto_ptr<CollectionConfig> config(new CollectionConfig(coll_name));
+    config->set_default();
+    set(coll_name, config.release());
 }
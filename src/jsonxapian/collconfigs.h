@@ -33,33 +33,72 @@ class CollectionPool;
 
 namespace RestPose {
 
+/** A reference to an immutable collection configuration, which may be shared
+ *  between threads.
+ *
+ *  Copies of a snapshot refer to the same configuration, which is deleted
+ *  when the last copy is destroyed.  The configuration can't be modified
+ *  through a snapshot; to change it, clone it, modify the clone, and make a
+ *  new snapshot from that.
+ */
+class CollectionConfigSnapshot {
+    class Internal;
+    Internal * internal;
+  public:
+    /** Make a snapshot of a configuration.
+     *
+     *  Takes ownership of the supplied config, which mustn't be modified
+     *  afterwards.
+     */
+    explicit CollectionConfigSnapshot(CollectionConfig * config);
+    CollectionConfigSnapshot(const CollectionConfigSnapshot & other);
+    void operator=(const CollectionConfigSnapshot & other);
+    ~CollectionConfigSnapshot();
+
+    const CollectionConfig & operator*() const;
+    const CollectionConfig * operator->() const;
+};
+
 /** Holds CollectionConfig objects for each collection.
  *
  *  Used to allow processing threads to get the appropriate configuration, even
  *  if it hasn't been comitted to the collection yet.
  *
- *  This is threadsafe - accesses are serialised by an internal mutex, and the
- *  returned results are new objects sharing no state with the internal
- *  objects.
+ *  This is threadsafe - accesses are serialised by an internal mutex.  The
+ *  configurations are held as snapshots, which are shared with the threads
+ *  using them, and replaced (rather than modified) when a configuration
+ *  changes.
  */
 class CollectionConfigs {
     Mutex mutex;
-    std::map<std::string, CollectionConfig *> configs;
+    std::map<std::string, CollectionConfigSnapshot> configs;
+
+    /** Get the snapshot for a collection, loading it if needed.
+     *
+     *  The mutex must be held by the caller.
+     */
+    const CollectionConfigSnapshot & get_locked(const std::string & coll_name);
     CollectionPool & pool;
 
     CollectionConfigs(const CollectionConfigs &);
     void operator=(const CollectionConfigs &);
   public:
     CollectionConfigs(CollectionPool & pool_) : pool(pool_) {}
-    ~CollectionConfigs();
 
-    /** Get a (newly allocated) configuration for a given collection.
+    /** Get a shared snapshot of the configuration for a given collection.
      *
      *  If the configuration isn't already known, attempts to get a
      *  corresponding collection from the collection pool and reads the
      *  configuration from that.  If no such collection exists, returns
      *  a default configuration.
      */
+    CollectionConfigSnapshot get_snapshot(const std::string & coll_name);
+
+    /** Get a (newly allocated) configuration for a given collection.
+     *
+     *  This is a copy of the current snapshot, which may be modified, and
+     *  then passed back to set().
+     */
     CollectionConfig * get(const std::string & coll_name);
 
     /** Set the configuration for a collection.
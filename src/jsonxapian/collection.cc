@@ -26,32 +26,136 @@
 #include "collection.h"
 
 #include "infohandlers.h"
+#include <algorithm>
 #include "jsonxapian/doctojson.h"
 #include "jsonxapian/indexing.h"
 #include "jsonxapian/pipe.h"
 #include "jsonxapian/query_builder.h"
+#include "jsonxapian/search_template.h"
 #include "logger/logger.h"
 #include <memory>
 #include "postingsources/multivalue_keymaker.h"
+#include "realtime.h"
 #include "str.h"
 #include "utils/jsonutils.h"
 #include "utils/rsperrors.h"
 #include "utils/stringutils.h"
+#include "utils/workpool.h"
 #include <vector>
 #include <xapian.h>
 
 using namespace std;
 using namespace RestPose;
 
+/** Number of results to retrieve at once when passing results to a
+ *  SearchResultsSink.
+ */
+static const Xapian::doccount SEARCH_PAGE_SIZE = 1000;
+
+/** Number of documents a SearchLimitDecider checks between reading the
+ *  clock and checking for cancellation.
+ */
+static const unsigned LIMIT_CHECK_INTERVAL = 256;
+
+SearchResultsSink::~SearchResultsSink() {}
+
+CommitWaiter::~CommitWaiter() {}
+
+/** Notify a list of commit waiters, and delete them.
+ *
+ *  @param error NULL if the commit succeeded; otherwise, a description of
+ *  the error.
+ */
+static void
+notify_commit_waiters(vector<CommitWaiter *> & waiters, const string * error)
+{
+    for (vector<CommitWaiter *>::iterator i = waiters.begin();
+	 i != waiters.end(); ++i) {
+	if (error == NULL) {
+	    (*i)->committed();
+	} else {
+	    (*i)->commit_failed(*error);
+	}
+	delete *i;
+	*i = NULL;
+    }
+    waiters.clear();
+}
+
+SearchCancelCheck::~SearchCancelCheck() {}
+
+/** Match decider which rejects all documents once a deadline has passed, or
+ *  the search has been cancelled.
+ *
+ *  Xapian 1.2 has no way to set a time limit on the matcher, or to interrupt
+ *  it, so this is used to make the rest of the match cheap once the search
+ *  should stop.  The clock and the cancellation check are only read every
+ *  few documents.
+ */
+class SearchLimitDecider : public Xapian::MatchDecider {
+    double deadline;
+    const SearchCancelCheck * cancel;
+    mutable unsigned countdown;
+    mutable bool expired;
+    mutable bool cancelled;
+  public:
+    SearchLimitDecider(double deadline_, const SearchCancelCheck * cancel_)
+	    : deadline(deadline_),
+	      cancel(cancel_),
+	      countdown(1),
+	      expired(false),
+	      cancelled(false)
+    {}
+
+    bool operator()(const Xapian::Document &) const {
+	if (expired || cancelled) {
+	    return false;
+	}
+	if (--countdown == 0) {
+	    countdown = LIMIT_CHECK_INTERVAL;
+	    if (deadline != 0.0 && RealTime::now() >= deadline) {
+		expired = true;
+		return false;
+	    }
+	    if (cancel != NULL && cancel->is_cancelled()) {
+		cancelled = true;
+		return false;
+	    }
+	}
+	return true;
+    }
+
+    /// Return true if any documents were rejected due to the deadline.
+    bool has_expired() const {
+	return expired;
+    }
+
+    /// Return true if any documents were rejected due to cancellation.
+    bool was_cancelled() const {
+	return cancelled;
+    }
+};
+
 Collection::Collection(const string & coll_name_,
 		       const string & coll_path_)
 	: config(coll_name_),
-	  group(coll_path_)
+	  group(coll_path_),
+	  match_pool(NULL),
+	  filter_cache(),
+	  generation(NULL),
+	  opened_generation(0),
+	  pending_docs(0),
+	  pending_bytes(0),
+	  first_pending_time(0.0),
+	  commit_waiters(),
+	  first_waiter_time(0.0)
 {
 }
 
 Collection::~Collection()
 {
+    string error("Collection closed before changes were committed");
+    notify_commit_waiters(commit_waiters, &error);
     try {
 	close();
     } catch (const Xapian::Error & e) {
@@ -64,6 +168,7 @@ Collection::open_writable()
 {
     if (!group.is_writable()) {
 	group.open_writable();
+	reset_filter_cache();
 	read_config();
     }
 }
@@ -71,8 +176,35 @@ Collection::open_writable()
 void
 Collection::open_readonly()
 {
+    // Read the generation first, so that a commit made while reopening
+    // causes another reopen next time.
+    uint64_t current = (generation == NULL) ? 0 : generation->get();
     group.open_readonly();
+    reset_filter_cache();
     read_config();
+    opened_generation = current;
+}
+
+void
+Collection::refresh_readonly()
+{
+    if (generation != NULL && group.is_open() && !group.is_writable() &&
+	generation->get() == opened_generation) {
+	return;
+    }
+    open_readonly();
+}
+
+void
+Collection::reset_filter_cache()
+{
+    if (!group.is_open() || group.is_writable()) {
+	filter_cache.clear();
+	return;
+    }
+    vector<Xapian::Database> dbs;
+    group.get_fragment_dbs(dbs);
+    filter_cache.reset(dbs);
 }
 
 const Xapian::Database &
@@ -94,12 +226,12 @@ Collection::read_config()
 	last_config = config_str;
 	if (config_str.empty()) {
 	    config.set_default();
-	    return;
+	} else {
+	    // Set the schema.
+	    Json::Value config_obj;
+	    config.from_json(json_unserialise(config_str, config_obj));
 	}
-
-	// Set the schema.
-	Json::Value config_obj;
-	config.from_json(json_unserialise(config_str, config_obj));
+	update_commit_policy();
     } catch(...) {
 	group.close();
 	throw;
@@ -423,6 +555,28 @@ Collection::category_remove_parent(const string & taxonomy_name,
     write_config();
 }
 
+void
+Collection::set_search_template(const string & template_name,
+				const SearchTemplate & tmpl)
+{
+    if (!group.is_writable()) {
+	throw InvalidStateError("Collection must be open for writing to set search template");
+    }
+    config.set_search_template(template_name, tmpl);
+    write_config();
+}
+
+const SearchTemplatePlan &
+Collection::get_search_plan(const string & template_name,
+			    const string & doc_type) const
+{
+    if (!group.is_open()) {
+	throw InvalidStateError("Collection must be open to get search template");
+    }
+    return config.get_search_template(template_name).get_plan(config,
+							       doc_type);
+}
+
 void
 Collection::from_json(const Json::Value & value)
 {
@@ -430,6 +584,7 @@ Collection::from_json(const Json::Value & value)
 	throw InvalidStateError("Collection must be open for writing to set config");
     }
     config.from_json(value);
+    update_commit_policy();
     write_config();
 }
 
@@ -480,6 +635,82 @@ Collection::process_doc(Json::Value & doc_obj,
     return doc;
 }
 
+/** Estimate the size of the changes made by adding a document.
+ *
+ *  This only needs to be cheap and roughly proportional to the work needed to
+ *  commit the document, so counts the data, terms, positions and values.
+ */
+static uint64_t
+estimate_doc_size(const Xapian::Document & doc)
+{
+    uint64_t size = doc.get_data().size();
+    for (Xapian::TermIterator i = doc.termlist_begin();
+	 i != doc.termlist_end(); ++i) {
+	size += (*i).size() + i.positionlist_count();
+    }
+    for (Xapian::ValueIterator i = doc.values_begin();
+	 i != doc.values_end(); ++i) {
+	size += (*i).size();
+    }
+    return size;
+}
+
+void
+Collection::note_change(uint64_t bytes)
+{
+    ContextLocker lock(pending_mutex);
+    if (pending_docs == 0) {
+	first_pending_time = RealTime::now();
+    }
+    ++pending_docs;
+    pending_bytes += bytes;
+}
+
+void
+Collection::clear_pending()
+{
+    ContextLocker lock(pending_mutex);
+    pending_docs = 0;
+    pending_bytes = 0;
+    first_pending_time = 0.0;
+}
+
+void
+Collection::update_commit_policy()
+{
+    ContextLocker lock(pending_mutex);
+    commit_policy = config.get_commit_policy();
+}
+
+void
+Collection::sync_changes()
+{
+    // Take the waiters before committing: any added after this point may
+    // be for changes which this commit misses.
+    vector<CommitWaiter *> waiters;
+    {
+	ContextLocker lock(pending_mutex);
+	waiters.swap(commit_waiters);
+	first_waiter_time = 0.0;
+    }
+    LOG_INFO("Committing changes to collection \"" + config.get_name() + "\"");
+    try {
+	group.sync();
+    } catch(const Xapian::Error & e) {
+	string error(e.get_description());
+	notify_commit_waiters(waiters, &error);
+	throw;
+    } catch(const RestPose::Error & e) {
+	string error(e.what());
+	notify_commit_waiters(waiters, &error);
+	throw;
+    }
+    if (generation != NULL) {
+	generation->bump();
+    }
+    notify_commit_waiters(waiters, NULL);
+}
+
 void
 Collection::raw_update_doc(const Xapian::Document & doc,
 			   const string & idterm)
@@ -488,6 +719,7 @@ Collection::raw_update_doc(const Xapian::Document & doc,
 	throw InvalidStateError("Collection must be open for writing to add document");
     }
     group.add_doc(doc, idterm);
+    note_change(estimate_doc_size(doc));
 }
 
 void
@@ -497,6 +729,7 @@ Collection::raw_delete_doc(const string & idterm)
 	throw InvalidStateError("Collection must be open for writing to delete document");
     }
     group.delete_doc(idterm);
+    note_change(idterm.size());
 }
 
 void
@@ -505,8 +738,78 @@ Collection::commit()
     if (!group.is_writable()) {
 	throw InvalidStateError("Collection must be open for writing to commit");
     }
-    LOG_INFO("Committing changes to collection \"" + config.get_name() + "\"");
-    group.sync();
+    clear_pending();
+    sync_changes();
+}
+
+CommitPolicy
+Collection::get_commit_policy() const
+{
+    ContextLocker lock(pending_mutex);
+    return commit_policy;
+}
+
+double
+Collection::get_commit_deadline() const
+{
+    ContextLocker lock(pending_mutex);
+    if (first_waiter_time != 0.0) {
+	return first_waiter_time;
+    }
+    if (pending_docs == 0 || commit_policy.max_latency == 0) {
+	return 0.0;
+    }
+    return first_pending_time + commit_policy.max_latency;
+}
+
+void
+Collection::add_commit_waiter(CommitWaiter * waiter, bool hurry)
+{
+    auto_ptr<CommitWaiter> waiter_ptr(waiter);
+    ContextLocker lock(pending_mutex);
+    if (hurry && first_waiter_time == 0.0) {
+	first_waiter_time = RealTime::now();
+    }
+    commit_waiters.push_back(NULL);
+    commit_waiters.back() = waiter_ptr.release();
+}
+
+bool
+Collection::commit_if_due()
+{
+    if (!group.is_writable()) {
+	throw InvalidStateError("Collection must be open for writing to commit");
+    }
+    {
+	ContextLocker lock(pending_mutex);
+	double now = RealTime::now();
+	if (!commit_policy.commit_due(pending_docs, pending_bytes,
+				      first_pending_time, now) &&
+	    (first_waiter_time == 0.0 ||
+	     now < first_waiter_time + commit_policy.ack_latency)) {
+	    return false;
+	}
+	pending_docs = 0;
+	pending_bytes = 0;
+	first_pending_time = 0.0;
+    }
+    sync_changes();
+    return true;
+}
+
+void
+Collection::refresh()
+{
+    if (group.is_writable()) {
+	clear_pending();
+	sync_changes();
+    } else {
+	uint64_t current = (generation == NULL) ? 0 : generation->get();
+	group.refresh();
+	reset_filter_cache();
+	read_config();
+	opened_generation = current;
+    }
 }
 
 uint64_t
@@ -522,7 +825,8 @@ calc_fromdoc_offset(const Xapian::Database & db,
 		    const string & fromdoc_id,
 		    Xapian::doccount fromdoc_pagesize,
 		    int fromdoc_from,
-		    Xapian::doccount check_at_least)
+		    Xapian::doccount check_at_least,
+		    const Xapian::MatchDecider * decider)
 {
     Xapian::doccount from = 0;
     // Get the Xapian ID of the document.
@@ -541,7 +845,7 @@ calc_fromdoc_offset(const Xapian::Database & db,
 
     while (true) {
 	Xapian::MSet mset = enq.get_mset(from, fromdoc_pagesize,
-					 check_at_least);
+					 check_at_least, NULL, decider);
 	for (Xapian::MSet::const_iterator i = mset.begin();
 	     i != mset.end(); ++i) {
 	    if (*i == fromdoc_xapid) {
@@ -566,10 +870,452 @@ calc_fromdoc_offset(const Xapian::Database & db,
     throw InvalidValueError("fromdoc document not present in result set");
 }
 
+/// Get the displayed form of a matching document.
+static void
+get_display_doc(const Xapian::Document & doc,
+		const Json::Value & fieldlist,
+		Json::Value & item)
+{
+    DocumentData docdata;
+    docdata.unserialise(doc.get_data());
+    docdata.to_display(fieldlist, item);
+}
+
+/// Get the displayed form of a search result item.
+static void
+get_display_item(const Xapian::MSetIterator & i,
+		 const Json::Value & fieldlist,
+		 Json::Value & item)
+{
+    get_display_doc(i.get_document(), fieldlist, item);
+}
+
+/// Add the info handlers requested by a search to an enquire object.
+static void
+add_info_handlers(const Json::Value & search,
+		  const QueryBuilder & builder,
+		  Xapian::Enquire & enq,
+		  const Xapian::Database & db,
+		  InfoHandlers & info_handlers,
+		  Xapian::doccount & check_at_least)
+{
+    if (search.isMember("info")) {
+	const Json::Value & info = search["info"];
+	json_check_array(info, "list of info items to gather");
+	for (Json::Value::const_iterator i = info.begin();
+	     i != info.end(); ++i) {
+	    info_handlers.add_handler(*i, builder, enq, &db, check_at_least);
+	}
+    }
+}
+
+/// The orders in which search results can be returned.
+enum SearchOrder {
+    ORDER_RELEVANCE,
+    ORDER_RELEVANCE_THEN_KEY,
+    ORDER_KEY_THEN_RELEVANCE,
+    ORDER_KEY
+};
+
+/** Parse the "order_by" parameter of a search.
+ *
+ *  Sets sorter to a key maker for the fields to order by, if there are any.
+ *  Fields which can't be sorted by are only logged if log_warnings is true.
+ */
+static SearchOrder
+parse_order_by(const Json::Value & search,
+	       const QueryBuilder & builder,
+	       auto_ptr<MultiValueKeyMaker> & sorter,
+	       bool log_warnings)
+{
+    if (!search.isMember("order_by")) {
+	return ORDER_RELEVANCE;
+    }
+    const Json::Value & order_by = search["order_by"];
+    json_check_array(order_by, "list of ordering items");
+    bool score_first = false;
+    bool score_last = false;
+    for (unsigned i = 0; i != order_by.size(); ++i) {
+	const Json::Value & order_by_item = order_by[i];
+	json_check_object(order_by_item, "ordering item");
+
+	if (order_by_item.isMember("field")) {
+	    // Order by a field.  The field must have a slot associated with
+	    // it, holding the sortable values.
+	    string fieldname = json_get_string_member(order_by_item, "field",
+						      string());
+
+	    auto_ptr<SlotDecoder> decoder(builder.get_slot_decoder(fieldname));
+	    // FIXME - make it obvious why the sorting didn't happen; this
+	    // shouldn't be an error, because it could just be that no
+	    // documents have yet been indexed with the given field, but it
+	    // should be reflected in the search results somehow (possibly only
+	    // in an explain view).
+
+	    if (decoder.get() != NULL) {
+		if (sorter.get() == NULL) {
+		    sorter = auto_ptr<MultiValueKeyMaker>(new MultiValueKeyMaker());
+		}
+
+		bool ascending = json_get_bool(order_by_item, "ascending", true);
+		sorter->add_decoder(decoder.release(), !ascending);
+	    } else if (log_warnings) {
+		LOG_WARN("Unable to apply requested sort by \"" +
+			 fieldname + "\" - no field config found.");
+	    }
+	} else if (order_by_item.isMember("score")) {
+	    // Order by the weights calculated in the query tree.
+	    if (order_by_item["score"] != "weight") {
+		throw InvalidValueError("Invalid score specification (only "
+					"allowed value is \"weight\")");
+	    }
+	    if (json_get_bool(order_by_item, "ascending", false)) {
+		throw InvalidValueError("Ascending order is not allowed when "
+					"ordering by weight");
+	    }
+	    if (i == 0) {
+		score_first = true;
+	    } else if (i + 1 == order_by.size()) {
+		score_last = true;
+	    } else {
+		throw InvalidValueError("Sorting by score is only allowed "
+					"as the first or last sorting "
+					"condition (was " + str(i) + " of "
+					+ str(order_by.size()) + ")");
+	    }
+	} else {
+	    throw InvalidValueError("Invalid order_by item - neither contains "
+				    "\"field\" or \"score\" member");
+	}
+    }
+    if (score_first && score_last) {
+	throw InvalidValueError("Sorting condition list may only contain "
+				"sorting by score once.");
+    }
+    if (sorter.get() == NULL) {
+	return ORDER_RELEVANCE;
+    }
+    if (score_first) {
+	return ORDER_RELEVANCE_THEN_KEY;
+    }
+    if (score_last) {
+	return ORDER_KEY_THEN_RELEVANCE;
+    }
+    return ORDER_KEY;
+}
+
+/// Set the order in which an enquire object returns results.
+static void
+set_search_order(Xapian::Enquire & enq,
+		 SearchOrder order,
+		 MultiValueKeyMaker * sorter)
+{
+    switch (order) {
+	case ORDER_RELEVANCE:
+	    enq.set_sort_by_relevance();
+	    break;
+	case ORDER_RELEVANCE_THEN_KEY:
+	    enq.set_sort_by_relevance_then_key(sorter, false);
+	    break;
+	case ORDER_KEY_THEN_RELEVANCE:
+	    enq.set_sort_by_key_then_relevance(sorter, false);
+	    break;
+	case ORDER_KEY:
+	    enq.set_sort_by_key(sorter, false);
+	    break;
+    }
+}
+
+/// Add a description of the query performed to the results of a search.
+static void
+write_query_description(Json::Value & results, const Xapian::Query & query)
+{
+    // Note - we can't just include query.get_description() in the output,
+    // because this isn't always a valid unicode string, so we escape it
+    // with hexesc.
+    results["query_description"] = hexesc(query.get_description());
+
+    // Also include the serialised form, since this can be usefully
+    // unserialised to build testcases to demonstrate problems.
+    results["query_serialised"] = hexesc(query.serialise());
+}
+
+/** A match from one database fragment, to be merged with the others.
+ */
+struct FragmentMatch {
+    /// The weight of the match.
+    Xapian::weight weight;
+
+    /// The sort key of the match, if sorting by fields.
+    string key;
+
+    /// The ID of the document in the group's database.
+    Xapian::docid did;
+
+    /// The index of the fragment the match is from.
+    unsigned frag;
+
+    /// The ID of the document in the fragment's database.
+    Xapian::docid frag_did;
+};
+
+/** Comparison of matches from database fragments, putting the matches which
+ *  should be returned first at the start.
+ *
+ *  Ties are broken by document ID in the group's database.
+ */
+class FragmentMatchOrder {
+    SearchOrder order;
+  public:
+    FragmentMatchOrder(SearchOrder order_) : order(order_) {}
+
+    bool operator()(const FragmentMatch & a, const FragmentMatch & b) const {
+	switch (order) {
+	    case ORDER_RELEVANCE:
+		if (a.weight != b.weight) return a.weight > b.weight;
+		break;
+	    case ORDER_RELEVANCE_THEN_KEY:
+		if (a.weight != b.weight) return a.weight > b.weight;
+		if (a.key != b.key) return a.key < b.key;
+		break;
+	    case ORDER_KEY_THEN_RELEVANCE:
+		if (a.key != b.key) return a.key < b.key;
+		if (a.weight != b.weight) return a.weight > b.weight;
+		break;
+	    case ORDER_KEY:
+		if (a.key != b.key) return a.key < b.key;
+		break;
+	}
+	return a.did < b.did;
+    }
+};
+
+/** A search of one database fragment, performed as part of a parallel
+ *  search.
+ *
+ *  Everything the job uses is set up by the thread performing the search,
+ *  and not shared with the other jobs, since Xapian objects mustn't be used
+ *  by several threads at once.  The exception is the query, which is built
+ *  once and only read while matching: each job's Enquire takes its copy of
+ *  it in setup(), and the copies are released after all the jobs finish,
+ *  so only the searching thread changes its reference counts.
+ */
+class FragmentSearchJob : public WorkJob {
+  public:
+    Xapian::Database db;
+    unsigned frag;
+    unsigned frag_count;
+    auto_ptr<MultiValueKeyMaker> sorter;
+    InfoHandlers info_handlers;
+    auto_ptr<SearchLimitDecider> decider;
+    Xapian::Enquire enq;
+    Xapian::doccount maxitems;
+    Xapian::doccount check_at_least;
+
+    /// The matches found, in the order returned by the fragment.
+    vector<FragmentMatch> matches;
+
+    /// Statistics about the number of matches in the fragment.
+    Xapian::doccount matches_lower_bound;
+    Xapian::doccount matches_estimated;
+    Xapian::doccount matches_upper_bound;
+
+    FragmentSearchJob(const Xapian::Database & db_,
+		      unsigned frag_,
+		      unsigned frag_count_)
+	    : db(db_),
+	      frag(frag_),
+	      frag_count(frag_count_),
+	      enq(db),
+	      maxitems(0),
+	      check_at_least(0),
+	      matches_lower_bound(0),
+	      matches_estimated(0),
+	      matches_upper_bound(0)
+    {}
+
+    /** Set up the search, with the parameters of the overall search.
+     *
+     *  @param wanted The number of matches wanted from each fragment.
+     */
+    void setup(const Json::Value & search,
+	       const QueryBuilder & builder,
+	       const Xapian::Query & query,
+	       SearchOrder order,
+	       Xapian::doccount wanted,
+	       Xapian::doccount check_at_least_,
+	       double deadline,
+	       const SearchCancelCheck * cancel)
+    {
+	enq.set_query(query);
+	enq.set_weighting_scheme(Xapian::BoolWeight());
+	check_at_least = check_at_least_;
+	add_info_handlers(search, builder, enq, db, info_handlers,
+			  check_at_least);
+	enq.set_docid_order(enq.DONT_CARE);
+	(void) parse_order_by(search, builder, sorter, false);
+	set_search_order(enq, order, sorter.get());
+	maxitems = min(wanted, db.get_doccount());
+	if (deadline != 0.0 || cancel != NULL) {
+	    decider.reset(new SearchLimitDecider(deadline, cancel));
+	}
+    }
+
+    void run() {
+	Xapian::MSet mset = enq.get_mset(0, maxitems, check_at_least, NULL,
+					 decider.get());
+	matches_lower_bound = mset.get_matches_lower_bound();
+	matches_estimated = mset.get_matches_estimated();
+	matches_upper_bound = mset.get_matches_upper_bound();
+	matches.reserve(mset.size());
+	for (Xapian::MSetIterator i = mset.begin(); i != mset.end(); ++i) {
+	    FragmentMatch match;
+	    match.weight = i.get_weight();
+	    if (sorter.get() != NULL) {
+		match.key = (*sorter)(i.get_document());
+	    }
+	    match.did = (*i - 1) * frag_count + frag + 1;
+	    match.frag = frag;
+	    match.frag_did = *i;
+	    matches.push_back(match);
+	}
+    }
+};
+
+/** The jobs of a parallel search, which are deleted when this goes out of
+ *  scope.
+ */
+struct FragmentSearchJobs {
+    vector<FragmentSearchJob *> jobs;
+
+    ~FragmentSearchJobs() {
+	for (vector<FragmentSearchJob *>::iterator i = jobs.begin();
+	     i != jobs.end(); ++i) {
+	    delete *i;
+	}
+    }
+};
+
+bool
+Collection::perform_parallel_search(const Json::Value & search,
+				    const QueryBuilder & builder,
+				    const Xapian::Query & query,
+				    Xapian::doccount total_docs,
+				    Xapian::doccount from,
+				    Xapian::doccount size,
+				    Xapian::doccount check_at_least,
+				    Json::Value & results,
+				    double deadline,
+				    const SearchCancelCheck * cancel) const
+{
+    if (match_pool == NULL || match_pool->size() == 0) {
+	return false;
+    }
+    vector<Xapian::Database> dbs;
+    group.get_fragment_dbs(dbs);
+    if (dbs.size() < 2) {
+	return false;
+    }
+
+    // Parse the ordering and info handlers against the whole group, to
+    // check the parameters and to get handlers to merge the information
+    // from each fragment into.
+    Xapian::Database db(get_db());
+    Xapian::Enquire enq(db);
+    InfoHandlers info_handlers;
+    Xapian::doccount fragment_check_at_least = check_at_least;
+    add_info_handlers(search, builder, enq, db, info_handlers,
+		      check_at_least);
+    auto_ptr<MultiValueKeyMaker> sorter;
+    SearchOrder order = parse_order_by(search, builder, sorter, true);
+
+    // Each fragment might hold all the matches on the requested page.
+    Xapian::doccount wanted = from + size;
+    if (wanted < from) {
+	wanted = Xapian::doccount(-1);
+    }
+
+    FragmentSearchJobs jobs;
+    vector<WorkJob *> work;
+    for (unsigned frag = 0; frag != dbs.size(); ++frag) {
+	FragmentSearchJob * job = new FragmentSearchJob(dbs[frag], frag,
+							dbs.size());
+	jobs.jobs.push_back(job);
+	work.push_back(job);
+	job->setup(search, builder, query, order, wanted,
+		   fragment_check_at_least, deadline, cancel);
+    }
+
+    if (!match_pool->run_jobs(work)) {
+	// Search serially instead, so that the error is reported normally.
+	return false;
+    }
+
+    vector<FragmentMatch> matches;
+    Xapian::doccount matches_lower_bound = 0;
+    Xapian::doccount matches_estimated = 0;
+    Xapian::doccount matches_upper_bound = 0;
+    bool timed_out = false;
+    for (vector<FragmentSearchJob *>::const_iterator i = jobs.jobs.begin();
+	 i != jobs.jobs.end(); ++i) {
+	const FragmentSearchJob & job = **i;
+	if (job.decider.get() != NULL) {
+	    if (job.decider->was_cancelled()) {
+		// Nobody wants the results, so don't spend time building them.
+		return true;
+	    }
+	    if (job.decider->has_expired()) {
+		timed_out = true;
+	    }
+	}
+	matches_lower_bound += job.matches_lower_bound;
+	matches_estimated += job.matches_estimated;
+	matches_upper_bound += job.matches_upper_bound;
+	matches.insert(matches.end(), job.matches.begin(), job.matches.end());
+	info_handlers.merge(job.info_handlers);
+    }
+
+    Xapian::doccount end = min(wanted, Xapian::doccount(matches.size()));
+    partial_sort(matches.begin(), matches.begin() + end, matches.end(),
+		 FragmentMatchOrder(order));
+
+    // Write the results
+    info_handlers.write_results(results, Xapian::MSet());
+    results["total_docs"] = total_docs;
+    results["from"] = from;
+    results["size_requested"] = size;
+    results["check_at_least"] = check_at_least;
+    results["matches_lower_bound"] = matches_lower_bound;
+    results["matches_estimated"] = matches_estimated;
+    results["matches_upper_bound"] = matches_upper_bound;
+    if (timed_out) {
+	// The results (and the statistics) are incomplete.
+	results["timed_out"] = true;
+    }
+    if (json_get_bool(search, "verbose", false)) {
+	write_query_description(results, query);
+    }
+
+    const Json::Value & fieldlist = search["display"];
+    Json::Value & items = results["items"] = Json::arrayValue;
+    for (Xapian::doccount i = from; i < end; ++i) {
+	const FragmentMatch & match = matches[i];
+	Json::Value tmp;
+	get_display_doc(dbs[match.frag].get_document(match.frag_did),
+			fieldlist, tmp);
+	items.append(tmp);
+    }
+    return true;
+}
+
 void
 Collection::perform_search(const Json::Value & search,
 			   const string & doc_type,
-			   Json::Value & results) const
+			   Json::Value & results,
+			   SearchResultsSink * sink,
+			   double deadline,
+			   const SearchCancelCheck * cancel,
+			   const CompiledQuery * compiled) const
 {
     if (!group.is_open()) {
 	throw InvalidStateError("Collection must be open to perform search");
@@ -597,9 +1343,22 @@ Collection::perform_search(const Json::Value & search,
 	builder = auto_ptr<QueryBuilder>(
 		new DocumentTypeQueryBuilder(config, doc_type));
     }
+    builder->set_filter_cache(&filter_cache);
 
     results = Json::objectValue;
-    Xapian::Query query(builder->build(search["query"]));
+    Xapian::Query query;
+    if (compiled == NULL) {
+	query = builder->build(search["query"]);
+    } else if (compiled->is_built) {
+	query = builder->restrict(compiled->built);
+    } else {
+	builder->set_subqueries(compiled->subqueries);
+	Xapian::Query unrestricted(builder->build_query(compiled->query));
+	// The subqueries belong to the plan, so don't let anything else the
+	// builder makes for this search pick them up.
+	builder->set_subqueries(NULL);
+	query = builder->restrict(unrestricted);
+    }
 
     Xapian::Database db(get_db());
 
@@ -663,107 +1422,63 @@ Collection::perform_search(const Json::Value & search,
 						Json::Value::maxUInt, 0);
     }
 
+    // Searches which page through the results from a given document, or
+    // which stream their results, are always matched serially.
+    bool streaming = (sink != NULL && size > SEARCH_PAGE_SIZE);
+    if (fromdoc_id.empty() && !streaming &&
+	perform_parallel_search(search, *builder, query, total_docs, from,
+				size, check_at_least, results, deadline,
+				cancel)) {
+	return;
+    }
+
     Xapian::Enquire enq(db);
     enq.set_query(query);
     enq.set_weighting_scheme(Xapian::BoolWeight());
 
     InfoHandlers info_handlers;
-    if (search.isMember("info")) {
-	const Json::Value & info = search["info"];
-	json_check_array(info, "list of info items to gather");
-	for (Json::Value::const_iterator i = info.begin();
-	     i != info.end(); ++i) {
-	    info_handlers.add_handler(*i, *(builder.get()),
-				      enq, &db, check_at_least);
-	}
-    }
+    add_info_handlers(search, *builder, enq, db, info_handlers,
+		      check_at_least);
 
     // Internal document IDs are not under the user's control, so set this
     // option for potential (though probably slight) performance increases.
     enq.set_docid_order(enq.DONT_CARE);
     auto_ptr<MultiValueKeyMaker> sorter;
-
     if (search.isMember("order_by")) {
-	const Json::Value & order_by = search["order_by"];
-	json_check_array(order_by, "list of ordering items");
-	bool score_first = false;
-	bool score_last = false;
-	for (unsigned i = 0; i != order_by.size(); ++i) {
-	    const Json::Value & order_by_item = order_by[i];
-	    json_check_object(order_by_item, "ordering item");
-
-	    if (order_by_item.isMember("field")) {
-		// Order by a field.  The field must have a slot associated with
-		// it, holding the sortable values.
-		string fieldname = json_get_string_member(order_by_item, "field",
-							  string());
-
-		auto_ptr<SlotDecoder> decoder(builder->get_slot_decoder(fieldname));
-		// FIXME - make it obvious why the sorting didn't happen; this
-		// shouldn't be an error, because it could just be that no
-		// documents have yet been indexed with the given field, but it
-		// should be reflected in the search results somehow (possibly only
-		// in an explain view).
-
-		if (decoder.get() != NULL) {
-		    if (sorter.get() == NULL) {
-			sorter = auto_ptr<MultiValueKeyMaker>(new MultiValueKeyMaker());
-		    }
-
-		    bool ascending = json_get_bool(order_by_item, "ascending", true);
-		    sorter->add_decoder(decoder.release(), !ascending);
-		} else {
-		    LOG_WARN("Unable to apply requested sort by \"" +
-			     fieldname + "\" - no field config found.");
-		}
-	    } else if (order_by_item.isMember("score")) {
-		// Order by the weights calculated in the query tree.
-		if (order_by_item["score"] != "weight") {
-		    throw InvalidValueError("Invalid score specification (only "
-					    "allowed value is \"weight\")");
-		}
-		if (json_get_bool(order_by_item, "ascending", false)) {
-		    throw InvalidValueError("Ascending order is not allowed when "
-					    "ordering by weight");
-		}
-		if (i == 0) {
-		    score_first = true;
-		} else if (i + 1 == order_by.size()) {
-		    score_last = true;
-		} else {
-		    throw InvalidValueError("Sorting by score is only allowed "
-					    "as the first or last sorting "
-					    "condition (was " + str(i) + " of "
-					    + str(order_by.size()) + ")");
-		}
-	    } else {
-		throw InvalidValueError("Invalid order_by item - neither contains "
-					"\"field\" or \"score\" member");
-	    }
-	}
-	if (score_first && score_last) {
-	    throw InvalidValueError("Sorting condition list may only contain "
-				    "sorting by score once.");
-	}
-	if (sorter.get() == NULL) {
-	    enq.set_sort_by_relevance();
-	} else {
-	    if (score_first) {
-		enq.set_sort_by_relevance_then_key(sorter.get(), false);
-	    } else if (score_last) {
-		enq.set_sort_by_key_then_relevance(sorter.get(), false);
-	    } else {
-		enq.set_sort_by_key(sorter.get(), false);
-	    }
-	}
+	set_search_order(enq, parse_order_by(search, *builder, sorter, true),
+			 sorter.get());
+    }
+
+    auto_ptr<SearchLimitDecider> decider;
+    if (deadline != 0.0 || cancel != NULL) {
+	decider.reset(new SearchLimitDecider(deadline, cancel));
     }
 
     if (!fromdoc_id.empty()) {
 	from = calc_fromdoc_offset(db, enq, fromdoc_type, fromdoc_id,
 				   fromdoc_pagesize, fromdoc_from,
-				   check_at_least);
+				   check_at_least, decider.get());
+    }
+    Xapian::MSet mset;
+    if (streaming) {
+	// Get the first page.  Xapian always checks at least as many
+	// documents as are requested, so check as many as a single call
+	// would have, to get the same statistics and info results.
+	Xapian::doccount dbsize = db.get_doccount();
+	Xapian::doccount wanted = 0;
+	if (from < dbsize) {
+	    wanted = min(size, dbsize - from);
+	}
+	mset = enq.get_mset(from, SEARCH_PAGE_SIZE,
+			    max(check_at_least, from + wanted),
+			    NULL, decider.get());
+    } else {
+	mset = enq.get_mset(from, size, check_at_least, NULL, decider.get());
+    }
+    if (decider.get() != NULL && decider->was_cancelled()) {
+	// Nobody wants the results, so don't spend time building them.
+	return;
     }
-    Xapian::MSet mset(enq.get_mset(from, size, check_at_least));
 
     // Write the results
     info_handlers.write_results(results, mset);
@@ -774,25 +1489,123 @@ Collection::perform_search(const Json::Value & search,
     results["matches_lower_bound"] = mset.get_matches_lower_bound();
     results["matches_estimated"] = mset.get_matches_estimated();
     results["matches_upper_bound"] = mset.get_matches_upper_bound();
-    Json::Value & items = results["items"] = Json::arrayValue;
-    for (Xapian::MSetIterator i = mset.begin(); i != mset.end(); ++i) {
-	Xapian::Document doc(i.get_document());
-	DocumentData docdata;
-	docdata.unserialise(doc.get_data());
-	Json::Value tmp;
-	items.append(docdata.to_display(fieldlist, tmp));
+    if (decider.get() != NULL && decider->has_expired()) {
+	// The results (and the statistics) are incomplete.
+	results["timed_out"] = true;
     }
     if (verbose) {
 	// Give debugging details about the search executed.
-	// Note - we can't just include query.get_description() in the output,
-	// because this isn't always a valid unicode string, so we escape it
-	// with hexesc.
-	results["query_description"] = hexesc(query.get_description());
+	write_query_description(results, query);
+    }
+
+    if (!streaming) {
+	Json::Value & items = results["items"] = Json::arrayValue;
+	for (Xapian::MSetIterator i = mset.begin(); i != mset.end(); ++i) {
+	    Json::Value tmp;
+	    get_display_item(i, fieldlist, tmp);
+	    items.append(tmp);
+	}
+	return;
+    }
+
+    if (!sink->start(results)) {
+	return;
+    }
+    results = Json::objectValue;
+
+    // The info handlers have their results already; don't make them
+    // gather them again for the remaining pages.
+    enq.clear_matchspies();
+
+    Xapian::doccount remaining = size;
+    Xapian::doccount page_from = from;
+    bool timed_out = false;
+    while (true) {
+	for (Xapian::MSetIterator i = mset.begin();
+	     i != mset.end() && remaining != 0; ++i) {
+	    Json::Value tmp;
+	    get_display_item(i, fieldlist, tmp);
+	    if (!sink->add_item(tmp)) {
+		return;
+	    }
+	    --remaining;
+	}
+	if (remaining == 0 || mset.size() < SEARCH_PAGE_SIZE) {
+	    break;
+	}
+	if (deadline != 0.0 && RealTime::now() >= deadline) {
+	    timed_out = true;
+	    break;
+	}
+	if (cancel != NULL && cancel->is_cancelled()) {
+	    return;
+	}
+	page_from += SEARCH_PAGE_SIZE;
+	mset = enq.get_mset(page_from, min(remaining, SEARCH_PAGE_SIZE),
+			    0, NULL, decider.get());
+    }
+    if (decider.get() != NULL && decider->has_expired()) {
+	timed_out = true;
+    }
+    sink->finish(timed_out);
+}
+
+double
+Collection::estimate_search_cost(const Json::Value & search,
+				 const string & doc_type,
+				 CompiledQuery * compiled) const
+{
+    if (!group.is_open()) {
+	throw InvalidStateError("Collection must be open to perform search");
+    }
+
+    auto_ptr<QueryBuilder> builder;
+    if (doc_type.empty()) {
+	builder = auto_ptr<QueryBuilder>(new CollectionQueryBuilder(config));
+    } else {
+	builder = auto_ptr<QueryBuilder>(
+		new DocumentTypeQueryBuilder(config, doc_type));
+    }
+
+    Xapian::Database db(get_db());
+    Xapian::doccount candidates;
+    if (compiled == NULL) {
+	candidates = builder->estimate_candidates(search["query"], db);
+    } else {
+	if (!compiled->is_built) {
+	    builder->set_subqueries(compiled->subqueries);
+	    compiled->built = builder->build_query(compiled->query);
+	    compiled->is_built = true;
+	}
+	candidates = builder->estimate_candidates(compiled->built, db);
+    }
+
+    // Unless the results are sorted, or a minimum number of documents to
+    // check was requested, the matcher can stop once it has found enough
+    // matches.
+    double examined = candidates;
+    if (!search.isMember("order_by") && search["check_at_least"] != -1) {
+	double wanted;
+	if (search["size"] == -1) {
+	    wanted = candidates;
+	} else {
+	    wanted = json_get_uint64_member(search, "from",
+					    Json::Value::maxUInt, 0);
+	    wanted += json_get_uint64_member(search, "size",
+					     Json::Value::maxUInt, 10);
+	}
+	wanted = max(wanted, double(json_get_uint64_member(
+		search, "check_at_least", Json::Value::maxUInt, 0)));
+	examined = min(examined, wanted);
+    }
 
-	// Also include the serialised form, since this can be usefully
-	// unserialised to build testcases to demonstrate problems.
-	results["query_serialised"] = hexesc(query.serialise());
+    // Each info item (eg, a facet count) does some work for every document
+    // examined.
+    const Json::Value & info = search["info"];
+    if (info.isArray()) {
+	examined *= 1 + info.size();
     }
+    return examined;
 }
 
 void
@@ -29,16 +29,117 @@
 #include "jsonmanip/mapping.h"
 #include "jsonxapian/collconfig.h"
 #include "ngramcat/categoriser.h"
+#include "postingsources/filter_bitmap_source.h"
 #include "schema.h"
 #include <string>
 #include "utils/safe_inttypes.h"
+#include "utils/threading.h"
+#include <vector>
 #include <xapian.h>
 
 class TaskManager;
+class WorkPool;
 
 namespace RestPose {
 
+struct CompiledQuery;
 struct Pipe;
+class QueryBuilder;
+class SearchTemplate;
+class SearchTemplatePlan;
+
+/** Receiver for the results of a search which are returned incrementally.
+ *
+ *  Used by Collection::perform_search() for large result sets, so that the
+ *  matching items needn't all be held in memory at once.
+ */
+class SearchResultsSink {
+  public:
+    virtual ~SearchResultsSink();
+
+    /** Start receiving results.
+     *
+     *  Called once, with all the parts of the results except the "items"
+     *  member.
+     *
+     *  @returns false if the search should be abandoned.
+     */
+    virtual bool start(const Json::Value & results) = 0;
+
+    /** Receive the next matching item.
+     *
+     *  @returns false if the search should be abandoned.
+     */
+    virtual bool add_item(const Json::Value & item) = 0;
+
+    /** Called after the last item has been received.
+     *
+     *  @param timed_out True if the search deadline passed before all the
+     *  requested items had been retrieved.
+     */
+    virtual void finish(bool timed_out) = 0;
+};
+
+/** Check used by Collection::perform_search() to find out whether the
+ *  results of a search are still wanted.
+ */
+class SearchCancelCheck {
+  public:
+    virtual ~SearchCancelCheck();
+
+    /** Return true if the search should be abandoned.
+     *
+     *  May be called frequently, so should be cheap.
+     */
+    virtual bool is_cancelled() const = 0;
+};
+
+/** A count of the changes committed to a collection.
+ *
+ *  Shared by the Collection objects for a collection, so that readers can
+ *  tell whether anything has changed since they were opened.
+ */
+class CommitGeneration {
+    mutable Mutex mutex;
+    uint64_t generation;
+
+    CommitGeneration(const CommitGeneration &);
+    void operator=(const CommitGeneration &);
+  public:
+    CommitGeneration() : generation(0) {}
+
+    /** Get the current generation.
+     */
+    uint64_t get() const {
+	ContextLocker lock(mutex);
+	return generation;
+    }
+
+    /** Move to a new generation.
+     *
+     *  Called after changes are committed, so that readers see the changes
+     *  when they reopen.
+     */
+    void bump() {
+	ContextLocker lock(mutex);
+	++generation;
+    }
+};
+
+/** Something waiting for changes made to a collection to be committed.
+ */
+class CommitWaiter {
+  public:
+    virtual ~CommitWaiter();
+
+    /** Called once the changes have been committed.
+     */
+    virtual void committed() = 0;
+
+    /** Called if the changes couldn't be committed.
+     */
+    virtual void commit_failed(const std::string & msg) = 0;
+};
 
 class Collection {
     /** The configuration used for this collection.
@@ -53,6 +154,79 @@ class Collection {
 
     RestPose::DbGroup group;
 
+    /** Pool of threads used to match searches against each database fragment
+     *  in parallel, or NULL to match them serially.
+     */
+    WorkPool * match_pool;
+
+    /** Cache of the documents matching frequently used filters, while the
+     *  collection is open for reading.
+     */
+    mutable FilterBitmapCache filter_cache;
+
+    /** The commit generation of the collection, or NULL if not tracked.
+     */
+    CommitGeneration * generation;
+
+    /** The commit generation when the collection was last opened for
+     *  reading.
+     */
+    uint64_t opened_generation;
+
+    /** Mutex protecting the commit policy and the record of uncommitted
+     *  changes, which are shared by the threads writing to the collection.
+     */
+    mutable Mutex pending_mutex;
+
+    /** A copy of the commit policy from the config, which may be read
+     *  while the config is being changed.
+     */
+    CommitPolicy commit_policy;
+
+    /// Number of documents changed since the last commit.
+    uint64_t pending_docs;
+
+    /// Approximate size of the changes made since the last commit.
+    uint64_t pending_bytes;
+
+    /// Time of the first change since the last commit, or 0 if none.
+    double first_pending_time;
+
+    /// Waiters for the next commit (owned by the collection).
+    std::vector<CommitWaiter *> commit_waiters;
+
+    /** Time at which the first of the commit waiters which is in a hurry
+     *  was added, or 0 if none are.
+     */
+    double first_waiter_time;
+
+    /** Record a change made to the collection.
+     */
+    void note_change(uint64_t bytes);
+
+    /** Forget the changes made since the last commit.
+     *
+     *  Called just before committing; changes made while the commit is in
+     *  progress may be recorded again, causing an unneeded commit later, but
+     *  are never missed.
+     */
+    void clear_pending();
+
+    /** Update the copy of the commit policy from the config.
+     */
+    void update_commit_policy();
+
+    /** Commit the changes made to the group, and tell readers and waiters
+     *  about them.
+     */
+    void sync_changes();
+
+    /** Drop any cached filters, since the collection has been reopened.
+     *
+     *  Filters are only cached while the collection is open for reading.
+     */
+    void reset_filter_cache();
+
     /** Get a database object.
      *
      *  Will return a reference to whichever of wrdb or rodb is open,
@@ -87,6 +261,24 @@ class Collection {
 				    const Taxonomy & taxonomy,
 				    const Categories & modified);
 
+    /** Perform a search by matching each database fragment in parallel on
+     *  the match pool, and merging the results.
+     *
+     *  The parameters are as for perform_search(), after parsing.  Returns
+     *  false, without modifying results, if the search should be performed
+     *  serially instead.
+     */
+    bool perform_parallel_search(const Json::Value & search,
+				 const QueryBuilder & builder,
+				 const Xapian::Query & query,
+				 Xapian::doccount total_docs,
+				 Xapian::doccount from,
+				 Xapian::doccount size,
+				 Xapian::doccount check_at_least,
+				 Json::Value & results,
+				 double deadline,
+				 const SearchCancelCheck * cancel) const;
+
     /// Copying not allowed.
     Collection(const Collection &);
     /// Assignment not allowed.
@@ -123,9 +315,37 @@ class Collection {
      */
     void open_readonly();
 
+    /** Open the collection for reading, unless it's already open for
+     *  reading and no changes have been committed since then.
+     *
+     *  Always reopens the collection if no commit generation has been set.
+     */
+    void refresh_readonly();
+
+    /** Set the commit generation used to track changes to the collection.
+     *
+     *  The generation is not owned by the collection.  Collection objects
+     *  for the same collection which share a generation see each other's
+     *  commits.
+     */
+    void set_generation(CommitGeneration * generation_) {
+	generation = generation_;
+    }
+
+    /** Get the commit generation when the collection was last opened for
+     *  reading.
+     *
+     *  The collection holds at least the changes committed up to this
+     *  generation.
+     */
+    uint64_t get_opened_generation() const {
+	return opened_generation;
+    }
+
     /** Close the collection.
      */
     void close() {
+	filter_cache.clear();
 	group.close();
     }
 
@@ -227,6 +447,23 @@ class Collection {
 				const std::string & child_name,
 				const std::string & parent_name);
 
+    /** Set a search template.
+     *
+     *  Takes a copy of the supplied template.
+     */
+    void set_search_template(const std::string & template_name,
+			     const SearchTemplate & tmpl);
+
+    /** Get the compiled plan for a search template.
+     *
+     *  Raises an exception if the template is not known.
+     *
+     *  The returned reference is invalid after modifications have been made
+     *  to the collection's configuration.
+     */
+    const SearchTemplatePlan &
+	    get_search_plan(const std::string & template_name,
+			    const std::string & doc_type) const;
 
     /** Convert the collection configuration to JSON.
      *
@@ -278,7 +515,96 @@ class Collection {
 				 std::string & idterm,
 				 bool & new_fields);
 
+    /** Set the number of write partitions to split new documents between.
+     *
+     *  See DbGroup for details.
+     */
+    void set_write_partitions(unsigned int partitions) {
+	group.set_partitions(partitions);
+    }
+
+    /** Set the pool of threads used to match searches in parallel.
+     *
+     *  If NULL (the default), or the collection has only one database
+     *  fragment, searches are matched serially by the calling thread.
+     */
+    void set_match_pool(WorkPool * match_pool_) {
+	match_pool = match_pool_;
+    }
+
+    /** Set the maximum memory used to cache frequently used filters.
+     *
+     *  While the collection is open for reading, the documents matching
+     *  filters used in searches (the type of document searched for, and
+     *  the filters of "filter" queries) are cached once the filters have
+     *  been used a few times, until the collection is next reopened.  0
+     *  (the default) disables the cache.  Applies from the next reopen.
+     */
+    void set_filter_cache_size(size_t max_bytes) {
+	filter_cache.set_max_bytes(max_bytes);
+    }
+
+    /** Check if the database fragments should be merged.
+     *
+     *  See DbGroup for details of merging; the methods below wrap the
+     *  corresponding DbGroup methods.
+     */
+    bool needs_merge() {
+	return group.needs_merge();
+    }
+
+    /** Prepare a merge of database fragments, in the background.
+     */
+    bool prepare_merge(DbGroupMerge & merge) {
+	return group.prepare_merge(merge);
+    }
+
+    /** Complete a prepared merge.
+     *
+     *  Waits for other changes in progress to finish.  The merge becomes
+     *  visible to readers when the collection is next committed.
+     */
+    bool complete_merge(const DbGroupMerge & merge) {
+	return group.complete_merge(merge);
+    }
+
+    /** Abandon a prepared merge.
+     */
+    void abandon_merge(const DbGroupMerge & merge) {
+	group.abandon_merge(merge);
+    }
+
+    /** Prepare to load documents into the collection in bulk.
+     *
+     *  See DbGroup for details of bulk loading; the methods below wrap the
+     *  corresponding DbGroup methods.
+     */
+    void prepare_load(DbGroupLoad & load, unsigned count) {
+	group.prepare_load(load, count);
+    }
+
+    /** Complete a bulk load, making the loaded documents visible.
+     *
+     *  Also commits any changes made to the configuration.
+     */
+    void complete_load(const DbGroupLoad & load) {
+	group.complete_load(load);
+	if (generation != NULL) {
+	    generation->bump();
+	}
+    }
+
+    /** Abandon a bulk load.
+     */
+    void abandon_load(const DbGroupLoad & load) {
+	group.abandon_load(load);
+    }
+
     /** Update (or add) a Xapian document, given its unique id term.
+     *
+     *  raw_update_doc(), raw_delete_doc() and commit() may be called by
+     *  several threads at once, as long as no two threads modify the same
+     *  document at once.
      */
     void raw_update_doc(const Xapian::Document & doc,
 			const std::string & idterm);
@@ -291,15 +617,93 @@ class Collection {
      */
     void commit();
 
+    /** Get the policy for committing changes to the collection.
+     */
+    CommitPolicy get_commit_policy() const;
+
+    /** Get the time by which the pending changes must be committed.
+     *
+     *  If anything is waiting for a commit, this is the time at which the
+     *  first waiter was added, so that the changes are committed as soon as
+     *  there are no more changes ready to be made.
+     *
+     *  Returns 0 if there are no pending changes, or the commit policy
+     *  doesn't limit how long changes may remain uncommitted.
+     */
+    double get_commit_deadline() const;
+
+    /** Add a waiter to be notified when the changes made so far have been
+     *  committed.
+     *
+     *  Takes ownership of the waiter.  All the waiters are notified by the
+     *  next commit, so clients waiting for their changes share a commit.
+     *
+     *  @param hurry If true, the waiter causes a commit soon (after the
+     *  commit policy's ack_latency).  Otherwise, it waits for the next
+     *  commit made for some other reason.
+     */
+    void add_commit_waiter(CommitWaiter * waiter, bool hurry = true);
+
+    /** Commit the pending changes, if the commit policy says they're due,
+     *  or something has been waiting for a commit for long enough.
+     *
+     *  If several threads call this at once, only one of them commits.
+     *
+     *  @returns true if a commit was performed.
+     */
+    bool commit_if_due();
+
+    /** Make all changes to the collection available for searching.
+     *
+     *  If the collection is open for writing, commits the pending changes.
+     *  Otherwise, reopens the collection to read the latest committed
+     *  changes.
+     */
+    void refresh();
+
     /** Get the total number of documents.
      */
     uint64_t doc_count() const;
 
     /** Perform a search, within a particular document type.
+     *
+     *  @param sink If not NULL, and more results are requested than fit in
+     *  a single page, the results are retrieved a page at a time and passed
+     *  to sink (if sink->start() is called, nothing is stored in results).
+     *
+     *  @param deadline If not 0.0, the time (as returned by RealTime::now())
+     *  at which to stop looking for matches.  If the deadline passes, the
+     *  results found so far are returned, with "timed_out" set to true.
+     *
+     *  @param cancel If not NULL, checked periodically while matching and
+     *  between pages of results.  If the search is cancelled, it returns
+     *  early, leaving results (and sink) incomplete.
+     *
+     *  @param compiled If not NULL, the query to match, with some parts
+     *  built in advance (from a search template); search["query"] must be
+     *  the same query without any parts built in advance.
      */
     void perform_search(const Json::Value & search,
 			const std::string & doc_type,
-			Json::Value & results) const;
+			Json::Value & results,
+			SearchResultsSink * sink = NULL,
+			double deadline = 0.0,
+			const SearchCancelCheck * cancel = NULL,
+			const CompiledQuery * compiled = NULL) const;
+
+    /** Estimate the cost of performing a search.
+     *
+     *  The cost is an estimate of the number of documents which the search
+     *  will examine, scaled up for each item of information to be gathered.
+     *  It's based on the frequencies of the terms in the query and the
+     *  search parameters, without running the matcher.
+     *
+     *  @param compiled As for perform_search().  The query built from it
+     *  is stored in it, for a following perform_search() to use.
+     */
+    double estimate_search_cost(const Json::Value & search,
+				const std::string & doc_type,
+				CompiledQuery * compiled = NULL) const;
 
     /** Get a set of stored fields from a Xapian document.
      */
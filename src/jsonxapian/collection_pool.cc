@@ -42,7 +42,10 @@ using namespace RestPose;
 
 CollectionPool::CollectionPool(const string & datadir_)
 	: datadir(datadir_),
-	  max_cached_readers_per_collection(5)
+	  max_cached_readers_per_collection(5),
+	  write_partitions(1),
+	  match_pool(NULL),
+	  filter_cache_size(0)
 {
     if (!string_endswith(datadir, DIR_SEPARATOR)) {
 	datadir += DIR_SEPARATOR;
@@ -69,6 +72,34 @@ CollectionPool::~CollectionPool()
 	 i = writable.begin(); i != writable.end(); ++i) {
 	delete i->second;
     }
+    for (map<string, CommitGeneration *>::const_iterator
+	 i = generations.begin(); i != generations.end(); ++i) {
+	delete i->second;
+    }
+}
+
+CommitGeneration *
+CollectionPool::get_generation(const string & collection)
+{
+    map<string, CommitGeneration *>::iterator i = generations.find(collection);
+    if (i == generations.end()) {
+	auto_ptr<CommitGeneration> generation(new CommitGeneration);
+	i = generations.insert(make_pair(collection, generation.get())).first;
+	generation.release();
+    }
+    return i->second;
+}
+
+uint64_t
+CollectionPool::current_generation(const string & collection)
+{
+    ContextLocker lock(mutex);
+    map<string, CommitGeneration *>::const_iterator i
+	    = generations.find(collection);
+    if (i == generations.end()) {
+	return 0;
+    }
+    return i->second->get();
 }
 
 bool
@@ -109,14 +140,29 @@ CollectionPool::del(const std::string & coll_name)
 
     map<string, Collection *>::iterator j = writable.find(coll_name);
     if (j != writable.end()) {
-	delete j->second;
+	Collection * coll = j->second;
 	writable.erase(j);
+	if (writable_users.find(coll) == writable_users.end()) {
+	    delete coll;
+	} else {
+	    // Still in use - close it so that users know to release it.  It
+	    // will be deleted when the last user releases it.
+	    coll->close();
+	}
     }
 
     string topdir = datadir + coll_name;
     if (dir_exists(topdir)) {
 	rmdir_recursive(topdir);
     }
+
+    // Move to a new generation, so that nothing cached from the deleted
+    // collection is mistaken for a collection of the same name created
+    // later.
+    map<string, CommitGeneration *>::iterator k = generations.find(coll_name);
+    if (k != generations.end()) {
+	k->second->bump();
+    }
 }
 
 Collection *
@@ -133,7 +179,10 @@ CollectionPool::get_readonly(const string & collection)
 	result = auto_ptr<Collection>(i->second.back());
 	i->second.pop_back();
     }
-    result->open_readonly();
+    result->set_match_pool(match_pool);
+    result->set_filter_cache_size(filter_cache_size);
+    result->set_generation(get_generation(collection));
+    result->refresh_readonly();
 
     // Add collection to readonly_in_use
     i = readonly_in_use.find(collection);
@@ -154,19 +203,42 @@ CollectionPool::get_readonly(const string & collection)
 Collection *
 CollectionPool::get_writable(const string & collection)
 {
-    auto_ptr<Collection> result;
     map<string, Collection *>::iterator i;
     ContextLocker lock(mutex);
     i = writable.find(collection);
-    if (i == writable.end() || i->second == NULL) {
-	result = auto_ptr<Collection>(
+    if (i == writable.end()) {
+	auto_ptr<Collection> result(
 		new Collection(collection, datadir + collection));
-    } else {
-	result = auto_ptr<Collection>(i->second);
-	i->second = NULL;
+	result->set_write_partitions(write_partitions);
+	result->set_match_pool(match_pool);
+	result->set_generation(get_generation(collection));
+	result->open_writable();
+	i = writable.insert(make_pair(collection, result.get())).first;
+	result.release();
     }
-    result->open_writable();
-    return result.release();
+    ++writable_users[i->second];
+    return i->second;
+}
+
+void
+CollectionPool::set_write_partitions(unsigned int write_partitions_)
+{
+    ContextLocker lock(mutex);
+    write_partitions = write_partitions_;
+}
+
+void
+CollectionPool::set_match_pool(WorkPool * match_pool_)
+{
+    ContextLocker lock(mutex);
+    match_pool = match_pool_;
+}
+
+void
+CollectionPool::set_filter_cache_size(size_t filter_cache_size_)
+{
+    ContextLocker lock(mutex);
+    filter_cache_size = filter_cache_size_;
 }
 
 void
@@ -175,21 +247,30 @@ CollectionPool::release(Collection * collection)
     if (collection == NULL) {
 	return;
     }
-    auto_ptr<Collection> collptr(collection);
-
     ContextLocker lock(mutex);
+    map<Collection *, size_t>::iterator users = writable_users.find(collection);
+    if (users != writable_users.end()) {
+	if (--(users->second) == 0) {
+	    writable_users.erase(users);
+	    map<string, Collection *>::iterator i =
+		    writable.find(collection->get_name());
+	    if (i == writable.end() || i->second != collection) {
+		// The collection has been deleted.
+		delete collection;
+	    }
+	}
+	return;
+    }
+
+    auto_ptr<Collection> collptr(collection);
     if (collection->is_writable()) {
 	pair<map<string, Collection *>::iterator, bool> ret;
 	pair<string, Collection *> item(collection->get_name(), NULL);
 	ret = writable.insert(item);
 	if (ret.second) {
-	    // New element was inserted
+	    // A writable collection which didn't come from the pool, and
+	    // there's no writable collection in the pool for it - keep it.
 	    ret.first->second = collptr.release();
-	} else {
-	    // ret.first points to an existing element.
-	    if (ret.first->second == NULL) {
-		ret.first->second = collptr.release();
-	    }
 	}
     } else {
 	// Check if collection is in list of valid in-use collections.
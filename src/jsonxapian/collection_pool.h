@@ -25,15 +25,17 @@
 #define RESTPOSE_INCLUDED_COLLECTION_POOL_H
 
 #include "jsonxapian/collection.h"
+#include <map>
 #include <string>
 #include "utils/threading.h"
 #include <vector>
 
 /** A pool of Collection objects.
  *
- *  Collection objects can be accessed only by a single thread at a time.  The
- *  pool maintains a set of objects ready to be used by a thread, and returned
- *  to the pool after use.
+ *  Collection objects can be accessed only by a single thread at a time
+ *  (except for the modifications which Collection allows to be made by
+ *  several threads at once).  The pool maintains a set of objects ready to be
+ *  used by a thread, and returned to the pool after use.
  */
 class CollectionPool {
     /** Mutex obtained by all public methods.
@@ -69,6 +71,42 @@ class CollectionPool {
      */
     std::map<std::string, RestPose::Collection *> writable;
 
+    /** The number of callers using each writable collection.
+     *
+     *  This may include collections which have been deleted, and so are no
+     *  longer in writable; these are deleted when the last caller releases
+     *  them.
+     */
+    std::map<RestPose::Collection *, size_t> writable_users;
+
+    /** The number of write partitions to use for writable collections.
+     */
+    unsigned int write_partitions;
+
+    /** The pool of threads used to match searches in parallel, or NULL.
+     */
+    WorkPool * match_pool;
+
+    /** The maximum memory used by each readonly collection to cache
+     *  frequently used filters.
+     */
+    size_t filter_cache_size;
+
+    /** The commit generation of each collection, keyed by collection name.
+     *
+     *  Shared by the readonly and writable collection objects, so that
+     *  cached readers are only reopened when changes have been committed.
+     *  Entries are kept until the pool is destroyed, since collection
+     *  objects which are still in use may refer to them.
+     */
+    std::map<std::string, RestPose::CommitGeneration *> generations;
+
+    /** Get the commit generation for a collection, creating it if needed.
+     *
+     *  The mutex must be held by the caller.
+     */
+    RestPose::CommitGeneration * get_generation(const std::string & collection);
+
     /** No copying */
     CollectionPool(const CollectionPool &);
     /** No assignment */
@@ -78,6 +116,21 @@ class CollectionPool {
     CollectionPool(const std::string & datadir_);
     ~CollectionPool();
 
+    /** Get the directory holding the collections.
+     *
+     *  This always ends with a directory separator.
+     */
+    const std::string & get_datadir() const {
+	return datadir;
+    }
+
+    /** Get the current commit generation of a collection.
+     *
+     *  Returns 0 if no collection objects have been opened for the
+     *  collection yet.
+     */
+    uint64_t current_generation(const std::string & collection);
+
     /** Check if a collection exists.
      *
      *  This doesn't attempt to open the collection - it just checks if it
@@ -87,7 +140,8 @@ class CollectionPool {
 
     /** Delete the named collection.
      *
-     *  Any writable handles should be released back to the pool before this call is made.
+     *  Writable handles on the collection which are still in use are closed,
+     *  and are deleted when they're released back to the pool.
      *
      *  Searches in progress may be interrupted by this call.
      */
@@ -96,17 +150,49 @@ class CollectionPool {
     /** Get a pointer to a collection, opened for reading, by collection name.
      *
      *  The returned pointer will never be NULL, and ownership of the pointer
-     *  passes to the caller.
+     *  passes to the caller.  Cached collection objects are reused without
+     *  being reopened if no changes have been committed to the collection
+     *  since they were last opened.
      */
     RestPose::Collection * get_readonly(const std::string & collection);
 
     /** Get a pointer to a collection, opened for writing, by collection name.
      *
-     *  May return NULL, if the collection is already owned for writing by a
-     *  separate caller.  Ownership of the pointer passes to the caller.
+     *  There is only one writable collection object for each collection, so
+     *  this returns the same object to each caller until it's deleted.  The
+     *  caller must release it back to the pool after use, and may only use
+     *  it for modifications which Collection allows to be made by several
+     *  threads at once, unless the caller knows that there are no other
+     *  users.
+     *
+     *  If the collection is deleted, the object is closed, so callers
+     *  holding it on to it should check that it is still writable.
      */
     RestPose::Collection * get_writable(const std::string & collection);
 
+    /** Set the number of write partitions to use for writable collections.
+     *
+     *  See DbGroup for details.  Applies to collections opened after the
+     *  call.
+     */
+    void set_write_partitions(unsigned int write_partitions_);
+
+    /** Set the pool of threads used to match searches in parallel.
+     *
+     *  See Collection::set_match_pool() for details.  Applies to collections
+     *  opened after the call.  The pool is not owned by the collection
+     *  pool, and must outlive any searches using it.
+     */
+    void set_match_pool(WorkPool * match_pool_);
+
+    /** Set the maximum memory used by each readonly collection to cache
+     *  frequently used filters.
+     *
+     *  See Collection::set_filter_cache_size() for details.  Applies to
+     *  collections opened after the call.
+     */
+    void set_filter_cache_size(size_t filter_cache_size_);
+
     /** Release a collection back to the pool.
      */
     void release(RestPose::Collection * collection);
@@ -0,0 +1,110 @@
+/** @file commit_policy.cc
+ * @brief Policy controlling when changes to a collection are committed.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "commit_policy.h"
+
+#include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
+
+using namespace std;
+using namespace RestPose;
+
+// Defaults for the commit policy.
+static const double DEFAULT_MAX_LATENCY = 30.0;
+static const double DEFAULT_IDLE_TIME = 5.0;
+static const double DEFAULT_ACK_LATENCY = 0.2;
+
+/** Get a non-negative number of seconds from a member of a JSON object.
+ */
+static double
+get_seconds_member(const Json::Value & value, const char * key, double def)
+{
+    double result = json_get_double_member(value, key, def);
+    if (result < 0) {
+	throw InvalidValueError(string("JSON value for ") + key +
+				" was negative");
+    }
+    return result;
+}
+
+CommitPolicy::CommitPolicy()
+	: max_docs(0),
+	  max_bytes(0),
+	  max_latency(DEFAULT_MAX_LATENCY),
+	  idle_time(DEFAULT_IDLE_TIME),
+	  ack_latency(DEFAULT_ACK_LATENCY)
+{}
+
+bool
+CommitPolicy::is_default() const
+{
+    return max_docs == 0 && max_bytes == 0 &&
+	    max_latency == DEFAULT_MAX_LATENCY &&
+	    idle_time == DEFAULT_IDLE_TIME &&
+	    ack_latency == DEFAULT_ACK_LATENCY;
+}
+
+bool
+CommitPolicy::commit_due(uint64_t docs, uint64_t bytes,
+			 double first_change, double now) const
+{
+    if (docs == 0) {
+	return false;
+    }
+    if (max_docs != 0 && docs >= max_docs) {
+	return true;
+    }
+    if (max_bytes != 0 && bytes >= max_bytes) {
+	return true;
+    }
+    return max_latency != 0 && now >= first_change + max_latency;
+}
+
+Json::Value &
+CommitPolicy::to_json(Json::Value & value) const
+{
+    value = Json::objectValue;
+    value["max_docs"] = Json::UInt64(max_docs);
+    value["max_bytes"] = Json::UInt64(max_bytes);
+    value["max_latency"] = max_latency;
+    value["idle_time"] = idle_time;
+    value["ack_latency"] = ack_latency;
+    return value;
+}
+
+void
+CommitPolicy::from_json(const Json::Value & value)
+{
+    json_check_object(value, "commit policy");
+    max_docs = json_get_uint64_member(value, "max_docs",
+				      Json::Value::maxUInt64, 0);
+    max_bytes = json_get_uint64_member(value, "max_bytes",
+				       Json::Value::maxUInt64, 0);
+    max_latency = get_seconds_member(value, "max_latency",
+				     DEFAULT_MAX_LATENCY);
+    idle_time = get_seconds_member(value, "idle_time", DEFAULT_IDLE_TIME);
+    ack_latency = get_seconds_member(value, "ack_latency",
+				     DEFAULT_ACK_LATENCY);
+}
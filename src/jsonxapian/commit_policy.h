@@ -0,0 +1,89 @@
+/** @file commit_policy.h
+ * @brief Policy controlling when changes to a collection are committed.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_COMMIT_POLICY_H
+#define RESTPOSE_INCLUDED_COMMIT_POLICY_H
+
+#include "json/value.h"
+#include "utils/safe_inttypes.h"
+
+namespace RestPose {
+
+/** The policy for when to commit changes made to a collection.
+ *
+ *  Changes are committed when the indexing queue for the collection has been
+ *  idle for a while, or when any of the limits on the uncommitted changes is
+ *  reached, whichever happens first.
+ */
+struct CommitPolicy {
+    /** Number of documents changed, after which to commit (0 for no
+     *  limit).
+     */
+    uint64_t max_docs;
+
+    /** Approximate size in bytes of the changed documents, after which to
+     *  commit (0 for no limit).
+     */
+    uint64_t max_bytes;
+
+    /** Seconds after the first uncommitted change, after which to commit
+     *  (0 for no limit).
+     */
+    double max_latency;
+
+    /// Seconds of idle time on the indexing queue, after which to commit.
+    double idle_time;
+
+    /** Seconds to keep making further changes before committing changes
+     *  which a client is waiting for.
+     *
+     *  The changes are committed sooner if the indexing queue becomes idle.
+     */
+    double ack_latency;
+
+    CommitPolicy();
+
+    /// Return true if the policy has the default settings.
+    bool is_default() const;
+
+    /** Check if a commit is due.
+     *
+     *  @param docs The number of uncommitted changed documents.
+     *  @param bytes The approximate size of the uncommitted changes.
+     *  @param first_change The time of the first uncommitted change.
+     *  @param now The current time.
+     */
+    bool commit_due(uint64_t docs, uint64_t bytes,
+		    double first_change, double now) const;
+
+    /// Convert the policy to a JSON object.
+    Json::Value & to_json(Json::Value & value) const;
+
+    /// Initialise the policy from a JSON object.
+    void from_json(const Json::Value & value);
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_COMMIT_POLICY_H */
@@ -33,6 +33,7 @@
 #include "matchspies/facetmatchspy.h"
 #include <memory>
 #include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
 
 using namespace RestPose;
 using namespace std;
@@ -53,6 +54,17 @@ BaseFacetInfoHandler::write_results(Json::Value & results,
     spy->get_result(info);
 }
 
+void
+BaseFacetInfoHandler::merge(const InfoHandler & other_base)
+{
+    const BaseFacetInfoHandler * other =
+	    dynamic_cast<const BaseFacetInfoHandler *>(&other_base);
+    if (other == NULL) {
+	throw InvalidStateError("Can't merge info handlers of different types");
+    }
+    spy->merge(*(other->spy));
+}
+
 
 FacetCountInfoHandler::FacetCountInfoHandler(const Json::Value & params,
 					     const QueryBuilder & builder,
@@ -47,6 +47,8 @@ class BaseFacetInfoHandler : public InfoHandler {
 
     void write_results(Json::Value & results,
 		       const Xapian::MSet & mset) const;
+
+    void merge(const InfoHandler & other);
 };
 
 class FacetCountInfoHandler : public BaseFacetInfoHandler {
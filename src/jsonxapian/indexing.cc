@@ -37,6 +37,7 @@
 
 #include "docdata.h"
 #include "hashterm.h"
+#include "jsonxapian/analysis.h"
 #include "jsonxapian/collconfig.h"
 #include "jsonxapian/taxonomy.h"
 #include "utils/jsonutils.h"
@@ -475,10 +476,18 @@ TermGeneratorIndexer::index(IndexingState & state,
 	}
 	state.field_nonempty(fieldname);
 
-	Xapian::TermGenerator tg;
-	tg.set_stemmer(Xapian::Stem(stem_lang));
+	Xapian::TermGenerator & tg =
+		AnalysisContext::for_thread().get_termgenerator(stem_lang);
 	tg.set_document(state.doc);
-	tg.index_text(val, 1 /*weight*/, prefix);
+	try {
+	    tg.index_text(val, 1 /*weight*/, prefix);
+	} catch(...) {
+	    tg.set_document(Xapian::Document());
+	    throw;
+	}
+	// Don't keep a handle on the document: it's passed on to another
+	// thread, and Xapian's reference counts aren't thread-safe.
+	tg.set_document(Xapian::Document());
     }
 
     if (!store_field.empty()) {
@@ -519,7 +528,8 @@ CJKIndexer::index(IndexingState & state,
 	state.field_nonempty(fieldname);
 
 	// index the text
-	cjk::tokenizer tknzr;
+	cjk::tokenizer & tknzr =
+		AnalysisContext::for_thread().get_cjk_tokenizer();
 	std::vector<std::pair<std::string, unsigned> > token_list;
 	std::vector<std::pair<std::string, unsigned> >::const_iterator token_iter;
 	tknzr.tokenize(val, token_list);
@@ -59,6 +59,19 @@ InfoHandlers::write_results(Json::Value & results,
     }
 }
 
+void
+InfoHandlers::merge(const InfoHandlers & other)
+{
+    if (handlers.size() != other.handlers.size()) {
+	throw InvalidStateError("Can't merge mismatched info handlers");
+    }
+    for (vector<InfoHandler *>::size_type i = 0; i != handlers.size(); ++i) {
+	if (handlers[i] != NULL && other.handlers[i] != NULL) {
+	    handlers[i]->merge(*(other.handlers[i]));
+	}
+    }
+}
+
 void
 InfoHandlers::add_handler(const Json::Value & handler,
 			  const QueryBuilder & builder,
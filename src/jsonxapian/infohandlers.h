@@ -41,6 +41,13 @@ class InfoHandler {
     virtual ~InfoHandler();
     virtual void write_results(Json::Value & results,
 			       const Xapian::MSet & mset) const = 0;
+
+    /** Merge the information gathered by another handler into this one.
+     *
+     *  The other handler must have been made from the same parameters, but
+     *  may have been used to search a different database.
+     */
+    virtual void merge(const InfoHandler & other) = 0;
 };
 
 class InfoHandlers {
@@ -57,6 +64,14 @@ class InfoHandlers {
     void write_results(Json::Value & results,
 		       const Xapian::MSet & mset) const;
 
+    /** Merge the information gathered by another set of handlers into this
+     *  one.
+     *
+     *  The other handlers must have been added with the same parameters, in
+     *  the same order.
+     */
+    void merge(const InfoHandlers & other);
+
     /** Add a new handler to a search, to be performed using the enquire
      *  object.
      */
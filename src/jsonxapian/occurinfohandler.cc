@@ -29,6 +29,7 @@
 #include "logger/logger.h"
 #include "matchspies/termoccurmatchspy.h"
 #include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
 
 using namespace RestPose;
 using namespace std;
@@ -49,6 +50,17 @@ BaseOccurInfoHandler::write_results(Json::Value & results,
     spy->get_result(info);
 }
 
+void
+BaseOccurInfoHandler::merge(const InfoHandler & other_base)
+{
+    const BaseOccurInfoHandler * other =
+	    dynamic_cast<const BaseOccurInfoHandler *>(&other_base);
+    if (other == NULL) {
+	throw InvalidStateError("Can't merge info handlers of different types");
+    }
+    spy->merge(*(other->spy));
+}
+
 
 OccurInfoHandler::OccurInfoHandler(const Json::Value & params,
 				   Xapian::Enquire & enq,
@@ -47,6 +47,8 @@ class BaseOccurInfoHandler : public InfoHandler {
 
     void write_results(Json::Value & results,
 		       const Xapian::MSet & mset) const;
+
+    void merge(const InfoHandler & other);
 };
 
 class OccurInfoHandler : public BaseOccurInfoHandler {
@@ -29,8 +29,10 @@
 #include "jsonxapian/schema.h"
 #include "jsonxapian/slotname.h"
 #include "logger/logger.h"
+#include "postingsources/filter_bitmap_source.h"
 #include "utils/jsonutils.h"
 #include "utils/rsperrors.h"
+#include <map>
 #include <vector>
 #include <xapian.h>
 
@@ -48,6 +50,17 @@ QueryBuilder::build_query(const Json::Value & jsonquery) const
 	return Xapian::Query::MatchNothing;
     }
 
+    if (subqueries != NULL && jsonquery.isMember("$subquery")) {
+	if (jsonquery.size() != 1) {
+	    throw InvalidValueError("Subquery reference must contain exactly one member");
+	}
+	uint64_t index = json_get_uint64(jsonquery["$subquery"]);
+	if (index >= subqueries->size()) {
+	    throw InvalidValueError("Subquery reference out of range");
+	}
+	return (*subqueries)[index];
+    }
+
     if (jsonquery.isMember("matchall")) {
 	if (jsonquery.size() != 1) {
 	    throw InvalidValueError("MatchAll query must contain exactly one member");
@@ -236,7 +249,8 @@ QueryBuilder::build_query(const Json::Value & jsonquery) const
 	filterqueries.reserve(queryparams.size() - 1);
 
 	for (; i != queryparams.end(); ++i) {
-	    filterqueries.push_back(build_query(*i));
+	    filterqueries.push_back(cached_filter(json_serialise(*i),
+						  build_query(*i)));
 	}
 	return Xapian::Query(Xapian::Query::OP_FILTER,
 			     mainquery,
@@ -261,15 +275,77 @@ QueryBuilder::build_query(const Json::Value & jsonquery) const
     throw InvalidValueError("Invalid query specification - no known members in query object (" + json_serialise(jsonquery) + ")");
 }
 
-QueryBuilder::QueryBuilder(const CollectionConfig & collconfig_)
-	: collconfig(collconfig_)
+Xapian::Query
+QueryBuilder::cached_filter(const string & key,
+			    const Xapian::Query & filter) const
+{
+    // Subquery references in the filter depend on the prebuilt subqueries,
+    // so can't be used in keys.
+    if (filter_cache == NULL || subqueries != NULL) {
+	return filter;
+    }
+    string full_key(filter_scope);
+    full_key += '\0';
+    full_key += key;
+
+    // Each use is only counted once per builder, so that a filter isn't
+    // counted several times for a single search.
+    map<string, bool>::const_iterator i = noted_filters.find(full_key);
+    if (i == noted_filters.end()) {
+	i = noted_filters.insert(make_pair(full_key,
+	    filter_cache->note_use(full_key, filter))).first;
+    }
+    if (!i->second) {
+	return filter;
+    }
+    FilterBitmapSource source(filter_cache, full_key,
+			      filter.get_description());
+    return Xapian::Query(&source);
+}
+
+QueryBuilder::QueryBuilder(const CollectionConfig & collconfig_,
+			   const string & filter_scope_)
+	: collconfig(collconfig_),
+	  subqueries(NULL),
+	  filter_cache(NULL),
+	  filter_scope(filter_scope_),
+	  noted_filters()
+{
+}
+
+Xapian::doccount
+QueryBuilder::estimate_candidates(const Json::Value & jsonquery,
+				  const Xapian::Database & db) const
+{
+    return estimate_candidates(build_query(jsonquery), db);
+}
+
+Xapian::doccount
+QueryBuilder::estimate_candidates(const Xapian::Query & query,
+				  const Xapian::Database & db) const
 {
+    Xapian::doccount total = total_docs(db);
+    if (query.empty()) {
+	return 0;
+    }
+    Xapian::TermIterator i = query.get_terms_begin();
+    if (i == query.get_terms_end()) {
+	return total;
+    }
+    Xapian::doccount result = 0;
+    for (; i != query.get_terms_end(); ++i) {
+	result += db.get_termfreq(*i);
+	if (result >= total) {
+	    return total;
+	}
+    }
+    return result;
 }
 
 
 CollectionQueryBuilder::CollectionQueryBuilder(
     const CollectionConfig & collconfig_)
-	: QueryBuilder(collconfig_)
+	: QueryBuilder(collconfig_, "*")
 {
 }
 
@@ -299,6 +375,12 @@ CollectionQueryBuilder::build(const Json::Value & jsonquery) const
     return build_query(jsonquery);
 }
 
+Xapian::Query
+CollectionQueryBuilder::restrict(const Xapian::Query & query) const
+{
+    return query;
+}
+
 Xapian::doccount
 CollectionQueryBuilder::total_docs(const Xapian::Database & db) const
 {
@@ -362,7 +444,7 @@ CollectionQueryBuilder::get_slot_decoder(const std::string & fieldname) const
 DocumentTypeQueryBuilder::DocumentTypeQueryBuilder(
     const CollectionConfig & collconfig_,
     const std::string & doc_type)
-	: QueryBuilder(collconfig_),
+	: QueryBuilder(collconfig_, "type:" + doc_type),
 	  schema(collconfig_.get_schema(doc_type))
 {
 }
@@ -372,7 +454,11 @@ DocumentTypeQueryBuilder::field_query(const std::string & fieldname,
 				      const std::string & querytype,
 				      const Json::Value & queryparams) const
 {
-    // Schema cannot be NULL, because this is checked in build().
+    // Queries may be built by build_query() for a type with no schema, so
+    // this must be checked here as well as in build().
+    if (schema == NULL) {
+	return Xapian::Query::MatchNothing;
+    }
     const FieldConfig * config = schema->get(fieldname);
     if (config == NULL) {
 	return Xapian::Query::MatchNothing;
@@ -388,6 +474,15 @@ DocumentTypeQueryBuilder::build(const Json::Value & jsonquery) const
 	// this isn't an error.
 	return Xapian::Query::MatchNothing;
     }
+    return restrict(build_query(jsonquery));
+}
+
+Xapian::Query
+DocumentTypeQueryBuilder::restrict(const Xapian::Query & query) const
+{
+    if (schema == NULL) {
+	return Xapian::Query::MatchNothing;
+    }
 
     // Filter to return only documents of this type.
     const FieldConfig * typeconfig = schema->get(collconfig.get_type_field());
@@ -399,7 +494,8 @@ DocumentTypeQueryBuilder::build(const Json::Value & jsonquery) const
     Xapian::Query type_query(typeconfig->query("is", schema->get_doctype()));
 
     return Xapian::Query(Xapian::Query::OP_FILTER,
-			 build_query(jsonquery), type_query);
+			 query,
+			 cached_filter(string(), type_query));
 }
 
 Xapian::doccount
@@ -27,12 +27,16 @@
 
 #include "json/value.h"
 #include "jsonxapian/slotname.h"
+#include <map>
+#include <string>
+#include <vector>
 #include <xapian.h>
 
 namespace RestPose {
     class Collection;
     class CollectionConfig;
     class FieldConfig;
+    class FilterBitmapCache;
     class Schema;
     class SlotDecoder;
 
@@ -46,9 +50,36 @@ namespace RestPose {
 	/** The configuration for the collection being searched.. */
 	const CollectionConfig & collconfig;
 
-	/** Build a query from a JSON query specification.
+	/** Prebuilt subqueries, referred to by {"$subquery": N} in queries.
+	 *
+	 *  NULL if there are no prebuilt subqueries.
 	 */
-	Xapian::Query build_query(const Json::Value & jsonquery) const;
+	const std::vector<Xapian::Query> * subqueries;
+
+	/** Cache of the documents matching filters, or NULL to not use one.
+	 */
+	FilterBitmapCache * filter_cache;
+
+	/** A string distinguishing the documents searched by the builder,
+	 *  used in the keys of cached filters.
+	 */
+	std::string filter_scope;
+
+	/** The filters whose use has been noted in the cache, and whether
+	 *  they are to be matched from it, by key.
+	 */
+	mutable std::map<std::string, bool> noted_filters;
+
+	/** Build a query used only to filter the results of a search.
+	 *
+	 *  If the filter is used frequently, returns a query matching the
+	 *  cached set of documents it matches.
+	 *
+	 *  @param key A key for the filter, unique within the scope of the
+	 *  builder.
+	 */
+	Xapian::Query cached_filter(const std::string & key,
+				    const Xapian::Query & filter) const;
 
 	/** Build a query for a particular field.
 	 */
@@ -58,18 +89,75 @@ namespace RestPose {
 			    const Json::Value & queryparams) const = 0;
 
       public:
-	QueryBuilder(const CollectionConfig & collconfig_);
+	QueryBuilder(const CollectionConfig & collconfig_,
+		     const std::string & filter_scope_);
+
+	/** Build a query from a JSON query specification.
+	 *
+	 *  Unlike build(), this doesn't restrict the query to the documents
+	 *  that the builder is for, so is suitable for building parts of a
+	 *  query.
+	 */
+	Xapian::Query build_query(const Json::Value & jsonquery) const;
+
+	/** Set the prebuilt subqueries which queries may refer to.
+	 *
+	 *  The subqueries must not be modified or destroyed while the builder
+	 *  is in use.  Set to NULL to stop allowing references to them.
+	 */
+	void set_subqueries(const std::vector<Xapian::Query> * subqueries_) {
+	    subqueries = subqueries_;
+	}
+
+	/** Set the cache used to match frequently used filters.
+	 *
+	 *  The cache must only hold the documents of the database being
+	 *  searched, and must outlive any queries built.  Set to NULL (the
+	 *  default) to match filters normally.  Filters are never cached
+	 *  while prebuilt subqueries are set.
+	 */
+	void set_filter_cache(FilterBitmapCache * filter_cache_) {
+	    filter_cache = filter_cache_;
+	}
 
 	/** Build a query from a JSON query specification.
 	 */
 	virtual Xapian::Query build(const Json::Value & jsonquery) const = 0;
 
+	/** Restrict a query built by build_query() to the documents that
+	 *  the builder is for.
+	 *
+	 *  build() is equivalent to calling this on the result of
+	 *  build_query().
+	 */
+	virtual Xapian::Query
+		restrict(const Xapian::Query & query) const = 0;
+
 	/** Get the total number of documents searched in the database
 	 *  specified by queries built by this builder.
 	 */
 	virtual Xapian::doccount
 		total_docs(const Xapian::Database & db) const = 0;
 
+	/** Estimate the number of documents which a query built from a JSON
+	 *  query specification could match.
+	 *
+	 *  This is the sum of the frequencies of the terms in the query,
+	 *  limited to total_docs(db), so it is cheap to calculate but may be
+	 *  a large overestimate.  Queries with no terms (eg, range queries)
+	 *  are assumed to match all the documents.
+	 */
+	Xapian::doccount
+		estimate_candidates(const Json::Value & jsonquery,
+				    const Xapian::Database & db) const;
+
+	/** Estimate the number of documents which a query built by
+	 *  build_query() could match, as for the other form of this method.
+	 */
+	Xapian::doccount
+		estimate_candidates(const Xapian::Query & query,
+				    const Xapian::Database & db) const;
+
 	/** Get the config for a given field.
 	 *
 	 *  If the configuration for the field varies for different document
@@ -107,6 +195,8 @@ namespace RestPose {
 	 */
 	Xapian::Query build(const Json::Value & jsonquery) const;
 
+	Xapian::Query restrict(const Xapian::Query & query) const;
+
 	Xapian::doccount total_docs(const Xapian::Database & db) const;
 
 	const FieldConfig *
@@ -135,6 +225,8 @@ namespace RestPose {
 
 	Xapian::Query build(const Json::Value & jsonquery) const;
 
+	Xapian::Query restrict(const Xapian::Query & query) const;
+
 	Xapian::doccount total_docs(const Xapian::Database & db) const;
 
 	const FieldConfig *
@@ -33,6 +33,7 @@
 #include "json/reader.h"
 #include "json/value.h"
 #include "json/writer.h"
+#include "jsonxapian/analysis.h"
 #include "jsonxapian/collconfig.h"
 #include "jsonxapian/indexing.h"
 #include "logger/logger.h"
@@ -510,7 +511,7 @@ TextFieldConfig::indexer() const
 static Xapian::Query
 build_CJK_query(string prefix, string text, string op, unsigned window)
 {
-    cjk::tokenizer tknzr;
+    cjk::tokenizer & tknzr = AnalysisContext::for_thread().get_cjk_tokenizer();
     vector<pair<string, unsigned> > token_list;
     tknzr.tokenize(text, token_list);
     if (token_list.empty()) {
@@ -554,11 +555,8 @@ static Xapian::Query
 build_stem_query(string prefix, string text, string op, unsigned window,
 		 string stemmer)
 {
-    Xapian::QueryParser qp;
-    if (!stemmer.empty()) {
-	qp.set_stemmer(Xapian::Stem(stemmer));
-	qp.set_stemming_strategy(qp.STEM_SOME);
-    }
+    Xapian::QueryParser & qp =
+	    AnalysisContext::for_thread().get_queryparser(stemmer);
 
     if (op == "phrase") {
 	qp.set_default_op(Xapian::Query::OP_PHRASE);
@@ -583,11 +581,8 @@ build_stem_query(string prefix, string text, string op, unsigned window,
 static Xapian::Query
 build_parsed_query(string prefix, string text, string op, string stemmer)
 {
-    Xapian::QueryParser qp;
-    if (!stemmer.empty()) {
-	qp.set_stemmer(Xapian::Stem(stemmer));
-	qp.set_stemming_strategy(qp.STEM_SOME);
-    }
+    Xapian::QueryParser & qp =
+	    AnalysisContext::for_thread().get_queryparser(stemmer);
 
     if (op == "and") {
 	qp.set_default_op(Xapian::Query::OP_AND);
@@ -1392,6 +1387,15 @@ Schema::get_taxonomy_groups(const string & taxonomy_name,
     }
 }
 
+void
+Schema::build_indexers() const
+{
+    for (map<string, FieldConfig *>::const_iterator i = fields.begin();
+	 i != fields.end(); ++i) {
+	(void) get_indexer(i->first);
+    }
+}
+
 Xapian::Document
 Schema::process(const Json::Value & value,
 		const CollectionConfig & collconfig,
@@ -1401,6 +1405,51 @@ Schema::process(const Json::Value & value,
 {
     json_check_object(value, "input document");
 
+    // Add config for any new fields, from the patterns.
+    string meta_field(collconfig.get_meta_field());
+    for (Json::Value::const_iterator viter = value.begin();
+	 viter != value.end();
+	 ++viter) {
+	const string & fieldname = viter.memberName();
+	if (fieldname != meta_field && get(fieldname) == NULL) {
+	    LOG_DEBUG(string("New field type: ") + fieldname);
+	    set(fieldname, patterns.get(fieldname, doc_type));
+	    new_fields = true;
+	}
+    }
+    if (!meta_field.empty() && get(meta_field) == NULL) {
+	LOG_DEBUG(string("New meta field type: ") + meta_field);
+	set(meta_field, patterns.get(meta_field, doc_type));
+	new_fields = true;
+    }
+
+    return index(value, collconfig, idterm, errors);
+}
+
+bool
+Schema::has_new_fields(const Json::Value & value,
+		       const string & meta_field) const
+{
+    json_check_object(value, "input document");
+    for (Json::Value::const_iterator viter = value.begin();
+	 viter != value.end();
+	 ++viter) {
+	const string & fieldname = viter.memberName();
+	if (fieldname != meta_field && get(fieldname) == NULL) {
+	    return true;
+	}
+    }
+    return !meta_field.empty() && get(meta_field) == NULL;
+}
+
+Xapian::Document
+Schema::index(const Json::Value & value,
+	      const CollectionConfig & collconfig,
+	      string & idterm,
+	      IndexingErrors & errors) const
+{
+    json_check_object(value, "input document");
+
     IndexingState state(collconfig, idterm, errors);
 
     string meta_field(collconfig.get_meta_field());
@@ -1417,13 +1466,6 @@ Schema::process(const Json::Value & value,
 	}
 
 	const FieldIndexer * indexer = get_indexer(fieldname);
-	if (!indexer) {
-	    LOG_DEBUG(string("New field type: ") + fieldname);
-	    set(fieldname, patterns.get(fieldname, doc_type));
-	    new_fields = true;
-	    indexer = get_indexer(fieldname);
-	}
-
 	if (indexer) {
 	    if ((*viter).isNull()) {
 		state.field_empty(fieldname);
@@ -1441,12 +1483,6 @@ Schema::process(const Json::Value & value,
 
     if (!meta_field.empty()) {
 	const FieldIndexer * indexer = get_indexer(meta_field);
-	if (!indexer) {
-	    LOG_DEBUG(string("New meta field type: ") + meta_field);
-	    set(meta_field, patterns.get(meta_field, doc_type));
-	    new_fields = true;
-	    indexer = get_indexer(meta_field);
-	}
 	if (indexer) {
 	    indexer->index(state, meta_field, Json::nullValue);
 	}
@@ -800,6 +800,14 @@ namespace RestPose {
 	 */
 	const FieldIndexer * get_indexer(const std::string & fieldname) const;
 
+	/** Build the cached indexers for all the fields with config.
+	 *
+	 *  After this, get_indexer() doesn't modify the schema, so the schema
+	 *  may be used to index documents with known fields from several
+	 *  threads at once.
+	 */
+	void build_indexers() const;
+
 	/** Set the field config for a field.
 	 *
 	 *  Takes ownership of the supplied configuration.
@@ -825,6 +833,24 @@ namespace RestPose {
 				 IndexingErrors & errors,
 				 bool & new_fields);
 
+	/** Check if a JSON object has any fields not known to the schema.
+	 *
+	 *  If this returns false, process() won't modify the schema, and
+	 *  index() can be used instead.
+	 */
+	bool has_new_fields(const Json::Value & value,
+			    const std::string & meta_field) const;
+
+	/** Process a JSON object into a Xapian document, using only the
+	 *  existing field configuration.
+	 *
+	 *  Unknown fields are ignored.
+	 */
+	Xapian::Document index(const Json::Value & value,
+			       const CollectionConfig & collconfig,
+			       std::string & idterm,
+			       IndexingErrors & errors) const;
+
 	/// Get the list of fields to return, from a search
 	void get_fieldlist(Json::Value & result,
 			   const Json::Value & search) const;
@@ -0,0 +1,316 @@
+/** @file search_template.cc
+ * @brief Stored, parameterised searches
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "jsonxapian/search_template.h"
+
+#include "jsonxapian/collconfig.h"
+#include "jsonxapian/query_builder.h"
+#include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
+#include <memory>
+
+using namespace std;
+using namespace RestPose;
+
+/// Check that all the placeholders in a value are well formed.
+static void
+check_placeholders(const Json::Value & value)
+{
+    if (value.isObject()) {
+	if (value.isMember("$param")) {
+	    const Json::Value & name = value["$param"];
+	    if (!name.isString() || name.asString().empty()) {
+		throw InvalidValueError("Search template parameter name must "
+					"be a non-empty string");
+	    }
+	    for (Json::Value::const_iterator i = value.begin();
+		 i != value.end(); ++i) {
+		string member(i.memberName());
+		if (member != "$param" && member != "default") {
+		    throw InvalidValueError("Unexpected member \"" + member +
+					    "\" in search template parameter");
+		}
+	    }
+	    return;
+	}
+	for (Json::Value::const_iterator i = value.begin();
+	     i != value.end(); ++i) {
+	    check_placeholders(*i);
+	}
+    } else if (value.isArray()) {
+	for (Json::Value::const_iterator i = value.begin();
+	     i != value.end(); ++i) {
+	    check_placeholders(*i);
+	}
+    }
+}
+
+/// Check if a value contains any placeholders.
+static bool
+has_placeholders(const Json::Value & value)
+{
+    if (value.isObject()) {
+	if (value.isMember("$param")) {
+	    return true;
+	}
+    } else if (!value.isArray()) {
+	return false;
+    }
+    for (Json::Value::const_iterator i = value.begin();
+	 i != value.end(); ++i) {
+	if (has_placeholders(*i)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+/// Check if a query operator takes a list of subqueries.
+static bool
+is_list_operator(const string & op)
+{
+    return (op == "and" || op == "or" || op == "xor" || op == "and_not" ||
+	    op == "and_maybe" || op == "filter");
+}
+
+/** Set the value at a path in a JSON tree.
+ *
+ *  Steps in the path before start are skipped.
+ */
+static void
+set_at_path(Json::Value & root,
+	    const vector<SearchTemplatePlan::PathStep> & path,
+	    vector<SearchTemplatePlan::PathStep>::size_type start,
+	    const Json::Value & value)
+{
+    Json::Value * target = &root;
+    for (vector<SearchTemplatePlan::PathStep>::size_type i = start;
+	 i != path.size(); ++i) {
+	const SearchTemplatePlan::PathStep & step = path[i];
+	if (step.is_index) {
+	    target = &((*target)[step.index]);
+	} else {
+	    target = &((*target)[step.key]);
+	}
+    }
+    *target = value;
+}
+
+void
+SearchTemplatePlan::compile_query(Json::Value & value,
+				  const QueryBuilder & builder)
+{
+    if (!has_placeholders(value)) {
+	subqueries.push_back(builder.build_query(value));
+	value = Json::objectValue;
+	value["$subquery"] = Json::UInt(subqueries.size() - 1);
+	return;
+    }
+    if (!value.isObject() || value.size() != 1) {
+	return;
+    }
+
+    // Recurse into the subqueries of operators, so that any of them which
+    // don't depend on parameters can be built.
+    string op(value.begin().memberName());
+    Json::Value & opparams = value[op];
+    if (is_list_operator(op) && opparams.isArray()) {
+	for (Json::Value::iterator i = opparams.begin();
+	     i != opparams.end(); ++i) {
+	    compile_query(*i, builder);
+	}
+    } else if (op == "scale" && opparams.isObject() &&
+	       opparams.isMember("query")) {
+	compile_query(opparams["query"], builder);
+    }
+}
+
+void
+SearchTemplatePlan::find_params(const Json::Value & value,
+				vector<PathStep> & path)
+{
+    if (value.isObject()) {
+	if (value.isMember("$param")) {
+	    Param param;
+	    param.name = value["$param"].asString();
+	    param.path = path;
+	    param.has_default = value.isMember("default");
+	    if (param.has_default) {
+		param.default_value = value["default"];
+	    }
+	    params.push_back(param);
+	    return;
+	}
+	for (Json::Value::const_iterator i = value.begin();
+	     i != value.end(); ++i) {
+	    PathStep step;
+	    step.key = i.memberName();
+	    step.index = 0;
+	    step.is_index = false;
+	    path.push_back(step);
+	    find_params(*i, path);
+	    path.pop_back();
+	}
+    } else if (value.isArray()) {
+	for (Json::ArrayIndex i = 0; i != value.size(); ++i) {
+	    PathStep step;
+	    step.index = i;
+	    step.is_index = true;
+	    path.push_back(step);
+	    find_params(value[i], path);
+	    path.pop_back();
+	}
+    }
+}
+
+void
+SearchTemplatePlan::expand(const Json::Value & values,
+			   Json::Value & search_out,
+			   CompiledQuery & compiled) const
+{
+    if (!values.isNull()) {
+	json_check_object(values, "search template parameters");
+	for (Json::Value::const_iterator i = values.begin();
+	     i != values.end(); ++i) {
+	    string name(i.memberName());
+	    vector<Param>::const_iterator j = params.begin();
+	    while (j != params.end() && j->name != name) {
+		++j;
+	    }
+	    if (j == params.end()) {
+		throw InvalidValueError("Unknown search template parameter \"" +
+					name + "\"");
+	    }
+	}
+    }
+
+    search_out = search;
+    compiled.query = query;
+    compiled.subqueries = &subqueries;
+    for (vector<Param>::const_iterator i = params.begin();
+	 i != params.end(); ++i) {
+	const Json::Value * value;
+	if (values.isMember(i->name)) {
+	    value = &(values[i->name]);
+	} else if (i->has_default) {
+	    value = &(i->default_value);
+	} else {
+	    throw InvalidValueError("Missing value for search template "
+				    "parameter \"" + i->name + "\"");
+	}
+	set_at_path(search_out, i->path, 0, *value);
+
+	// Parameters in the query are at the same place in the compiled
+	// query, since only subtrees without parameters are replaced.
+	if (!i->path.empty() && !i->path[0].is_index &&
+	    i->path[0].key == "query") {
+	    set_at_path(compiled.query, i->path, 1, *value);
+	}
+    }
+}
+
+SearchTemplate &
+SearchTemplate::operator=(const SearchTemplate & other)
+{
+    clear_plans();
+    search = other.search;
+    return *this;
+}
+
+SearchTemplate::~SearchTemplate()
+{
+    clear_plans();
+}
+
+Json::Value &
+SearchTemplate::to_json(Json::Value & value) const
+{
+    value = search;
+    return value;
+}
+
+void
+SearchTemplate::from_json(const Json::Value & value)
+{
+    json_check_object(value, "search template");
+    if (value.isMember("$param")) {
+	throw InvalidValueError("Search template must be a search, not a "
+				"single parameter");
+    }
+    check_placeholders(value);
+    clear_plans();
+    search = value;
+}
+
+void
+SearchTemplate::compile(const QueryBuilder * builder,
+			SearchTemplatePlan & plan) const
+{
+    plan.search = search;
+    plan.query = search["query"];
+    plan.params.clear();
+    plan.subqueries.clear();
+
+    vector<SearchTemplatePlan::PathStep> path;
+    plan.find_params(search, path);
+    if (builder != NULL) {
+	plan.compile_query(plan.query, *builder);
+    }
+}
+
+const SearchTemplatePlan &
+SearchTemplate::get_plan(const CollectionConfig & config,
+			 const string & doc_type) const
+{
+    map<string, SearchTemplatePlan *>::const_iterator i = plans.find(doc_type);
+    if (i != plans.end()) {
+	return *(i->second);
+    }
+
+    auto_ptr<SearchTemplatePlan> plan(new SearchTemplatePlan);
+    if (doc_type.empty()) {
+	CollectionQueryBuilder builder(config);
+	compile(&builder, *plan);
+    } else if (config.get_schema(doc_type) != NULL) {
+	DocumentTypeQueryBuilder builder(config, doc_type);
+	compile(&builder, *plan);
+    } else {
+	// Searches of types with no schema match nothing, so there's no
+	// point building any of the query.
+	compile(NULL, *plan);
+    }
+    plans[doc_type] = plan.get();
+    return *(plan.release());
+}
+
+void
+SearchTemplate::clear_plans() const
+{
+    for (map<string, SearchTemplatePlan *>::iterator i = plans.begin();
+	 i != plans.end(); ++i) {
+	delete i->second;
+    }
+    plans.clear();
+}
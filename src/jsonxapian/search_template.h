@@ -0,0 +1,186 @@
+/** @file search_template.h
+ * @brief Stored, parameterised searches
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_SEARCH_TEMPLATE_H
+#define RESTPOSE_INCLUDED_SEARCH_TEMPLATE_H
+
+#include "json/value.h"
+#include <map>
+#include <string>
+#include <vector>
+#include <xapian.h>
+
+namespace RestPose {
+
+class CollectionConfig;
+class QueryBuilder;
+
+/** A query tree in which some subtrees have been built in advance.
+ *
+ *  The prebuilt subtrees are replaced in the tree by objects of the form
+ *  {"$subquery": N}, where N is the index of the query in subqueries.
+ */
+struct CompiledQuery {
+    /// The query tree, with the prebuilt subtrees replaced by markers.
+    Json::Value query;
+
+    /// The prebuilt subqueries.
+    const std::vector<Xapian::Query> * subqueries;
+
+    /** The query built from the tree, if is_built is set.
+     *
+     *  Set by Collection::estimate_search_cost(), so that
+     *  Collection::perform_search() doesn't need to build it again.  Not
+     *  restricted to the document type searched.
+     */
+    Xapian::Query built;
+
+    /// True if built has been set.
+    bool is_built;
+
+    CompiledQuery() : query(), subqueries(NULL), built(), is_built(false) {}
+};
+
+/** A search template, compiled for searching a particular document type.
+ *
+ *  The parts of the template's query which don't depend on any parameters
+ *  are built into Xapian queries once, and the locations of the parameters
+ *  in the template are found once, so that a search using the template
+ *  only needs to substitute the parameter values and build the parts of the
+ *  query which use them.
+ */
+class SearchTemplatePlan {
+  public:
+    /// A step in the path to a parameter: an object member or array index.
+    struct PathStep {
+	std::string key;
+	Json::ArrayIndex index;
+	bool is_index;
+    };
+
+    /// A parameter in the template.
+    struct Param {
+	std::string name;
+	std::vector<PathStep> path;
+	bool has_default;
+	Json::Value default_value;
+    };
+
+  private:
+    friend class SearchTemplate;
+
+    /// The template's search, with placeholders for the parameters.
+    Json::Value search;
+
+    /// The template's query, with the prebuilt subtrees replaced.
+    Json::Value query;
+
+    /// The parameters, in the order they appear in the template.
+    std::vector<Param> params;
+
+    /// The prebuilt subqueries.
+    std::vector<Xapian::Query> subqueries;
+
+    /** Replace the query subtree at value with a marker, if it contains no
+     *  parameters.
+     */
+    void compile_query(Json::Value & value, const QueryBuilder & builder);
+
+    /** Find the parameters in a value, given the path to the value.
+     */
+    void find_params(const Json::Value & value, std::vector<PathStep> & path);
+
+  public:
+    /** Expand the template with a set of parameter values.
+     *
+     *  @param values A JSON object mapping parameter names to values.  May
+     *  be null if no values are supplied.
+     *
+     *  @param search_out Set to the full search, with the values substituted.
+     *
+     *  @param compiled Set to the query of the search, with the prebuilt
+     *  subtrees replaced.
+     *
+     *  Raises InvalidValueError if an unknown parameter is supplied, or a
+     *  parameter without a default is missing.
+     */
+    void expand(const Json::Value & values,
+		Json::Value & search_out,
+		CompiledQuery & compiled) const;
+};
+
+/** A stored search, with placeholders for parameters.
+ *
+ *  A placeholder is an object of the form {"$param": "name"}, or
+ *  {"$param": "name", "default": value}, and may appear anywhere in the
+ *  search.
+ */
+class SearchTemplate {
+    /// The search, with placeholders.
+    Json::Value search;
+
+    /// Compiled plans, by document type ("" for the whole collection).
+    mutable std::map<std::string, SearchTemplatePlan *> plans;
+
+  public:
+    SearchTemplate() : search(Json::objectValue), plans() {}
+    SearchTemplate(const SearchTemplate & other)
+	    : search(other.search), plans() {}
+    SearchTemplate & operator=(const SearchTemplate & other);
+    ~SearchTemplate();
+
+    /// Convert the template to a JSON object.
+    Json::Value & to_json(Json::Value & value) const;
+
+    /// Initialise the template from a JSON object.
+    void from_json(const Json::Value & value);
+
+    /** Compile the template into a plan.
+     *
+     *  If builder is NULL, none of the query is built in advance.
+     *
+     *  Raises InvalidValueError if a constant part of the query is invalid.
+     */
+    void compile(const QueryBuilder * builder,
+		 SearchTemplatePlan & plan) const;
+
+    /** Get the compiled plan for searching a given document type.
+     *
+     *  The plan is compiled the first time it's needed, and kept until the
+     *  configuration is changed.
+     */
+    const SearchTemplatePlan & get_plan(const CollectionConfig & config,
+					const std::string & doc_type) const;
+
+    /** Discard any compiled plans.
+     *
+     *  Must be called when the schemas that the plans were compiled with
+     *  change.
+     */
+    void clear_plans() const;
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_SEARCH_TEMPLATE_H */
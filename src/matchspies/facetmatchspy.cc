@@ -27,6 +27,7 @@
 
 #include <algorithm>
 #include "serialise.h"
+#include "utils/rsperrors.h"
 #include "utils/stringutils.h"
 #include <vector>
 
@@ -65,6 +66,22 @@ FacetCountMatchSpy::operator()(const Xapian::Document &doc, Xapian::weight)
     }
 }
 
+void
+FacetCountMatchSpy::merge(const BaseFacetMatchSpy & other_base)
+{
+    const FacetCountMatchSpy * other =
+	    dynamic_cast<const FacetCountMatchSpy *>(&other_base);
+    if (other == NULL) {
+	throw InvalidStateError("Can't merge facet spies of different types");
+    }
+    docs_seen += other->docs_seen;
+    values_seen += other->values_seen;
+    for (std::map<std::string, Xapian::doccount>::const_iterator
+	 i = other->counts.begin(); i != other->counts.end(); ++i) {
+	counts[i->first] += i->second;
+    }
+}
+
 struct StringAndFreq {
     string str;
     Xapian::doccount freq;
@@ -68,6 +68,13 @@ class BaseFacetMatchSpy : public Xapian::MatchSpy {
 
     virtual void operator()(const Xapian::Document &doc, Xapian::weight wt) = 0;
 
+    /** Add the counts gathered by another spy into this one.
+     *
+     *  Used to combine the results of spies run over separate databases.
+     *  The other spy must be of the same type as this one.
+     */
+    virtual void merge(const BaseFacetMatchSpy & other) = 0;
+
     virtual void get_result(Json::Value & result) const = 0;
 };
 
@@ -99,6 +106,8 @@ class FacetCountMatchSpy : public BaseFacetMatchSpy {
 
     void operator()(const Xapian::Document &doc, Xapian::weight wt);
 
+    void merge(const BaseFacetMatchSpy & other);
+
     void get_result(Json::Value & result) const;
 };
 
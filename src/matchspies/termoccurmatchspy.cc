@@ -59,6 +59,17 @@ BaseTermOccurMatchSpy::add_stopword(const std::string & word)
     stopwords.insert(word);
 }
 
+void
+BaseTermOccurMatchSpy::merge(const BaseTermOccurMatchSpy & other)
+{
+    docs_seen += other.docs_seen;
+    terms_seen += other.terms_seen;
+    for (std::map<std::string, Xapian::doccount>::const_iterator
+	 i = other.counts.begin(); i != other.counts.end(); ++i) {
+	counts[i->first] += i->second;
+    }
+}
+
 
 void
 TermOccurMatchSpy::operator()(const Xapian::Document &doc, Xapian::weight)
@@ -90,6 +90,13 @@ class BaseTermOccurMatchSpy : public Xapian::MatchSpy {
 
     void add_stopword(const std::string & word);
 
+    /** Add the counts gathered by another spy into this one.
+     *
+     *  Used to combine the results of spies run over separate databases.
+     *  Term frequencies are still read from this spy's database.
+     */
+    void merge(const BaseTermOccurMatchSpy & other);
+
     virtual void operator()(const Xapian::Document &doc, Xapian::weight wt) = 0;
 
     virtual void get_result(Json::Value & result) const = 0;
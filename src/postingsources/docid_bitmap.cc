@@ -0,0 +1,231 @@
+/** @file docid_bitmap.cc
+ * @brief Compressed sets of document IDs
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "postingsources/docid_bitmap.h"
+
+#include <algorithm>
+
+using namespace RestPose;
+using namespace std;
+
+/** The number of IDs above which a chunk is held as a bitset.
+ *
+ *  A bitset for a chunk takes 8KB, the same as an array of this many IDs.
+ */
+static const size_t MAX_SPARSE_IDS = 4096;
+
+/// The number of 32 bit words in the bitset of a chunk.
+static const unsigned CHUNK_WORDS = 65536 / 32;
+
+/// Get the number of the lowest bit set in a non-zero word.
+static inline unsigned
+lowest_bit(uint32_t word)
+{
+    unsigned result = 0;
+    if ((word & 0xffff) == 0) {
+	result += 16;
+	word >>= 16;
+    }
+    if ((word & 0xff) == 0) {
+	result += 8;
+	word >>= 8;
+    }
+    while ((word & 1) == 0) {
+	++result;
+	word >>= 1;
+    }
+    return result;
+}
+
+DocidBitmap::DocidBitmap(const vector<Xapian::docid> & docids)
+	: chunks(),
+	  count(docids.size())
+{
+    // Count the chunks first, so that they're never copied as the list grows.
+    size_t chunk_count = 0;
+    Xapian::docid high = 0;
+    for (vector<Xapian::docid>::const_iterator i = docids.begin();
+	 i != docids.end(); ++i) {
+	if (i == docids.begin() || (*i >> 16) != high) {
+	    high = *i >> 16;
+	    ++chunk_count;
+	}
+    }
+    chunks.reserve(chunk_count);
+
+    vector<uint16_t> low;
+    for (vector<Xapian::docid>::const_iterator i = docids.begin();
+	 i != docids.end(); ++i) {
+	if (!low.empty() && (*i >> 16) != high) {
+	    add_chunk(high, low);
+	    low.clear();
+	}
+	high = *i >> 16;
+	low.push_back(uint16_t(*i & 0xffff));
+    }
+    if (!low.empty()) {
+	add_chunk(high, low);
+    }
+}
+
+void
+DocidBitmap::add_chunk(Xapian::docid high, const vector<uint16_t> & low)
+{
+    chunks.push_back(Chunk());
+    Chunk & chunk = chunks.back();
+    chunk.high = high;
+    if (low.size() <= MAX_SPARSE_IDS) {
+	chunk.low.assign(low.begin(), low.end());
+	return;
+    }
+    chunk.bits.resize(CHUNK_WORDS, 0);
+    for (vector<uint16_t>::const_iterator i = low.begin();
+	 i != low.end(); ++i) {
+	chunk.bits[*i >> 5] |= uint32_t(1) << (*i & 31);
+    }
+}
+
+size_t
+DocidBitmap::bytes() const
+{
+    size_t result = sizeof(*this) + chunks.capacity() * sizeof(Chunk);
+    for (vector<Chunk>::const_iterator i = chunks.begin();
+	 i != chunks.end(); ++i) {
+	result += i->low.capacity() * sizeof(uint16_t);
+	result += i->bits.capacity() * sizeof(uint32_t);
+    }
+    return result;
+}
+
+bool
+DocidBitmap::contains(Xapian::docid did) const
+{
+    Xapian::docid high = did >> 16;
+    vector<Chunk>::const_iterator i = lower_bound(chunks.begin(), chunks.end(),
+						  high, chunk_before);
+    if (i == chunks.end() || i->high != high) {
+	return false;
+    }
+    uint16_t low = uint16_t(did & 0xffff);
+    if (i->bits.empty()) {
+	return binary_search(i->low.begin(), i->low.end(), low);
+    }
+    return (i->bits[low >> 5] & (uint32_t(1) << (low & 31))) != 0;
+}
+
+
+DocidBitmap::Cursor::Cursor()
+	: bitmap(NULL),
+	  chunk(0),
+	  offset(0),
+	  did(0)
+{
+}
+
+DocidBitmap::Cursor::Cursor(const DocidBitmap & bitmap_)
+	: bitmap(&bitmap_),
+	  chunk(0),
+	  offset(0),
+	  did(0)
+{
+}
+
+bool
+DocidBitmap::Cursor::seek(size_t chunk_, unsigned from_low)
+{
+    const vector<Chunk> & chunks = bitmap->chunks;
+    for (chunk = chunk_; chunk < chunks.size(); ++chunk, from_low = 0) {
+	const Chunk & current = chunks[chunk];
+	if (current.bits.empty()) {
+	    vector<uint16_t>::const_iterator i
+		    = lower_bound(current.low.begin(), current.low.end(),
+				  from_low);
+	    if (i != current.low.end()) {
+		offset = i - current.low.begin();
+		did = (current.high << 16) | *i;
+		return true;
+	    }
+	} else {
+	    unsigned word = from_low >> 5;
+	    uint32_t bits = current.bits[word] & (~uint32_t(0) << (from_low & 31));
+	    while (true) {
+		if (bits != 0) {
+		    offset = (word << 5) | lowest_bit(bits);
+		    did = (current.high << 16) | offset;
+		    return true;
+		}
+		if (++word == CHUNK_WORDS) {
+		    break;
+		}
+		bits = current.bits[word];
+	    }
+	}
+    }
+    did = 0;
+    return false;
+}
+
+bool
+DocidBitmap::Cursor::next()
+{
+    if (at_end()) {
+	return false;
+    }
+    if (did == 0) {
+	return seek(0, 0);
+    }
+    const Chunk & current = bitmap->chunks[chunk];
+    if (current.bits.empty()) {
+	if (++offset < current.low.size()) {
+	    did = (current.high << 16) | current.low[offset];
+	    return true;
+	}
+	return seek(chunk + 1, 0);
+    }
+    if (offset == 0xffff) {
+	return seek(chunk + 1, 0);
+    }
+    return seek(chunk, offset + 1);
+}
+
+bool
+DocidBitmap::Cursor::skip_to(Xapian::docid target)
+{
+    if (at_end()) {
+	return false;
+    }
+    if (did != 0 && did >= target) {
+	return true;
+    }
+    const vector<Chunk> & chunks = bitmap->chunks;
+    Xapian::docid high = target >> 16;
+    vector<Chunk>::const_iterator i = lower_bound(chunks.begin() + chunk,
+						  chunks.end(), high,
+						  chunk_before);
+    if (i != chunks.end() && i->high == high) {
+	return seek(i - chunks.begin(), target & 0xffff);
+    }
+    return seek(i - chunks.begin(), 0);
+}
@@ -0,0 +1,146 @@
+/** @file docid_bitmap.h
+ * @brief Compressed sets of document IDs
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_DOCID_BITMAP_H
+#define RESTPOSE_INCLUDED_DOCID_BITMAP_H
+
+#include "utils/safe_inttypes.h"
+#include <vector>
+#include <xapian.h>
+
+namespace RestPose {
+
+/** A compressed, immutable set of document IDs.
+ *
+ *  The IDs are split into chunks by their high 16 bits.  Each chunk holds
+ *  the low 16 bits of its IDs either as a sorted array, if it has few IDs,
+ *  or as a bitset covering every possible ID in the chunk, if it has many;
+ *  so no chunk takes more than 8KB.
+ */
+class DocidBitmap {
+  public:
+    class Cursor;
+    friend class Cursor;
+
+  private:
+    struct Chunk {
+	/// The high 16 bits of the document IDs in the chunk.
+	Xapian::docid high;
+
+	/// The low 16 bits of the document IDs, in ascending order, if sparse.
+	std::vector<uint16_t> low;
+
+	/// A bit for each possible document ID in the chunk, if dense.
+	std::vector<uint32_t> bits;
+    };
+
+    /// The chunks holding any document IDs, in ascending order.
+    std::vector<Chunk> chunks;
+
+    /// The number of document IDs in the set.
+    Xapian::doccount count;
+
+    /// Add a chunk holding some low parts, converting it to a bitset if big.
+    void add_chunk(Xapian::docid high, const std::vector<uint16_t> & low);
+
+    /// Comparison for finding chunks by the high part of document IDs.
+    static bool chunk_before(const Chunk & chunk, Xapian::docid high) {
+	return chunk.high < high;
+    }
+
+  public:
+    /** A position in the set, for iterating through its document IDs.
+     */
+    class Cursor {
+	const DocidBitmap * bitmap;
+
+	/// The index of the chunk at the current position.
+	size_t chunk;
+
+	/// The array index, or bit number, in the chunk.
+	unsigned offset;
+
+	/// The document ID at the current position, or 0 if not on one.
+	Xapian::docid did;
+
+	/** Move to the first document ID at or after the low part given,
+	 *  starting at a given chunk.
+	 *
+	 *  Returns false, leaving the cursor at the end, if there are none.
+	 */
+	bool seek(size_t chunk_, unsigned from_low);
+
+      public:
+	/// Make a cursor which isn't positioned on any set.
+	Cursor();
+
+	/// Make a cursor positioned before the first ID in a set.
+	Cursor(const DocidBitmap & bitmap_);
+
+	/** Move to the next document ID.
+	 *
+	 *  Returns false if there are no more.
+	 */
+	bool next();
+
+	/** Move to the first document ID which is at least target.
+	 *
+	 *  Never moves backwards.  Returns false if there are no more.
+	 */
+	bool skip_to(Xapian::docid target);
+
+	/** Check if the cursor has moved past the last document ID.
+	 */
+	bool at_end() const {
+	    return bitmap == NULL || chunk == bitmap->chunks.size();
+	}
+
+	/** Get the document ID at the current position.
+	 */
+	Xapian::docid get_docid() const {
+	    return did;
+	}
+    };
+
+    /** Build a set from a list of document IDs.
+     *
+     *  The IDs must be in ascending order, with no duplicates.
+     */
+    DocidBitmap(const std::vector<Xapian::docid> & docids);
+
+    /// Get the number of document IDs in the set.
+    Xapian::doccount size() const {
+	return count;
+    }
+
+    /// Get the approximate amount of memory used by the set.
+    size_t bytes() const;
+
+    /// Check if a document ID is in the set.
+    bool contains(Xapian::docid did) const;
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_DOCID_BITMAP_H */
@@ -0,0 +1,350 @@
+/** @file filter_bitmap_source.cc
+ * @brief PostingSource matching cached bitmaps of filter results
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "postingsources/filter_bitmap_source.h"
+
+#include <algorithm>
+#include "str.h"
+#include "utils/rsperrors.h"
+
+using namespace RestPose;
+using namespace std;
+
+/** The number of times a filter must be used before it is cached.
+ *
+ *  Building a bitmap costs about as much as running the filter once, so
+ *  filters which are only used once aren't worth caching.
+ */
+static const unsigned MIN_USES_TO_CACHE = 2;
+
+/** The maximum number of filters whose uses are counted.
+ *
+ *  The counts are all forgotten when this is reached, to bound the memory
+ *  used if many distinct filters are used.
+ */
+static const size_t MAX_COUNTED_FILTERS = 1000;
+
+/** Get an identifier for a database fragment.
+ *
+ *  Returns an empty string if the fragment can't be identified.
+ */
+static string
+shard_id(const Xapian::Database & db)
+{
+    string uuid = db.get_uuid();
+    if (uuid.empty()) {
+	return uuid;
+    }
+    return uuid + "/" + str(db.get_doccount()) + "/" + str(db.get_lastdocid());
+}
+
+/** A MatchDecider which records the IDs of the documents it sees, and
+ *  rejects them all.
+ */
+class DocidRecorder : public Xapian::MatchDecider {
+  public:
+    mutable vector<Xapian::docid> docids;
+
+    bool operator()(const Xapian::Document & doc) const {
+	docids.push_back(doc.get_docid());
+	return false;
+    }
+};
+
+/** Build a bitmap of the documents in a database matching a filter.
+ */
+static DocidBitmap *
+build_bitmap(const Xapian::Query & filter, const Xapian::Database & db)
+{
+    DocidRecorder recorder;
+    Xapian::doccount dbsize = db.get_doccount();
+    if (dbsize != 0) {
+	Xapian::Enquire enq(db);
+	enq.set_query(filter);
+	enq.set_weighting_scheme(Xapian::BoolWeight());
+	enq.set_docid_order(Xapian::Enquire::ASCENDING);
+	// Every match is rejected by the recorder, so all of them are checked.
+	(void) enq.get_mset(0, 1, dbsize, NULL, &recorder);
+    }
+    vector<Xapian::docid> & docids = recorder.docids;
+    sort(docids.begin(), docids.end());
+    docids.erase(unique(docids.begin(), docids.end()), docids.end());
+    return new DocidBitmap(docids);
+}
+
+
+FilterBitmapCache::FilterBitmapCache()
+	: cond(),
+	  max_bytes(0),
+	  bytes(0),
+	  shard_ids(),
+	  uses(),
+	  filters(),
+	  building(),
+	  uncacheable(),
+	  bitmaps()
+{
+}
+
+FilterBitmapCache::~FilterBitmapCache()
+{
+    drop_bitmaps();
+}
+
+void
+FilterBitmapCache::drop_bitmaps()
+{
+    for (map<pair<string, unsigned>, DocidBitmap *>::iterator
+	 i = bitmaps.begin(); i != bitmaps.end(); ++i) {
+	delete i->second;
+    }
+    bitmaps.clear();
+    bytes = 0;
+}
+
+void
+FilterBitmapCache::set_max_bytes(size_t max_bytes_)
+{
+    ContextLocker lock(cond);
+    max_bytes = max_bytes_;
+}
+
+void
+FilterBitmapCache::reset(const vector<Xapian::Database> & shards)
+{
+    ContextLocker lock(cond);
+    drop_bitmaps();
+    shard_ids.clear();
+    filters.clear();
+    uncacheable.clear();
+    if (max_bytes == 0) {
+	return;
+    }
+    vector<string> ids;
+    for (vector<Xapian::Database>::const_iterator i = shards.begin();
+	 i != shards.end(); ++i) {
+	string id = shard_id(*i);
+	if (id.empty() || find(ids.begin(), ids.end(), id) != ids.end()) {
+	    // Bitmaps could be used for the wrong fragment, so don't cache.
+	    return;
+	}
+	ids.push_back(id);
+    }
+    shard_ids.swap(ids);
+}
+
+void
+FilterBitmapCache::clear()
+{
+    ContextLocker lock(cond);
+    drop_bitmaps();
+    shard_ids.clear();
+    filters.clear();
+    uncacheable.clear();
+}
+
+bool
+FilterBitmapCache::note_use(const string & key, const Xapian::Query & filter)
+{
+    ContextLocker lock(cond);
+    if (shard_ids.empty() || uncacheable.find(key) != uncacheable.end()) {
+	return false;
+    }
+    if (filters.find(key) != filters.end()) {
+	return true;
+    }
+    if (bytes >= max_bytes || filters.size() >= MAX_COUNTED_FILTERS) {
+	return false;
+    }
+    if (uses.size() >= MAX_COUNTED_FILTERS && uses.find(key) == uses.end()) {
+	uses.clear();
+    }
+    if (++uses[key] < MIN_USES_TO_CACHE) {
+	return false;
+    }
+    filters.insert(make_pair(key, filter));
+    return true;
+}
+
+const DocidBitmap *
+FilterBitmapCache::get(const string & key,
+		       const Xapian::Database & shard,
+		       auto_ptr<DocidBitmap> & uncached)
+{
+    string id = shard_id(shard);
+    ContextLocker lock(cond);
+    vector<string>::const_iterator i = find(shard_ids.begin(),
+					    shard_ids.end(), id);
+    pair<string, unsigned> bitmap_key(key, i - shard_ids.begin());
+
+    // The cached filter mustn't be used by several threads at once, so wait
+    // for any other thread building a bitmap from it, which may also be the
+    // bitmap wanted here.
+    while (true) {
+	if (i != shard_ids.end()) {
+	    map<pair<string, unsigned>, DocidBitmap *>::const_iterator j
+		    = bitmaps.find(bitmap_key);
+	    if (j != bitmaps.end()) {
+		return j->second;
+	    }
+	}
+	if (building.find(key) == building.end()) {
+	    break;
+	}
+	cond.wait();
+    }
+
+    map<string, Xapian::Query>::const_iterator filter = filters.find(key);
+    if (filter == filters.end()) {
+	throw InvalidStateError("Filter not found in filter cache");
+    }
+
+    // The filters aren't changed until the cache is reset, which doesn't
+    // happen during searches, so the filter can be used without the lock.
+    building.insert(key);
+    lock.unlock();
+    auto_ptr<DocidBitmap> bitmap;
+    try {
+	bitmap.reset(build_bitmap(filter->second, shard));
+    } catch(...) {
+	lock.lock();
+	building.erase(key);
+	cond.broadcast();
+	throw;
+    }
+    lock.lock();
+    building.erase(key);
+    cond.broadcast();
+
+    if (i != shard_ids.end()) {
+	size_t size = bitmap->bytes();
+	if (bytes + size <= max_bytes) {
+	    bytes += size;
+	    bitmaps[bitmap_key] = bitmap.get();
+	    return bitmap.release();
+	}
+    }
+    // Searches already using the filter's other bitmaps may still be
+    // running, so those are kept until the cache is reset.
+    uncacheable.insert(key);
+    uncached = bitmap;
+    return uncached.get();
+}
+
+
+FilterBitmapSource::FilterBitmapSource(FilterBitmapCache * cache_,
+				       const string & key_,
+				       const string & description_)
+	: cache(cache_),
+	  key(key_),
+	  description(description_),
+	  bitmap(NULL),
+	  uncached(),
+	  cursor()
+{
+}
+
+Xapian::doccount
+FilterBitmapSource::get_termfreq_min() const
+{
+    return bitmap->size();
+}
+
+Xapian::doccount
+FilterBitmapSource::get_termfreq_est() const
+{
+    return bitmap->size();
+}
+
+Xapian::doccount
+FilterBitmapSource::get_termfreq_max() const
+{
+    return bitmap->size();
+}
+
+Xapian::docid
+FilterBitmapSource::get_docid() const
+{
+    return cursor.get_docid();
+}
+
+void
+FilterBitmapSource::next(Xapian::weight)
+{
+    (void) cursor.next();
+}
+
+void
+FilterBitmapSource::skip_to(Xapian::docid did, Xapian::weight)
+{
+    (void) cursor.skip_to(did);
+}
+
+bool
+FilterBitmapSource::check(Xapian::docid did, Xapian::weight)
+{
+    (void) cursor.skip_to(did);
+    return true;
+}
+
+bool
+FilterBitmapSource::at_end() const
+{
+    return cursor.at_end();
+}
+
+Xapian::PostingSource *
+FilterBitmapSource::clone() const
+{
+    return new FilterBitmapSource(cache, key, description);
+}
+
+string
+FilterBitmapSource::name() const
+{
+    return "FilterBitmapSource";
+}
+
+string
+FilterBitmapSource::serialise() const
+{
+    // The cache can't be serialised, so just record the key of the filter.
+    return key;
+}
+
+void
+FilterBitmapSource::init(const Xapian::Database & db)
+{
+    uncached.reset();
+    bitmap = cache->get(key, db, uncached);
+    cursor = DocidBitmap::Cursor(*bitmap);
+    set_maxweight(0);
+}
+
+string
+FilterBitmapSource::get_description() const
+{
+    return "FilterBitmapSource(" + description + ")";
+}
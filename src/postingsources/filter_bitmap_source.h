@@ -0,0 +1,198 @@
+/** @file filter_bitmap_source.h
+ * @brief PostingSource matching cached bitmaps of filter results
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_FILTER_BITMAP_SOURCE_H
+#define RESTPOSE_INCLUDED_FILTER_BITMAP_SOURCE_H
+
+#include <map>
+#include <memory>
+#include "postingsources/docid_bitmap.h"
+#include <set>
+#include <string>
+#include "utils/threading.h"
+#include <vector>
+#include <xapian.h>
+
+namespace RestPose {
+
+/** A cache of the documents matching frequently used filters, for one
+ *  reader of a database.
+ *
+ *  The documents matching a filter in each database fragment read are held
+ *  as a DocidBitmap.  A filter is cached once it has been used a few times,
+ *  while the total size of the bitmaps is within a limit.  If a filter's
+ *  bitmap doesn't fit within the limit, the filter is not matched from the
+ *  cache again until the cache is reset.
+ *
+ *  The bitmaps are only valid for the revision of the fragments they were
+ *  built from, so must be dropped (by calling reset()) whenever the reader
+ *  is reopened.  The cache may be used by several threads at once, but
+ *  reset() and clear() must only be called while no searches using it are
+ *  in progress.
+ *
+ *  The cache holds its own copy of each filter being cached, which is only
+ *  used by one thread at a time, so that the threads matching different
+ *  fragments never share a query.  Bitmaps are built without holding the
+ *  cache's lock, so that building one doesn't hold up other searches.
+ */
+class FilterBitmapCache {
+    /// Lock protecting the cache, signalled when a bitmap has been built.
+    mutable Condition cond;
+
+    /// The maximum total size of the bitmaps, in bytes.  0 to disable.
+    size_t max_bytes;
+
+    /// The total size of the bitmaps, in bytes.
+    size_t bytes;
+
+    /** Identifiers for each database fragment being read.
+     *
+     *  Empty if the fragments couldn't be told apart, or the cache has been
+     *  cleared, in which case nothing is cached.
+     */
+    std::vector<std::string> shard_ids;
+
+    /// The number of times each filter has been used, by key.
+    std::map<std::string, unsigned> uses;
+
+    /// The filters being matched from the cache, by key.
+    std::map<std::string, Xapian::Query> filters;
+
+    /// The keys of the filters which a bitmap is being built for.
+    std::set<std::string> building;
+
+    /** The keys of the filters whose bitmaps didn't fit in the cache.
+     *
+     *  These are no longer matched from the cache, since their bitmaps
+     *  would have to be rebuilt for every search.
+     */
+    std::set<std::string> uncacheable;
+
+    /// The bitmaps, keyed by filter key and fragment number.
+    std::map<std::pair<std::string, unsigned>, DocidBitmap *> bitmaps;
+
+    /// Delete all the bitmaps.  The lock must be held.
+    void drop_bitmaps();
+
+    FilterBitmapCache(const FilterBitmapCache &);
+    void operator=(const FilterBitmapCache &);
+  public:
+    FilterBitmapCache();
+    ~FilterBitmapCache();
+
+    /** Set the maximum total size of the bitmaps.
+     *
+     *  0 disables the cache.  Applies from the next call to reset().
+     */
+    void set_max_bytes(size_t max_bytes_);
+
+    /** Drop the bitmaps, and start caching for a new set of fragments.
+     */
+    void reset(const std::vector<Xapian::Database> & shards);
+
+    /** Drop the bitmaps, and stop caching until reset() is next called.
+     */
+    void clear();
+
+    /** Record a use of a filter, and check if it should be matched from the
+     *  cache.
+     *
+     *  If it should, the cache keeps a copy of the filter, to build bitmaps
+     *  from.  Returns false for filters whose bitmaps didn't fit in the
+     *  cache.
+     *
+     *  @param key A key identifying the filter, which must be distinct for
+     *  filters which may match different documents.
+     */
+    bool note_use(const std::string & key, const Xapian::Query & filter);
+
+    /** Get the bitmap of the documents matching a filter in a fragment.
+     *
+     *  The bitmap is built (by running the filter) if it's not already
+     *  cached.  If it can't be cached, it is returned in uncached, which the
+     *  caller then owns, and the filter is marked as uncacheable.
+     *
+     *  @param key The key of the filter, for which note_use() must have
+     *  returned true since the cache was last reset.
+     */
+    const DocidBitmap * get(const std::string & key,
+			    const Xapian::Database & shard,
+			    std::auto_ptr<DocidBitmap> & uncached);
+};
+
+/** A PostingSource which matches the documents matching a filter, using the
+ *  bitmaps in a FilterBitmapCache.
+ *
+ *  This returns no weight, so is intended for use as the right hand side of
+ *  an OP_FILTER query.
+ */
+class FilterBitmapSource : public Xapian::PostingSource {
+    FilterBitmapCache * cache;
+    std::string key;
+
+    /// A description of the filter.
+    std::string description;
+
+    /// The bitmap for the fragment being matched.
+    const DocidBitmap * bitmap;
+
+    /// The bitmap, if it couldn't be cached.
+    std::auto_ptr<DocidBitmap> uncached;
+
+    /// The position in the bitmap.
+    DocidBitmap::Cursor cursor;
+
+    FilterBitmapSource(const FilterBitmapSource &);
+    void operator=(const FilterBitmapSource &);
+  public:
+    /** Make a source matching the documents which match a filter.
+     *
+     *  @param cache_ The cache to get the bitmaps from.  Must outlive the
+     *  source, and any queries it is used in.
+     *  @param key_ The key of the filter, for which
+     *  FilterBitmapCache::note_use() returned true.
+     *  @param description_ A description of the filter.
+     */
+    FilterBitmapSource(FilterBitmapCache * cache_,
+		       const std::string & key_,
+		       const std::string & description_);
+
+    Xapian::doccount get_termfreq_min() const;
+    Xapian::doccount get_termfreq_est() const;
+    Xapian::doccount get_termfreq_max() const;
+    Xapian::docid get_docid() const;
+    void next(Xapian::weight min_wt);
+    void skip_to(Xapian::docid did, Xapian::weight min_wt);
+    bool check(Xapian::docid did, Xapian::weight min_wt);
+    bool at_end() const;
+    Xapian::PostingSource * clone() const;
+    std::string name() const;
+    std::string serialise() const;
+    void init(const Xapian::Database & db);
+    std::string get_description() const;
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_FILTER_BITMAP_SOURCE_H */
@@ -25,12 +25,16 @@
 #include <config.h>
 #include "rest/handler.h"
 
+#include <cstdlib>
 #include "httpserver/httpserver.h"
 #include "logger/logger.h"
 #include <microhttpd.h>
+#include "realtime.h"
 #include "server/task_manager.h"
 #include "str.h"
+#include <strings.h>
 #include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
 
 using namespace std;
 using namespace RestPose;
@@ -38,12 +42,164 @@ using namespace RestPose;
 // Virtual destructor to ensure there's a vtable.
 Handler::~Handler() {}
 
+void
+respond_when_ready(ConnectionInfo & conn, ResultHandle & resulthandle)
+{
+    // We won't be called again until a response has been queued, so wait
+    // for the result here.  Only this connection's thread is held up.
+    // Tasks always set their result, including when they expire or fail,
+    // so there's no time limit, but long waits are noted in the log.
+    double started = RealTime::now();
+    while (!resulthandle.wait_ready(RealTime::now() +
+				    BLOCKING_WAIT_LOG_INTERVAL)) {
+	LOG_WARN("Still waiting for the result of a task after " +
+		 str(int(RealTime::now() - started)) + " seconds");
+    }
+    conn.respond(resulthandle);
+}
+
+bool
+open_body_decoder(ConnectionInfo & conn,
+		  std::auto_ptr<ZlibInflater> & inflater)
+{
+    const char * encoding = MHD_lookup_connection_value(conn.connection,
+	MHD_HEADER_KIND, "Content-Encoding");
+    if (encoding == NULL || *encoding == '\0' ||
+	strcasecmp(encoding, "identity") == 0) {
+	return true;
+    }
+    if (strcasecmp(encoding, "gzip") == 0 ||
+	strcasecmp(encoding, "x-gzip") == 0 ||
+	strcasecmp(encoding, "deflate") == 0) {
+	// The inflater detects whether a gzip or zlib header is used, so
+	// also copes with clients which send raw gzip data for "deflate".
+	inflater.reset(new ZlibInflater(true));
+	return true;
+    }
+    Json::Value result(Json::objectValue);
+    result["err"] = "Unsupported Content-Encoding: " + string(encoding);
+    conn.respond(MHD_HTTP_UNSUPPORTED_MEDIA_TYPE, json_serialise(result),
+		 "application/json");
+    return false;
+}
+
+JsonBodyReader::JsonBodyReader()
+	: parser(),
+	  inflater(),
+	  received(0),
+	  error_status(0),
+	  error_msg()
+{
+}
+
+void
+JsonBodyReader::set_error(int status, const string & msg)
+{
+    if (error_status == 0) {
+	error_status = status;
+	error_msg = msg;
+    }
+}
+
+void
+JsonBodyReader::parse(ConnectionInfo & conn, const char * data, size_t len)
+{
+    received += len;
+    if (conn.max_body_size != 0 && received > conn.max_body_size) {
+	set_error(MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+		  "Request body too large");
+	return;
+    }
+    // FIXME - check Content-Type
+    try {
+	parser.parse(data, len);
+    } catch(const InvalidValueError & e) {
+	set_error(MHD_HTTP_BAD_REQUEST, e.what());
+    }
+}
+
+bool
+JsonBodyReader::read(ConnectionInfo & conn, Json::Value & body)
+{
+    if (conn.first_call) {
+	if (!open_body_decoder(conn, inflater)) {
+	    return true;
+	}
+
+	// Reject bodies which are declared to be too large before reading
+	// any of them.  For compressed bodies, this only checks the
+	// compressed size; the decoded size is checked as it is received.
+	if (conn.max_body_size != 0) {
+	    const char * length = MHD_lookup_connection_value(conn.connection,
+		MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_LENGTH);
+	    if (length != NULL &&
+		strtoull(length, NULL, 10) > conn.max_body_size) {
+		conn.respond(MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+			     "{\"err\":\"Request body too large\"}",
+			     "application/json");
+		return true;
+	    }
+	}
+	return false;
+    }
+
+    size_t len = *(conn.upload_data_size);
+    if (len != 0) {
+	*(conn.upload_data_size) = 0;
+	if (error_status != 0) {
+	    // Discard the rest of an invalid body.
+	    return false;
+	}
+	if (inflater.get() == NULL) {
+	    parse(conn, conn.upload_data, len);
+	    return false;
+	}
+	try {
+	    inflater->set_input(conn.upload_data, len);
+	    string piece;
+	    while (error_status == 0 && inflater->read_output(piece)) {
+		parse(conn, piece.data(), piece.size());
+	    }
+	} catch(const CompressionError & e) {
+	    set_error(MHD_HTTP_BAD_REQUEST,
+		      string("Invalid compressed request body: ") + e.what());
+	}
+	return false;
+    }
+
+    if (error_status == 0 && inflater.get() != NULL && !inflater->at_end()) {
+	set_error(MHD_HTTP_BAD_REQUEST,
+		  "Invalid compressed request body: unexpected end of data");
+    }
+    if (error_status == 0) {
+	try {
+	    parser.finish(body);
+	} catch(const InvalidValueError & e) {
+	    set_error(MHD_HTTP_BAD_REQUEST, e.what());
+	}
+    }
+    if (error_status != 0) {
+	LOG_ERROR("Invalid request body: " + error_msg);
+	Json::Value result(Json::objectValue);
+	result["err"] = error_msg;
+	conn.respond(error_status, json_serialise(result), "application/json");
+    }
+    return true;
+}
+
 QueuedHandler::QueuedHandler()
 	: Handler(),
 	  queued(false)
 {
 }
 
+QueuedHandler::~QueuedHandler()
+{
+    if (queued) {
+	resulthandle.cancel();
+    }
+}
+
 /** Handle queue push status responses which correspond to the push having
  *  failed.
  */
@@ -65,6 +221,23 @@ QueuedHandler::handle_queue_push_fail(Queue::QueueState state,
     return false;
 }
 
+void
+QueuedHandler::respond_queued(Queue::QueueState state)
+{
+    Json::Value result(Json::objectValue);
+    switch (state) {
+	case Queue::LOW_SPACE:
+	    result["high_load"] = 1;
+	    // Fall through
+	case Queue::HAS_SPACE:
+	    // Return HTTP Accepted status code
+	    (void) resulthandle.set_ready_json(result, 202);
+	    break;
+	default:
+	    break;
+    }
+}
+
 void
 QueuedHandler::handle(ConnectionInfo & conn)
 {
@@ -73,35 +246,35 @@ QueuedHandler::handle(ConnectionInfo & conn)
 	      ", data=\"" + (conn.upload_data ? conn.upload_data : "NULL") +
 	      "\", size=" + (conn.upload_data_size ? str(*(conn.upload_data_size)) : string("NULL")));
     if (conn.first_call) {
-	resulthandle.set_nudge(taskman->get_nudge_fd(), 'H');
-	return;
+	if (!conn.blocking) {
+	    resulthandle.set_nudge(taskman->get_nudge_fd(), 'H');
+	}
     }
     if (!queued) {
-	if (*(conn.upload_data_size) != 0) {
-	    // FIXME - enforce an upload size limit
-	    uploaded_data += string(conn.upload_data, *(conn.upload_data_size));
-	    *(conn.upload_data_size) = 0;
+	Json::Value body(Json::nullValue);
+	if (!body_reader.read(conn, body) || conn.responded) {
 	    return;
 	}
-
-	// FIXME - check Content-Type
-	Json::Value body(Json::nullValue);
-	if (uploaded_data.size() != 0) {
-	    // Handle failure to parse data
-	    try {
-		json_unserialise(uploaded_data, body);
-	    } catch(InvalidValueError & e) {
-		LOG_ERROR(string("Invalid JSON supplied in request body: ") + e.what());
-		resulthandle.failed(e.what(), 400);
-		conn.respond(resulthandle);
-		return;
-	    }
+	Queue::QueueState state;
+	try {
+	    state = enqueue(conn, body);
+	} catch (const InvalidValueError & e) {
+	    LOG_ERROR(string("Error queueing task: ") + e.what());
+	    Json::Value result(Json::objectValue);
+	    result["err"] = e.what();
+	    conn.respond(400, json_serialise(result), "application/json");
+	    return;
 	}
-	Queue::QueueState state = enqueue(conn, body);
 	if (handle_queue_push_fail(state, conn)) {
 	    return;
 	}
 	queued = true;
+	if (conn.blocking) {
+	    respond_when_ready(conn, resulthandle);
+	} else if (resulthandle.is_ready()) {
+	    // The response was set while queueing.
+	    conn.respond(resulthandle);
+	}
     } else {
 	if (resulthandle.is_ready()) {
 	    conn.respond(resulthandle);
@@ -141,22 +314,9 @@ NoWaitQueuedHandler::handle(ConnectionInfo & conn)
     LOG_DEBUG("NoWaitQueuedHandler: firstcall=" + str(conn.first_call) +
 	      ", data=\"" + (conn.upload_data ? conn.upload_data : "NULL") +
 	      "\", size=" + (conn.upload_data_size ? str(*(conn.upload_data_size)) : string("NULL")))
-    if (conn.first_call) {
-	return;
-    }
-
-    if (*(conn.upload_data_size) != 0) {
-	// FIXME - enforce an upload size limit
-	uploaded_data += string(conn.upload_data, *(conn.upload_data_size));
-	*(conn.upload_data_size) = 0;
-	return;
-    }
-
-    // FIXME - check Content-Type
     Json::Value body(Json::nullValue);
-    if (uploaded_data.size() != 0) {
-	// FIXME - handle failure to parse data
-	json_unserialise(uploaded_data, body);
+    if (!body_reader.read(conn, body) || conn.responded) {
+	return;
     }
 
     Queue::QueueState state;
@@ -25,8 +25,11 @@
 #define RESTPOSE_INCLUDED_HANDLER_H
 
 #include "json/value.h"
+#include <memory>
 #include "server/result_handle.h"
 #include <string>
+#include "utils/compression.h"
+#include "utils/jsonparser.h"
 #include "utils/queueing.h"
 #include <vector>
 
@@ -65,6 +68,21 @@ class Handler {
     virtual void handle(ConnectionInfo & info) = 0;
 };
 
+/** Interval, in seconds, at which a warning is logged while a connection
+ *  thread is still waiting for the result of a task.
+ */
+#define BLOCKING_WAIT_LOG_INTERVAL 120.0
+
+/** Wait for the result of a task, and respond with it.
+ *
+ *  Used when the connection is blocking (ie, the HTTP server is running a
+ *  thread for each connection), so the handler won't be called again until
+ *  a response has been queued.  Only the connection's own thread waits, so
+ *  there is no time limit: searches are limited by their own timeouts.
+ */
+void respond_when_ready(ConnectionInfo & conn,
+			RestPose::ResultHandle & resulthandle);
+
 /** Factory for creating a new handler for a request, with the specified path
  *  parameters.
  *
@@ -76,6 +94,68 @@ class HandlerFactory {
     virtual Handler * create(const std::vector<std::string> & path_params) const = 0;
 };
 
+/** Set up decoding of a request body, according to its Content-Encoding.
+ *
+ *  Should be called on the first call to a handler.  If the body is gzip or
+ *  deflate encoded, inflater is set to a decoder for it; otherwise, inflater
+ *  is left empty.
+ *
+ *  @returns false if the encoding of the body isn't supported.  An error
+ *  response will have been sent in this case.
+ */
+bool open_body_decoder(ConnectionInfo & conn,
+		       std::auto_ptr<ZlibInflater> & inflater);
+
+/** Reader for JSON request bodies.
+ *
+ *  The body is parsed incrementally as each chunk arrives, so the serialised
+ *  body is never held in memory.  The maximum body size configured for the
+ *  server is enforced, both from the Content-Length header and as the body
+ *  is received.  Bodies may be gzip or deflate encoded; the size limit
+ *  applies to the decoded body.
+ */
+class JsonBodyReader {
+    /// The parser for the body.
+    RestPose::JsonStreamParser parser;
+
+    /// Decoder for the body, if it is compressed.
+    std::auto_ptr<ZlibInflater> inflater;
+
+    /// The number of bytes of the (decoded) body received so far.
+    size_t received;
+
+    /** The status code to respond with, if the body is invalid (or 0 if no
+     *  error has been found).
+     */
+    int error_status;
+
+    /// The error message to respond with, if the body is invalid.
+    std::string error_msg;
+
+    /// Record an error, and ignore the rest of the body.
+    void set_error(int status, const std::string & msg);
+
+    /// Parse a piece of the decoded body.
+    void parse(ConnectionInfo & conn, const char * data, size_t len);
+
+  public:
+    JsonBodyReader();
+
+    /** Read the next part of the body.
+     *
+     *  Should be called each time the handler is called until it returns
+     *  true.
+     *
+     *  @param conn The connection to read from.
+     *  @param body Set to the parsed body, once the body has been read.
+     *
+     *  @returns false if more of the body is expected.  true if the body has
+     *  been completely read; if the body was invalid, an error response will
+     *  have been sent, and conn.responded will be set.
+     */
+    bool read(ConnectionInfo & conn, Json::Value & body);
+};
+
 /** Base class of handlers which put a task on a queue and wait for the
  *  response.
  */
@@ -85,7 +165,8 @@ class QueuedHandler : public Handler {
      */
     bool queued;
 
-    std::string uploaded_data;
+    /// Reader for the request body.
+    JsonBodyReader body_reader;
 
     /** Handle the request if the queue push failed.
      *
@@ -99,8 +180,23 @@ class QueuedHandler : public Handler {
      */
     RestPose::ResultHandle resulthandle;
 
+    /** Respond to a write request which returns as soon as it has been
+     *  queued.
+     *
+     *  Does nothing if the push failed; that's reported by handle().
+     */
+    void respond_queued(Queue::QueueState state);
+
   public:
     QueuedHandler();
+
+    /** Cancel the result, in case it is still being prepared.
+     *
+     *  The handler is destroyed when the connection is closed, so if the
+     *  result hasn't been sent by then, the client has gone away.
+     */
+    ~QueuedHandler();
+
     void handle(ConnectionInfo & conn);
     virtual Queue::QueueState enqueue(ConnectionInfo & conn,
 				      const Json::Value & body) = 0;
@@ -110,7 +206,7 @@ class QueuedHandler : public Handler {
  */
 class NoWaitQueuedHandler : public Handler {
     // FIXME - share code with QueuedHandler
-    std::string uploaded_data;
+    JsonBodyReader body_reader;
     bool handle_queue_push_fail(Queue::QueueState state,
 				ConnectionInfo & conn);
   public:
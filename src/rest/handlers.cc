@@ -26,11 +26,15 @@
 #include "rest/handlers.h"
 
 #include "httpserver/httpserver.h"
+#include "httpserver/response.h"
 #include "logger/logger.h"
 #include <microhttpd.h>
+#include "server/journal.h"
 #include "server/task_manager.h"
 #include "server/tasks.h"
+#include "server/write_ack.h"
 #include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
 #include "utils/validation.h"
 
 using namespace std;
@@ -108,12 +112,25 @@ IndexDocumentHandlerFactory::create(
 }
 
 Queue::QueueState
-IndexDocumentHandler::enqueue(ConnectionInfo &,
+IndexDocumentHandler::enqueue(ConnectionInfo & conn,
 			      const Json::Value & body)
 {
-    return taskman->queue_processing(coll_name,
-	new ProcessorProcessDocumentTask(doc_type, doc_id, body),
-	false);
+    AckLevel level = get_ack_level(conn);
+    WriteAck * ack = NULL;
+    if (level != ACK_QUEUED) {
+	ack = new WriteAck(resulthandle, level);
+    }
+    string records;
+    if (taskman->get_journals().is_enabled()) {
+	JournalRecord::append_index(records, doc_type, doc_id, body);
+    }
+    Queue::QueueState state = taskman->queue_journalled(coll_name,
+	new ProcessorProcessDocumentTask(doc_type, doc_id, body, ack),
+	records, false);
+    if (level == ACK_QUEUED) {
+	respond_queued(state);
+    }
+    return state;
 }
 
 Handler *
@@ -161,12 +178,25 @@ DeleteDocumentHandlerFactory::create(
 }
 
 Queue::QueueState
-DeleteDocumentHandler::enqueue(ConnectionInfo &,
+DeleteDocumentHandler::enqueue(ConnectionInfo & conn,
 			       const Json::Value &)
 {
-    return taskman->queue_processing(coll_name,
-	new DelayedIndexingTask(new DeleteDocumentTask(doc_type, doc_id)),
-	false);
+    AckLevel level = get_ack_level(conn);
+    WriteAck * ack = NULL;
+    if (level != ACK_QUEUED) {
+	ack = new WriteAck(resulthandle, level);
+    }
+    string records;
+    if (taskman->get_journals().is_enabled()) {
+	JournalRecord::append_delete(records, doc_type, doc_id);
+    }
+    Queue::QueueState state = taskman->queue_journalled(coll_name,
+	new DelayedIndexingTask(new DeleteDocumentTask(doc_type, doc_id, ack)),
+	records, false);
+    if (level == ACK_QUEUED) {
+	respond_queued(state);
+    }
+    return state;
 }
 
 
@@ -206,8 +236,37 @@ Queue::QueueState
 SearchHandler::enqueue(ConnectionInfo &,
 		       const Json::Value & body)
 {
+    double deadline;
+    try {
+	deadline = search_deadline(body);
+    } catch(const InvalidValueError & e) {
+	resulthandle.failed(e.what(), 400);
+	return Queue::HAS_SPACE;
+    }
+
+    // Answer the search from the cache if the result for the collection's
+    // current revision is there, without queueing it.
+    SearchResultCache & cache(taskman->get_result_cache());
+    if (!cache.is_enabled()) {
+	return taskman->queue_readonly("search",
+	    new PerformSearchTask(resulthandle, coll_name, body, doc_type,
+				  deadline));
+    }
+    string cache_key(SearchResultCache::make_key(coll_name, doc_type, body));
+    string cached;
+    if (cache.get(cache_key,
+		  taskman->get_collections().current_generation(coll_name),
+		  cached)) {
+	Response & response(resulthandle.response());
+	response.set_data(cached);
+	response.set_content_type("application/json");
+	response.set_status(200);
+	resulthandle.set_ready();
+	return Queue::HAS_SPACE;
+    }
     return taskman->queue_readonly("search",
-	new PerformSearchTask(resulthandle, coll_name, body, doc_type));
+	new PerformSearchTask(resulthandle, coll_name, body, doc_type,
+			      deadline, &cache, cache_key));
 }
 
 Handler *
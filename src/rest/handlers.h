@@ -76,7 +76,7 @@ class IndexDocumentHandlerFactory : public HandlerFactory {
     Handler * create(const std::vector<std::string> & path_params) const;
 };
 
-class IndexDocumentHandler : public NoWaitQueuedHandler {
+class IndexDocumentHandler : public QueuedHandler {
     std::string coll_name;
     std::string doc_type;
     std::string doc_id;
@@ -114,7 +114,7 @@ class DeleteDocumentHandlerFactory : public HandlerFactory {
     Handler * create(const std::vector<std::string> & path_params) const;
 };
 
-class DeleteDocumentHandler : public NoWaitQueuedHandler {
+class DeleteDocumentHandler : public QueuedHandler {
     std::string coll_name;
     std::string doc_type;
     std::string doc_id;
@@ -25,9 +25,12 @@
 #include <config.h>
 #include "rest/routes.h"
 
+#include "features/bulk_handlers.h"
 #include "features/checkpoint_handlers.h"
 #include "features/category_handlers.h"
 #include "features/coll_handlers.h"
+#include "features/msearch_handlers.h"
+#include "features/template_handlers.h"
 #include "httpserver/httpserver.h"
 #include "rest/handlers.h"
 #include "rest/router.h"
@@ -48,6 +51,7 @@ setup_routes(Router & router)
     router.add("/coll/?", HTTP_DELETE, new CollDeleteHandlerFactory);
     router.add("/coll/?/config", HTTP_GETHEAD, new CollGetConfigHandlerFactory);
     router.add("/coll/?/config", HTTP_PUT, new CollSetConfigHandlerFactory);
+    router.add("/coll/?/refresh", HTTP_POST, new CollRefreshHandlerFactory);
 
     // Checkpoints
     router.add("/coll/?/checkpoint", HTTP_GETHEAD, new CollGetCheckpointsHandlerFactory);
@@ -77,10 +81,18 @@ setup_routes(Router & router)
     router.add("/coll/?/type/?", HTTP_POST, new IndexDocumentTypeHandlerFactory);
     router.add("/coll/?/id/?", HTTP_POST, new IndexDocumentIdHandlerFactory);
     router.add("/coll/?", HTTP_POST, new IndexDocumentNoTypeIdHandlerFactory);
+    router.add("/coll/?/bulk", HTTP_POST, new CollBulkHandlerFactory);
 
     // Search
     router.add("/coll/?/type/?/search", HTTP_GETHEAD | HTTP_POST, new SearchHandlerFactory);
     router.add("/coll/?/search", HTTP_GETHEAD | HTTP_POST, new SearchHandlerFactory);
+    router.add("/coll/?/type/?/msearch", HTTP_GETHEAD | HTTP_POST, new MultiSearchHandlerFactory);
+    router.add("/coll/?/msearch", HTTP_GETHEAD | HTTP_POST, new MultiSearchHandlerFactory);
+
+    // Search templates
+    router.add("/coll/?/template/?", HTTP_PUT, new CollSetTemplateHandlerFactory);
+    router.add("/coll/?/type/?/template/?/search", HTTP_GETHEAD | HTTP_POST, new TemplateSearchHandlerFactory);
+    router.add("/coll/?/template/?/search", HTTP_GETHEAD | HTTP_POST, new TemplateSearchHandlerFactory);
 
     // Set a handler for anything else to return 404.
     router.set_default(new NotFoundHandlerFactory);
@@ -25,6 +25,7 @@
 #include <config.h>
 
 #include <cstdio>
+#include <fstream>
 #include <memory>
 #include <iostream>
 #include "loadfile.h"
@@ -33,6 +34,7 @@
 #include "httpserver/httpserver.h"
 // #include "importer/filesystem/filesystem_import.h"
 #include "importer/mongo/mongo_import.h"
+#include "jsonxapian/bulk_load.h"
 #include <pthread.h>
 #include "rest/routes.h"
 #include "rest/router.h"
@@ -40,6 +42,7 @@
 #include "server/task_manager.h"
 #include "server/server.h"
 #include "utils/rsperrors.h"
+#include "utils/utils.h"
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -81,11 +84,20 @@ main_do(int argc, char * const* argv)
 	// Have already done an action, so should finish.
     } else if (opts.action == CliOptions::ACT_SERVE) {
 	CollectionPool pool(opts.datadir);
-	TaskManager * taskman = new TaskManager(pool);
+	TaskManagerSizes sizes;
+	opts.apply_task_sizes(sizes);
+	TaskManager * taskman = new TaskManager(pool, sizes);
 	server.add("taskman", taskman);
+	if (opts.journal) {
+	    taskman->enable_journals();
+	}
 	Router router(taskman, &server);
 	setup_routes(router);
-	server.add("httpserver", new HTTPServer(opts.port, opts.pedantic, &router));
+	server.add("httpserver", new HTTPServer(opts.port, opts.pedantic, &router,
+						opts.http_threads,
+						opts.max_body_size,
+						opts.compress_level,
+						opts.compress_min_size));
 
 	if (!opts.mongo_import.empty()) {
 	    std::auto_ptr<MongoImporter> importer(new MongoImporter(taskman));
@@ -93,6 +105,9 @@ main_do(int argc, char * const* argv)
 	    importer->set_config(json_unserialise(opts.mongo_import, config));
 	    server.add_bg_task("mongoimport", importer.release());
 	}
+	// Start the task manager before the HTTP server, so that changes
+	// replayed from the journals are queued before any new ones.
+	taskman->start();
 	server.run();
 
     } else if (opts.action == CliOptions::ACT_SEARCH) {
@@ -124,6 +139,39 @@ main_do(int argc, char * const* argv)
 	    }
 	}
 
+    } else if (opts.action == CliOptions::ACT_LOAD) {
+	std::ifstream loadfile;
+	std::istream * input = &std::cin;
+	if (opts.loadfile != "-") {
+	    loadfile.open(opts.loadfile.c_str());
+	    if (!loadfile) {
+		throw SysError("Unable to open file to load \"" +
+			       opts.loadfile + "\"", errno);
+	    }
+	    input = &loadfile;
+	}
+	unsigned threads = opts.load_threads;
+	if (threads == 0) {
+	    threads = get_cpu_count();
+	}
+
+	Collection coll(opts.dbname, opts.datadir + "/" + opts.dbname);
+	coll.open_writable();
+	BulkLoadResult result;
+	bulk_load(coll, *input, threads, result);
+	coll.close();
+
+	for (std::vector<std::string>::const_iterator
+	     i = result.errors.begin(); i != result.errors.end(); ++i) {
+	    std::cerr << *i << std::endl;
+	}
+	std::cout << "Loaded " << result.loaded << " documents from " <<
+		result.lines << " lines";
+	if (result.failed != 0) {
+	    std::cout << "; " << result.failed << " documents failed";
+	}
+	std::cout << std::endl;
+
     } else if (opts.action == CliOptions::ACT_TRAIN) {
 	Categoriser cat;
 	for (std::vector<std::string>::const_iterator
@@ -4,6 +4,8 @@ noinst_HEADERS += \
  src/server/basetasks.h \
  src/server/checkpoints.h \
  src/server/ignore_sigpipe.h \
+ src/server/journal.h \
+ src/server/result_cache.h \
  src/server/result_handle.h \
  src/server/server.h \
  src/server/signals.h \
@@ -11,16 +13,20 @@ noinst_HEADERS += \
  src/server/task_queue_group.h \
  src/server/task_threads.h \
  src/server/tasks.h \
- src/server/thread_pool.h
+ src/server/thread_pool.h \
+ src/server/write_ack.h
 
 libserver_a_SOURCES = \
  src/server/basetasks.cc \
  src/server/checkpoints.cc \
  src/server/ignore_sigpipe.cc \
+ src/server/journal.cc \
+ src/server/result_cache.cc \
  src/server/result_handle.cc \
  src/server/server.cc \
  src/server/signals.cc \
  src/server/task_manager.cc \
  src/server/task_threads.cc \
  src/server/tasks.cc \
- src/server/thread_pool.cc
+ src/server/thread_pool.cc \
+ src/server/write_ack.cc
@@ -25,6 +25,7 @@
 #include <config.h>
 #include "server/basetasks.h"
 
+#include "dbgroup/dbgroup.h"
 #include "server/task_manager.h"
 #include <string>
 
@@ -64,6 +65,14 @@ IndexingTask::perform(const string & coll_name,
     post_perform(coll_name, collection, taskman);
 }
 
+unsigned long
+IndexingTask::doc_sequence_key(const string & idterm)
+{
+    unsigned long key = DbGroup::idterm_hash(idterm);
+    // 0 means no key, so avoid it.
+    return (key == 0) ? 1 : key;
+}
+
 void
 IndexingTask::post_perform(const std::string &,
 			   RestPose::Collection *,
@@ -37,6 +37,26 @@ namespace RestPose {
 
 class TaskManager;
 
+/** Scheduling priority classes for tasks.
+ *
+ *  Waiting tasks are taken from the highest priority class which has any,
+ *  except that batch tasks are given a turn periodically, so that they always
+ *  make progress.
+ */
+enum TaskPriority {
+    /// Status and administration requests, which are cheap.
+    PRIORITY_ADMIN,
+
+    /// Requests which a user is waiting for.  The default.
+    PRIORITY_INTERACTIVE,
+
+    /// Expensive requests, which may be delayed in favour of cheaper ones.
+    PRIORITY_BATCH,
+
+    /// The number of priority classes.
+    PRIORITY_COUNT
+};
+
 /** Base class of all tasks performed.
  */
 class Task {
@@ -48,10 +68,50 @@ class Task {
      */
     bool allow_parallel;
 
+    /** Key used to keep related tasks in order.
+     *
+     *  Tasks which allow parallel execution, but have the same non-zero
+     *  sequence key, are never performed at the same time, so are performed
+     *  in the order they were queued.  0 means no key.
+     */
+    unsigned long sequence_key;
+
+    /** Time (as returned by RealTime::now()) after which the task should be
+     *  abandoned rather than started, or 0.0 for no deadline.
+     */
+    double deadline;
+
+    /// The priority class the task is scheduled in.
+    TaskPriority priority;
+
+    /** Time (as returned by RealTime::now()) at which the task was queued,
+     *  or last requeued.  Only used for statistics of time spent waiting.
+     */
+    double queued_at;
+
     Task(bool allow_parallel_=true)
-	    : allow_parallel(allow_parallel_)
+	    : allow_parallel(allow_parallel_),
+	      sequence_key(0),
+	      deadline(0.0),
+	      priority(PRIORITY_INTERACTIVE),
+	      queued_at(0.0)
     {}
     virtual ~Task();
+
+    /** Called instead of performing the task, if its deadline passes while
+     *  it is waiting on a queue.
+     *
+     *  The task is deleted after this call.
+     */
+    virtual void expired();
+
+    /** Check if the result of the task is no longer wanted.
+     *
+     *  Cancelled tasks which haven't been started are dropped from their
+     *  queue without being performed.  The default implementation returns
+     *  false.
+     */
+    virtual bool cancelled() const;
 };
 
 /// A task for the readonly task queue.
@@ -76,6 +136,20 @@ class ReadonlyTask : public Task {
     }
 
     virtual void perform(RestPose::Collection * collection) = 0;
+
+    /** Estimate the cost of performing the task.
+     *
+     *  The cost is roughly the number of documents which will need to be
+     *  examined.  Called with the collection the task will be performed on,
+     *  before calling perform().  The default implementation returns 0.
+     */
+    virtual double estimate_cost(RestPose::Collection * collection) const;
+
+    /// Report that the task timed out before it was started.
+    void expired();
+
+    /// Check if the result handle has been cancelled.
+    bool cancelled() const;
 };
 
 /// A task for the readonly task queue, for a specific collection.
@@ -107,7 +181,19 @@ class ProcessingTask : public Task {
  */
 class IndexingTask : public Task {
   public:
-    IndexingTask() : Task(false) {}
+    /** Create an indexing task.
+     *
+     *  Indexing tasks which allow parallel execution may be performed by
+     *  several threads at once, when a collection has several writers.
+     *  They should have a sequence key identifying the document they modify.
+     */
+    IndexingTask(bool allow_parallel_=false) : Task(allow_parallel_) {}
+
+    /** Get the sequence key to use for a task modifying a document.
+     *
+     *  @param idterm The idterm of the document.
+     */
+    static unsigned long doc_sequence_key(const std::string & idterm);
 
     void perform(const std::string & coll_name,
 		 RestPose::Collection * & collection,
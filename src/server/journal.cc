@@ -0,0 +1,346 @@
+/** @file journal.cc
+ * @brief Journals of the changes accepted for collections.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "server/journal.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include "diritor.h"
+#include "loadfile.h"
+#include "logger/logger.h"
+#include "safeerrno.h"
+#include "serialise.h"
+#include "str.h"
+#include "utils/io_wrappers.h"
+#include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
+#include "utils.h"
+
+using namespace std;
+using namespace RestPose;
+
+/// The prefix of the names of journal segment files.
+#define SEGMENT_PREFIX "journal"
+
+void
+JournalRecord::append_index(string & records,
+			    const string & doc_type,
+			    const string & doc_id,
+			    const Json::Value & doc)
+{
+    string payload(1, char(INDEX));
+    payload += encode_length(doc_type.size());
+    payload += doc_type;
+    payload += encode_length(doc_id.size());
+    payload += doc_id;
+    payload += json_serialise(doc);
+    records += encode_length(payload.size());
+    records += payload;
+}
+
+void
+JournalRecord::append_delete(string & records,
+			     const string & doc_type,
+			     const string & doc_id)
+{
+    string payload(1, char(DELETE));
+    payload += encode_length(doc_type.size());
+    payload += doc_type;
+    payload += encode_length(doc_id.size());
+    payload += doc_id;
+    records += encode_length(payload.size());
+    records += payload;
+}
+
+CollectionJournal::CollectionJournal(const string & dir_)
+	: deleting(false),
+	  dir(dir_),
+	  active(1)
+{
+}
+
+CollectionJournal::~CollectionJournal()
+{
+    reset();
+}
+
+string
+CollectionJournal::segment_path(unsigned num) const
+{
+    return dir + "/" SEGMENT_PREFIX + str(num);
+}
+
+void
+CollectionJournal::close_segment(map<unsigned, Segment>::iterator i)
+{
+    if (i->second.fd != -1) {
+	if (!io_close(i->second.fd)) {
+	    LOG_ERROR("Failed to close journal segment",
+		      SysError(segment_path(i->first), errno));
+	}
+	unreleased.push_back(segment_path(i->first));
+    }
+    segments.erase(i);
+}
+
+void
+CollectionJournal::recover(vector<string> & paths)
+{
+    paths.clear();
+    vector<unsigned> nums;
+    const size_t prefix_len = sizeof(SEGMENT_PREFIX) - 1;
+    ContextLocker lock(mutex);
+    if (dir_exists(dir)) {
+	try {
+	    DirectoryIterator diriter(false);
+	    diriter.start(dir);
+	    while (diriter.next()) {
+		string leafname(diriter.leafname());
+		if (leafname.compare(0, prefix_len, SEGMENT_PREFIX) != 0 ||
+		    diriter.get_type() != DirectoryIterator::REGULAR_FILE) {
+		    continue;
+		}
+		string numstr(leafname, prefix_len);
+		if (numstr.empty() ||
+		    numstr.find_first_not_of("0123456789") != string::npos) {
+		    continue;
+		}
+		nums.push_back(atoi(numstr.c_str()));
+	    }
+	} catch (const string & error) {
+	    LOG_ERROR("Unable to list journal segments in '" + dir + "': " +
+		      error);
+	}
+    }
+    sort(nums.begin(), nums.end());
+    for (vector<unsigned>::const_iterator i = nums.begin();
+	 i != nums.end(); ++i) {
+	paths.push_back(segment_path(*i));
+	if (*i >= active) {
+	    active = *i + 1;
+	}
+    }
+}
+
+bool
+CollectionJournal::start_append(unsigned & segment)
+{
+    append_mutex.lock();
+    ContextLocker lock(mutex);
+    if (deleting) {
+	lock.unlock();
+	append_mutex.unlock();
+	return false;
+    }
+    ++(segments[active].pending);
+    segment = active;
+    return true;
+}
+
+bool
+CollectionJournal::finish_append(unsigned segment, const string * records)
+{
+    bool ok = write_append(segment, records);
+    append_mutex.unlock();
+    return ok;
+}
+
+bool
+CollectionJournal::write_append(unsigned segment, const string * records)
+{
+    ContextLocker lock(mutex);
+    map<unsigned, Segment>::iterator i = segments.find(segment);
+    if (i == segments.end()) {
+	// Can't happen, since the journal can't be reset during an append.
+	return records == NULL;
+    }
+    bool ok = true;
+    if (records != NULL && !records->empty()) {
+	if (i->second.fd == -1) {
+	    if (!dir_exists(dir) && mkdir(dir, 0770) != 0 && errno != EEXIST) {
+		LOG_ERROR("Couldn't create journal directory",
+			  SysError(dir, errno));
+		ok = false;
+	    } else {
+		string path(segment_path(segment));
+		i->second.fd = io_open_append_create(path.c_str(), false);
+		if (i->second.fd == -1) {
+		    LOG_ERROR("Couldn't open journal segment",
+			      SysError(path, errno));
+		    ok = false;
+		}
+	    }
+	}
+	if (ok && !io_write(i->second.fd, *records)) {
+	    LOG_ERROR("Couldn't write to journal segment",
+		      SysError(segment_path(segment), errno));
+	    ok = false;
+	}
+    }
+    if (i->second.pending > 0) {
+	--(i->second.pending);
+    }
+    if (i->second.sealed && i->second.pending == 0) {
+	close_segment(i);
+    }
+    return ok;
+}
+
+void
+CollectionJournal::seal()
+{
+    ContextLocker lock(mutex);
+    map<unsigned, Segment>::iterator i = segments.find(active);
+    if (i == segments.end()) {
+	// Nothing has been appended since the last seal.
+	return;
+    }
+    ++active;
+    i->second.sealed = true;
+    if (i->second.pending == 0) {
+	close_segment(i);
+    }
+}
+
+void
+CollectionJournal::take_unreleased(vector<string> & paths)
+{
+    ContextLocker lock(mutex);
+    paths.clear();
+    swap(paths, unreleased);
+}
+
+void
+CollectionJournal::add_unreleased(const vector<string> & paths)
+{
+    ContextLocker lock(mutex);
+    unreleased.insert(unreleased.end(), paths.begin(), paths.end());
+}
+
+void
+CollectionJournal::start_delete()
+{
+    ContextLocker append_lock(append_mutex);
+    reset();
+    ContextLocker lock(mutex);
+    deleting = true;
+}
+
+void
+CollectionJournal::finish_delete()
+{
+    ContextLocker lock(mutex);
+    deleting = false;
+}
+
+void
+CollectionJournal::reset()
+{
+    ContextLocker lock(mutex);
+    for (map<unsigned, Segment>::iterator i = segments.begin();
+	 i != segments.end(); ++i) {
+	if (i->second.fd != -1) {
+	    (void) io_close(i->second.fd);
+	}
+    }
+    segments.clear();
+    unreleased.clear();
+}
+
+bool
+CollectionJournal::read_records(const string & path,
+				vector<JournalRecord> & records)
+{
+    string data;
+    if (!load_file(path, data)) {
+	throw SysError("Couldn't read journal segment '" + path + "'", errno);
+    }
+    const char * pos = data.data();
+    const char * end = pos + data.size();
+    while (pos != end) {
+	const char * start = pos;
+	try {
+	    size_t len = rsp_decode_length(&pos, end, true);
+	    const char * rec_end = pos + len;
+	    if (len == 0 || (*pos != JournalRecord::INDEX &&
+			     *pos != JournalRecord::DELETE)) {
+		throw UnserialisationError("Bad journal record type");
+	    }
+	    JournalRecord record;
+	    record.type = JournalRecord::record_type(*pos++);
+	    len = rsp_decode_length(&pos, rec_end, true);
+	    record.doc_type.assign(pos, len);
+	    pos += len;
+	    len = rsp_decode_length(&pos, rec_end, true);
+	    record.doc_id.assign(pos, len);
+	    pos += len;
+	    if (record.type == JournalRecord::INDEX) {
+		json_unserialise(string(pos, rec_end - pos), record.doc);
+	    }
+	    pos = rec_end;
+	    records.push_back(record);
+	} catch (const Error & e) {
+	    LOG_WARN("Ignoring incomplete record at offset " +
+		     str(start - data.data()) + " of journal segment '" +
+		     path + "': " + e.what());
+	    return false;
+	}
+    }
+    return true;
+}
+
+Journals::~Journals()
+{
+    for (map<string, CollectionJournal *>::iterator i = journals.begin();
+	 i != journals.end(); ++i) {
+	delete i->second;
+    }
+}
+
+void
+Journals::enable(const string & datadir_)
+{
+    ContextLocker lock(mutex);
+    datadir = datadir_;
+    enabled = true;
+}
+
+CollectionJournal *
+Journals::get(const string & coll_name)
+{
+    ContextLocker lock(mutex);
+    if (!enabled) {
+	return NULL;
+    }
+    map<string, CollectionJournal *>::iterator i = journals.find(coll_name);
+    if (i != journals.end()) {
+	return i->second;
+    }
+    auto_ptr<CollectionJournal> journal(
+	new CollectionJournal(datadir + coll_name));
+    journals[coll_name] = journal.get();
+    return journal.release();
+}
@@ -0,0 +1,285 @@
+/** @file journal.h
+ * @brief Journals of the changes accepted for collections.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_JOURNAL_H
+#define RESTPOSE_INCLUDED_JOURNAL_H
+
+#include "json/value.h"
+#include <map>
+#include <string>
+#include "utils/threading.h"
+#include <vector>
+
+namespace RestPose {
+
+/** A change to a document, as recorded in a journal.
+ */
+struct JournalRecord {
+    enum record_type {
+	/// Index (or replace) a document.
+	INDEX = 'I',
+
+	/// Delete a document.
+	DELETE = 'D'
+    };
+
+    record_type type;
+
+    /// The type of the document (may be empty when indexing).
+    std::string doc_type;
+
+    /// The ID of the document (may be empty when indexing).
+    std::string doc_id;
+
+    /// The document to index (null for deletions).
+    Json::Value doc;
+
+    /** Append a serialised record for indexing a document to a string.
+     */
+    static void append_index(std::string & records,
+			     const std::string & doc_type,
+			     const std::string & doc_id,
+			     const Json::Value & doc);
+
+    /** Append a serialised record for deleting a document to a string.
+     */
+    static void append_delete(std::string & records,
+			      const std::string & doc_type,
+			      const std::string & doc_id);
+};
+
+/** An append-only journal of the changes to documents accepted for a
+ *  collection, which may not have been committed yet.
+ *
+ *  Changes are recorded as they're queued, so that if the server stops
+ *  before committing them, they can be replayed when it next starts.  The
+ *  journal is held in a series of segment files in the collection's
+ *  directory, named "journal" followed by the segment number.  Changes are
+ *  appended to the active segment until the collection is next committed,
+ *  when the segment is sealed, and a new one started.  Once all the
+ *  changes in a sealed segment have been applied to the collection, and the
+ *  collection has been committed again, the segment is removed.
+ *
+ *  Each append is split into start_append(), called before the changes are
+ *  queued, and finish_append(), called afterwards with the records if the
+ *  changes were queued.  Only one append may be in progress at once, so
+ *  records are written in the same order as the changes are queued, and
+ *  replaying them applies changes to a document in the right order.  A
+ *  segment isn't released while changes recorded in it may still be being
+ *  queued, but it may be sealed.
+ *
+ *  This is threadsafe - accesses are serialised by an internal mutex.
+ */
+class CollectionJournal {
+    /** The state of a segment which may still be appended to.
+     */
+    struct Segment {
+	/// File descriptor open for appending, or -1 if not open yet.
+	int fd;
+
+	/// The number of appends started, but not finished.
+	unsigned pending;
+
+	/// True once the segment has been sealed.
+	bool sealed;
+
+	Segment() : fd(-1), pending(0), sealed(false) {}
+    };
+
+    /// Mutex protecting the journal.
+    Mutex mutex;
+
+    /** Mutex held from the start to the finish of each append, and while
+     *  deleting.
+     */
+    Mutex append_mutex;
+
+    /// True while the collection is being deleted; appends fail.
+    bool deleting;
+
+    /// The directory holding the segment files.
+    std::string dir;
+
+    /// The number of the active segment.
+    unsigned active;
+
+    /// The segments which may still be appended to, keyed by number.
+    std::map<unsigned, Segment> segments;
+
+    /** Paths of sealed segments, with no appends pending, which haven't
+     *  yet been queued for release.
+     */
+    std::vector<std::string> unreleased;
+
+    /** Get the path of a segment file.
+     */
+    std::string segment_path(unsigned num) const;
+
+    /** Close a sealed segment which has no appends pending.
+     *
+     *  The mutex must be held.
+     */
+    void close_segment(std::map<unsigned, Segment>::iterator i);
+
+    /** Forget about all the segments.
+     */
+    void reset();
+
+    /** Write the records for an append, and finish it.
+     *
+     *  The append mutex must be held.
+     */
+    bool write_append(unsigned segment, const std::string * records);
+
+    CollectionJournal(const CollectionJournal &);
+    void operator=(const CollectionJournal &);
+  public:
+    CollectionJournal(const std::string & dir_);
+    ~CollectionJournal();
+
+    /** Find segments left by a previous run.
+     *
+     *  Appends will start with a new segment after these.  The found
+     *  segments are not released until passed to add_unreleased(), which
+     *  should be done once the changes in them have been queued for
+     *  replaying.
+     *
+     *  @param paths Set to the paths of the segments, in order.
+     */
+    void recover(std::vector<std::string> & paths);
+
+    /** Start appending to the journal.
+     *
+     *  If this succeeds, it must be followed by a call to finish_append();
+     *  other appends wait until then.
+     *
+     *  @param segment Set to the number of the segment to append to.
+     *
+     *  @returns false if the collection is being deleted, in which case
+     *  the changes mustn't be queued.
+     */
+    bool start_append(unsigned & segment);
+
+    /** Finish appending to the journal.
+     *
+     *  @param segment The segment number returned by start_append().
+     *  @param records The serialised records to append, or NULL if the
+     *  changes weren't accepted.
+     *
+     *  @returns false if the records couldn't be written (the error is
+     *  logged).
+     */
+    bool finish_append(unsigned segment, const std::string * records);
+
+    /** Seal the active segment, if anything has been appended to it.
+     *
+     *  Called after the collection has been committed.
+     */
+    void seal();
+
+    /** Take the paths of the sealed segments which are ready for release.
+     *
+     *  All the changes in these segments have been queued.  The caller
+     *  should queue a task which waits for the changes to be applied, and
+     *  then removes the segments once the collection has been committed.
+     */
+    void take_unreleased(std::vector<std::string> & paths);
+
+    /** Add segments to the list of those ready for release.
+     *
+     *  Used for recovered segments, once their changes have been queued,
+     *  and to put back segments which couldn't be queued for release.
+     */
+    void add_unreleased(const std::vector<std::string> & paths);
+
+    /** Prepare for the collection (and its directory) to be deleted.
+     *
+     *  Waits for any append in progress to finish, then forgets about all
+     *  the segments.  Appends fail until finish_delete() is called, so
+     *  that they can't recreate the collection's directory.
+     */
+    void start_delete();
+
+    /** Allow appends again, after the collection has been deleted.
+     *
+     *  Changes appended after this are for a new collection.
+     */
+    void finish_delete();
+
+    /** Read the records in a segment file.
+     *
+     *  Reading stops at the first incomplete record, which will be the
+     *  result of the server stopping while appending it.
+     *
+     *  @returns false if the file ended with an incomplete record.
+     */
+    static bool read_records(const std::string & path,
+			     std::vector<JournalRecord> & records);
+};
+
+/** The journals for all the collections.
+ *
+ *  Journalling is disabled until enable() is called.
+ */
+class Journals {
+    /// Mutex protecting the map of journals.
+    Mutex mutex;
+
+    /// The directory holding the collections (ending with a separator).
+    std::string datadir;
+
+    /// True if journalling is enabled.
+    bool enabled;
+
+    /// The journals, keyed by collection name.
+    std::map<std::string, CollectionJournal *> journals;
+
+    Journals(const Journals &);
+    void operator=(const Journals &);
+  public:
+    Journals() : enabled(false) {}
+    ~Journals();
+
+    /** Enable journalling.
+     *
+     *  @param datadir_ The directory holding the collections.
+     */
+    void enable(const std::string & datadir_);
+
+    bool is_enabled() {
+	ContextLocker lock(mutex);
+	return enabled;
+    }
+
+    /** Get the journal for a collection.
+     *
+     *  @returns The journal (which remains owned by this object, and valid
+     *  for its lifetime), or NULL if journalling is disabled.
+     */
+    CollectionJournal * get(const std::string & coll_name);
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_JOURNAL_H */
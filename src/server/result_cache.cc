@@ -0,0 +1,163 @@
+/** @file result_cache.cc
+ * @brief Cache of search results
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "server/result_cache.h"
+
+#include "utils/jsonutils.h"
+
+using namespace std;
+using namespace RestPose;
+
+/** The largest result to cache, as a fraction of the cache size.
+ *
+ *  This stops a single large result from displacing everything else.
+ */
+static const size_t MAX_ENTRY_FRACTION = 8;
+
+/// Approximate overhead of an entry, beyond its key and body.
+static const size_t ENTRY_OVERHEAD = 128;
+
+size_t
+SearchResultCache::Entry::size() const
+{
+    // The key is held in both the list and the index.
+    return key.size() * 2 + body.size() + ENTRY_OVERHEAD;
+}
+
+SearchResultCache::SearchResultCache(size_t max_bytes_)
+	: mutex(),
+	  max_bytes(max_bytes_),
+	  bytes(0),
+	  entries(),
+	  index(),
+	  hits(0),
+	  misses(0),
+	  invalidations(0),
+	  evictions(0)
+{
+}
+
+void
+SearchResultCache::remove(list<Entry>::iterator i)
+{
+    bytes -= i->size();
+    index.erase(i->key);
+    entries.erase(i);
+}
+
+string
+SearchResultCache::make_key(const string & coll_name,
+			    const string & doc_type,
+			    const Json::Value & search)
+{
+    string key(coll_name);
+    key += '\0';
+    key += doc_type;
+    key += '\0';
+    if (search.isObject() && search.isMember("timeout")) {
+	// The timeout doesn't affect the results (results of searches which
+	// timed out aren't cached), so searches differing only in it share
+	// results.
+	Json::Value tmp(search);
+	tmp.removeMember("timeout");
+	key += json_serialise(tmp);
+    } else {
+	key += json_serialise(search);
+    }
+    return key;
+}
+
+bool
+SearchResultCache::get(const string & key, uint64_t generation,
+		       string & body)
+{
+    ContextLocker lock(mutex);
+    map<string, list<Entry>::iterator>::iterator i = index.find(key);
+    if (i == index.end()) {
+	++misses;
+	return false;
+    }
+    list<Entry>::iterator entry = i->second;
+    if (entry->generation != generation) {
+	if (entry->generation < generation) {
+	    // Changes have been committed since the result was produced.
+	    remove(entry);
+	    ++invalidations;
+	}
+	++misses;
+	return false;
+    }
+    entries.splice(entries.begin(), entries, entry);
+    body = entry->body;
+    ++hits;
+    return true;
+}
+
+void
+SearchResultCache::set(const string & key, uint64_t generation,
+		       const string & body)
+{
+    if (body.size() > max_bytes / MAX_ENTRY_FRACTION) {
+	return;
+    }
+    ContextLocker lock(mutex);
+    map<string, list<Entry>::iterator>::iterator i = index.find(key);
+    if (i != index.end()) {
+	if (i->second->generation > generation) {
+	    // A result from a later generation is already cached.
+	    return;
+	}
+	remove(i->second);
+    }
+
+    entries.push_front(Entry());
+    Entry & entry(entries.front());
+    entry.key = key;
+    entry.generation = generation;
+    entry.body = body;
+    index[key] = entries.begin();
+    bytes += entry.size();
+
+    while (bytes > max_bytes && !entries.empty()) {
+	list<Entry>::iterator last = entries.end();
+	--last;
+	remove(last);
+	++evictions;
+    }
+}
+
+void
+SearchResultCache::get_status(Json::Value & result) const
+{
+    ContextLocker lock(mutex);
+    result = Json::objectValue;
+    result["max_bytes"] = Json::UInt64(max_bytes);
+    result["bytes"] = Json::UInt64(bytes);
+    result["entries"] = Json::UInt64(index.size());
+    result["hits"] = Json::UInt64(hits);
+    result["misses"] = Json::UInt64(misses);
+    result["invalidations"] = Json::UInt64(invalidations);
+    result["evictions"] = Json::UInt64(evictions);
+}
@@ -0,0 +1,127 @@
+/** @file result_cache.h
+ * @brief Cache of search results
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_RESULT_CACHE_H
+#define RESTPOSE_INCLUDED_RESULT_CACHE_H
+
+#include "json/value.h"
+#include <list>
+#include <map>
+#include "utils/safe_inttypes.h"
+#include <string>
+#include "utils/threading.h"
+
+namespace RestPose {
+
+/** A cache of the serialised results of searches.
+ *
+ *  Results are keyed by the collection, document type and search, and
+ *  tagged with the commit generation of the collection they were produced
+ *  from.  A result is only returned for the same generation, so results
+ *  are invalidated whenever changes to the collection are committed.
+ *
+ *  The least recently used results are discarded to keep the total size of
+ *  the cache within a limit.
+ */
+class SearchResultCache {
+    struct Entry {
+	std::string key;
+	uint64_t generation;
+	std::string body;
+
+	size_t size() const;
+    };
+
+    mutable Mutex mutex;
+
+    /// The maximum total size of the entries, in bytes.  0 to disable.
+    size_t max_bytes;
+
+    /// The total size of the entries, in bytes.
+    size_t bytes;
+
+    /// The entries, most recently used first.
+    std::list<Entry> entries;
+
+    /// Index of the entries, by key.
+    std::map<std::string, std::list<Entry>::iterator> index;
+
+    /// Statistics about the use of the cache.
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+
+    /// Remove an entry.  The mutex must be held.
+    void remove(std::list<Entry>::iterator i);
+
+    SearchResultCache(const SearchResultCache &);
+    void operator=(const SearchResultCache &);
+  public:
+    SearchResultCache(size_t max_bytes_);
+
+    /// Check if results are being cached.
+    bool is_enabled() const {
+	return max_bytes != 0;
+    }
+
+    /** Build the key for a search.
+     *
+     *  The search is serialised in its normal form (members in sorted
+     *  order, no whitespace), so equivalent searches have the same key.
+     *  Its "timeout" member is left out, since it doesn't affect the
+     *  results which are cached.
+     */
+    static std::string make_key(const std::string & coll_name,
+				const std::string & doc_type,
+				const Json::Value & search);
+
+    /** Get a cached result.
+     *
+     *  @param generation The current commit generation of the collection.
+     *
+     *  Returns true, and sets body to the serialised result, if a result
+     *  for the generation is cached.
+     */
+    bool get(const std::string & key, uint64_t generation,
+	     std::string & body);
+
+    /** Store a result.
+     *
+     *  @param generation The commit generation of the collection the
+     *  result was produced from.
+     *
+     *  Results which are too large to be worth caching are ignored.
+     */
+    void set(const std::string & key, uint64_t generation,
+	     const std::string & body);
+
+    /** Get the status of the cache, as a JSON object.
+     */
+    void get_status(Json::Value & result) const;
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_RESULT_CACHE_H */
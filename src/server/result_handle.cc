@@ -34,18 +34,20 @@ class ResultHandle::Internal {
     Internal(const Internal &);
     void operator=(const Internal &);
   public:
-    mutable Mutex mutex;
+    mutable Condition cond;
     mutable unsigned ref_count;
     Response response;
     int nudge_fd;
     char nudge_byte;
     bool is_ready;
+    bool is_cancelled;
 
     Internal()
 	    : ref_count(1),
 	      nudge_fd(-1),
 	      nudge_byte('\0'),
-	      is_ready(false) {}
+	      is_ready(false),
+	      is_cancelled(false) {}
 };
 
 
@@ -55,7 +57,7 @@ ResultHandle::ResultHandle()
 
 ResultHandle::~ResultHandle()
 {
-    ContextLocker lock(internal->mutex);
+    ContextLocker lock(internal->cond);
     --(internal->ref_count);
     if (internal->ref_count == 0) {
 	lock.unlock();
@@ -66,7 +68,7 @@ ResultHandle::~ResultHandle()
 ResultHandle::ResultHandle(const ResultHandle & other)
 	: internal(NULL)
 {
-    ContextLocker lock(other.internal->mutex);
+    ContextLocker lock(other.internal->cond);
     internal = other.internal;
     ++(internal->ref_count);
 }
@@ -75,7 +77,7 @@ void
 ResultHandle::operator=(const ResultHandle & other)
 {
     {
-	ContextLocker lock(internal->mutex);
+	ContextLocker lock(internal->cond);
 	--(internal->ref_count);
 	if (internal->ref_count == 0) {
 	    lock.unlock();
@@ -85,7 +87,7 @@ ResultHandle::operator=(const ResultHandle & other)
     }
 
     {
-	ContextLocker lock(other.internal->mutex);
+	ContextLocker lock(other.internal->cond);
 	internal = other.internal;
 	++(internal->ref_count);
     }
@@ -96,14 +98,23 @@ void ResultHandle::set_nudge(int nudge_fd, char nudge_byte) {
     internal->nudge_byte = nudge_byte;
 }
 
+int ResultHandle::get_nudge_fd() const {
+    return internal->nudge_fd;
+}
+
+char ResultHandle::get_nudge_byte() const {
+    return internal->nudge_byte;
+}
+
 Response & ResultHandle::response() {
     return internal->response;
 }
 
 void
 ResultHandle::set_ready() {
-    ContextLocker lock(internal->mutex);
+    ContextLocker lock(internal->cond);
     internal->is_ready = true;
+    internal->cond.broadcast();
     lock.unlock();
     // Unlock before writing, just in case the io_write_byte() blocks.
     (void) io_send_byte(internal->nudge_fd, internal->nudge_byte);
@@ -111,19 +122,51 @@ ResultHandle::set_ready() {
 
 bool
 ResultHandle::is_ready() const {
-    ContextLocker lock(internal->mutex);
+    ContextLocker lock(internal->cond);
     return internal->is_ready;
 }
 
+bool
+ResultHandle::wait_ready(double end_time) const {
+    ContextLocker lock(internal->cond);
+    while (!internal->is_ready) {
+	if (internal->cond.timedwait(end_time)) {
+	    return internal->is_ready;
+	}
+    }
+    return true;
+}
+
 void
-ResultHandle::failed_json(const Json::Value & body, int status_code)
+ResultHandle::cancel() {
+    ContextLocker lock(internal->cond);
+    internal->is_cancelled = true;
+}
+
+bool
+ResultHandle::is_cancelled() const {
+    ContextLocker lock(internal->cond);
+    return internal->is_cancelled;
+}
+
+bool
+ResultHandle::set_ready_json(const Json::Value & body, int status_code)
 {
-    ContextLocker lock(internal->mutex);
-    if (!internal->is_ready) {
-	internal->response.set(body, status_code);
-	internal->is_ready = true;
-	lock.unlock();
-	// Unlock before writing, just in case the io_write_byte() blocks.
-	(void) io_write_byte(internal->nudge_fd, internal->nudge_byte);
+    ContextLocker lock(internal->cond);
+    if (internal->is_ready) {
+	return false;
     }
+    internal->response.set(body, status_code);
+    internal->is_ready = true;
+    internal->cond.broadcast();
+    lock.unlock();
+    // Unlock before writing, just in case the io_write_byte() blocks.
+    (void) io_write_byte(internal->nudge_fd, internal->nudge_byte);
+    return true;
+}
+
+void
+ResultHandle::failed_json(const Json::Value & body, int status_code)
+{
+    (void) set_ready_json(body, status_code);
 }
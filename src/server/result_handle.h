@@ -38,7 +38,8 @@ namespace RestPose {
  *  another thread wants to use the result when it's prepared.
  *
  *  The waiting thread should be notified by some other mechanism (eg, a nudge
- *  on a file descriptor) that the result is ready.
+ *  on a file descriptor) that the result is ready, or should block in
+ *  wait_ready().
  */
 class ResultHandle {
     class Internal;
@@ -53,6 +54,16 @@ class ResultHandle {
 
     void set_nudge(int nudge_fd, char nudge_byte);
 
+    /** Get the file descriptor which is nudged when the result is ready.
+     *
+     *  Returns -1 if no nudge has been set (in which case the waiting
+     *  thread is blocking in wait_ready()).
+     */
+    int get_nudge_fd() const;
+
+    /// Get the byte written to the nudge file descriptor.
+    char get_nudge_byte() const;
+
     /** Get a reference to the response object.
      *
      *  This reference should only be used by the preparing thread before
@@ -73,6 +84,43 @@ class ResultHandle {
      */
     bool is_ready() const;
 
+    /** Block until the result is ready, or a time limit expires.
+     *
+     *  This is intended for use by a waiting thread which has nothing else
+     *  to do until the result is available (eg, an HTTP worker thread when
+     *  the HTTP server is running in threaded mode).
+     *
+     *  @param end_time The time (as returned by RealTime::now()) at which
+     *  to stop waiting.
+     *
+     *  Returns true if the result is ready, false if the time limit expired
+     *  first.
+     */
+    bool wait_ready(double end_time) const;
+
+    /** Mark the result as no longer wanted.
+     *
+     *  This is intended for use by the waiting thread, when it gives up on
+     *  the result (eg, because the client has disconnected).  The preparing
+     *  thread may check is_cancelled() to abandon its work early.
+     */
+    void cancel();
+
+    /** Check if the result is no longer wanted - return true if so.
+     */
+    bool is_cancelled() const;
+
+    /** Set a JSON response, and mark the result as ready, unless the result
+     *  is already ready.
+     *
+     *  This is safe to call when several threads are preparing parts of
+     *  the result; only the first call will have any effect.
+     *
+     *  @returns true if the response was set, false if the result was
+     *  already ready.
+     */
+    bool set_ready_json(const Json::Value & body, int status_code = 200);
+
     /** This may be called by the preparing thread to indicate a failure.
      *
      *  If set_ready() has already been called, this call will have no effect.
@@ -25,30 +25,82 @@
 #include <config.h>
 #include "task_manager.h"
 
+#include <algorithm>
 #include "logger/logger.h"
+#include "realtime.h"
 #include "safeerrno.h"
 #include "str.h"
 #include "safesysselect.h"
 #include "socketpair.h"
 #include "utils/jsonutils.h"
+#include "utils/utils.h"
 
 using namespace std;
 using namespace RestPose;
 
-TaskManager::TaskManager(CollectionPool & collections_)
+/** Average time (in seconds) that searches may wait on the queue before an
+ *  elastic search thread pool grows.
+ */
+static const double ELASTIC_GROW_WAIT = 0.01;
+
+/** Time (in seconds) to wait for space on a processing queue when replaying
+ *  a journal.
+ */
+static const double JOURNAL_REPLAY_TIMEOUT = 300.0;
+
+TaskManagerSizes::TaskManagerSizes()
+	: indexing_threads(2),
+	  collection_writers(1),
+	  processing_threads(get_cpu_count()),
+	  search_threads(get_cpu_count()),
+	  max_search_threads(0),
+	  match_threads(0),
+	  indexing_queue_size(101000),
+	  processing_queue_size(101000),
+	  search_queue_size(2000),
+	  result_cache_size(32 * 1024 * 1024),
+	  filter_cache_size(8 * 1024 * 1024)
+{
+}
+
+/** Get the size at which a queue of a given maximum size is throttled.
+ *
+ *  Large queues are throttled when they're within 1% of being full; small
+ *  ones when they're half full.
+ */
+static size_t
+throttle_size(size_t max_size)
+{
+    if (max_size > 10000) {
+	return max_size - max_size / 101;
+    }
+    return max_size / 2;
+}
+
+TaskManager::TaskManager(CollectionPool & collections_,
+			 const TaskManagerSizes & sizes_)
 	: nudge_write_end(-1),
 	  nudge_read_end(-1),
 	  started(false),
 	  stopping(false),
-	  indexing_queues(100000, 101000), // FIXME - pull out magic constants
+	  indexing_queues(throttle_size(sizes_.indexing_queue_size),
+			  sizes_.indexing_queue_size),
 	  indexing_threads(),
-	  processing_queues(100000, 101000), // FIXME - pull out magic constants
+	  processing_queues(throttle_size(sizes_.processing_queue_size),
+			    sizes_.processing_queue_size),
 	  processing_threads(),
-	  search_queues(1000, 2000), // FIXME - pull out magic constants
+	  search_queues(throttle_size(sizes_.search_queue_size),
+			sizes_.search_queue_size),
 	  search_threads(),
+	  match_pool(),
+	  merge_queues(1, 1),
+	  merge_threads(),
 	  collections(collections_),
 	  collconfigs(collections),
-	  checkpoints(100, 24 * 60 * 60) // Keep up to 100 log messages per checkpoint, and keep checkpoints for a day.  FIXME - pull out magic constants
+	  checkpoints(100, 24 * 60 * 60), // Keep up to 100 log messages per checkpoint, and keep checkpoints for a day.  FIXME - pull out magic constants
+	  sizes(sizes_),
+	  journals(),
+	  result_cache(sizes_.result_cache_size)
 {
     // Create the nudge socket.
     SOCKET fds[2];
@@ -69,6 +121,8 @@ TaskManager::~TaskManager()
     (void)io_close_socket(nudge_write_end);
     (void)io_close_socket(nudge_read_end);
     search_queues.close();
+    merge_queues.close();
+    merge_threads.stop();
     processing_queues.close();
     processing_queues.wait_for_empty();
     indexing_queues.close();
@@ -77,9 +131,12 @@ TaskManager::~TaskManager()
     indexing_threads.stop();
     search_queues.wait_for_empty();
     search_threads.stop();
+    merge_threads.join();
     processing_threads.join();
     indexing_threads.join();
     search_threads.join();
+    collections.set_match_pool(NULL);
+    match_pool.stop();
 }
 
 Queue::QueueState
@@ -98,9 +155,34 @@ TaskManager::queue_readonly(const std::string & queue, ReadonlyTask * task)
 						  false);
     LOG_DEBUG("TaskManager queuing readonly task on '" + queue +
 	      "': state " + str(result));
+    if (result != Queue::FULL && result != Queue::CLOSED) {
+	check_search_threads();
+    }
     return result;
 }
 
+void
+TaskManager::check_search_threads()
+{
+    size_t waiting, idle;
+    double wait_time;
+    search_queues.get_load(waiting, idle, wait_time);
+    if (idle != 0 || waiting == 0) {
+	return;
+    }
+    // Tasks are waiting for a thread.  Only grow if they've been waiting
+    // for a while, or if there's a backlog, to avoid growing for a burst
+    // which the current threads will clear quickly.
+    if (wait_time < ELASTIC_GROW_WAIT && waiting < sizes.search_threads) {
+	return;
+    }
+    if (search_threads.add_elastic_thread(new SearchThread(search_queues,
+							   collections))) {
+	LOG_INFO("Added a search thread: " + str(waiting) +
+		 " tasks waiting, average wait " + str(wait_time) + "s");
+    }
+}
+
 void
 TaskManager::queue_indexing_from_processing(const std::string & queue,
 					    IndexingTask * task)
@@ -168,6 +250,26 @@ TaskManager::queue_indexing(const string & queue,
     return result;
 }
 
+void
+TaskManager::queue_merge(const string & coll_name)
+{
+    {
+	ContextLocker lock(cond);
+	if (stopping) {
+	    return;
+	}
+    }
+    Queue::QueueState result = merge_queues.push(coll_name,
+						 new MergeFragmentsTask,
+						 true);
+    LOG_DEBUG("TaskManager queuing merge of '" + coll_name + "': state " +
+	      str(result));
+    if (result == Queue::FULL) {
+	// Another merge will be queued after the next commit.
+	LOG_WARN("Merge queue full: merge of '" + coll_name + "' not queued");
+    }
+}
+
 Queue::QueueState
 TaskManager::queue_processing(const string & queue,
 			      ProcessingTask * task,
@@ -189,6 +291,137 @@ TaskManager::queue_processing(const string & queue,
     return result;
 }
 
+Queue::QueueState
+TaskManager::queue_journalled(const string & queue,
+			      ProcessingTask * task,
+			      const string & records,
+			      bool allow_throttle,
+			      double end_time)
+{
+    CollectionJournal * journal = journals.get(queue);
+    if (journal == NULL) {
+	return queue_processing(queue, task, allow_throttle, end_time);
+    }
+    auto_ptr<ProcessingTask> taskptr(task);
+    unsigned segment;
+    if (!journal->start_append(segment)) {
+	// The collection is being deleted; the change can be retried once
+	// it has been.
+	return Queue::FULL;
+    }
+    Queue::QueueState result;
+    try {
+	result = queue_processing(queue, taskptr.release(), allow_throttle,
+				  end_time);
+    } catch(...) {
+	(void) journal->finish_append(segment, NULL);
+	throw;
+    }
+    bool accepted = (result != Queue::FULL && result != Queue::CLOSED);
+    (void) journal->finish_append(segment, accepted ? &records : NULL);
+    queue_journal_release(queue);
+    return result;
+}
+
+void
+TaskManager::seal_journal(const string & coll_name)
+{
+    CollectionJournal * journal = journals.get(coll_name);
+    if (journal == NULL) {
+	return;
+    }
+    journal->seal();
+    queue_journal_release(coll_name);
+}
+
+void
+TaskManager::queue_journal_release(const string & coll_name)
+{
+    CollectionJournal * journal = journals.get(coll_name);
+    if (journal == NULL) {
+	return;
+    }
+    vector<string> paths;
+    journal->take_unreleased(paths);
+    if (paths.empty()) {
+	return;
+    }
+    // Queue the release on the processing queue, so that it follows all
+    // the changes in the segments.
+    Queue::QueueState result = queue_processing(coll_name,
+	new DelayedIndexingTask(new JournalReleaseTask(paths)), false);
+    if (result == Queue::FULL || result == Queue::CLOSED) {
+	// Try again after the next append or commit.
+	journal->add_unreleased(paths);
+    }
+}
+
+void
+TaskManager::enable_journals()
+{
+    journals.enable(collections.get_datadir());
+}
+
+void
+TaskManager::replay_journals()
+{
+    vector<string> coll_names;
+    collections.get_names(coll_names);
+    for (vector<string>::const_iterator i = coll_names.begin();
+	 i != coll_names.end(); ++i) {
+	const string & coll_name = *i;
+	CollectionJournal * journal = journals.get(coll_name);
+	vector<string> paths;
+	journal->recover(paths);
+	if (paths.empty()) {
+	    continue;
+	}
+	size_t replayed = 0;
+	bool complete = true;
+	for (vector<string>::const_iterator j = paths.begin();
+	     complete && j != paths.end(); ++j) {
+	    vector<JournalRecord> records;
+	    try {
+		(void) CollectionJournal::read_records(*j, records);
+	    } catch(const RestPose::Error & e) {
+		LOG_ERROR("Unable to replay journal for collection '" +
+			  coll_name + "'", e);
+		complete = false;
+		break;
+	    }
+	    for (vector<JournalRecord>::const_iterator k = records.begin();
+		 k != records.end(); ++k) {
+		ProcessingTask * task;
+		if (k->type == JournalRecord::INDEX) {
+		    task = new ProcessorProcessDocumentTask(k->doc_type,
+							    k->doc_id,
+							    k->doc);
+		} else {
+		    task = new DelayedIndexingTask(
+			new DeleteDocumentTask(k->doc_type, k->doc_id));
+		}
+		Queue::QueueState result = queue_processing(coll_name, task,
+		    false, RealTime::now() + JOURNAL_REPLAY_TIMEOUT);
+		if (result == Queue::FULL || result == Queue::CLOSED) {
+		    LOG_ERROR("Unable to queue changes from journal for "
+			      "collection '" + coll_name + "'");
+		    complete = false;
+		    break;
+		}
+		++replayed;
+	    }
+	}
+	LOG_INFO("Replayed " + str(replayed) + " changes from journal for "
+		 "collection '" + coll_name + "'");
+	if (complete) {
+	    // Replaying the changes again is harmless, so the segments are
+	    // only removed once the replayed changes have been committed.
+	    journal->add_unreleased(paths);
+	    queue_journal_release(coll_name);
+	}
+    }
+}
+
 Queue::QueueState
 TaskManager::queue_pipe_document(const string & collection,
 				 const string & pipe,
@@ -223,25 +456,51 @@ TaskManager::start()
     LOG_DEBUG("TaskManager starting");
 
     // Start threads for indexing, processing and searching.
-    // FIXME - these should be configurable
-    int indexing_thread_count = 2;
-    int processing_thread_count = 10;
-    int search_thread_count = 10;
+    unsigned indexing_thread_count = sizes.indexing_threads;
+    unsigned processing_thread_count = sizes.processing_threads;
+    unsigned search_thread_count = sizes.search_threads;
+
+    // Let several indexing threads write to a collection at once, each
+    // mostly writing to its own write partition.
+    indexing_queues.set_max_handlers(sizes.collection_writers);
+    collections.set_write_partitions(sizes.collection_writers);
+    collections.set_filter_cache_size(sizes.filter_cache_size);
 
-    for (int i = indexing_thread_count; i != 0; --i) {
+    for (unsigned i = indexing_thread_count; i != 0; --i) {
 	indexing_threads.add_thread(new IndexingThread(indexing_queues,
 						       collections,
 						       this));
     }
-    for (int i = processing_thread_count; i != 0; --i) {
+    for (unsigned i = processing_thread_count; i != 0; --i) {
 	processing_threads.add_thread(new ProcessingThread(processing_queues,
 							   collections,
 							   this));
     }
-    for (int i = search_thread_count; i != 0; --i) {
+    // Leave some search threads free for interactive tasks.
+    search_queues.set_batch_limit(max(1u, search_thread_count / 2));
+    if (sizes.max_search_threads > search_thread_count) {
+	search_threads.set_elastic(search_thread_count,
+				   sizes.max_search_threads);
+    }
+    if (sizes.match_threads != 0) {
+	if (match_pool.start(sizes.match_threads)) {
+	    collections.set_match_pool(&match_pool);
+	} else {
+	    LOG_ERROR("Unable to start threads for parallel matching");
+	    match_pool.stop();
+	}
+    }
+    for (unsigned i = search_thread_count; i != 0; --i) {
 	search_threads.add_thread(new SearchThread(search_queues,
 						   collections));
     }
+    // Merging is IO bound, so one thread is plenty.
+    merge_threads.add_thread(new ProcessingThread(merge_queues, collections,
+						  this));
+
+    if (journals.is_enabled()) {
+	replay_journals();
+    }
 }
 
 void
@@ -250,6 +509,7 @@ TaskManager::stop()
     LOG_DEBUG("TaskManager stopping");
     ContextLocker lock(cond);
     stopping = true;
+    merge_queues.close();
     processing_queues.close();
     search_queues.close();
 }
@@ -257,6 +517,9 @@ TaskManager::stop()
 void
 TaskManager::join()
 {
+    // Don't wait for queued merges; they'll be retried when indexing next
+    // happens.
+    merge_threads.stop();
     LOG_DEBUG("TaskManager waiting for processing queue to empty");
     processing_queues.wait_for_empty();
     indexing_queues.close();
@@ -267,12 +530,16 @@ TaskManager::join()
     LOG_DEBUG("TaskManager waiting for indexing queue to empty");
     indexing_queues.wait_for_empty();
     indexing_threads.stop();
+    LOG_DEBUG("TaskManager waiting for merge thread to finish");
+    merge_threads.join();
     LOG_DEBUG("TaskManager waiting for processing threads to finish");
     processing_threads.join();
     LOG_DEBUG("TaskManager waiting for indexing threads to finish");
     indexing_threads.join();
     LOG_DEBUG("TaskManager waiting for search threads to finish");
     search_threads.join();
+    collections.set_match_pool(NULL);
+    match_pool.stop();
 }
 
 void
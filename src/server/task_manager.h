@@ -28,6 +28,8 @@
 #include "jsonxapian/collection.h"
 #include "jsonxapian/collection_pool.h"
 #include "server/checkpoints.h"
+#include "server/journal.h"
+#include "server/result_cache.h"
 #include "server/result_handle.h"
 #include "server/server.h"
 #include "server/tasks.h"
@@ -37,6 +39,7 @@
 #include <string>
 #include "utils/queueing.h"
 #include "utils/io_wrappers.h"
+#include "utils/workpool.h"
 #include <xapian.h>
 
 namespace Xapian {
@@ -45,6 +48,74 @@ namespace Xapian {
 
 class TaskManager;
 
+/** The sizes of the thread pools and queues used by a TaskManager.
+ */
+struct TaskManagerSizes {
+    /// Number of threads performing indexing.
+    unsigned indexing_threads;
+
+    /** Maximum number of indexing threads writing to a collection at once.
+     *
+     *  New documents in each collection are split between this many write
+     *  partitions, so that the threads mostly write to separate databases.
+     */
+    unsigned collection_writers;
+
+    /// Number of threads processing documents.
+    unsigned processing_threads;
+
+    /// Number of threads for searching (the minimum, in elastic mode).
+    unsigned search_threads;
+
+    /** Maximum number of threads for searching.
+     *
+     *  If greater than search_threads, the search thread pool is elastic,
+     *  growing when searches are waiting, and shrinking when threads are
+     *  idle.
+     */
+    unsigned max_search_threads;
+
+    /** Number of threads for matching the database fragments of a
+     *  collection in parallel, shared by all searches.
+     *
+     *  If 0, each search matches its fragments serially.
+     */
+    unsigned match_threads;
+
+    /** Maximum number of tasks on each indexing queue.
+     *
+     *  Pushes which can be throttled are refused when a queue is nearly
+     *  full.  The same applies to the other queue sizes.
+     */
+    size_t indexing_queue_size;
+
+    /// Maximum number of tasks on each processing queue.
+    size_t processing_queue_size;
+
+    /// Maximum number of tasks on each search queue.
+    size_t search_queue_size;
+
+    /** Maximum size in bytes of the cache of search results.
+     *
+     *  If 0, search results are not cached.
+     */
+    size_t result_cache_size;
+
+    /** Maximum size in bytes of the cache of frequently used filters, for
+     *  each collection opened for searching.
+     *
+     *  If 0, filters are not cached.
+     */
+    size_t filter_cache_size;
+
+    /** Set the default sizes.
+     *
+     *  The processing and search thread counts default to the number of
+     *  processors.
+     */
+    TaskManagerSizes();
+};
+
 /** Manager for all non-instantaneous tasks.
  */
 class TaskManager : public SubServer {
@@ -104,6 +175,19 @@ class TaskManager : public SubServer {
      */
     ThreadPool search_threads;
 
+    /** Threads used by searches to match database fragments in parallel.
+     */
+    WorkPool match_pool;
+
+    /** Queues, keyed by collection name, for merging the database fragments
+     *  of a collection.
+     */
+    TaskQueueGroup merge_queues;
+
+    /** Thread merging database fragments.
+     */
+    ThreadPool merge_threads;
+
     /** The pool of collections used by tasks.
      */
     CollectionPool & collections;
@@ -116,10 +200,32 @@ class TaskManager : public SubServer {
      */
     CheckPointManager checkpoints;
 
+    /** The sizes of the thread pools and queues.
+     */
+    TaskManagerSizes sizes;
+
+    /** The journals of accepted changes, if journalling is enabled.
+     */
+    RestPose::Journals journals;
+
+    /** The cache of search results.
+     */
+    RestPose::SearchResultCache result_cache;
+
+    /** Queue the changes recorded in the journals left by a previous run.
+     */
+    void replay_journals();
+
+    /** Add a search thread if the pool is elastic, and searches are waiting
+     *  for a thread.
+     */
+    void check_search_threads();
+
     TaskManager(const TaskManager &);
     void operator=(const TaskManager &);
   public:
-    TaskManager(CollectionPool & collections_);
+    TaskManager(CollectionPool & collections_,
+		const TaskManagerSizes & sizes_ = TaskManagerSizes());
     ~TaskManager();
 
     CollectionPool & get_collections() {
@@ -134,6 +240,21 @@ class TaskManager : public SubServer {
 	return checkpoints;
     }
 
+    RestPose::Journals & get_journals() {
+	return journals;
+    }
+
+    RestPose::SearchResultCache & get_result_cache() {
+	return result_cache;
+    }
+
+    /** Enable journalling of the changes accepted for collections.
+     *
+     *  Must be called before start(), which replays any changes left in
+     *  the journals by a previous run.
+     */
+    void enable_journals();
+
     /** Get the write end of the nudge pipe.
      *
      *  This is used by resulthandlers to nudge the server when results are
@@ -164,6 +285,12 @@ class TaskManager : public SubServer {
 				     IndexingTask * task,
 				     bool allow_throttle);
 
+    /** Queue a merge of the database fragments of a collection.
+     *
+     *  Does nothing if a merge of the collection is already queued.
+     */
+    void queue_merge(const std::string & coll_name);
+
     /** Queue a processing task.
      */
     Queue::QueueState queue_processing(const std::string & queue,
@@ -171,6 +298,36 @@ class TaskManager : public SubServer {
 				       bool allow_throttle,
 				       double end_time=0.0);
 
+    /** Queue a processing task which makes changes to documents, recording
+     *  the changes in the collection's journal if they're accepted.
+     *
+     *  @param records The serialised journal records for the changes.
+     *
+     *  No other journalled changes are queued for the collection between
+     *  starting and finishing the append, so the records are in the same
+     *  order as the changes are queued.  If the collection is being deleted, the changes
+     *  aren't queued, and FULL is returned, so the request can be retried.
+     *
+     *  If journalling is disabled, this is the same as queue_processing().
+     */
+    Queue::QueueState queue_journalled(const std::string & queue,
+				       ProcessingTask * task,
+				       const std::string & records,
+				       bool allow_throttle,
+				       double end_time=0.0);
+
+    /** Seal the active segment of a collection's journal.
+     *
+     *  Called after the collection has been committed, so that the
+     *  segments holding the committed changes can be released.
+     */
+    void seal_journal(const std::string & coll_name);
+
+    /** Queue the release of any of a collection's journal segments which
+     *  are ready to be released.
+     */
+    void queue_journal_release(const std::string & coll_name);
+
     Queue::QueueState queue_pipe_document(const std::string & collection,
 					  const std::string & pipe,
 					  const Json::Value & doc,
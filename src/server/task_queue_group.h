@@ -24,11 +24,14 @@
 #ifndef RESTPOSE_INCLUDED_TASK_QUEUE_GROUP_H
 #define RESTPOSE_INCLUDED_TASK_QUEUE_GROUP_H
 
+#include <cmath>
+#include <deque>
 #include "logger/logger.h"
 #include <map>
 #include <memory>
 #include "omassert.h"
 #include <queue>
+#include "realtime.h"
 #include "server/server.h"
 #include "server/tasks.h"
 #include <set>
@@ -40,19 +43,95 @@
 
 class TaskManager;
 
+/** The number of times in a row that a waiting batch task may be passed over
+ *  in favour of higher priority tasks, before a batch task is given a turn.
+ */
+static const unsigned BATCH_TURN_INTERVAL = 4;
+
+/** The weight given to the latest wait time when updating the average wait
+ *  time of a task queue group.
+ */
+static const double WAIT_TIME_DECAY = 0.1;
+
+/** The maximum number of tasks which a worker claims from a queue at once.
+ */
+static const size_t MAX_CLAIM_SIZE = 8;
+
 // FIXME - no good reason why most of this class is implemented in the header file.
 
 /** A group of queues of tasks, keyed by a name.
+ *
+ *  Threads may either pop tasks one at a time, with pop_any() or pop_from(),
+ *  or register a Worker and use the Worker form of pop_any().  A Worker
+ *  claims a run of tasks from a queue when the queue is long, and then
+ *  starts them without taking the group's lock; workers with no tasks of
+ *  their own steal half of the tasks claimed by another worker.
  */
 class TaskQueueGroup {
     friend class TaskManager;
 
+  public:
+    /** The state of a thread which pops tasks from the group as a worker.
+     *
+     *  A worker must be registered with add_worker() before it is used, and
+     *  removed with remove_worker() before it is destroyed.
+     */
+    class Worker {
+	friend class TaskQueueGroup;
+
+	/** Mutex protecting key and tasks, which are accessed by other
+	 *  workers when they steal tasks.
+	 */
+	Mutex mutex;
+
+	/// The key of the queue which the claimed tasks were taken from.
+	std::string key;
+
+	/// Tasks claimed by the worker, which haven't been started yet.
+	std::deque<Task *> tasks;
+
+	/// The number of claimed tasks finished, but not yet reported.
+	size_t finished;
+
+	/// The number of batch priority tasks counted in finished.
+	size_t finished_batch;
+
+	/// The number of tasks started since the last report.
+	size_t started;
+
+	/// The total time that the tasks counted in started spent waiting.
+	double total_wait;
+
+	/** Note that a claimed task has been finished (or dropped).
+	 */
+	void note_finished(const Task * task) {
+	    ++finished;
+	    if (task->priority == PRIORITY_BATCH) {
+		++finished_batch;
+	    }
+	}
+
+	Worker(const Worker &);
+	void operator=(const Worker &);
+      public:
+	Worker()
+		: mutex(),
+		  key(),
+		  tasks(),
+		  finished(0),
+		  finished_batch(0),
+		  started(0),
+		  total_wait(0.0)
+	{}
+    };
+
+  private:
     /** A queue in the group, and associated information.
      */
     struct QueueInfo {
-	/** The actual queue of tasks.
+	/** The actual queues of tasks, one for each priority class.
 	 */
-	std::queue<Task *> queue;
+	std::queue<Task *> lanes[PRIORITY_COUNT];
 
 	/** Tasks in progress.
 	 *
@@ -69,13 +148,47 @@ class TaskQueueGroup {
 	 */
 	bool active;
 
-	/** True for queues which have a dedicated handler assigned.
+	/** The number of dedicated handlers assigned to the queue.
+	 */
+	size_t handlers;
+
+	/** The number of tasks claimed by workers, and not yet reported as
+	 *  finished.  These are either waiting in a worker, or in progress.
 	 */
-	bool assigned;
+	size_t local;
+
+	/** True if one of the tasks counted in local doesn't run freely (see
+	 *  runs_freely()).
+	 */
+	bool local_exclusive;
 
 	/** Create a new, empty, active queue.
 	 */
-	QueueInfo() : queue(), active(true), assigned(false) {}
+	QueueInfo()
+		: active(true), handlers(0),
+		  local(0), local_exclusive(false)
+	{}
+
+	/** Get the number of tasks waiting in the queue.
+	 */
+	size_t size() const {
+	    size_t result = 0;
+	    for (int lane = 0; lane != PRIORITY_COUNT; ++lane) {
+		result += lanes[lane].size();
+	    }
+	    return result;
+	}
+
+	/** Check if there are no tasks waiting in the queue.
+	 */
+	bool empty() const {
+	    for (int lane = 0; lane != PRIORITY_COUNT; ++lane) {
+		if (!lanes[lane].empty()) {
+		    return false;
+		}
+	    }
+	    return true;
+	}
     };
 
     /** The queues of tasks.
@@ -95,14 +208,123 @@ class TaskQueueGroup {
     int nudge_fd;
     char nudge_byte;
 
+    /** The maximum number of batch tasks to run at once, or 0 for no limit.
+     *
+     *  Keeping this below the number of threads popping from the group means
+     *  that there are always threads available for higher priority tasks.
+     */
+    size_t batch_limit;
+
+    /// The number of batch tasks in progress.
+    size_t batch_in_progress;
+
+    /** The number of times in a row that a batch task which could have
+     *  been run has been passed over for a higher priority task.
+     */
+    unsigned batch_passed_over;
+
+    /// The number of threads waiting in pop_any() for a task.
+    size_t idle_threads;
+
+    /** Moving average of the time (in seconds) that started tasks had spent
+     *  waiting on the queues.
+     */
+    double avg_wait;
+
+    /** The maximum number of handlers which may be assigned to a queue at
+     *  once.
+     */
+    size_t max_handlers;
+
+    /// The registered workers.
+    std::vector<Worker *> workers;
+
+    /// The offset in workers at which to start looking for tasks to steal.
+    size_t next_victim;
+
+    /** Get the priority class which the next task should be taken from.
+     *
+     *  Returns -1 if there is no task in the queue which can be started.
+     */
+    int next_lane(const QueueInfo & queue) const {
+	bool batch_ok = !queue.lanes[PRIORITY_BATCH].empty() &&
+		(batch_limit == 0 || batch_in_progress < batch_limit);
+	if (batch_ok && batch_passed_over >= BATCH_TURN_INTERVAL) {
+	    return PRIORITY_BATCH;
+	}
+	for (int lane = 0; lane != PRIORITY_BATCH; ++lane) {
+	    if (!queue.lanes[lane].empty()) {
+		return lane;
+	    }
+	}
+	return batch_ok ? PRIORITY_BATCH : -1;
+    }
+
+    /** Take the next task from a queue.
+     *
+     *  There must be a task which can be started (ie, next_lane() must not
+     *  return -1).  The caller should pass the task to start_task() if it is
+     *  to be performed.
+     */
+    Task * take_next(QueueInfo & queue) {
+	int lane = next_lane(queue);
+	Assert(lane != -1);
+	if (lane == PRIORITY_BATCH) {
+	    batch_passed_over = 0;
+	} else if (!queue.lanes[PRIORITY_BATCH].empty() &&
+		   (batch_limit == 0 || batch_in_progress < batch_limit)) {
+	    ++batch_passed_over;
+	}
+	Task * task = queue.lanes[lane].front();
+	queue.lanes[lane].pop();
+	return task;
+    }
+
+    /** Mark a task as in progress.
+     */
+    void start_task(QueueInfo & queue, Task * task) {
+	queue.in_progress.insert(task);
+	if (task->priority == PRIORITY_BATCH) {
+	    ++batch_in_progress;
+	}
+    }
+
+    /** Mark a task as no longer in progress.
+     *
+     *  If the task isn't one started by start_task(), it must have been
+     *  claimed by a worker.
+     */
+    void finish_task(QueueInfo & queue, Task * task) {
+	if (queue.in_progress.erase(task) == 0) {
+	    release_local(queue, 1, task->priority == PRIORITY_BATCH ? 1 : 0);
+	} else if (task->priority == PRIORITY_BATCH) {
+	    --batch_in_progress;
+	}
+    }
+
+    /** Release tasks claimed by workers from a queue.
+     *
+     *  @param count The number of tasks to release.
+     *  @param batch_count The number of the tasks with batch priority.
+     */
+    void release_local(QueueInfo & queue, size_t count, size_t batch_count) {
+	Assert(queue.local >= count);
+	Assert(batch_in_progress >= batch_count);
+	queue.local -= count;
+	batch_in_progress -= batch_count;
+	if (queue.local == 0) {
+	    queue.local_exclusive = false;
+	}
+    }
+
     /** Check if the next task is allowed to run now.
      *
      *  This checks if there are any tasks running which prevent the new task
      *  starting, and checks if the new task requires other tasks to have
      *  finished before it starts.
      */
-    bool check_parallel_allowed(QueueInfo & queue) {
-	if (queue.in_progress.empty()) {
+    bool check_parallel_allowed(QueueInfo & queue, int lane) {
+	if (queue.in_progress.empty() && queue.local == 0) {
 	    return true;
 	}
 
@@ -110,57 +332,119 @@ class TaskQueueGroup {
 	// execution.  (Just check the first task being performed, because
 	// if it doesn't allow parallel execution, there should be exactly
 	// one!)
-	if (!(*(queue.in_progress.begin()))->allow_parallel) {
+	if (queue.local_exclusive ||
+	    (!queue.in_progress.empty() &&
+	     !(*(queue.in_progress.begin()))->allow_parallel)) {
 	    return false;
 	}
 
 	// Check if the next task to perform allows parallel execution.
-	if (!queue.queue.front()->allow_parallel) {
+	const Task * next = queue.lanes[lane].front();
+	if (!next->allow_parallel) {
 	    return false;
 	}
 
+	// Check that no task with the same sequence key is being performed.
+	if (next->sequence_key != 0) {
+	    for (std::set<Task *>::const_iterator i = queue.in_progress.begin();
+		 i != queue.in_progress.end(); ++i) {
+		if ((*i)->sequence_key == next->sequence_key) {
+		    return false;
+		}
+	    }
+	}
+
 	return true;
     }
 
-    /** Pick a queue which is active and not assigned.
+    /** Find a queue which is active, and has a task which can be started,
+     *  and has fewer than a given number of handlers assigned.
+     *
+     *  A queue which already has handlers is only picked if they're all busy
+     *  performing tasks.  The queue whose next task has the highest priority
+     *  is picked; if several queues have tasks of the same priority, they're
+     *  picked in round-robin order.
+     *
+     *  @param max_handlers The number of handlers which excludes a queue.
+     *  Pass 1 to find only queues with no handlers.
      *
-     *  Block until there is such a queue, or the group is closed.  If the
-     *  group is closed without finding such a queue, return queues.end().
+     *  Returns queues.end() if there is no such queue.
      */
-    std::map<std::string, QueueInfo>::iterator pick_queue() {
-	std::map<std::string, QueueInfo>::iterator i, j;
+    std::map<std::string, QueueInfo>::iterator
+    find_queue(size_t max_handlers) {
+	if (queues.empty()) {
+	    return queues.end();
+	}
+
+	// Move i and j to point to queue after last popped from.
+	std::map<std::string, QueueInfo>::iterator i, j, best;
+	i = queues.lower_bound(last_pop_from + std::string(1, '\0'));
+	if (i == queues.end()) {
+	    i = queues.begin();
+	}
+	j = i;
+
+	// Find the active queue with the highest priority task which can be
+	// started.
+	best = queues.end();
+	int best_lane = PRIORITY_COUNT;
 	while (true) {
-	    if (!queues.empty()) {
-		// Move i and j to point to queue after last popped from.
-		i = queues.lower_bound(last_pop_from + std::string(1, '\0'));
-		if (i == queues.end()) {
-		    i = queues.begin();
+	    const QueueInfo & queue = i->second;
+	    if (queue.active && queue.handlers < max_handlers &&
+		(queue.handlers == 0 ||
+		 queue.in_progress.size() >= queue.handlers)) {
+		int lane = next_lane(i->second);
+		if (lane != -1 && lane < best_lane &&
+		    check_parallel_allowed(i->second, lane)) {
+		    best = i;
+		    best_lane = lane;
 		}
-		j = i;
-
-		// Try and find an unassigned, active queue with items in it.
-		while (true) {
-		    if (i->second.active && !i->second.assigned &&
-			!i->second.queue.empty()) {
-			if (check_parallel_allowed(i->second)) {
-			    last_pop_from = i->first;
-			    return i;
-			}
-		    }
+	    }
 
-		    ++i;
-		    if (i == queues.end()) {
-			i = queues.begin();
-		    }
-		    if (i == j) {
-			break;
-		    }
-		}
+	    ++i;
+	    if (i == queues.end()) {
+		i = queues.begin();
+	    }
+	    if (i == j) {
+		break;
+	    }
+	}
+	if (best != queues.end()) {
+	    last_pop_from = best->first;
+	}
+	return best;
+    }
+
+    /** Pick a queue which is active and has a task which can be started.
+     *
+     *  The queue is chosen as by find_queue().
+     *
+     *  Block until there is such a queue, or the group is closed, or
+     *  end_time is reached (if it is not 0.0).  If no such queue is found,
+     *  return queues.end().
+     */
+    std::map<std::string, QueueInfo>::iterator
+    pick_queue(double end_time, size_t max_handlers) {
+	while (true) {
+	    std::map<std::string, QueueInfo>::iterator i =
+		    find_queue(max_handlers);
+	    if (i != queues.end()) {
+		return i;
 	    }
 	    if (closed) {
 		return queues.end();
 	    }
-	    cond.wait();
+	    ++idle_threads;
+	    bool timed_out = false;
+	    if (end_time == 0.0) {
+		cond.wait();
+	    } else {
+		timed_out = cond.timedwait(end_time);
+	    }
+	    --idle_threads;
+	    if (timed_out) {
+		return queues.end();
+	    }
 	}
     }
 
@@ -182,15 +466,232 @@ class TaskQueueGroup {
     void check_for_cleanup(const std::map<std::string, QueueInfo>::iterator & i)
     {
 	QueueInfo & queue(i->second);
-	if (queue.queue.size() == 0 &&
+	if (queue.empty() &&
 	    queue.in_progress.size() == 0 &&
+	    queue.local == 0 &&
 	    queue.active &&
-	    !queue.assigned) {
+	    queue.handlers == 0) {
 	    // Boring queue - equivalent to not existing.
 	    queues.erase(i);
 	}
     }
 
+    /** Remove cancelled tasks which are waiting in a queue.
+     *
+     *  Used when a queue is full, so that tasks whose results are no longer
+     *  wanted don't take up space.
+     *
+     *  Returns true if any tasks were removed.
+     */
+    bool purge_cancelled(QueueInfo & queue)
+    {
+	bool removed = false;
+	for (int lane = 0; lane != PRIORITY_COUNT; ++lane) {
+	    std::queue<Task *> & tasks = queue.lanes[lane];
+	    size_t count = tasks.size();
+	    while (count-- != 0) {
+		Task * task = tasks.front();
+		tasks.pop();
+		if (task->cancelled()) {
+		    delete task;
+		    removed = true;
+		} else {
+		    tasks.push(task);
+		}
+	    }
+	}
+	if (removed) {
+	    LOG_DEBUG("Removed cancelled tasks from a full queue");
+	}
+	return removed;
+    }
+
+    /** Report the tasks which a worker has finished, and the time which
+     *  those it started spent waiting.
+     *
+     *  The lock must be held.
+     */
+    void report_local(Worker & worker) {
+	if (worker.started != 0) {
+	    // Equivalent to updating the average once for each task, if they
+	    // all waited for the mean time.
+	    double mean = worker.total_wait / worker.started;
+	    double weight = 1.0 - std::pow(1.0 - WAIT_TIME_DECAY,
+					   double(worker.started));
+	    avg_wait += (mean - avg_wait) * weight;
+	    worker.started = 0;
+	    worker.total_wait = 0.0;
+	}
+	if (worker.finished == 0) {
+	    return;
+	}
+	std::map<std::string, QueueInfo>::iterator i = queues.find(worker.key);
+	Assert(i != queues.end());
+	release_local(i->second, worker.finished, worker.finished_batch);
+	worker.finished = 0;
+	worker.finished_batch = 0;
+	check_for_cleanup(i);
+	cond.broadcast();
+    }
+
+    /** Check if a task may be run in parallel with any other task.
+     *
+     *  Claimed tasks aren't tracked individually, so other tasks can't be
+     *  checked against them; a claimed task which doesn't run freely must
+     *  run alone.
+     */
+    static bool runs_freely(const Task * task) {
+	return task->allow_parallel && task->sequence_key == 0;
+    }
+
+    /** Claim tasks from a queue for a worker.
+     *
+     *  The queue must have a task which can be started, and the worker must
+     *  have no claimed tasks.  When the queue is long, a run of tasks of the
+     *  same priority is claimed, so that the worker can start them without
+     *  taking the lock; the run is limited to a share of the queue, so that
+     *  other workers have tasks to take.  Tasks which don't run freely, and
+     *  batch tasks, are claimed one at a time.
+     *
+     *  The lock must be held.
+     */
+    void claim(Worker & worker, std::map<std::string, QueueInfo>::iterator i) {
+	QueueInfo & queue = i->second;
+	int lane = next_lane(queue);
+	Assert(lane != -1);
+	Assert(!workers.empty());
+	size_t count = 1;
+	if (lane != PRIORITY_BATCH && runs_freely(queue.lanes[lane].front())) {
+	    count = queue.lanes[lane].size() / workers.size();
+	    if (count > MAX_CLAIM_SIZE) {
+		count = MAX_CLAIM_SIZE;
+	    } else if (count == 0) {
+		count = 1;
+	    }
+	}
+
+	ContextLocker worker_lock(worker.mutex);
+	Assert(worker.tasks.empty());
+	worker.key = i->first;
+	Task * task = take_next(queue);
+	if (!runs_freely(task)) {
+	    queue.local_exclusive = true;
+	}
+	if (task->priority == PRIORITY_BATCH) {
+	    ++batch_in_progress;
+	}
+	worker.tasks.push_back(task);
+	++queue.local;
+	while (--count != 0 && next_lane(queue) == lane &&
+	       runs_freely(queue.lanes[lane].front())) {
+	    worker.tasks.push_back(take_next(queue));
+	    ++queue.local;
+	}
+    }
+
+    /** Steal tasks claimed by another worker.
+     *
+     *  Takes half of the waiting tasks (rounded up) from the back of the
+     *  first worker found with any.  The thief must have no claimed tasks.
+     *
+     *  The lock must be held.
+     *
+     *  @returns true if any tasks were stolen.
+     */
+    bool steal(Worker & thief) {
+	size_t count = workers.size();
+	for (size_t n = 0; n != count; ++n) {
+	    Worker * victim = workers[(next_victim + n) % count];
+	    if (victim == &thief) {
+		continue;
+	    }
+	    ContextLocker victim_lock(victim->mutex);
+	    if (victim->tasks.empty()) {
+		continue;
+	    }
+	    size_t steal_count = (victim->tasks.size() + 1) / 2;
+	    ContextLocker thief_lock(thief.mutex);
+	    Assert(thief.tasks.empty());
+	    thief.key = victim->key;
+	    while (steal_count-- != 0) {
+		thief.tasks.push_front(victim->tasks.back());
+		victim->tasks.pop_back();
+	    }
+	    next_victim = (next_victim + n + 1) % count;
+	    return true;
+	}
+	return false;
+    }
+
+    /** Get the next task claimed by a worker, without taking the lock.
+     *
+     *  Returns NULL if the worker has no claimed tasks waiting.
+     */
+    Task * pop_local(Worker & worker, std::string & key) {
+	ContextLocker worker_lock(worker.mutex);
+	if (worker.tasks.empty()) {
+	    return NULL;
+	}
+	Task * task = worker.tasks.front();
+	worker.tasks.pop_front();
+	key = worker.key;
+	return task;
+    }
+
+    /** Claim or steal some tasks for a worker which has run out.
+     *
+     *  Blocks until some tasks have been obtained, or the group is closed,
+     *  or end_time is reached (if it is not 0.0).
+     *
+     *  @returns true if some tasks were obtained.
+     */
+    bool refill(Worker & worker, double end_time) {
+	ContextLocker lock(cond);
+	report_local(worker);
+	while (true) {
+	    std::map<std::string, QueueInfo>::iterator i = find_queue(1);
+	    if (i != queues.end()) {
+		QueueInfo & queue = i->second;
+		size_t old_size = queue.size();
+		claim(worker, i);
+
+		// File descriptor to nudge on, if not -1.
+		// We need to take a copy here, so that nudge_fd isn't accessed
+		// when the lock isn't held.
+		int nudge_fd_copy = (old_size >= throttle_size &&
+				     queue.size() < throttle_size) ?
+			nudge_fd : -1;
+		char nudge_byte_copy(nudge_byte);
+		cond.broadcast();
+
+		// Drop the lock before nudging, so that the lock isn't held if
+		// the write blocks.
+		lock.unlock();
+		if (nudge_fd_copy != -1) {
+		    (void) io_send_byte(nudge_fd_copy, nudge_byte_copy);
+		}
+		return true;
+	    }
+	    if (steal(worker)) {
+		return true;
+	    }
+	    if (closed) {
+		return false;
+	    }
+	    ++idle_threads;
+	    bool timed_out = false;
+	    if (end_time == 0.0) {
+		cond.wait();
+	    } else {
+		timed_out = cond.timedwait(end_time);
+	    }
+	    --idle_threads;
+	    if (timed_out) {
+		return false;
+	    }
+	}
+    }
+
   public:
     /** create a new queue group.
      *
@@ -205,7 +706,15 @@ class TaskQueueGroup {
 	      throttle_size(throttle_size_),
 	      max_size(max_size_),
 	      nudge_fd(-1),
-	      nudge_byte('Q')
+	      nudge_byte('Q'),
+	      batch_limit(0),
+	      batch_in_progress(0),
+	      batch_passed_over(0),
+	      idle_threads(0),
+	      avg_wait(0.0),
+	      max_handlers(1),
+	      workers(),
+	      next_victim(0)
     {
     }
 
@@ -220,10 +729,12 @@ class TaskQueueGroup {
 	// problems to worry about.
 	for (std::map<std::string, QueueInfo>::iterator
 	     i = queues.begin(); i != queues.end(); ++i) {
-	    std::queue<Task *> & queue = i->second.queue;
-	    while (!queue.empty()) {
-		delete queue.front();
-		queue.pop();
+	    for (int lane = 0; lane != PRIORITY_COUNT; ++lane) {
+		std::queue<Task *> & queue = i->second.lanes[lane];
+		while (!queue.empty()) {
+		    delete queue.front();
+		    queue.pop();
+		}
 	    }
 	}
     }
@@ -247,6 +758,78 @@ class TaskQueueGroup {
 	nudge_byte = nudge_byte_;
     }
 
+    /** Set the maximum number of batch priority tasks to run at once.
+     *
+     *  @param batch_limit_ The limit, or 0 for no limit.
+     */
+    void set_batch_limit(size_t batch_limit_)
+    {
+	ContextLocker lock(cond);
+	batch_limit = batch_limit_;
+	cond.broadcast();
+    }
+
+    /** Set the maximum number of handlers which may be assigned to a queue
+     *  at once.
+     *
+     *  Extra handlers are only assigned to a queue when the existing handlers
+     *  are all busy, and the next task can be run in parallel with theirs.
+     */
+    void set_max_handlers(size_t max_handlers_)
+    {
+	ContextLocker lock(cond);
+	max_handlers = (max_handlers_ == 0) ? 1 : max_handlers_;
+	cond.broadcast();
+    }
+
+    /** Check if the group has been closed.
+     */
+    bool is_closed() const
+    {
+	ContextLocker lock(cond);
+	return closed;
+    }
+
+    /** Get measurements of how busy the group is.
+     *
+     *  @param waiting Set to the number of tasks waiting on the queues.
+     *  @param idle Set to the number of threads waiting for a task.
+     *  @param wait_time Set to the average time recent tasks spent waiting on
+     *  the queues before being started.
+     */
+    void get_load(size_t & waiting, size_t & idle, double & wait_time) const
+    {
+	ContextLocker lock(cond);
+	waiting = 0;
+	for (std::map<std::string, QueueInfo>::const_iterator
+	     i = queues.begin(); i != queues.end(); ++i) {
+	    waiting += i->second.size();
+	}
+	idle = idle_threads;
+	wait_time = avg_wait;
+    }
+
+    /** Put a task which has been popped back on its queue, with a new
+     *  priority.
+     *
+     *  The task is put at the back of the queue for its new priority, and is
+     *  no longer in progress.  This is allowed even if the queue is full.
+     *
+     *  The time spent waiting before the first pop has already been counted
+     *  in the wait statistics, so the queueing time is reset.  The task's
+     *  deadline is left alone: it runs from when the request arrived.
+     */
+    void requeue(const std::string & key, Task * task, TaskPriority priority)
+    {
+	ContextLocker lock(cond);
+	QueueInfo & queue = queues[key];
+	finish_task(queue, task);
+	task->priority = priority;
+	task->queued_at = RealTime::now();
+	queue.lanes[priority].push(task);
+	cond.broadcast();
+    }
+
     /** Close all queues, and prevent new queues being created.
      *
      *  Prevents further items being added to the queues, and causes pop
@@ -354,8 +937,11 @@ class TaskQueueGroup {
 		return Queue::CLOSED;
 	    }
 
-	    if ((allow_throttle && (queue.queue.size() >= throttle_size)) ||
-		(!allow_throttle && (queue.queue.size() >= max_size))) {
+	    if ((allow_throttle && (queue.size() >= throttle_size)) ||
+		(!allow_throttle && (queue.size() >= max_size))) {
+		if (purge_cancelled(queue)) {
+		    continue;
+		}
 		if (end_time == 0.0) {
 		    LOG_INFO("Queue '" + key + "' is full, on push");
 		    return Queue::FULL;
@@ -370,10 +956,12 @@ class TaskQueueGroup {
 	    break;
 	}
 
-	queue.queue.push(NULL);
-	queue.queue.back() = itemptr.release();
+	item->queued_at = RealTime::now();
+	std::queue<Task *> & lane = queue.lanes[item->priority];
+	lane.push(NULL);
+	lane.back() = itemptr.release();
 	Queue::QueueState result;
-	size_t size = queue.queue.size();
+	size_t size = queue.size();
 	if (size < throttle_size) {
 	    result = Queue::HAS_SPACE;
 	} else {
@@ -395,13 +983,14 @@ class TaskQueueGroup {
      */
     bool assign_handler(std::string & assignment) {
 	ContextLocker lock(cond);
-	std::map<std::string, QueueInfo>::iterator i = pick_queue();
+	std::map<std::string, QueueInfo>::iterator i =
+		pick_queue(0.0, max_handlers);
 	if (i == queues.end()) {
 	    assignment.resize(0);
 	    return false;
 	}
 	assignment = i->first;
-	i->second.assigned = true;
+	++i->second.handlers;
 	// Assigning a handler can't make there be work for any other thread
 	// to do, so no need to signal the condition.
 	return true;
@@ -411,7 +1000,9 @@ class TaskQueueGroup {
      */
     void unassign_handler(const std::string & assignment) {
 	ContextLocker lock(cond);
-	queues[assignment].assigned = false;
+	QueueInfo & queue = queues[assignment];
+	Assert(queue.handlers != 0);
+	--queue.handlers;
 	check_for_cleanup(queues.find(assignment));
 	cond.broadcast();
     }
@@ -429,8 +1020,105 @@ class TaskQueueGroup {
 	    std::map<std::string, QueueInfo>::iterator
 		    i = queues.find(key);
 	    if (i != queues.end()) {
-		(void) i->second.in_progress.erase(task);
+		finish_task(i->second, task);
+	    }
+	    // Finishing a batch task may allow another to start.
+	    cond.broadcast();
+	}
+    }
+
+    /** Register a worker with the group.
+     */
+    void add_worker(Worker & worker) {
+	ContextLocker lock(cond);
+	workers.push_back(&worker);
+    }
+
+    /** Remove a worker from the group.
+     *
+     *  Any tasks claimed by the worker which haven't been started are put
+     *  back on their queue.
+     *
+     *  @param completed_task A task returned to the worker which has been
+     *  completed, or NULL.
+     */
+    void remove_worker(Worker & worker, Task * completed_task) {
+	ContextLocker lock(cond);
+	if (completed_task != NULL) {
+	    worker.note_finished(completed_task);
+	}
+	report_local(worker);
+	{
+	    ContextLocker worker_lock(worker.mutex);
+	    if (!worker.tasks.empty()) {
+		QueueInfo & queue = queues[worker.key];
+		while (!worker.tasks.empty()) {
+		    Task * task = worker.tasks.front();
+		    worker.tasks.pop_front();
+		    release_local(queue, 1,
+				  task->priority == PRIORITY_BATCH ? 1 : 0);
+		    queue.lanes[task->priority].push(task);
+		}
+	    }
+	}
+	for (std::vector<Worker *>::iterator i = workers.begin();
+	     i != workers.end(); ++i) {
+	    if (*i == &worker) {
+		workers.erase(i);
+		break;
+	    }
+	}
+	next_victim = 0;
+	cond.broadcast();
+    }
+
+    /** Pop a task for a worker, from any active, non-assigned, queue.
+     *
+     *  This behaves like the other form of pop_any(), except that tasks are
+     *  claimed by the worker in runs, or stolen from other workers, as
+     *  described for the class.
+     *
+     *  @param worker The worker, which must have been registered with
+     *  add_worker().
+     *  @param key Set to the key of the queue of the task which is returned
+     *  (if the returned task is not NULL).
+     *  @param completed_task The task last returned to the worker, if it has
+     *  been completed, or NULL.
+     *  @param end_time If not 0.0, the time at which to give up waiting for
+     *  a task, and return NULL.
+     */
+    Task * pop_any(Worker & worker,
+		   std::string & key,
+		   Task * completed_task,
+		   double end_time=0.0) {
+	if (completed_task != NULL) {
+	    worker.note_finished(completed_task);
+	}
+	while (true) {
+	    std::auto_ptr<Task> resultptr(pop_local(worker, key));
+	    if (resultptr.get() == NULL) {
+		if (!refill(worker, end_time)) {
+		    return NULL;
+		}
+		continue;
+	    }
+
+	    // Tasks whose deadline has passed, or whose result is no longer
+	    // wanted, are dropped rather than returned.
+	    double now = RealTime::now();
+	    if (resultptr->deadline != 0.0 && resultptr->deadline <= now) {
+		LOG_INFO("Dropping task from queue '" + key +
+			 "' - deadline passed");
+		resultptr->expired();
+	    } else if (resultptr->cancelled()) {
+		LOG_DEBUG("Dropping task from queue '" + key +
+			  "' - cancelled");
+	    } else {
+		++worker.started;
+		worker.total_wait += now - resultptr->queued_at;
+		return resultptr.release();
 	    }
+	    worker.note_finished(resultptr.get());
 	}
     }
 
@@ -438,58 +1126,85 @@ class TaskQueueGroup {
      *
      *  If closed and all queues are empty, this will return NULL.  Otherwise,
      *  blocks if all queues are empty or disabled, then pops the oldest item
-     *  from a queue, picking a different queue each time in round-robin order
-     *  if there are multiple options, then returns a pointer to the item and
-     *  sets @a key to contain the key of the queue returned from.
+     *  of the highest priority available from a queue, picking a different
+     *  queue each time in round-robin order if there are multiple options,
+     *  then returns a pointer to the item and sets @a key to contain the key
+     *  of the queue returned from.
      *
      *  @param key Should be initialised to the key of the task which has just
      *  been completed (if completed_task is not NULL).  Will be set to the key
      *  of the task which is returned (if returned task is not NULL).
      *  @param completed_task A task which has been completed, or NULL.
+     *  @param end_time If not 0.0, the time at which to give up waiting for
+     *  a task, and return NULL.
      */
     Task * pop_any(std::string & key,
-		   Task * completed_task) {
+		   Task * completed_task,
+		   double end_time=0.0) {
 	ContextLocker lock(cond);
 	std::map<std::string, QueueInfo>::iterator i;
 	if (completed_task != NULL) {
 	    //printf("pop_any: completed: %s:%p\n", key.c_str(), completed_task);
 	    i = queues.find(key);
 	    Assert(i != queues.end());
-	    (void) i->second.in_progress.erase(completed_task);
+	    finish_task(i->second, completed_task);
 	    check_for_cleanup(i);
 	}
-	i = pick_queue();
-	if (i == queues.end()) {
-	    return NULL;
-	}
 
-	key = i->first;
-	QueueInfo & queue = i->second;
+	while (true) {
+	    i = pick_queue(end_time, 1);
+	    if (i == queues.end()) {
+		return NULL;
+	    }
 
-	// File descriptor to nudge on, if not -1.
-	// We need to take a copy here, so that nudge_fd isn't accessed when
-	// the lock isn't held.
-	int nudge_fd_copy
-		= (queue.queue.size() == throttle_size) ? nudge_fd : -1;
-	char nudge_byte_copy(nudge_byte);
+	    key = i->first;
+	    QueueInfo & queue = i->second;
 
-	std::auto_ptr<Task> resultptr(queue.queue.front());
-	queue.queue.pop();
-	queue.in_progress.insert(resultptr.get());
-	//printf("pop_any: queue %s now has %d items\n\n", key.c_str(), queue.queue.size());
-	//printf("pop_any: %s:%p\n", key.c_str(), resultptr.get());
-	check_for_cleanup(i);
-	cond.broadcast();
+	    // File descriptor to nudge on, if not -1.
+	    // We need to take a copy here, so that nudge_fd isn't accessed when
+	    // the lock isn't held.
+	    int nudge_fd_copy
+		    = (queue.size() == throttle_size) ? nudge_fd : -1;
+	    char nudge_byte_copy(nudge_byte);
 
-	// Drop the lock before nudging, so that the lock isn't held if the
-	// write blocks.
-	lock.unlock();
-	if (nudge_fd_copy != -1) {
-	    // Nudge when size is about to drop below throttle_size
-	    (void) io_send_byte(nudge_fd_copy, nudge_byte_copy);
-	}
+	    std::auto_ptr<Task> resultptr(take_next(queue));
 
-	return resultptr.release();
+	    // Tasks whose deadline has passed, or whose result is no longer
+	    // wanted, are dropped rather than returned.
+	    bool expired = (resultptr->deadline != 0.0 &&
+			    resultptr->deadline <= RealTime::now());
+	    bool cancelled = !expired && resultptr->cancelled();
+	    if (!expired && !cancelled) {
+		start_task(queue, resultptr.get());
+		double waited = RealTime::now() - resultptr->queued_at;
+		avg_wait += (waited - avg_wait) * WAIT_TIME_DECAY;
+	    }
+	    //printf("pop_any: queue %s now has %d items\n\n", key.c_str(), queue.size());
+	    //printf("pop_any: %s:%p\n", key.c_str(), resultptr.get());
+	    check_for_cleanup(i);
+	    cond.broadcast();
+
+	    // Drop the lock before nudging, so that the lock isn't held if the
+	    // write blocks.
+	    lock.unlock();
+	    if (nudge_fd_copy != -1) {
+		// Nudge when size is about to drop below throttle_size
+		(void) io_send_byte(nudge_fd_copy, nudge_byte_copy);
+	    }
+
+	    if (expired) {
+		LOG_INFO("Dropping task from queue '" + key +
+			 "' - deadline passed");
+		resultptr->expired();
+	    } else if (cancelled) {
+		LOG_DEBUG("Dropping task from queue '" + key +
+			  "' - cancelled");
+	    } else {
+		return resultptr.release();
+	    }
+	    resultptr.reset();
+	    lock.lock();
+	}
     }
 
     /** Pop from a specific queue.
@@ -510,7 +1225,7 @@ class TaskQueueGroup {
 	if (completed_task != NULL) {
 	    i = queues.find(completed_key);
 	    Assert(i != queues.end());
-	    (void) i->second.in_progress.erase(completed_task);
+	    finish_task(i->second, completed_task);
 	    check_for_cleanup(i);
 	}
 
@@ -519,11 +1234,9 @@ class TaskQueueGroup {
 	i = queues.find(key);
 	is_finished = false;
 	while (!closed) {
-	    if (i != queues.end() &&
-		i->second.active &&
-		!i->second.queue.empty()) {
-
-		if (check_parallel_allowed(i->second)) {
+	    if (i != queues.end() && i->second.active) {
+		int lane = next_lane(i->second);
+		if (lane != -1 && check_parallel_allowed(i->second, lane)) {
 		    break;
 		}
 	    }
@@ -534,26 +1247,29 @@ class TaskQueueGroup {
 	    // have been removed from the list during the wait.
 	    i = queues.find(key);
 	}
-	if (i == queues.end() || i->second.queue.empty()) {
+	if (i == queues.end() || i->second.empty()) {
 	    // Queue is empty - should only get here if it's also closed.
 	    is_finished = true;
 	    return NULL;
 	}
+	if (next_lane(i->second) == -1) {
+	    // Only batch tasks are left, and the limit on them is reached.
+	    return NULL;
+	}
 
 	QueueInfo & queue = i->second;
-	//printf("pop_from: queue %s has %d items\n", key.c_str(), queue.queue.size());
+	//printf("pop_from: queue %s has %d items\n", key.c_str(), queue.size());
 
 	// File descriptor to nudge on, if not -1.
 	// We need to take a copy here, so that nudge_fd isn't accessed when
 	// the lock isn't held.
 	int nudge_fd_copy
-		= (queue.queue.size() == throttle_size) ? nudge_fd : -1;
+		= (queue.size() == throttle_size) ? nudge_fd : -1;
 	char nudge_byte_copy(nudge_byte);
 
-	std::auto_ptr<Task> resultptr(queue.queue.front());
-	queue.queue.pop();
-	queue.in_progress.insert(resultptr.get());
-	//printf("pop_from: queue %s now has %d items\n\n", key.c_str(), queue.queue.size());
+	std::auto_ptr<Task> resultptr(take_next(queue));
+	start_task(queue, resultptr.get());
+	//printf("pop_from: queue %s now has %d items\n\n", key.c_str(), queue.size());
 	check_for_cleanup(i);
 	cond.broadcast();
 
@@ -576,7 +1292,7 @@ class TaskQueueGroup {
 	ContextLocker lock(cond);
 	for (std::map<std::string, QueueInfo>::const_iterator i = queues.begin();
 	     i != queues.end(); ++i) {
-	    if (i->second.queue.size() >= throttle_size) {
+	    if (i->second.size() >= throttle_size) {
 		result.push_back(i->first);
 	    }
 	}
@@ -606,12 +1322,17 @@ class TaskQueueGroup {
 	    std::map<std::string, QueueInfo>::const_iterator i = queues.begin();
 	    bool found = false;
 	    while (i != queues.end()) {
-		if (!i->second.queue.empty()) {
+		if (!i->second.empty()) {
 		    found = true;
 		    break;
 		}
 		++i;
 	    }
+	    for (std::vector<Worker *>::const_iterator j = workers.begin();
+		 !found && j != workers.end(); ++j) {
+		ContextLocker worker_lock((*j)->mutex);
+		found = !(*j)->tasks.empty();
+	    }
 	    if (!found) return;
 	    cond.wait();
 	}
@@ -625,10 +1346,18 @@ class TaskQueueGroup {
 	for (std::map<std::string, QueueInfo>::const_iterator
 	     i = queues.begin(); i != queues.end(); ++i) {
 	    Json::Value & queue_val(result[i->first] = Json::objectValue);
-	    queue_val["size"] = Json::UInt64(i->second.queue.size());
+	    queue_val["size"] = Json::UInt64(i->second.size());
+	    if (!i->second.lanes[PRIORITY_BATCH].empty()) {
+		queue_val["batch_size"] =
+			Json::UInt64(i->second.lanes[PRIORITY_BATCH].size());
+	    }
 	    queue_val["active"] = i->second.active;
-	    queue_val["assigned"] = i->second.assigned;
-	    queue_val["in_progress"] = Json::UInt64(i->second.in_progress.size());
+	    queue_val["assigned"] = (i->second.handlers != 0);
+	    if (i->second.handlers > 1) {
+		queue_val["handlers"] = Json::UInt64(i->second.handlers);
+	    }
+	    queue_val["in_progress"] = Json::UInt64(i->second.in_progress.size() +
+						    i->second.local);
 	}
     }
 };
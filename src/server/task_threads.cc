@@ -26,8 +26,10 @@
 #include "task_threads.h"
 
 #include "httpserver/response.h"
+#include "jsonxapian/commit_policy.h"
 #include "logger/logger.h"
 #include "realtime.h"
+#include "server/task_manager.h"
 #include "server/thread_pool.h"
 #include "utils/jsonutils.h"
 #include "utils.h"
@@ -37,6 +39,16 @@
 using namespace std;
 using namespace RestPose;
 
+/** Estimated cost (see ReadonlyTask::estimate_cost()) at or above which an
+ *  interactive task is moved to batch priority.
+ */
+static const double BATCH_COST_THRESHOLD = 100000.0;
+
+/** Time (in seconds) that a search thread in an elastic pool waits for a
+ *  task before offering to retire.
+ */
+static const double ELASTIC_IDLE_TIMEOUT = 30.0;
+
 TaskThread::~TaskThread()
 {
     // Delete the collection - it should have been returned to the pool
@@ -107,9 +119,6 @@ ProcessingThread::cleanup()
 void
 IndexingThread::run()
 {
-    // Number of seconds of idle time to commit after.
-    // FIXME - pull this out into a config file somewhere.
-    double commit_after_idle = 5;
     while (true) {
 	{
 	    ContextLocker lock(cond);
@@ -129,9 +138,23 @@ IndexingThread::run()
 	    while (true) {
 		bool is_finished;
 
+		// Wait for the next task until the queue has been idle for
+		// long enough to commit, or until the pending changes have
+		// been waiting too long.
+		double deadline;
+		if (collection != NULL) {
+		    deadline = RealTime::now() +
+			    collection->get_commit_policy().idle_time;
+		    double commit_deadline = collection->get_commit_deadline();
+		    if (commit_deadline != 0.0 && commit_deadline < deadline) {
+			deadline = commit_deadline;
+		    }
+		} else {
+		    deadline = RealTime::now() + CommitPolicy().idle_time;
+		}
+
 		Task * newtask = queuegroup.pop_from(coll_name,
-		    RealTime::now() + commit_after_idle, is_finished,
-		    task, last_coll_name);
+		    deadline, is_finished, task, last_coll_name);
 		delete task;
 		task = newtask;
 		last_coll_name = coll_name;
@@ -144,12 +167,30 @@ IndexingThread::run()
 		    // Timeout
 		    break;
 		}
+		if (collection != NULL && !collection->is_writable()) {
+		    // The collection has been deleted by another thread.
+		    Collection * tmp = collection;
+		    collection = NULL;
+		    pool.release(tmp);
+		}
 		IndexingTask * colltask = static_cast<IndexingTask *>(task);
 		colltask->perform(coll_name, collection, taskman);
+
+		if (collection != NULL && collection->is_writable() &&
+		    collection->commit_if_due()) {
+		    taskman->seal_journal(coll_name);
+		    if (collection->needs_merge()) {
+			taskman->queue_merge(coll_name);
+		    }
+		}
 	    }
 
-	    if (collection != NULL) {
+	    if (collection != NULL && collection->is_writable()) {
 		collection->commit();
+		taskman->seal_journal(coll_name);
+		if (collection->needs_merge()) {
+		    taskman->queue_merge(coll_name);
+		}
 	    }
 
 	} catch(const RestPose::Error & e) {
@@ -178,7 +219,9 @@ void
 IndexingThread::cleanup()
 {
     if (collection) {
-	collection->commit();
+	if (collection->is_writable()) {
+	    collection->commit();
+	}
 	Collection * tmp = collection;
 	collection = NULL;
 	pool.release(tmp);
@@ -200,13 +243,28 @@ SearchThread::run()
 	    }
 	}
 
-	Task * newtask = queuegroup.pop_any(group_name, task);
+	double end_time = 0.0;
+	if (threadpool != NULL && threadpool->is_elastic()) {
+	    end_time = RealTime::now() + ELASTIC_IDLE_TIMEOUT;
+	}
+	Task * newtask = queuegroup.pop_any(worker, group_name, task,
+					    end_time);
 	delete task;
 	task = newtask;
 
 	if (!task) {
-	    // Queue has been closed, and is empty.
-	    return;
+	    if (queuegroup.is_closed()) {
+		// Queue has been closed, and is empty.
+		return;
+	    }
+	    // Timed out waiting for a task.
+	    if (threadpool->retire_idle_thread(this)) {
+		// The pool will join and delete this thread, so don't report
+		// back to it on cleanup.
+		threadpool = NULL;
+		return;
+	    }
+	    continue;
 	}
 
 	ReadonlyTask * rotask = static_cast<ReadonlyTask *>(task);
@@ -235,6 +293,15 @@ SearchThread::run()
 		}
 	    }
 
+	    if (rotask->priority == PRIORITY_INTERACTIVE &&
+		rotask->estimate_cost(collection) >= BATCH_COST_THRESHOLD) {
+		// Let cheaper tasks go first.
+		LOG_DEBUG("Moving expensive task on queue '" + group_name +
+			  "' to batch priority");
+		queuegroup.requeue(group_name, task, PRIORITY_BATCH);
+		task = NULL;
+		continue;
+	    }
 	    rotask->perform(collection);
 	} catch(const RestPose::Error & e) {
 	    LOG_ERROR("Readonly task failed with", e);
@@ -170,16 +170,24 @@ class SearchThread : public TaskThread {
      */
     Task * task;
 
+    /** The state used to take tasks from the queue group.
+     */
+    TaskQueueGroup::Worker worker;
+
   public:
     /** Create an indexer for a collection.
      */
     SearchThread(TaskQueueGroup & queuegroup_, CollectionPool & pool_)
 	    : TaskThread(queuegroup_, pool_),
-	      task(NULL)
-    {}
+	      task(NULL),
+	      worker()
+    {
+	queuegroup.add_worker(worker);
+    }
 
     ~SearchThread()
     {
+	queuegroup.remove_worker(worker, task);
 	delete task;
     }
 
@@ -25,23 +25,95 @@
 #include <config.h>
 #include "tasks.h"
 
+#include <cstdio>
 #include "httpserver/response.h"
+#include "httpserver/response_stream.h"
 #include "jsonxapian/collection.h"
 #include "jsonxapian/collection_pool.h"
 #include "jsonxapian/indexing.h"
 #include "jsonxapian/pipe.h"
+#include "jsonxapian/search_template.h"
 #include "loadfile.h"
 #include "logger/logger.h"
+#include "realtime.h"
+#include "safeerrno.h"
+#include "server/journal.h"
+#include "server/result_cache.h"
 #include "server/task_manager.h"
+#include "str.h"
 #include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
 #include "utils/stringutils.h"
 #include "utils/validation.h"
 
 using namespace std;
 using namespace RestPose;
 
+/** Pass on the acknowledgement for a change which has been made to a
+ *  collection.
+ *
+ *  If the acknowledgement is waiting for a commit, a copy is added to the
+ *  collection's commit waiters; otherwise, it's sent now.
+ */
+static void
+ack_change(WriteAck & ack, RestPose::Collection * collection)
+{
+    if (ack.get_level() == ACK_COMMITTED) {
+	collection->add_commit_waiter(new WriteAck(ack));
+    } else {
+	ack.succeeded();
+    }
+}
+
 Task::~Task() {}
 
+void
+Task::expired()
+{}
+
+bool
+Task::cancelled() const
+{
+    return false;
+}
+
+void
+ReadonlyTask::expired()
+{
+    resulthandle.failed("Request timed out before it was started", 503);
+}
+
+double
+ReadonlyTask::estimate_cost(RestPose::Collection *) const
+{
+    return 0.0;
+}
+
+bool
+ReadonlyTask::cancelled() const
+{
+    return resulthandle.is_cancelled();
+}
+
+double
+search_deadline(const Json::Value & search, double start)
+{
+    if (!search.isObject()) {
+	return 0.0;
+    }
+    double timeout = json_get_double_member(search, "timeout", 0.0);
+    if (timeout < 0.0) {
+	throw InvalidValueError("Search timeout must not be negative");
+    }
+    if (timeout == 0.0) {
+	return 0.0;
+    }
+    if (start == 0.0) {
+	start = RealTime::now();
+    }
+    return start + timeout;
+}
+
 void
 StaticFileTask::perform(RestPose::Collection *)
 {
@@ -71,6 +143,114 @@ StaticFileTask::perform(RestPose::Collection *)
     resulthandle.set_ready();
 }
 
+/** Size of the buffer of serialised items to build up before writing it to
+ *  a response stream.
+ */
+static const size_t SEARCH_STREAM_CHUNK_SIZE = 16 * 1024;
+
+/** Search results sink which streams the results into an HTTP response.
+ *
+ *  The serialised form is identical to that produced by serialising the
+ *  complete results object.
+ */
+class StreamingSearchSink : public SearchResultsSink {
+    ResultHandle & resulthandle;
+    ResponseStream stream;
+
+    /// Serialised results which haven't been written to the stream yet.
+    string buf;
+
+    /// The members which follow the items.
+    Json::Value tail;
+
+    bool started;
+    bool finished;
+    bool first_item;
+
+    StreamingSearchSink(const StreamingSearchSink &);
+    void operator=(const StreamingSearchSink &);
+  public:
+    StreamingSearchSink(ResultHandle & resulthandle_)
+	    : resulthandle(resulthandle_),
+	      stream(),
+	      buf(),
+	      tail(Json::objectValue),
+	      started(false),
+	      finished(false),
+	      first_item(true)
+    {}
+
+    ~StreamingSearchSink() {
+	if (started && !finished) {
+	    // Let the client see that the response is incomplete.
+	    stream.abort();
+	}
+    }
+
+    bool is_started() const { return started; }
+
+    bool start(const Json::Value & results) {
+	// Members are serialised in sorted order, so the items go between
+	// the members which sort before and after "items".
+	string head;
+	Json::Value::Members names(results.getMemberNames());
+	for (Json::Value::Members::const_iterator i = names.begin();
+	     i != names.end(); ++i) {
+	    if (*i < "items") {
+		head += json_serialise(Json::Value(*i)) + ":" +
+			json_serialise(results[*i]) + ",";
+	    } else {
+		tail[*i] = results[*i];
+	    }
+	}
+	buf = "{" + head + "\"items\":[";
+
+	stream.set_nudge(resulthandle.get_nudge_fd(),
+			 resulthandle.get_nudge_byte());
+	Response & response(resulthandle.response());
+	response.set_stream(stream);
+	response.set_content_type("application/json");
+	response.set_status(200);
+	started = true;
+	resulthandle.set_ready();
+	return true;
+    }
+
+    bool add_item(const Json::Value & item) {
+	if (first_item) {
+	    first_item = false;
+	} else {
+	    buf += ",";
+	}
+	buf += json_serialise(item);
+	if (buf.size() >= SEARCH_STREAM_CHUNK_SIZE) {
+	    if (!stream.write(buf)) {
+		LOG_INFO("Search results stream closed by reader");
+		return false;
+	    }
+	    buf.resize(0);
+	}
+	return true;
+    }
+
+    void finish(bool timed_out) {
+	if (timed_out) {
+	    tail["timed_out"] = true;
+	}
+	buf += "]";
+	Json::Value::Members names(tail.getMemberNames());
+	for (Json::Value::Members::const_iterator i = names.begin();
+	     i != names.end(); ++i) {
+	    buf += "," + json_serialise(Json::Value(*i)) + ":" +
+		    json_serialise(tail[*i]);
+	}
+	buf += "}";
+	(void) stream.write(buf);
+	stream.close();
+	finished = true;
+    }
+};
+
 void
 PerformSearchTask::perform(RestPose::Collection * collection)
 {
@@ -83,15 +263,147 @@ PerformSearchTask::perform(RestPose::Collection * collection)
     }
 
     Json::Value result(Json::objectValue);
-    collection->perform_search(search, doc_type, result);
+    StreamingSearchSink sink(resulthandle);
+    ResultHandleCancelCheck cancel(resulthandle);
+    collection->perform_search(search, doc_type, result, &sink, deadline,
+			       &cancel);
+    if (resulthandle.is_cancelled()) {
+	// The client has gone away, so there's nobody to send the result to.
+	LOG_DEBUG("search of collection '" + collection->get_name() +
+		  "' cancelled");
+	return;
+    }
     if (doc_type.empty()) {
 	LOG_DEBUG("searched collection '" + collection->get_name() + "'");
     } else {
 	LOG_DEBUG("searched collection '" + collection->get_name() +
 		  "' within type '" + doc_type + "'");
     }
-    resulthandle.response().set(result, 200);
-    resulthandle.set_ready();
+    if (!sink.is_started()) {
+	string body(json_serialise(result));
+	if (cache != NULL && !result.isMember("timed_out")) {
+	    cache->set(cache_key, collection->get_opened_generation(), body);
+	}
+	Response & response(resulthandle.response());
+	response.set_data(body);
+	response.set_content_type("application/json");
+	response.set_status(200);
+	resulthandle.set_ready();
+    }
+}
+
+double
+PerformSearchTask::estimate_cost(RestPose::Collection * collection) const
+{
+    if (!doc_type.empty() && !validate_doc_type(doc_type).empty()) {
+	// perform() will report the error.
+	return 0.0;
+    }
+    try {
+	return collection->estimate_search_cost(search, doc_type);
+    } catch(const RestPose::Error &) {
+	// perform() will report the error.
+	return 0.0;
+    }
+}
+
+bool
+PerformTemplateSearchTask::expand(const RestPose::Collection * collection) const
+{
+    clear_expansion();
+    expand_error.resize(0);
+
+    if (!doc_type.empty()) {
+	expand_error = validate_doc_type(doc_type);
+	if (!expand_error.empty()) {
+	    expand_status = 400;
+	    return false;
+	}
+    }
+
+    const SearchTemplatePlan * plan;
+    try {
+	plan = &(collection->get_search_plan(template_name, doc_type));
+    } catch(const InvalidValueError &) {
+	expand_error = "No search template of name \"" + template_name +
+		"\" exists";
+	expand_status = 404;
+	return false;
+    }
+
+    try {
+	plan->expand(params, search, compiled);
+	// Check that the timeout is valid.
+	(void) search_deadline(search, received);
+    } catch(const InvalidValueError & e) {
+	clear_expansion();
+	expand_error = e.what();
+	expand_status = 400;
+	return false;
+    }
+    return true;
+}
+
+void
+PerformTemplateSearchTask::clear_expansion() const
+{
+    search = Json::Value();
+    compiled = CompiledQuery();
+}
+
+void
+PerformTemplateSearchTask::perform(RestPose::Collection * collection)
+{
+    if (!expand(collection)) {
+	resulthandle.failed(expand_error, expand_status);
+	return;
+    }
+
+    // The timeout comes from the template, so the deadline couldn't be
+    // checked when the task left the queue: check it now.
+    deadline = search_deadline(search, received);
+    if (deadline != 0.0 && deadline <= RealTime::now()) {
+	expired();
+	return;
+    }
+
+    Json::Value result(Json::objectValue);
+    StreamingSearchSink sink(resulthandle);
+    ResultHandleCancelCheck cancel(resulthandle);
+    collection->perform_search(search, doc_type, result, &sink, deadline,
+			       &cancel, &compiled);
+    clear_expansion();
+    if (resulthandle.is_cancelled()) {
+	LOG_DEBUG("template search of collection '" + collection->get_name() +
+		  "' cancelled");
+	return;
+    }
+    LOG_DEBUG("searched collection '" + collection->get_name() +
+	      "' using template '" + template_name + "'");
+    if (!sink.is_started()) {
+	resulthandle.response().set(result, 200);
+	resulthandle.set_ready();
+    }
+}
+
+double
+PerformTemplateSearchTask::estimate_cost(RestPose::Collection * collection) const
+{
+    if (!expand(collection)) {
+	// perform() will report the error.
+	return 0.0;
+    }
+    // The task may be requeued after this, so perform() expands the
+    // template again rather than keeping this expansion.
+    double cost = 0.0;
+    try {
+	cost = collection->estimate_search_cost(search, doc_type, &compiled);
+    } catch(const RestPose::Error &) {
+	// perform() will report the error.
+    } catch(const Xapian::Error &) {
+    }
+    clear_expansion();
+    return cost;
 }
 
 void
@@ -139,6 +451,12 @@ ServerStatusTask::perform(RestPose::Collection *)
 	taskman->search_queues.get_status(search["queues"]);
 	taskman->search_threads.get_status(search["threads"]);
     }
+    {
+	Json::Value & merging(tasks["merging"] = Json::objectValue);
+	taskman->merge_queues.get_status(merging["queues"]);
+	taskman->merge_threads.get_status(merging["threads"]);
+    }
+    taskman->result_cache.get_status(result["result_cache"]);
     resulthandle.response().set(result, 200);
     resulthandle.set_ready();
 }
@@ -157,16 +475,46 @@ ProcessorPipeDocumentTask::perform(const string & coll_name,
 void
 ProcessorProcessDocumentTask::perform(const string & coll_name,
 				      TaskManager * taskman)
+{
+    if (ack.get() == NULL) {
+	process(coll_name, taskman);
+	return;
+    }
+    try {
+	process(coll_name, taskman);
+    } catch(const InvalidValueError & e) {
+	ack->failed(e.what(), 400);
+	throw;
+    } catch(const RestPose::Error & e) {
+	ack->failed(e.what());
+	throw;
+    } catch(const Xapian::Error & e) {
+	ack->failed(e.get_description());
+	throw;
+    }
+}
+
+void
+ProcessorProcessDocumentTask::process(const string & coll_name,
+				      TaskManager * taskman)
 {
     LOG_DEBUG("ProcessDocument type '" + doc_type + "' in '" + coll_name + "'");
-    auto_ptr<CollectionConfig> config(taskman->get_collconfigs()
-				      .get(coll_name));
+    CollectionConfigSnapshot snapshot(taskman->get_collconfigs()
+				      .get_snapshot(coll_name));
+    auto_ptr<CollectionConfig> config;
     string idterm;
-    config->clear_changed();
     IndexingErrors errors;
     // Validation happens in process_doc
     bool new_fields(false);
-    Xapian::Document xdoc = config->process_doc(doc, doc_type, doc_id, idterm, errors, new_fields);
+    Xapian::Document xdoc;
+    if (!snapshot->process_doc_unchanged(doc, doc_type, doc_id, idterm,
+					 errors, xdoc)) {
+	// The document needs the config to be changed, so work on a copy.
+	config.reset(snapshot->clone());
+	config->clear_changed();
+	xdoc = config->process_doc(doc, doc_type, doc_id, idterm, errors,
+				   new_fields);
+    }
     for (vector<pair<string, string> >::const_iterator
 	 i = errors.errors.begin(); i != errors.errors.end(); ++i) {
 	string msg("Indexing error in field \"" + i->first + "\": \"" +
@@ -182,15 +530,23 @@ ProcessorProcessDocumentTask::perform(const string & coll_name,
 				errors.errors[0].second);
     }
 
+    // Pass the acknowledgement on if it's waiting for a commit.
+    WriteAck * index_ack = NULL;
+    if (ack.get() != NULL && ack->get_level() == ACK_COMMITTED) {
+	index_ack = ack.release();
+    }
     taskman->queue_indexing_from_processing(coll_name,
-	new IndexerUpdateDocumentTask(idterm, xdoc));
+	new IndexerUpdateDocumentTask(idterm, xdoc, index_ack));
+    if (ack.get() != NULL) {
+	ack->succeeded();
+    }
 
     // FIXME - when it's just new fields that have been added, should send
     // out a task that updates the collection config with the new fields,
     // without overwriting any other new fields that have been added by
     // tasks running in parallel.
 
-    if (config->is_changed() || new_fields) {
+    if (config.get() != NULL && (config->is_changed() || new_fields)) {
 	LOG_DEBUG("Config has changed due to processing; applying new config");
 	// FIXME - could push just the new config for the schema for the doc_type in question, to save work.
 	Json::Value tmp;
@@ -242,6 +598,20 @@ IndexerUpdateDocumentTask::perform_task(const string & coll_name,
 	collection = taskman->get_collections().get_writable(coll_name);
     }
     collection->raw_update_doc(doc, idterm);
+    if (ack.get() != NULL) {
+	ack_change(*ack, collection);
+	acked = true;
+    }
+}
+
+void
+IndexerUpdateDocumentTask::post_perform(const string &,
+					RestPose::Collection *,
+					TaskManager *)
+{
+    if (ack.get() != NULL && !acked) {
+	ack->failed("Indexing document failed");
+    }
 }
 
 void
@@ -264,7 +634,8 @@ IndexerUpdateDocumentTask::info(string & description,
 IndexingTask *
 IndexerUpdateDocumentTask::clone() const
 {
-    return new IndexerUpdateDocumentTask(idterm, doc);
+    return new IndexerUpdateDocumentTask(idterm, doc,
+	(ack.get() == NULL) ? NULL : new WriteAck(*ack));
 }
 
 
@@ -281,6 +652,10 @@ DeleteDocumentTask::perform_task(const string & coll_name,
 	LOG_ERROR(error);
 	taskman->get_checkpoints().append_error(coll_name, error,
 						doc_type, doc_id);
+	if (ack.get() != NULL) {
+	    ack->failed(error, 400);
+	    acked = true;
+	}
 	throw InvalidValueError(error);
     }
 
@@ -291,6 +666,20 @@ DeleteDocumentTask::perform_task(const string & coll_name,
 	collection = taskman->get_collections().get_writable(coll_name);
     }
     collection->raw_delete_doc("\t" + doc_type + "\t" + doc_id);
+    if (ack.get() != NULL) {
+	ack_change(*ack, collection);
+	acked = true;
+    }
+}
+
+void
+DeleteDocumentTask::post_perform(const string &,
+				 RestPose::Collection *,
+				 TaskManager *)
+{
+    if (ack.get() != NULL && !acked) {
+	ack->failed("Deleting document failed");
+    }
 }
 
 void
@@ -306,9 +695,170 @@ DeleteDocumentTask::info(string & description,
 IndexingTask *
 DeleteDocumentTask::clone() const
 {
-    return new DeleteDocumentTask(doc_type, doc_id);
+    return new DeleteDocumentTask(doc_type, doc_id,
+	(ack.get() == NULL) ? NULL : new WriteAck(*ack));
+}
+
+
+void
+AckBarrierTask::perform_task(const string & coll_name,
+			     RestPose::Collection * & collection,
+			     TaskManager * taskman)
+{
+    if (ack->get_level() == ACK_COMMITTED && collection == NULL) {
+	collection = taskman->get_collections().get_writable(coll_name);
+    }
+    ack_change(*ack, collection);
+    acked = true;
+}
+
+void
+AckBarrierTask::info(string & description, string & doc_type,
+		     string & doc_id) const
+{
+    description = "Acknowledging changes";
+    doc_type.resize(0);
+    doc_id.resize(0);
+}
+
+void
+AckBarrierTask::post_perform(const string &,
+			     RestPose::Collection *,
+			     TaskManager *)
+{
+    if (!acked) {
+	ack->failed("Acknowledging changes failed");
+    }
+}
+
+IndexingTask *
+AckBarrierTask::clone() const
+{
+    return new AckBarrierTask(new WriteAck(*ack));
+}
+
+
+/** Remove journal segments once the collection has been committed.
+ */
+class JournalReleaseWaiter : public CommitWaiter {
+    string coll_name;
+    vector<string> paths;
+  public:
+    JournalReleaseWaiter(const string & coll_name_,
+			 const vector<string> & paths_)
+	    : coll_name(coll_name_),
+	      paths(paths_)
+    {}
+
+    void committed() {
+	for (vector<string>::const_iterator i = paths.begin();
+	     i != paths.end(); ++i) {
+	    if (remove(i->c_str()) != 0 && errno != ENOENT) {
+		LOG_ERROR("Couldn't remove journal segment",
+			  SysError(*i, errno));
+	    }
+	}
+    }
+
+    void commit_failed(const string & msg) {
+	LOG_ERROR("Keeping journal segments for collection '" + coll_name +
+		  "', since committing failed: " + msg);
+    }
+};
+
+void
+JournalReleaseTask::perform_task(const string & coll_name,
+				 RestPose::Collection * & collection,
+				 TaskManager * taskman)
+{
+    if (collection == NULL) {
+	CollectionPool & pool = taskman->get_collections();
+	if (!pool.exists(coll_name)) {
+	    // The collection (and its journal) has been deleted.
+	    return;
+	}
+	collection = pool.get_writable(coll_name);
+    }
+    collection->add_commit_waiter(
+	new JournalReleaseWaiter(coll_name, paths), false);
+}
+
+void
+JournalReleaseTask::info(string & description, string & doc_type,
+			 string & doc_id) const
+{
+    description = "Releasing journal segments";
+    doc_type.resize(0);
+    doc_id.resize(0);
 }
 
+IndexingTask *
+JournalReleaseTask::clone() const
+{
+    return new JournalReleaseTask(paths);
+}
+
+void
+MergeFragmentsTask::perform(const std::string & coll_name,
+			    TaskManager * taskman)
+{
+    CollectionPool & pool = taskman->get_collections();
+    if (!pool.exists(coll_name)) {
+	return;
+    }
+    RestPose::Collection * collection = pool.get_writable(coll_name);
+    try {
+	RestPose::DbGroupMerge merge;
+	if (collection->prepare_merge(merge)) {
+	    LOG_INFO("Merged " + str(merge.sources.size()) +
+		     " fragments of collection '" + coll_name + "' into " +
+		     merge.target);
+	    Queue::QueueState state = taskman->queue_indexing(coll_name,
+		new CompleteMergeTask(merge), false);
+	    if (state == Queue::FULL || state == Queue::CLOSED) {
+		collection->abandon_merge(merge);
+	    }
+	}
+    } catch(...) {
+	pool.release(collection);
+	throw;
+    }
+    pool.release(collection);
+}
+
+void
+CompleteMergeTask::perform_task(const string & coll_name,
+				RestPose::Collection * & collection,
+				TaskManager * taskman)
+{
+    if (collection == NULL) {
+	collection = taskman->get_collections().get_writable(coll_name);
+    }
+    if (!collection->complete_merge(merge)) {
+	LOG_INFO("Abandoned merge of fragments of collection '" + coll_name +
+		 "': fragments modified while merging");
+	return;
+    }
+    if (collection->needs_merge()) {
+	taskman->queue_merge(coll_name);
+    }
+}
+
+void
+CompleteMergeTask::info(string & description,
+			string & doc_type_ret,
+			string & doc_id_ret) const
+{
+    description = "Merging database fragments";
+    doc_type_ret.resize(0);
+    doc_id_ret.resize(0);
+}
+
+IndexingTask *
+CompleteMergeTask::clone() const
+{
+    return new CompleteMergeTask(merge);
+}
 
 void
 DeleteCollectionProcessingTask::perform(const std::string & coll_name,
@@ -330,7 +880,24 @@ DeleteCollectionTask::perform_task(const string & coll_name,
 	collection = NULL;
 	taskman->get_collections().release(tmp);
     }
-    taskman->get_collections().del(coll_name);
+    // Stop changes being journalled while the collection is deleted, so
+    // that they can't recreate its directory.
+    RestPose::CollectionJournal * journal =
+	    taskman->get_journals().get(coll_name);
+    if (journal != NULL) {
+	journal->start_delete();
+    }
+    try {
+	taskman->get_collections().del(coll_name);
+    } catch(...) {
+	if (journal != NULL) {
+	    journal->finish_delete();
+	}
+	throw;
+    }
+    if (journal != NULL) {
+	journal->finish_delete();
+    }
 }
 
 void
@@ -24,7 +24,11 @@
 #ifndef RESTPOSE_INCLUDED_TASKS_H
 #define RESTPOSE_INCLUDED_TASKS_H
 
+#include "jsonxapian/collection.h"
+#include "jsonxapian/search_template.h"
+#include <memory>
 #include "server/basetasks.h"
+#include "server/write_ack.h"
 #include <string>
 
 namespace Xapian {
@@ -33,10 +37,34 @@ namespace Xapian {
 
 namespace RestPose {
     class CollectionConfig;
+    class SearchResultCache;
 };
 
 class CollectionPool;
 
+/** Get the deadline for a search, from its "timeout" member.
+ *
+ *  The timeout is a number of seconds from start (or from now, if start is
+ *  0.0).  Returns 0.0 if no timeout was given.  Raises InvalidValueError if
+ *  the timeout is invalid.
+ */
+double search_deadline(const Json::Value & search, double start = 0.0);
+
+/** Cancellation check for a search, which reports that the search should be
+ *  abandoned once the result handle it is for has been cancelled.
+ */
+class ResultHandleCancelCheck : public RestPose::SearchCancelCheck {
+    const RestPose::ResultHandle & resulthandle;
+  public:
+    ResultHandleCancelCheck(const RestPose::ResultHandle & resulthandle_)
+	    : resulthandle(resulthandle_)
+    {}
+
+    bool is_cancelled() const {
+	return resulthandle.is_cancelled();
+    }
+};
+
 class StaticFileTask : public ReadonlyTask {
     std::string path;
   public:
@@ -51,17 +79,96 @@ class StaticFileTask : public ReadonlyTask {
 class PerformSearchTask : public ReadonlyCollTask {
     Json::Value search;
     std::string doc_type;
+
+    /// The cache to store the result in, or NULL.
+    RestPose::SearchResultCache * cache;
+
+    /// The key to store the result under in the cache.
+    std::string cache_key;
   public:
     PerformSearchTask(const RestPose::ResultHandle & resulthandle_,
 		      const std::string & coll_name_,
 		      const Json::Value & search_,
-		      const std::string & doc_type_)
+		      const std::string & doc_type_,
+		      double deadline_ = 0.0,
+		      RestPose::SearchResultCache * cache_ = NULL,
+		      const std::string & cache_key_ = std::string())
 	    : ReadonlyCollTask(resulthandle_, coll_name_),
 	      search(search_),
-	      doc_type(doc_type_)
+	      doc_type(doc_type_),
+	      cache(cache_),
+	      cache_key(cache_key_)
+    {
+	deadline = deadline_;
+    }
+
+    void perform(RestPose::Collection * collection);
+    double estimate_cost(RestPose::Collection * collection) const;
+};
+
+/** Perform a search using a stored search template.
+ *
+ *  The values for the template's parameters are given as a JSON object.
+ */
+class PerformTemplateSearchTask : public ReadonlyCollTask {
+    std::string template_name;
+    Json::Value params;
+    std::string doc_type;
+
+    /** The time the search was requested.
+     *
+     *  The search's timeout comes from the template, so is only known once
+     *  the template has been expanded, but is measured from this time.
+     */
+    double received;
+
+    /** The expanded search.
+     *
+     *  This and compiled are only set while estimate_cost() or perform()
+     *  runs: compiled shares parts of the query with the collection's
+     *  template plan, so mustn't be kept once the task has let go of the
+     *  collection (eg, when the task is requeued).
+     */
+    mutable Json::Value search;
+
+    /// The expanded query.
+    mutable RestPose::CompiledQuery compiled;
+
+    /// The error message if the template couldn't be expanded.
+    mutable std::string expand_error;
+
+    /// The HTTP status code to return with expand_error.
+    mutable int expand_status;
+
+    /** Expand the template for a collection.
+     *
+     *  Returns false, with expand_error and expand_status set, if the
+     *  template couldn't be expanded.
+     */
+    bool expand(const RestPose::Collection * collection) const;
+
+    /// Discard the expansion made by expand().
+    void clear_expansion() const;
+  public:
+    PerformTemplateSearchTask(const RestPose::ResultHandle & resulthandle_,
+			      const std::string & coll_name_,
+			      const std::string & template_name_,
+			      const Json::Value & params_,
+			      const std::string & doc_type_,
+			      double received_)
+	    : ReadonlyCollTask(resulthandle_, coll_name_),
+	      template_name(template_name_),
+	      params(params_),
+	      doc_type(doc_type_),
+	      received(received_),
+	      search(),
+	      compiled(),
+	      expand_error(),
+	      expand_status(0)
     {}
 
     void perform(RestPose::Collection * collection);
+    double estimate_cost(RestPose::Collection * collection) const;
 };
 
 class GetDocumentTask : public ReadonlyCollTask {
@@ -87,7 +194,9 @@ class ServerStatusTask : public ReadonlyTask {
 		     const TaskManager * taskman_)
 	    : ReadonlyTask(resulthandle_),
 	      taskman(taskman_)
-    {}
+    {
+	priority = PRIORITY_ADMIN;
+    }
 
     void perform(RestPose::Collection * collection);
 };
@@ -122,11 +231,24 @@ class ProcessorProcessDocumentTask : public ProcessingTask {
     /// The serialised document to process.
     Json::Value doc;
 
+    /// Acknowledgement to send for the request, or NULL.
+    std::auto_ptr<RestPose::WriteAck> ack;
+
+    /// Process the document, and pass it on for indexing.
+    void process(const std::string & coll_name,
+		 TaskManager * taskman);
+
   public:
+    /** Create a task to process a document.
+     *
+     *  @param ack_ The acknowledgement to send once the document has been
+     *  processed or committed (as requested), or NULL.  Takes ownership.
+     */
     ProcessorProcessDocumentTask(const std::string & doc_type_,
 				 const std::string & doc_id_,
-				 const Json::Value & doc_)
-	    : doc_type(doc_type_), doc_id(doc_id_), doc(doc_)
+				 const Json::Value & doc_,
+				 RestPose::WriteAck * ack_ = NULL)
+	    : doc_type(doc_type_), doc_id(doc_id_), doc(doc_), ack(ack_)
     {}
 
     /// Perform the processing task, given a collection (open for reading).
@@ -159,11 +281,21 @@ class IndexerUpdateDocumentTask : public IndexingTask {
     /// The document to add.
     Xapian::Document doc;
 
+    /// Acknowledgement to send once the change is committed, or NULL.
+    std::auto_ptr<RestPose::WriteAck> ack;
+
+    /// True once the acknowledgement has been passed on.
+    bool acked;
+
   public:
     IndexerUpdateDocumentTask(const std::string & idterm_,
-			      const Xapian::Document & doc_)
-	    : idterm(idterm_), doc(doc_)
-    {}
+			      const Xapian::Document & doc_,
+			      RestPose::WriteAck * ack_ = NULL)
+	    : IndexingTask(true), idterm(idterm_), doc(doc_), ack(ack_),
+	      acked(false)
+    {
+	sequence_key = doc_sequence_key(idterm);
+    }
 
     /// Perform the indexing task, given a collection (open for writing).
     void perform_task(const std::string & coll_name,
@@ -174,6 +306,10 @@ class IndexerUpdateDocumentTask : public IndexingTask {
 	      std::string & doc_type,
 	      std::string & doc_id) const;
 
+    void post_perform(const std::string & coll_name,
+		      RestPose::Collection * collection,
+		      TaskManager * taskman);
+
     /// Clone the task.
     IndexingTask * clone() const;
 };
@@ -184,12 +320,24 @@ class DeleteDocumentTask : public IndexingTask {
     std::string doc_type;
     std::string doc_id;
 
+    /// Acknowledgement to send for the request, or NULL.
+    std::auto_ptr<RestPose::WriteAck> ack;
+
+    /// True once the acknowledgement has been passed on.
+    bool acked;
+
   public:
     DeleteDocumentTask(const std::string & doc_type_,
-		       const std::string & doc_id_)
-	    : doc_type(doc_type_),
-	      doc_id(doc_id_)
-    {}
+		       const std::string & doc_id_,
+		       RestPose::WriteAck * ack_ = NULL)
+	    : IndexingTask(true),
+	      doc_type(doc_type_),
+	      doc_id(doc_id_),
+	      ack(ack_),
+	      acked(false)
+    {
+	sequence_key = doc_sequence_key("\t" + doc_type + "\t" + doc_id);
+    }
 
     /// Perform the indexing task, given a collection (open for writing).
     void perform_task(const std::string & coll_name,
@@ -200,10 +348,111 @@ class DeleteDocumentTask : public IndexingTask {
 	      std::string & doc_type,
 	      std::string & doc_id) const;
 
+    void post_perform(const std::string & coll_name,
+		      RestPose::Collection * collection,
+		      TaskManager * taskman);
+
     /// Clone the task.
     IndexingTask * clone() const;
 };
 
+/** Acknowledge a write request once all the changes queued before it have
+ *  been made (or committed, as requested).
+ *
+ *  This is an exclusive indexing task, so all the tasks before it on the
+ *  indexing queue have been performed by the time it is.
+ */
+class AckBarrierTask : public IndexingTask {
+    /// Acknowledgement to send.
+    std::auto_ptr<RestPose::WriteAck> ack;
+
+    /// True once the acknowledgement has been passed on.
+    bool acked;
+
+  public:
+    AckBarrierTask(RestPose::WriteAck * ack_)
+	    : IndexingTask(),
+	      ack(ack_),
+	      acked(false)
+    {}
+
+    void perform_task(const std::string & coll_name,
+		      RestPose::Collection * & collection,
+		      TaskManager * taskman);
+
+    void info(std::string & description,
+	      std::string & doc_type,
+	      std::string & doc_id) const;
+
+    void post_perform(const std::string & coll_name,
+		      RestPose::Collection * collection,
+		      TaskManager * taskman);
+
+    IndexingTask * clone() const;
+};
+
+
+/** Release journal segments, once the changes in them have been committed.
+ *
+ *  This is an exclusive indexing task, so all the changes recorded in the
+ *  segments have been made by the time it is performed.  The segments are
+ *  removed after the next commit of the collection.
+ */
+class JournalReleaseTask : public IndexingTask {
+    /// Paths of the journal segments to release.
+    std::vector<std::string> paths;
+
+  public:
+    JournalReleaseTask(const std::vector<std::string> & paths_)
+	    : IndexingTask(),
+	      paths(paths_)
+    {}
+
+    void perform_task(const std::string & coll_name,
+		      RestPose::Collection * & collection,
+		      TaskManager * taskman);
+
+    void info(std::string & description,
+	      std::string & doc_type,
+	      std::string & doc_id) const;
+
+    IndexingTask * clone() const;
+};
+
+/** Merge the database fragments of a collection.
+ *
+ *  Performed on the merge queue, so that merging doesn't hold up other
+ *  tasks.  Once the merged fragment is ready, a CompleteMergeTask is queued
+ *  to swap it in.
+ */
+class MergeFragmentsTask : public ProcessingTask {
+  public:
+    void perform(const std::string & coll_name,
+		 TaskManager * taskman);
+};
+
+/// Swap merged database fragments into a collection.
+class CompleteMergeTask : public IndexingTask {
+    /// The prepared merge.
+    RestPose::DbGroupMerge merge;
+
+  public:
+    CompleteMergeTask(const RestPose::DbGroupMerge & merge_)
+	    : merge(merge_)
+    {}
+
+    /// Perform the indexing task, given a collection (open for writing).
+    void perform_task(const std::string & coll_name,
+		      RestPose::Collection * & collection,
+		      TaskManager * taskman);
+
+    void info(std::string & description,
+	      std::string & doc_type,
+	      std::string & doc_id) const;
+
+    /// Clone the task.
+    IndexingTask * clone() const;
+};
 
 /// Delete a collection task for processing queue.
 class DeleteCollectionProcessingTask : public ProcessingTask {
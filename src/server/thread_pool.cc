@@ -28,7 +28,9 @@
 #include "logger/logger.h"
 #include <memory>
 #include "server/task_threads.h"
+#include "str.h"
 #include "utils/jsonutils.h"
+#include <vector>
 
 using namespace std;
 using namespace RestPose;
@@ -63,6 +65,17 @@ ThreadPool::add_thread(TaskThread * thread)
 {
     auto_ptr<TaskThread> threadptr(thread);
     ContextLocker lock(mutex);
+    start_thread(threadptr);
+}
+
+void
+ThreadPool::start_thread(auto_ptr<TaskThread> & threadptr)
+{
+    if (stopping) {
+	// Don't start new threads after stop(); threadptr deletes the thread.
+	return;
+    }
+    TaskThread * thread = threadptr.get();
     try {
 	threads[threadptr.release()] = true;
     } catch(...) {
@@ -87,19 +100,98 @@ ThreadPool::thread_finished(TaskThread * thread)
     ContextLocker lock(mutex);
     std::map<TaskThread *, bool>::iterator i = threads.find(thread);
     if (i != threads.end()) {
-	i->second = false;
-	--running;
-	++waiting_for_join;
-	LOG_DEBUG("TaskThread finished - waiting for join");
+	if (i->second) {
+	    i->second = false;
+	    --running;
+	    ++waiting_for_join;
+	    LOG_DEBUG("TaskThread finished - waiting for join");
+	}
     } else {
 	LOG_ERROR("TaskThread finished, but couldn't find its entry in the thread pool - resource leak likely ");
     }
 }
 
+void
+ThreadPool::reap(ContextLocker & lock)
+{
+    std::vector<TaskThread *> retired;
+    std::map<TaskThread *, bool>::iterator i = threads.begin();
+    while (i != threads.end()) {
+	if (i->second) {
+	    ++i;
+	} else {
+	    retired.push_back(i->first);
+	    threads.erase(i++);
+	    --waiting_for_join;
+	}
+    }
+    if (retired.empty()) {
+	return;
+    }
+    lock.unlock();
+    for (std::vector<TaskThread *>::iterator j = retired.begin();
+	 j != retired.end(); ++j) {
+	(*j)->join();
+	delete *j;
+    }
+    lock.lock();
+}
+
+void
+ThreadPool::set_elastic(unsigned min_threads_, unsigned max_threads_)
+{
+    ContextLocker lock(mutex);
+    min_threads = min_threads_;
+    max_threads = max_threads_;
+}
+
+bool
+ThreadPool::is_elastic() const
+{
+    ContextLocker lock(mutex);
+    return max_threads != 0;
+}
+
+bool
+ThreadPool::add_elastic_thread(TaskThread * thread)
+{
+    auto_ptr<TaskThread> threadptr(thread);
+    ContextLocker lock(mutex);
+    if (max_threads == 0 || stopping) {
+	return false;
+    }
+    reap(lock);
+    if (stopping || running >= max_threads) {
+	return false;
+    }
+    start_thread(threadptr);
+    return true;
+}
+
+bool
+ThreadPool::retire_idle_thread(TaskThread * thread)
+{
+    ContextLocker lock(mutex);
+    if (max_threads == 0 || stopping || running <= min_threads) {
+	return false;
+    }
+    std::map<TaskThread *, bool>::iterator i = threads.find(thread);
+    if (i == threads.end() || !i->second) {
+	return false;
+    }
+    i->second = false;
+    --running;
+    ++waiting_for_join;
+    LOG_DEBUG("Idle TaskThread retiring - " + str(running) +
+	      " threads still running");
+    return true;
+}
+
 void
 ThreadPool::stop()
 {
     ContextLocker lock(mutex);
+    stopping = true;
     for (std::map<TaskThread *, bool>::iterator i = threads.begin();
 	 i != threads.end(); ++i) {
 	if (i->second) {
@@ -131,4 +223,8 @@ ThreadPool::get_status(Json::Value & status) const
     status["size"] = Json::UInt64(threads.size());
     status["running"] = Json::UInt64(running);
     status["waiting_for_join"] = Json::UInt64(waiting_for_join);
+    if (max_threads != 0) {
+	status["min_size"] = Json::UInt64(min_threads);
+	status["max_size"] = Json::UInt64(max_threads);
+    }
 }
@@ -28,10 +28,15 @@
 #include "utils/io_wrappers.h"
 #include "utils/threading.h"
 #include <map>
+#include <memory>
 
 class TaskThread;
 
 /** A pool of threads.
+ *
+ *  In elastic mode, the number of threads varies between a minimum and a
+ *  maximum: the owner of the pool adds threads when it sees that tasks are
+ *  waiting, and threads which have been idle for a while retire themselves.
  */
 class ThreadPool {
     mutable Mutex mutex;
@@ -49,10 +54,37 @@ class ThreadPool {
     /// Number of threads waiting to be joined.
     unsigned waiting_for_join;
 
+    /// Minimum number of threads to keep running, in elastic mode.
+    unsigned min_threads;
+
+    /// Maximum number of threads to run, or 0 if not in elastic mode.
+    unsigned max_threads;
+
+    /// Flag set when the pool has been told to stop.
+    bool stopping;
+
+    /** Join and delete any threads which have retired.
+     *
+     *  The lock must be held on entry; it is released while joining.
+     */
+    void reap(ContextLocker & lock);
+
+    /** Add a thread to the pool, and start it.
+     *
+     *  The lock must be held on entry.
+     */
+    void start_thread(std::auto_ptr<TaskThread> & threadptr);
+
     ThreadPool(const ThreadPool &);
     void operator=(const ThreadPool &);
   public:
-    ThreadPool() : running(0), waiting_for_join(0) {}
+    ThreadPool()
+	    : running(0),
+	      waiting_for_join(0),
+	      min_threads(0),
+	      max_threads(0),
+	      stopping(false)
+    {}
     ~ThreadPool();
 
     /** Add a thread to the pool, and start it.
@@ -63,6 +95,34 @@ class ThreadPool {
      */
     void thread_finished(TaskThread * thread);
 
+    /** Put the pool into elastic mode.
+     *
+     *  @param min_threads_ The number of threads below which the pool
+     *  won't shrink.
+     *  @param max_threads_ The number of threads above which the pool won't
+     *  grow.
+     */
+    void set_elastic(unsigned min_threads_, unsigned max_threads_);
+
+    /** Check if the pool is in elastic mode.
+     */
+    bool is_elastic() const;
+
+    /** Add a thread to the pool and start it, if the pool may grow.
+     *
+     *  If not in elastic mode, if the pool is at its maximum size, or if the
+     *  pool is stopping, the thread is deleted and false is returned.  Also
+     *  joins any retired threads.
+     */
+    bool add_elastic_thread(TaskThread * thread);
+
+    /** Called by an idle thread to ask whether it should exit.
+     *
+     *  If this returns true, the thread has been removed from the running
+     *  count, and should exit (without calling thread_finished()).
+     */
+    bool retire_idle_thread(TaskThread * thread);
+
     /** Stop all threads in the pool.
      */
     void stop();
@@ -0,0 +1,110 @@
+/** @file write_ack.cc
+ * @brief Acknowledgement of write requests at a requested level.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "server/write_ack.h"
+
+#include "httpserver/httpserver.h"
+#include "utils/rsperrors.h"
+
+using namespace std;
+using namespace RestPose;
+
+AckLevel
+RestPose::get_ack_level(const ConnectionInfo & conn)
+{
+    const string * wait = conn.get_uri_arg_val("wait");
+    if (wait == NULL || *wait == "queued") {
+	return ACK_QUEUED;
+    }
+    if (*wait == "processed") {
+	return ACK_PROCESSED;
+    }
+    if (*wait == "committed" || *wait == "searchable") {
+	return ACK_COMMITTED;
+    }
+    throw InvalidValueError("Unknown value for wait parameter: \"" + *wait +
+			    "\" (expected queued, processed, committed or "
+			    "searchable)");
+}
+
+WriteAck::WriteAck(const WriteAck & other)
+	: CommitWaiter(),
+	  resulthandle(other.resulthandle),
+	  level(other.level),
+	  result(other.result),
+	  shared(other.shared)
+{
+    ContextLocker lock(shared->mutex);
+    ++(shared->copies);
+}
+
+WriteAck::~WriteAck()
+{
+    {
+	ContextLocker lock(shared->mutex);
+	if (--(shared->copies) != 0) {
+	    return;
+	}
+    }
+    // This was the last copy, so nothing else can use the shared state.
+    bool sent = shared->sent;
+    delete shared;
+    if (!sent) {
+	resulthandle.failed("Change was not applied", 500);
+    }
+}
+
+void
+WriteAck::set_sent()
+{
+    ContextLocker lock(shared->mutex);
+    shared->sent = true;
+}
+
+void
+WriteAck::succeeded()
+{
+    set_sent();
+    (void) resulthandle.set_ready_json(result, 200);
+}
+
+void
+WriteAck::failed(const string & msg, int status_code)
+{
+    set_sent();
+    resulthandle.failed(msg, status_code);
+}
+
+void
+WriteAck::committed()
+{
+    succeeded();
+}
+
+void
+WriteAck::commit_failed(const string & msg)
+{
+    failed("Commit failed: " + msg);
+}
@@ -0,0 +1,131 @@
+/** @file write_ack.h
+ * @brief Acknowledgement of write requests at a requested level.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_WRITE_ACK_H
+#define RESTPOSE_INCLUDED_WRITE_ACK_H
+
+#include "jsonxapian/collection.h"
+#include "json/value.h"
+#include "server/result_handle.h"
+#include <string>
+#include "utils/threading.h"
+
+class ConnectionInfo;
+
+namespace RestPose {
+
+/** The stage of handling a write request at which the request returns.
+ */
+enum AckLevel {
+    /// Return as soon as the request has been queued.
+    ACK_QUEUED,
+
+    /// Return once the request has been processed and passed to indexing.
+    ACK_PROCESSED,
+
+    /** Return once the change has been committed.
+     *
+     *  Searches started after a commit see the committed changes, so this
+     *  is also the level for requests waiting until changes are searchable.
+     */
+    ACK_COMMITTED
+};
+
+/** Get the acknowledgement level requested by the "wait" parameter of a
+ *  request.
+ *
+ *  Raises InvalidValueError if the parameter has an unknown value.
+ */
+AckLevel get_ack_level(const ConnectionInfo & conn);
+
+/** An acknowledgement to send for a write request, once it reaches the
+ *  requested level.
+ *
+ *  Passed along with the tasks performing the write.  Copies share the
+ *  result handle, and only the first response given by any copy is used.
+ *  When waiting for a commit, a copy is handed to the collection, to be
+ *  notified when the commit happens.
+ *
+ *  If the last copy is destroyed without a response having been given (eg,
+ *  because a task was dropped), the write is reported as failed, so that
+ *  the request doesn't wait forever.
+ */
+class WriteAck : public CommitWaiter {
+    /// State shared between the copies of an acknowledgement.
+    struct Shared {
+	Mutex mutex;
+
+	/// The number of copies.
+	unsigned copies;
+
+	/// True once a response has been given by any copy.
+	bool sent;
+
+	Shared() : mutex(), copies(1), sent(false) {}
+    };
+
+    ResultHandle resulthandle;
+    AckLevel level;
+    Json::Value result;
+    Shared * shared;
+
+    /// Record that a response has been given.
+    void set_sent();
+
+    void operator=(const WriteAck &);
+  public:
+    /** Create an acknowledgement.
+     *
+     *  @param result The body to return when the level is reached.
+     */
+    WriteAck(const ResultHandle & resulthandle_,
+	     AckLevel level_,
+	     const Json::Value & result_ = Json::Value(Json::objectValue))
+	    : resulthandle(resulthandle_),
+	      level(level_),
+	      result(result_),
+	      shared(new Shared)
+    {}
+
+    WriteAck(const WriteAck & other);
+
+    ~WriteAck();
+
+    AckLevel get_level() const {
+	return level;
+    }
+
+    /// Report that the write has reached the requested level.
+    void succeeded();
+
+    /// Report that the write failed.
+    void failed(const std::string & msg, int status_code = 500);
+
+    void committed();
+    void commit_failed(const std::string & msg);
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_WRITE_ACK_H */
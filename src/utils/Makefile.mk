@@ -3,6 +3,7 @@ noinst_LIBRARIES += libutils.a
 noinst_HEADERS += \
  src/utils/compression.h \
  src/utils/io_wrappers.h \
+ src/utils/jsonparser.h \
  src/utils/jsonutils.h \
  src/utils/queueing.h \
  src/utils/rmdir.h \
@@ -14,15 +15,18 @@ noinst_HEADERS += \
  src/utils/threadsafequeue.h \
  src/utils/utils.h \
  src/utils/validation.h \
- src/utils/winservice.h
+ src/utils/winservice.h \
+ src/utils/workpool.h
 
 libutils_a_SOURCES = \
  src/utils/compression.cc \
  src/utils/io_wrappers.cc \
+ src/utils/jsonparser.cc \
  src/utils/jsonutils.cc \
  src/utils/rmdir.cc \
  src/utils/rsperrors.cc \
  src/utils/threading.cc \
  src/utils/utils.cc \
  src/utils/validation.cc \
- src/utils/winservice.cc
+ src/utils/winservice.cc \
+ src/utils/workpool.cc
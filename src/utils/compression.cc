@@ -37,7 +37,7 @@ ZlibInflater::make_inflate_zstream()
     inflate_zstream->next_in = Z_NULL;
     inflate_zstream->avail_in = 0;
 
-    int err = inflateInit2(inflate_zstream.get(), 15);
+    int err = inflateInit2(inflate_zstream.get(), window_bits);
     if (rare(err != Z_OK)) {
 	if (err == Z_MEM_ERROR) {
 	    throw std::bad_alloc();
@@ -49,18 +49,27 @@ ZlibInflater::make_inflate_zstream()
 	    msg += str(err);
 	}
 	msg += ')';
-	throw RestPose::ImporterError(msg);
+	throw RestPose::CompressionError(msg);
     }
     stream = inflate_zstream.release();
+    finished = false;
+    pending_output = false;
 }
 
-std::string
-ZlibInflater::inflate(const char * data, size_t data_len)
+void
+ZlibInflater::free_zstream()
 {
     if (stream) {
+	(void) inflateEnd(stream);
 	delete stream;
 	stream = NULL;
     }
+}
+
+std::string
+ZlibInflater::inflate(const char * data, size_t data_len)
+{
+    free_zstream();
     make_inflate_zstream();
     std::string uncompressed;
     stream->next_in = (Bytef*)const_cast<char *>(data);
@@ -80,7 +89,7 @@ ZlibInflater::inflate(const char * data, size_t data_len)
 		msg += stream->msg;
 		msg += ')';
 	    }
-	    throw RestPose::ImporterError(msg);
+	    throw RestPose::CompressionError(msg);
 	}
 	uncompressed.append(reinterpret_cast<const char *>(buf),
 			    stream->next_out - buf);
@@ -91,7 +100,109 @@ ZlibInflater::inflate(const char * data, size_t data_len)
 	msg += " != ";
 	// OpenBSD's zlib.h uses off_t instead of uLong for total_out.
 	msg += str((size_t)stream->total_out);
-	throw RestPose::ImporterError(msg);
+	throw RestPose::CompressionError(msg);
     }
     return uncompressed;
 }
+
+void
+ZlibInflater::set_input(const char * data, size_t data_len)
+{
+    if (!stream) {
+	make_inflate_zstream();
+    }
+    if (finished && data_len != 0) {
+	throw RestPose::CompressionError("Unexpected data after end of "
+					 "compressed stream");
+    }
+    stream->next_in = (Bytef*)const_cast<char *>(data);
+    stream->avail_in = (uInt)data_len;
+}
+
+bool
+ZlibInflater::read_output(std::string & output)
+{
+    output.resize(0);
+    if (!stream || finished) {
+	return false;
+    }
+    Bytef buf[8192];
+    while (stream->avail_in != 0 || pending_output) {
+	stream->next_out = buf;
+	stream->avail_out = (uInt)sizeof(buf);
+	int err = ::inflate(stream, Z_SYNC_FLUSH);
+	if (err == Z_BUF_ERROR) {
+	    // No progress was possible.
+	    pending_output = false;
+	    break;
+	}
+	if (err != Z_OK && err != Z_STREAM_END) {
+	    if (err == Z_MEM_ERROR) throw std::bad_alloc();
+	    std::string msg = "inflate failed";
+	    if (stream->msg) {
+		msg += " (";
+		msg += stream->msg;
+		msg += ')';
+	    }
+	    throw RestPose::CompressionError(msg);
+	}
+	pending_output = (stream->avail_out == 0);
+	output.assign(reinterpret_cast<const char *>(buf),
+		      stream->next_out - buf);
+	if (err == Z_STREAM_END) {
+	    finished = true;
+	    if (stream->avail_in != 0) {
+		throw RestPose::CompressionError("Unexpected data after end "
+						 "of compressed stream");
+	    }
+	    break;
+	}
+	if (!output.empty()) {
+	    break;
+	}
+    }
+    return !output.empty();
+}
+
+std::string
+ZlibDeflater::gzip(const char * data, size_t data_len) const
+{
+    z_stream stream;
+    stream.zalloc = reinterpret_cast<alloc_func>(0);
+    stream.zfree = reinterpret_cast<free_func>(0);
+    stream.opaque = Z_NULL;
+
+    // Adding 16 to the window bits gives a gzip header and trailer.
+    int err = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+			   Z_DEFAULT_STRATEGY);
+    if (rare(err != Z_OK)) {
+	if (err == Z_MEM_ERROR) {
+	    throw std::bad_alloc();
+	}
+	std::string msg = "deflateInit2 failed (";
+	if (stream.msg) {
+	    msg += stream.msg;
+	} else {
+	    msg += str(err);
+	}
+	msg += ')';
+	throw RestPose::CompressionError(msg);
+    }
+
+    // Older versions of zlib don't allow for the gzip header and trailer
+    // in deflateBound(), so add space for them.
+    std::string compressed;
+    compressed.resize(deflateBound(&stream, (uLong)data_len) + 18);
+    stream.next_in = (Bytef*)const_cast<char *>(data);
+    stream.avail_in = (uInt)data_len;
+    stream.next_out = reinterpret_cast<Bytef *>(&compressed[0]);
+    stream.avail_out = (uInt)compressed.size();
+
+    err = ::deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    (void) deflateEnd(&stream);
+    if (err != Z_STREAM_END) {
+	throw RestPose::CompressionError("deflate failed (" + str(err) + ")");
+    }
+    return compressed;
+}
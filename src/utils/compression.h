@@ -30,15 +30,79 @@
 
 class ZlibInflater {
     z_stream * stream;
+
+    /** The windowBits parameter to pass to zlib.
+     *
+     *  This determines the header format expected.
+     */
+    int window_bits;
+
+    /// True if the end of the compressed stream has been reached.
+    bool finished;
+
+    /** True if the last call to inflate filled the output buffer, so more
+     *  output may be available without further input.
+     */
+    bool pending_output;
+
     void make_inflate_zstream();
+    void free_zstream();
+
+    ZlibInflater(const ZlibInflater &);
+    void operator=(const ZlibInflater &);
   public:
-    ZlibInflater() : stream(NULL) {}
+    /** Create an inflater.
+     *
+     *  @param accept_gzip If true, accept data with either a zlib or a gzip
+     *  header.  Otherwise, only a zlib header is accepted.
+     */
+    ZlibInflater(bool accept_gzip = false)
+	    : stream(NULL),
+	      window_bits(accept_gzip ? 15 + 32 : 15),
+	      finished(false),
+	      pending_output(false)
+    {}
     ~ZlibInflater() {
-	delete stream;
+	free_zstream();
     }
     /** Uncompress some data compressed with zlib.
      */
     std::string inflate(const char * data, size_t len);
+
+    /** Supply the next piece of a compressed stream.
+     *
+     *  The data must remain valid until read_output() has returned false.
+     *  The stream is started on the first call.
+     */
+    void set_input(const char * data, size_t len);
+
+    /** Read some uncompressed data from the stream.
+     *
+     *  Sets output to the next piece of uncompressed data (of at most a few
+     *  kilobytes, so that the total amount of memory used is bounded even
+     *  for highly compressed data).
+     *
+     *  @returns false if no more output is available from the input
+     *  supplied so far (in which case output will be empty).
+     */
+    bool read_output(std::string & output);
+
+    /** Return true if the end of the compressed stream has been reached.
+     */
+    bool at_end() const {
+	return finished;
+    }
+};
+
+class ZlibDeflater {
+    /// The compression level to use (0 to 9).
+    int level;
+  public:
+    ZlibDeflater(int level_ = Z_DEFAULT_COMPRESSION) : level(level_) {}
+
+    /** Compress some data, returning it in gzip format.
+     */
+    std::string gzip(const char * data, size_t len) const;
 };
 
 #endif /* RESTPOSE_INCLUDED_UTILS_H */
@@ -0,0 +1,459 @@
+/** @file jsonparser.cc
+ * @brief Incremental JSON parser.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "utils/jsonparser.h"
+
+#include <cstdlib>
+#include <cstring>
+#include "str.h"
+#include "utils/rsperrors.h"
+
+using namespace std;
+using namespace RestPose;
+
+/** Append the UTF-8 encoding of a unicode code point to a string.
+ */
+static void
+append_utf8(string & result, unsigned cp)
+{
+    if (cp <= 0x7f) {
+	result += static_cast<char>(cp);
+    } else if (cp <= 0x7ff) {
+	result += static_cast<char>(0xc0 | (0x1f & (cp >> 6)));
+	result += static_cast<char>(0x80 | (0x3f & cp));
+    } else if (cp <= 0xffff) {
+	result += static_cast<char>(0xe0 | (0x0f & (cp >> 12)));
+	result += static_cast<char>(0x80 | (0x3f & (cp >> 6)));
+	result += static_cast<char>(0x80 | (0x3f & cp));
+    } else if (cp <= 0x10ffff) {
+	result += static_cast<char>(0xf0 | (0x07 & (cp >> 18)));
+	result += static_cast<char>(0x80 | (0x3f & (cp >> 12)));
+	result += static_cast<char>(0x80 | (0x3f & (cp >> 6)));
+	result += static_cast<char>(0x80 | (0x3f & cp));
+    }
+}
+
+JsonStreamParser::JsonStreamParser()
+	: result(),
+	  stack(),
+	  state(EXPECT_VALUE),
+	  comment_return(EXPECT_VALUE),
+	  container_empty(false),
+	  string_is_key(false),
+	  token(),
+	  key(),
+	  unicode_digits(0),
+	  unicode_value(0),
+	  high_surrogate(0),
+	  literal(NULL),
+	  offset(0)
+{
+}
+
+void
+JsonStreamParser::fail(const string & msg) const
+{
+    throw InvalidValueError("Invalid JSON: " + msg + " at offset " +
+			    str(offset));
+}
+
+Json::Value &
+JsonStreamParser::next_value()
+{
+    if (stack.empty()) {
+	state = DONE;
+	return result;
+    }
+    state = EXPECT_SEPARATOR;
+    Json::Value & top = *(stack.back());
+    if (top.isArray()) {
+	return top.append(Json::Value());
+    }
+    return top[key];
+}
+
+void
+JsonStreamParser::start_value(char ch)
+{
+    switch (ch) {
+	case '{': {
+	    Json::Value & value = next_value();
+	    value = Json::Value(Json::objectValue);
+	    stack.push_back(&value);
+	    state = EXPECT_KEY;
+	    container_empty = true;
+	    return;
+	}
+	case '[': {
+	    Json::Value & value = next_value();
+	    value = Json::Value(Json::arrayValue);
+	    stack.push_back(&value);
+	    state = EXPECT_VALUE;
+	    container_empty = true;
+	    return;
+	}
+	case '"':
+	    token.resize(0);
+	    string_is_key = false;
+	    state = IN_STRING;
+	    return;
+	case '-': case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+	    token.assign(1, ch);
+	    state = IN_NUMBER;
+	    return;
+	case 't':
+	    literal = "true";
+	    break;
+	case 'f':
+	    literal = "false";
+	    break;
+	case 'n':
+	    literal = "null";
+	    break;
+	default:
+	    fail("Syntax error: value, object or array expected");
+    }
+    token.assign(1, ch);
+    state = IN_LITERAL;
+}
+
+void
+JsonStreamParser::close_container(char ch)
+{
+    if ((ch == '}') != stack.back()->isObject()) {
+	fail(string("Unexpected '") + ch + "'");
+    }
+    stack.pop_back();
+    state = stack.empty() ? DONE : EXPECT_SEPARATOR;
+}
+
+void
+JsonStreamParser::finish_string()
+{
+    if (string_is_key) {
+	key.swap(token);
+	state = EXPECT_COLON;
+    } else {
+	next_value() = Json::Value(token);
+    }
+    token.resize(0);
+}
+
+void
+JsonStreamParser::finish_number()
+{
+    // Decode the number in the same way as Json::Reader does: as an integer
+    // if possible, otherwise as a double.
+    bool is_double = false;
+    for (string::size_type i = 0; i != token.size(); ++i) {
+	char ch = token[i];
+	if (ch == '.' || ch == 'e' || ch == 'E' || ch == '+' ||
+	    (ch == '-' && i != 0)) {
+	    is_double = true;
+	    break;
+	}
+    }
+
+    if (!is_double) {
+	const char * pos = token.data();
+	const char * end = pos + token.size();
+	bool negative = (*pos == '-');
+	if (negative) {
+	    ++pos;
+	}
+	if (pos == end) {
+	    fail("'" + token + "' is not a number");
+	}
+	Json::Value::LargestUInt max_value = negative ?
+		Json::Value::LargestUInt(Json::Value::maxLargestInt) + 1 :
+		Json::Value::maxLargestUInt;
+	Json::Value::LargestUInt threshold = max_value / 10;
+	unsigned last_digit_threshold = unsigned(max_value % 10);
+	Json::Value::LargestUInt value = 0;
+	while (pos != end) {
+	    unsigned digit = *pos++ - '0';
+	    if (value >= threshold &&
+		(pos != end || digit > last_digit_threshold)) {
+		// Too large for an integer.
+		is_double = true;
+		break;
+	    }
+	    value = value * 10 + digit;
+	}
+	if (!is_double) {
+	    Json::Value & result_value = next_value();
+	    if (negative) {
+		result_value = Json::Value::LargestInt(0 - value);
+	    } else if (value <= Json::Value::LargestUInt(Json::Value::maxInt)) {
+		result_value = Json::Value::LargestInt(value);
+	    } else {
+		result_value = value;
+	    }
+	    return;
+	}
+    }
+
+    char * endptr;
+    double value = strtod(token.c_str(), &endptr);
+    if (endptr != token.c_str() + token.size()) {
+	fail("'" + token + "' is not a number");
+    }
+    next_value() = value;
+}
+
+void
+JsonStreamParser::finish_unicode()
+{
+    state = IN_STRING;
+    unsigned cp = unicode_value;
+    if (high_surrogate != 0) {
+	cp = 0x10000 + ((high_surrogate & 0x3ff) << 10) + (cp & 0x3ff);
+	high_surrogate = 0;
+    } else if (cp >= 0xd800 && cp <= 0xdbff) {
+	high_surrogate = cp;
+	return;
+    }
+    append_utf8(token, cp);
+}
+
+bool
+JsonStreamParser::handle_space(char ch)
+{
+    switch (ch) {
+	case ' ': case '\t': case '\r': case '\n':
+	    return true;
+	case '/':
+	    comment_return = state;
+	    state = IN_COMMENT_START;
+	    return true;
+    }
+    return false;
+}
+
+void
+JsonStreamParser::parse(const char * data, size_t len)
+{
+    const char * pos = data;
+    const char * end = data + len;
+    while (pos != end) {
+	char ch = *pos;
+	switch (state) {
+	    case EXPECT_VALUE:
+		if (handle_space(ch)) {
+		    break;
+		}
+		if (ch == ']' && container_empty) {
+		    close_container(ch);
+		    break;
+		}
+		container_empty = false;
+		start_value(ch);
+		break;
+	    case EXPECT_KEY:
+		if (handle_space(ch)) {
+		    break;
+		}
+		if (ch == '}' && container_empty) {
+		    close_container(ch);
+		    break;
+		}
+		if (ch != '"') {
+		    fail("Missing '}' or object member name");
+		}
+		container_empty = false;
+		token.resize(0);
+		string_is_key = true;
+		state = IN_STRING;
+		break;
+	    case EXPECT_COLON:
+		if (handle_space(ch)) {
+		    break;
+		}
+		if (ch != ':') {
+		    fail("Missing ':' after object member name");
+		}
+		state = EXPECT_VALUE;
+		break;
+	    case EXPECT_SEPARATOR:
+		if (handle_space(ch)) {
+		    break;
+		}
+		if (ch == ',') {
+		    // A value must follow, even if the container was left
+		    // marked empty by a nested empty container closing.
+		    container_empty = false;
+		    state = stack.back()->isObject() ? EXPECT_KEY : EXPECT_VALUE;
+		    break;
+		}
+		if (ch == '}' || ch == ']') {
+		    close_container(ch);
+		    break;
+		}
+		if (stack.back()->isObject()) {
+		    fail("Missing ',' or '}' in object declaration");
+		}
+		fail("Missing ',' or ']' in array declaration");
+		break;
+	    case IN_STRING: {
+		// Copy runs of plain characters in one go.
+		const char * start = pos;
+		while (pos != end && *pos != '"' && *pos != '\\') {
+		    ++pos;
+		}
+		if (high_surrogate != 0 && (pos != start || *pos != '\\')) {
+		    fail("Expecting another \\u token to begin the second "
+			 "half of a unicode surrogate pair");
+		}
+		token.append(start, pos - start);
+		offset += pos - start;
+		if (pos == end) {
+		    return;
+		}
+		if (*pos == '"') {
+		    finish_string();
+		} else {
+		    state = IN_STRING_ESCAPE;
+		}
+		break;
+	    }
+	    case IN_STRING_ESCAPE:
+		if (high_surrogate != 0 && ch != 'u') {
+		    fail("Expecting another \\u token to begin the second "
+			 "half of a unicode surrogate pair");
+		}
+		state = IN_STRING;
+		switch (ch) {
+		    case '"': token += '"'; break;
+		    case '/': token += '/'; break;
+		    case '\\': token += '\\'; break;
+		    case 'b': token += '\b'; break;
+		    case 'f': token += '\f'; break;
+		    case 'n': token += '\n'; break;
+		    case 'r': token += '\r'; break;
+		    case 't': token += '\t'; break;
+		    case 'u':
+			unicode_digits = 0;
+			unicode_value = 0;
+			state = IN_STRING_UNICODE;
+			break;
+		    default:
+			fail("Bad escape sequence in string");
+		}
+		break;
+	    case IN_STRING_UNICODE: {
+		unsigned digit;
+		if (ch >= '0' && ch <= '9') {
+		    digit = ch - '0';
+		} else if (ch >= 'a' && ch <= 'f') {
+		    digit = ch - 'a' + 10;
+		} else if (ch >= 'A' && ch <= 'F') {
+		    digit = ch - 'A' + 10;
+		} else {
+		    fail("Bad unicode escape sequence in string: hexadecimal "
+			 "digit expected");
+		}
+		unicode_value = unicode_value * 16 + digit;
+		if (++unicode_digits == 4) {
+		    finish_unicode();
+		}
+		break;
+	    }
+	    case IN_NUMBER:
+		if ((ch >= '0' && ch <= '9') || ch == '.' || ch == 'e' ||
+		    ch == 'E' || ch == '+' || ch == '-') {
+		    token += ch;
+		    break;
+		}
+		finish_number();
+		// Handle the character which ended the number in the new state.
+		continue;
+	    case IN_LITERAL:
+		if (ch != literal[token.size()]) {
+		    fail("Syntax error: value, object or array expected");
+		}
+		token += ch;
+		if (literal[token.size()] == '\0') {
+		    Json::Value & value = next_value();
+		    if (literal[0] == 't') {
+			value = true;
+		    } else if (literal[0] == 'f') {
+			value = false;
+		    }
+		    token.resize(0);
+		}
+		break;
+	    case IN_COMMENT_START:
+		if (ch == '/') {
+		    state = IN_LINE_COMMENT;
+		} else if (ch == '*') {
+		    state = IN_BLOCK_COMMENT;
+		} else {
+		    fail("Syntax error: comment expected");
+		}
+		break;
+	    case IN_LINE_COMMENT:
+		if (ch == '\n') {
+		    state = comment_return;
+		}
+		break;
+	    case IN_BLOCK_COMMENT:
+		if (ch == '*') {
+		    state = IN_BLOCK_COMMENT_STAR;
+		}
+		break;
+	    case IN_BLOCK_COMMENT_STAR:
+		if (ch == '/') {
+		    state = comment_return;
+		} else if (ch != '*') {
+		    state = IN_BLOCK_COMMENT;
+		}
+		break;
+	    case DONE:
+		if (handle_space(ch)) {
+		    break;
+		}
+		fail("Unexpected data after end of value");
+		break;
+	}
+	++pos;
+	++offset;
+    }
+}
+
+void
+JsonStreamParser::finish(Json::Value & value)
+{
+    if (state == IN_NUMBER) {
+	finish_number();
+    } else if (state == IN_LINE_COMMENT) {
+	state = comment_return;
+    }
+    if (state == DONE || (state == EXPECT_VALUE && stack.empty())) {
+	value.swap(result);
+	return;
+    }
+    fail("Unexpected end of input");
+}
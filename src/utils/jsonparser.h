@@ -0,0 +1,163 @@
+/** @file jsonparser.h
+ * @brief Incremental JSON parser.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef RESTPOSE_INCLUDED_JSONPARSER_H
+#define RESTPOSE_INCLUDED_JSONPARSER_H
+
+#include "json/value.h"
+#include <string>
+#include <vector>
+
+namespace RestPose {
+
+/** Incremental parser for JSON values.
+ *
+ *  The serialised value may be supplied in arbitrarily sized pieces, which are
+ *  parsed as they arrive.  Only the token currently being read (eg, a string
+ *  or number) is buffered, rather than the whole serialised value, so the
+ *  memory used is dominated by the size of the resulting Json::Value.
+ *
+ *  The input accepted is the same as for json_unserialise(), except that
+ *  anything other than whitespace or comments following the value is an
+ *  error.
+ */
+class JsonStreamParser {
+    enum State {
+	/// Expecting a value (or the end of an array, if it is empty).
+	EXPECT_VALUE,
+	/// Expecting an object key (or the end of the object, if it is empty).
+	EXPECT_KEY,
+	/// Expecting the colon after an object key.
+	EXPECT_COLON,
+	/// Expecting a comma, or the end of the enclosing container.
+	EXPECT_SEPARATOR,
+	/// Reading a string.
+	IN_STRING,
+	/// Reading the character after a backslash in a string.
+	IN_STRING_ESCAPE,
+	/// Reading the hex digits of a \u escape in a string.
+	IN_STRING_UNICODE,
+	/// Reading a number.
+	IN_NUMBER,
+	/// Reading one of the literals true, false or null.
+	IN_LITERAL,
+	/// Read a / which should start a comment.
+	IN_COMMENT_START,
+	/// Reading a comment which ends at the end of the line.
+	IN_LINE_COMMENT,
+	/// Reading a comment which ends with an asterisk and a slash.
+	IN_BLOCK_COMMENT,
+	/// Read a * inside a block comment.
+	IN_BLOCK_COMMENT_STAR,
+	/// A complete value has been read.
+	DONE
+    };
+
+    /// The value being built.
+    Json::Value result;
+
+    /// The containers (arrays and objects) currently open.
+    std::vector<Json::Value *> stack;
+
+    /// The current state.
+    State state;
+
+    /// The state to return to at the end of a comment.
+    State comment_return;
+
+    /// True if an array or object has just been opened.
+    bool container_empty;
+
+    /// True if the string being read is an object key.
+    bool string_is_key;
+
+    /// The string, number or literal currently being read.
+    std::string token;
+
+    /// The key to use for the next member of the current object.
+    std::string key;
+
+    /// The number of hex digits read so far in a \u escape.
+    unsigned unicode_digits;
+
+    /// The code point being read from a \u escape.
+    unsigned unicode_value;
+
+    /** The high half of a surrogate pair, if the low half is expected next,
+     *  or 0 otherwise.
+     */
+    unsigned high_surrogate;
+
+    /// The literal being read.
+    const char * literal;
+
+    /// The number of bytes of input processed.
+    size_t offset;
+
+    /// Raise an error about the input.
+    void fail(const std::string & msg) const;
+
+    /// Get a reference to the place to store the next value.
+    Json::Value & next_value();
+
+    /// Start reading a value, starting with the given character.
+    void start_value(char ch);
+
+    /// Close the innermost container.
+    void close_container(char ch);
+
+    /// Finish reading a string.
+    void finish_string();
+
+    /// Finish reading a number.
+    void finish_number();
+
+    /// Finish reading a \u escape.
+    void finish_unicode();
+
+    /// Handle a character between tokens.
+    bool handle_space(char ch);
+
+  public:
+    JsonStreamParser();
+
+    /** Parse some more of the serialised value.
+     *
+     *  Raises InvalidValueError if the data is not valid JSON.
+     */
+    void parse(const char * data, size_t len);
+
+    /** Finish parsing.
+     *
+     *  Raises InvalidValueError if the data supplied was not a complete JSON
+     *  value.  If no data (other than whitespace) was supplied, the result
+     *  is a null value.
+     *
+     *  @param value Set to the parsed value.
+     */
+    void finish(Json::Value & value);
+};
+
+}
+
+#endif /* RESTPOSE_INCLUDED_JSONPARSER_H */
@@ -83,6 +83,13 @@ namespace RestPose {
 	InvalidStateError(const std::string & message_) : Error(message_, "InvalidStateError") {}
     };
 
+    /** An error when compressing or uncompressing data.
+     */
+    class CompressionError : public Error {
+      public:
+	CompressionError(const std::string & message_) : Error(message_, "CompressionError") {}
+    };
+
     /** An error in an importer.
      */
     class ImporterError : public Error {
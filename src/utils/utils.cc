@@ -26,9 +26,13 @@
 #include "utils.h"
 
 #include <ctype.h>
+#include "safeunistd.h"
 #include "str.h"
 #include <string>
 #include <string.h>
+#ifdef __WIN32__
+#include <windows.h>
+#endif
 
 std::string
 get_sys_error(int errno_value)
@@ -54,6 +58,24 @@ get_sys_error(int errno_value)
 #endif
 }
 
+unsigned
+get_cpu_count()
+{
+#if defined __WIN32__
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long count = info.dwNumberOfProcessors;
+#elif defined _SC_NPROCESSORS_ONLN
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    long count = 1;
+#endif
+    if (count < 1) {
+	return 1;
+    }
+    return unsigned(count);
+}
+
 std::string
 urlquote(const std::string & value)
 {
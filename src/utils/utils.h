@@ -33,6 +33,12 @@
  */
 std::string get_sys_error(int errno_value);
 
+/** Get the number of processors available.
+ *
+ *  Returns 1 if the number can't be determined.
+ */
+unsigned get_cpu_count();
+
 /// Quote a url string (ie, replace unsafe characters with %XX values)
 std::string urlquote(const std::string & value);
 
@@ -132,3 +132,33 @@ validate_catid_throw(const string & value)
 	throw InvalidValueError(error);
     }
 }
+
+string
+validate_template_name(const string & value)
+{
+    if (value.empty()) {
+	return "Invalid empty search template name";
+    }
+    for (string::size_type i = 0; i != value.size(); ++i) {
+	unsigned char ch = value[i];
+	switch (ch) {
+	    case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+	    case 8: case 9: case 10: case 11: case 12: case 13: case 14:
+	    case 15: case 16: case 17: case 18: case 19: case 20: case 21:
+	    case 22: case 23: case 24: case 25: case 26: case 27: case 28:
+	    case 29: case 30: case 31: case ':': case '/': case '\\':
+	    case '.': case ',': case '[': case ']': case '{': case '}':
+		return "Invalid character (" + hexesc(value.substr(i, 1)) + ") in search template name";
+	}
+    }
+    return string();
+}
+
+void
+validate_template_name_throw(const string & value)
+{
+    string error = validate_template_name(value);
+    if (!error.empty()) {
+	throw InvalidValueError(error);
+    }
+}
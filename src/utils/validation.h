@@ -62,4 +62,16 @@ std::string validate_catid(const std::string & value);
  */
 void validate_catid_throw(const std::string & value);
 
+/** Check if a search template name is valid.
+ *
+ *  Returns an error message if the name is not valid.
+ */
+std::string validate_template_name(const std::string & value);
+
+/** Check if a search template name is valid.
+ *
+ *  Raises InvalidValueError if the name is not valid.
+ */
+void validate_template_name_throw(const std::string & value);
+
 #endif /* RESTPOSE_INCLUDED_VALIDATION_H */
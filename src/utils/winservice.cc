@@ -297,14 +297,20 @@ run_service(DWORD, LPTSTR *)
     report_status(SERVICE_START_PENDING, 1000);
 
     CollectionPool pool(g_options->datadir);
-    TaskManager * taskman = new TaskManager(pool);
+    TaskManagerSizes sizes;
+    g_options->apply_task_sizes(sizes);
+    TaskManager * taskman = new TaskManager(pool, sizes);
     g_server->add("taskman", taskman);
     Router router(taskman, g_server);
     setup_routes(router);
 
     // Service setup and mainloop (could be moved to a separate function).
     g_server->add("httpserver",
-		  new HTTPServer(g_options->port, g_options->pedantic, &router));
+		  new HTTPServer(g_options->port, g_options->pedantic, &router,
+				 g_options->http_threads,
+				 g_options->max_body_size,
+				 g_options->compress_level,
+				 g_options->compress_min_size));
     report_status(SERVICE_RUNNING);
     g_server->run();
 
@@ -0,0 +1,170 @@
+/** @file workpool.cc
+ * @brief A pool of threads for running batches of jobs in parallel.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "utils/workpool.h"
+
+#include <algorithm>
+#include "logger/logger.h"
+#include <xapian.h>
+
+using namespace std;
+
+WorkJob::~WorkJob()
+{
+}
+
+/** A thread in a WorkPool.
+ */
+class WorkPool::WorkThread : public Thread {
+    WorkPool & pool;
+  public:
+    WorkThread(WorkPool & pool_) : Thread(), pool(pool_) {}
+
+    void run() {
+	pool.work();
+    }
+};
+
+WorkPool::WorkPool()
+	: stopping(false)
+{
+}
+
+WorkPool::~WorkPool()
+{
+    stop();
+}
+
+WorkJob *
+WorkPool::claim(Batch * batch)
+{
+    WorkJob * job = batch->jobs[batch->next];
+    if (++(batch->next) == batch->jobs.size()) {
+	deque<Batch *>::iterator i = find(batches.begin(), batches.end(),
+					  batch);
+	if (i != batches.end()) {
+	    batches.erase(i);
+	}
+    }
+    return job;
+}
+
+void
+WorkPool::run_claimed(Batch * batch, WorkJob * job, ContextLocker & lock)
+{
+    lock.unlock();
+    bool ok = true;
+    try {
+	job->run();
+    } catch(const RestPose::Error & e) {
+	LOG_ERROR("Work job failed with", e);
+	ok = false;
+    } catch(const Xapian::Error & e) {
+	LOG_ERROR("Work job failed with", e);
+	ok = false;
+    } catch(const std::bad_alloc & e) {
+	LOG_ERROR("Work job failed with", e);
+	ok = false;
+    } catch(...) {
+	LOG_ERROR("Work job failed with unknown exception");
+	ok = false;
+    }
+    lock.lock();
+    if (!ok) {
+	batch->failed = true;
+    }
+    if (--(batch->remaining) == 0) {
+	cond.broadcast();
+    }
+}
+
+void
+WorkPool::work()
+{
+    ContextLocker lock(cond);
+    while (!stopping) {
+	if (batches.empty()) {
+	    cond.wait();
+	    continue;
+	}
+	Batch * batch = batches.front();
+	WorkJob * job = claim(batch);
+	run_claimed(batch, job, lock);
+    }
+}
+
+bool
+WorkPool::start(unsigned count)
+{
+    for (unsigned i = 0; i != count; ++i) {
+	WorkThread * thread = new WorkThread(*this);
+	{
+	    ContextLocker lock(cond);
+	    threads.push_back(thread);
+	}
+	if (!thread->start()) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+void
+WorkPool::stop()
+{
+    {
+	ContextLocker lock(cond);
+	stopping = true;
+	cond.broadcast();
+    }
+    for (vector<WorkThread *>::iterator i = threads.begin();
+	 i != threads.end(); ++i) {
+	(*i)->join();
+	delete *i;
+    }
+    threads.clear();
+}
+
+bool
+WorkPool::run_jobs(const vector<WorkJob *> & jobs)
+{
+    if (jobs.empty()) {
+	return true;
+    }
+    Batch batch(jobs);
+    ContextLocker lock(cond);
+    if (!stopping && !threads.empty()) {
+	batches.push_back(&batch);
+	cond.broadcast();
+    }
+    while (batch.next != jobs.size()) {
+	WorkJob * job = claim(&batch);
+	run_claimed(&batch, job, lock);
+    }
+    while (batch.remaining != 0) {
+	cond.wait();
+    }
+    return !batch.failed;
+}
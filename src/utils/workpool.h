@@ -0,0 +1,150 @@
+/** @file workpool.h
+ * @brief A pool of threads for running batches of jobs in parallel.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RESTPOSE_INCLUDED_WORKPOOL_H
+#define RESTPOSE_INCLUDED_WORKPOOL_H
+
+#include <deque>
+#include "utils/threading.h"
+#include <vector>
+
+/** A job to be run by a WorkPool.
+ */
+class WorkJob {
+  public:
+    virtual ~WorkJob();
+
+    /** Run the job.
+     *
+     *  Jobs should catch their own exceptions; any which escape are
+     *  swallowed, and reported by the return value of WorkPool::run_jobs().
+     */
+    virtual void run() = 0;
+};
+
+/** A pool of threads, for running batches of short jobs in parallel.
+ *
+ *  Unlike the task queues, this is for splitting up a single piece of work
+ *  (such as a search) which a caller is waiting for.  The caller runs jobs
+ *  from its own batch alongside the pool's threads, so a batch always makes
+ *  progress even if all the pool's threads are busy with other batches.
+ */
+class WorkPool {
+    class WorkThread;
+    friend class WorkThread;
+
+    /** A batch of jobs being run.
+     */
+    struct Batch {
+	/// The jobs in the batch.
+	const std::vector<WorkJob *> & jobs;
+
+	/// Index of the next job to be claimed.
+	size_t next;
+
+	/// Number of jobs which haven't yet finished.
+	size_t remaining;
+
+	/// Flag set if any job raised an exception.
+	bool failed;
+
+	Batch(const std::vector<WorkJob *> & jobs_)
+		: jobs(jobs_), next(0), remaining(jobs_.size()), failed(false)
+	{}
+    };
+
+    /** Condition, holding the lock protecting the state below.
+     *
+     *  Broadcast when a batch is added, when a batch finishes, and when the
+     *  pool is stopped.
+     */
+    Condition cond;
+
+    /// Batches with jobs which have not yet been claimed.
+    std::deque<Batch *> batches;
+
+    /// The threads in the pool.
+    std::vector<WorkThread *> threads;
+
+    /// Flag set when the pool's threads should exit.
+    bool stopping;
+
+    /** Claim the next job from a batch.
+     *
+     *  The lock must be held by the caller.  The batch must have unclaimed
+     *  jobs.
+     */
+    WorkJob * claim(Batch * batch);
+
+    /** Run a claimed job, and mark it as finished.
+     *
+     *  The lock must be held by the caller; it is released while the job
+     *  runs.
+     */
+    void run_claimed(Batch * batch, WorkJob * job, ContextLocker & lock);
+
+    /** Run jobs from any batch until the pool is stopped.
+     */
+    void work();
+
+    WorkPool(const WorkPool &);
+    void operator=(const WorkPool &);
+  public:
+    WorkPool();
+
+    /** Destroy the pool.
+     *
+     *  Stops and joins the threads, which must not be busy with a batch.
+     */
+    ~WorkPool();
+
+    /** Start a number of threads in the pool.
+     *
+     *  Returns false if any thread failed to start.
+     */
+    bool start(unsigned count);
+
+    /** Get the number of threads in the pool.
+     */
+    size_t size() const {
+	return threads.size();
+    }
+
+    /** Stop the threads in the pool, and wait for them to exit.
+     *
+     *  Batches run after this are run entirely by the caller.
+     */
+    void stop();
+
+    /** Run a batch of jobs, returning when they have all finished.
+     *
+     *  The jobs are run in parallel by the calling thread and any idle
+     *  threads in the pool.  Ownership of the jobs stays with the caller.
+     *
+     *  Returns false if any job raised an exception.
+     */
+    bool run_jobs(const std::vector<WorkJob *> & jobs);
+};
+
+#endif /* RESTPOSE_INCLUDED_WORKPOOL_H */
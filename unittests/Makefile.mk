@@ -6,19 +6,28 @@ TESTS += unittest$(EXEEXT)
 unittest_SOURCES = \
  unittests/category_hierarchy.cc \
  unittests/collection.cc \
+ unittests/commit_policy.cc \
+ unittests/compression.cc \
+ unittests/dbgroup/idfilter.cc \
  unittests/docdata.cc \
  unittests/doctojson.cc \
  unittests/jsonmanip/conditionals.cc \
  unittests/jsonmanip/mapping.cc \
  unittests/jsonmanip/walker.cc \
+ unittests/jsonparser.cc \
  unittests/ngramcat/categoriser.cc \
  unittests/ngramcat/profile.cc \
  unittests/pipe.cc \
+ unittests/postingsources/docid_bitmap.cc \
  unittests/schema.cc \
  unittests/search.cc \
  unittests/server/checkpoints.cc \
+ unittests/server/result_cache.cc \
+ unittests/server/task_queue_group.cc \
+ unittests/server/write_ack.cc \
  unittests/slotname.cc \
- unittests/threadsafequeue.cc
+ unittests/threadsafequeue.cc \
+ unittests/workpool.cc
 
 unittest_SOURCES += \
  unittests/runner.cc
@@ -28,14 +28,19 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include "jsonxapian/bulk_load.h"
 #include "jsonxapian/collection.h"
 #include "jsonxapian/collection_pool.h"
 #include "jsonxapian/doctojson.h"
 #include "jsonxapian/indexing.h"
 #include "jsonxapian/pipe.h"
+#include "server/journal.h"
 #include "server/task_manager.h"
+#include <sstream>
+#include "str.h"
 #include "utils.h"
 #include "utils/jsonutils.h"
+#include "utils/rmdir.h"
 #include "utils/rsperrors.h"
 
 #ifdef __WIN32__
@@ -317,6 +322,92 @@ TEST(CollectionAddViaPipe)
     pool.release(c);
 }
 
+/// Test that cached readers are reused, and see changes once committed.
+TEST(CollectionReaderReuse)
+{
+    TempDir path("jsonxapian");
+    CollectionPool pool(path.get());
+    Collection * w = pool.get_writable("default");
+    w->commit();
+
+    Collection * r = pool.get_readonly("default");
+    Collection * first = r;
+    CHECK_EQUAL(0u, r->doc_count());
+    pool.release(r);
+
+    Json::Value tmp;
+    w->add_doc(json_unserialise("{\"id\": \"1\"}", tmp), "default");
+    r = pool.get_readonly("default");
+    CHECK(r == first);
+    CHECK_EQUAL(0u, r->doc_count());
+    pool.release(r);
+
+    w->commit();
+    r = pool.get_readonly("default");
+    CHECK(r == first);
+    CHECK_EQUAL(1u, r->doc_count());
+    pool.release(r);
+    pool.release(w);
+}
+
+/// Test loading documents into a collection in bulk.
+TEST(CollectionBulkLoad)
+{
+    TempDir path("jsonxapian");
+    Collection c("test", path.get() + "/test");
+    c.open_writable();
+
+    std::istringstream input(
+	"{\"type\": \"default\", \"id\": \"1\", \"text\": \"hello\"}\n"
+	"\n"
+	"{\"type\": \"default\", \"id\": \"2\", \"text\": \"world\"}\n"
+	"not json\n"
+	"{\"type\": \"default\", \"id\": \"1\", \"text\": \"again\"}\n");
+    BulkLoadResult result;
+    bulk_load(c, input, 2, result);
+    CHECK_EQUAL(5u, result.lines);
+    CHECK_EQUAL(3u, result.loaded);
+    CHECK_EQUAL(1u, result.failed);
+    CHECK_EQUAL(1u, result.errors.size());
+    CHECK_EQUAL(2u, c.doc_count());
+
+    // The field seen during the load is added to the schema.
+    Json::Value tmp;
+    c.get_schema("default").to_json(tmp);
+    CHECK(tmp["fields"].isMember("text"));
+
+    // Only empty collections can be loaded into.
+    std::istringstream input2("{\"type\": \"default\", \"id\": \"3\"}\n");
+    CHECK_THROW(bulk_load(c, input2, 1, result), InvalidStateError);
+    CHECK_EQUAL(2u, c.doc_count());
+}
+
+/// Test that a bulk load keeps the last version of a document which appears
+/// in several batches of input.
+TEST(CollectionBulkLoadDuplicateAcrossBatches)
+{
+    TempDir path("jsonxapian");
+    Collection c("test", path.get() + "/test");
+    c.open_writable();
+
+    std::string lines(
+	"{\"type\": \"default\", \"id\": \"dup\", \"text\": \"first\"}\n");
+    for (int i = 0; i != 2500; ++i) {
+	lines += "{\"type\": \"default\", \"id\": \"" + str(i) + "\"}\n";
+    }
+    lines += "{\"type\": \"default\", \"id\": \"dup\", \"text\": \"last\"}\n";
+    std::istringstream input(lines);
+    BulkLoadResult result;
+    bulk_load(c, input, 4, result);
+    CHECK_EQUAL(2502u, result.loaded);
+    CHECK_EQUAL(0u, result.failed);
+    CHECK_EQUAL(2501u, c.doc_count());
+
+    Json::Value tmp;
+    c.get_document("default", "dup", tmp);
+    CHECK_EQUAL("[\"last\"]", json_serialise(tmp["data"]["text"]));
+}
+
 /// Test using a categoriser in a collection.
 TEST(CollectionCategoriser)
 {
@@ -652,3 +743,95 @@ TEST(MetaInfoMissing)
 		    json_serialise(doc_to_json(xdoc, tmp)));
     }
 }
+
+/// Test recording changes in a collection's journal, and reading them back.
+TEST(CollectionJournal)
+{
+    TempDir path("jsonxapian");
+    std::string dir = path.get() + "/test";
+    std::vector<std::string> paths;
+    {
+	CollectionJournal journal(dir);
+	journal.recover(paths);
+	CHECK_EQUAL(0u, paths.size());
+
+	Json::Value doc(Json::objectValue);
+	doc["text"] = "hello";
+	std::string records;
+	JournalRecord::append_index(records, "default", "1", doc);
+	JournalRecord::append_delete(records, "default", "2");
+	unsigned segment;
+	CHECK(journal.start_append(segment));
+	CHECK(journal.finish_append(segment, &records));
+
+	// Changes which weren't accepted aren't recorded.
+	CHECK(journal.start_append(segment));
+	CHECK(journal.finish_append(segment, NULL));
+
+	// A segment isn't released while an append to it is pending.
+	CHECK(journal.start_append(segment));
+	journal.seal();
+	journal.take_unreleased(paths);
+	CHECK_EQUAL(0u, paths.size());
+	CHECK(journal.finish_append(segment, &records));
+	journal.take_unreleased(paths);
+	CHECK_EQUAL(1u, paths.size());
+
+	// Sealing an empty segment does nothing.
+	journal.seal();
+	journal.take_unreleased(paths);
+	CHECK_EQUAL(0u, paths.size());
+
+	// Leave a segment with an incomplete record at the end.
+	records.resize(0);
+	JournalRecord::append_delete(records, "default", "3");
+	std::string partial;
+	JournalRecord::append_delete(partial, "default", "4");
+	records += partial.substr(0, partial.size() - 1);
+	CHECK(journal.start_append(segment));
+	CHECK(journal.finish_append(segment, &records));
+    }
+
+    // The segments are found again after a restart.
+    CollectionJournal journal(dir);
+    journal.recover(paths);
+    CHECK_EQUAL(2u, paths.size());
+
+    std::vector<JournalRecord> records;
+    CHECK(CollectionJournal::read_records(paths[0], records));
+    CHECK_EQUAL(4u, records.size());
+    CHECK_EQUAL(JournalRecord::INDEX, records[0].type);
+    CHECK_EQUAL("default", records[0].doc_type);
+    CHECK_EQUAL("1", records[0].doc_id);
+    CHECK_EQUAL("{\"text\":\"hello\"}", json_serialise(records[0].doc));
+    CHECK_EQUAL(JournalRecord::DELETE, records[1].type);
+    CHECK_EQUAL("2", records[1].doc_id);
+
+    records.clear();
+    CHECK(!CollectionJournal::read_records(paths[1], records));
+    CHECK_EQUAL(1u, records.size());
+    CHECK_EQUAL("3", records[0].doc_id);
+
+    // New appends go to a new segment.
+    unsigned segment;
+    CHECK(journal.start_append(segment));
+    std::string more;
+    JournalRecord::append_delete(more, "default", "5");
+    CHECK(journal.finish_append(segment, &more));
+    journal.seal();
+    std::vector<std::string> sealed;
+    journal.take_unreleased(sealed);
+    CHECK_EQUAL(1u, sealed.size());
+    CHECK(sealed[0] != paths[0] && sealed[0] != paths[1]);
+
+    // Appends fail while the collection is being deleted, and don't
+    // recreate its directory.
+    rmdir_recursive(dir);
+    journal.start_delete();
+    CHECK(!journal.start_append(segment));
+    CHECK(!dir_exists(dir));
+    journal.finish_delete();
+    CHECK(journal.start_append(segment));
+    CHECK(journal.finish_append(segment, &more));
+    CHECK(dir_exists(dir));
+}
@@ -0,0 +1,77 @@
+/** @file commit_policy.cc
+ * @brief Tests for CommitPolicy
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "UnitTest++.h"
+#include "jsonxapian/commit_policy.h"
+#include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
+
+using namespace RestPose;
+
+TEST(CommitPolicyJson)
+{
+    CommitPolicy p;
+    Json::Value tmp;
+    CHECK(p.is_default());
+    CHECK_EQUAL("{\"ack_latency\":0.20,\"idle_time\":5.0,\"max_bytes\":0,"
+		"\"max_docs\":0,\"max_latency\":30.0}",
+		json_serialise(p.to_json(tmp)));
+
+    json_unserialise("{\"max_docs\": 1000, \"max_latency\": 2}", tmp);
+    p.from_json(tmp);
+    CHECK(!p.is_default());
+    CHECK_EQUAL(1000u, p.max_docs);
+    CHECK_EQUAL(0u, p.max_bytes);
+    CHECK_EQUAL(2.0, p.max_latency);
+    CHECK_EQUAL(5.0, p.idle_time);
+    CHECK_EQUAL(0.2, p.ack_latency);
+
+    json_unserialise("{\"idle_time\": -1}", tmp);
+    CHECK_THROW(p.from_json(tmp), InvalidValueError);
+    json_unserialise("[]", tmp);
+    CHECK_THROW(p.from_json(tmp), InvalidValueError);
+}
+
+TEST(CommitPolicyDue)
+{
+    CommitPolicy p;
+    p.max_docs = 10;
+    p.max_bytes = 1000;
+    p.max_latency = 2.0;
+
+    // Nothing pending.
+    CHECK(!p.commit_due(0, 0, 0.0, 100.0));
+
+    CHECK(!p.commit_due(9, 999, 100.0, 101.0));
+    CHECK(p.commit_due(10, 999, 100.0, 101.0));
+    CHECK(p.commit_due(9, 1000, 100.0, 101.0));
+    CHECK(p.commit_due(1, 1, 100.0, 102.0));
+
+    // Limits of 0 are ignored.
+    p.max_docs = 0;
+    p.max_bytes = 0;
+    p.max_latency = 0.0;
+    CHECK(!p.commit_due(1000000, 1000000, 100.0, 1000.0));
+}
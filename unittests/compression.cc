@@ -0,0 +1,88 @@
+/** @file compression.cc
+ * @brief Tests for zlib compression helpers
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "UnitTest++.h"
+#include "utils/compression.h"
+#include "utils/rsperrors.h"
+
+using namespace RestPose;
+
+/** Decompress a string, supplying it to the inflater in chunks of a given
+ *  size.
+ *
+ *  Returns "error" if decompression failed or the stream was incomplete.
+ */
+static std::string
+inflate_chunked(const std::string & input, size_t chunk_size)
+{
+    ZlibInflater inflater(true);
+    std::string result;
+    try {
+	for (size_t i = 0; i < input.size(); i += chunk_size) {
+	    inflater.set_input(input.data() + i,
+			       std::min(chunk_size, input.size() - i));
+	    std::string piece;
+	    while (inflater.read_output(piece)) {
+		result += piece;
+	    }
+	}
+    } catch(const CompressionError &) {
+	return "error";
+    }
+    if (!inflater.at_end()) {
+	return "error";
+    }
+    return result;
+}
+
+TEST(GzipRoundTrip)
+{
+    std::string input;
+    for (int i = 0; i != 10000; ++i) {
+	input += "Some repetitive text, with a number: ";
+	input += char('0' + i % 10);
+    }
+    std::string compressed = ZlibDeflater(6).gzip(input.data(), input.size());
+    CHECK(compressed.size() < input.size());
+
+    CHECK(inflate_chunked(compressed, compressed.size()) == input);
+    CHECK(inflate_chunked(compressed, 1) == input);
+    CHECK(inflate_chunked(compressed, 7) == input);
+
+    std::string empty = ZlibDeflater().gzip("", 0);
+    CHECK_EQUAL("", inflate_chunked(empty, 3));
+}
+
+TEST(GzipInvalid)
+{
+    std::string compressed = ZlibDeflater(1).gzip("Hello world", 11);
+    CHECK_EQUAL("Hello world", inflate_chunked(compressed, 4));
+
+    // Truncated stream.
+    CHECK_EQUAL("error", inflate_chunked(compressed.substr(0, 8), 4));
+
+    // Not compressed at all.
+    CHECK_EQUAL("error", inflate_chunked("Hello world", 4));
+}
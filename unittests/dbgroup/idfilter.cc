@@ -0,0 +1,99 @@
+/** @file idfilter.cc
+ * @brief Tests for the document ID filter.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "UnitTest++.h"
+#include "dbgroup/idfilter.h"
+#include "str.h"
+#include "utils/rsperrors.h"
+
+using namespace RestPose;
+
+TEST(IdFilterNoFalseNegatives)
+{
+    IdFilter filter;
+    filter.reset(1000);
+    for (int i = 0; i != 1000; ++i) {
+	filter.add("\tdoc\t" + str(i));
+    }
+    CHECK(!filter.is_full());
+    for (int i = 0; i != 1000; ++i) {
+	CHECK(filter.may_contain("\tdoc\t" + str(i)));
+    }
+
+    // False positives should be rare while the filter isn't full.
+    int false_positives = 0;
+    for (int i = 1000; i != 11000; ++i) {
+	if (filter.may_contain("\tdoc\t" + str(i))) {
+	    ++false_positives;
+	}
+    }
+    CHECK(false_positives < 300);
+
+    for (int i = 1000; i != 2000; ++i) {
+	filter.add("\tdoc\t" + str(i));
+    }
+    CHECK(filter.is_full());
+}
+
+TEST(IdFilterChunks)
+{
+    IdFilter filter;
+    filter.reset(1000000);
+    CHECK(filter.get_chunk_count() > 10);
+    for (size_t chunk = 0; chunk != filter.get_chunk_count(); ++chunk) {
+	CHECK(filter.is_chunk_modified(chunk));
+    }
+    filter.clear_modified();
+
+    // Adding an ID only modifies the chunks its bits are in.
+    filter.add("\tdoc\t1");
+    size_t modified = 0;
+    for (size_t chunk = 0; chunk != filter.get_chunk_count(); ++chunk) {
+	if (filter.is_chunk_modified(chunk)) {
+	    ++modified;
+	}
+    }
+    CHECK(modified >= 1);
+    CHECK(modified < filter.get_chunk_count());
+
+    for (int i = 0; i != 100; ++i) {
+	filter.add("\tdoc\t" + str(i));
+    }
+    IdFilter filter2;
+    filter2.reset(filter.get_capacity());
+    for (size_t chunk = 0; chunk != filter.get_chunk_count(); ++chunk) {
+	filter2.set_chunk(chunk, filter.get_chunk(chunk));
+    }
+    filter2.set_items(filter.get_items());
+    CHECK_EQUAL(filter.get_items(), filter2.get_items());
+    for (int i = 0; i != 100; ++i) {
+	CHECK(filter2.may_contain("\tdoc\t" + str(i)));
+    }
+
+    CHECK_THROW(filter2.set_chunk(0, ""), UnserialisationError);
+    CHECK_THROW(filter2.set_chunk(filter2.get_chunk_count(),
+				  filter.get_chunk(0)),
+		UnserialisationError);
+}
@@ -0,0 +1,119 @@
+/** @file jsonparser.cc
+ * @brief Tests for JsonStreamParser
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "UnitTest++.h"
+#include "utils/jsonparser.h"
+#include "utils/jsonutils.h"
+#include "utils/rsperrors.h"
+
+using namespace RestPose;
+
+/** Parse a string, supplying it to the parser in chunks of a given size.
+ *
+ *  Returns the reserialised result, or "error" if parsing failed.
+ */
+static std::string
+parse_chunked(const std::string & input, size_t chunk_size)
+{
+    JsonStreamParser parser;
+    Json::Value result;
+    try {
+	for (size_t i = 0; i < input.size(); i += chunk_size) {
+	    parser.parse(input.data() + i,
+			 std::min(chunk_size, input.size() - i));
+	}
+	parser.finish(result);
+    } catch(const InvalidValueError &) {
+	return "error";
+    }
+    return json_serialise(result);
+}
+
+/** Parse a string in one chunk, and in single byte chunks.
+ *
+ *  Returns "mismatch" if the results differ.
+ */
+static std::string
+parse(const std::string & input)
+{
+    std::string result = parse_chunked(input, input.size() + 1);
+    if (result != parse_chunked(input, 1)) {
+	return "mismatch";
+    }
+    return result;
+}
+
+TEST(JsonParserValues)
+{
+    CHECK_EQUAL("null", parse(""));
+    CHECK_EQUAL("null", parse("  \n"));
+    CHECK_EQUAL("null", parse("null"));
+    CHECK_EQUAL("true", parse("true"));
+    CHECK_EQUAL("false", parse(" false "));
+    CHECK_EQUAL("1", parse("1"));
+    CHECK_EQUAL("-12", parse("-12"));
+    CHECK_EQUAL("1500.0", parse("1.5e3"));
+    CHECK_EQUAL("18446744073709551615", parse("18446744073709551615"));
+    CHECK_EQUAL("-9223372036854775808", parse("-9223372036854775808"));
+    CHECK_EQUAL("\"hello\"", parse("\"hello\""));
+    CHECK_EQUAL("[]", parse("[ ]"));
+    CHECK_EQUAL("{}", parse("{ }"));
+    CHECK_EQUAL("[1,[2,{}],{\"a\":\"b\"}]", parse("[1, [2, {}], {\"a\": \"b\"}]"));
+    CHECK_EQUAL("{\"a\":1,\"b\":[true,false,null]}",
+		parse("{\"a\":1,\"b\":[true,false,null]} // comment"));
+    CHECK_EQUAL("{\"a\":1}", parse("/* comment */ {\"a\": 1}"));
+}
+
+TEST(JsonParserStrings)
+{
+    CHECK_EQUAL("\"a\\\\b\\\"c\\n\"", parse("\"a\\\\b\\\"c\\n\""));
+
+    Json::Value tmp;
+    json_unserialise(parse("\"\\u00e9\""), tmp);
+    CHECK_EQUAL("\xc3\xa9", tmp.asString());
+
+    // A surrogate pair is a single four byte character.
+    json_unserialise(parse("\"\\ud83d\\ude00\""), tmp);
+    CHECK_EQUAL("\xf0\x9f\x98\x80", tmp.asString());
+}
+
+TEST(JsonParserErrors)
+{
+    CHECK_EQUAL("error", parse("["));
+    CHECK_EQUAL("error", parse("[1,]"));
+    CHECK_EQUAL("error", parse("[[],]"));
+    CHECK_EQUAL("error", parse("{\"a\":{},}"));
+    CHECK_EQUAL("error", parse("[1 2]"));
+    CHECK_EQUAL("error", parse("{\"a\" 1}"));
+    CHECK_EQUAL("error", parse("{,}"));
+    CHECK_EQUAL("error", parse("[}"));
+    CHECK_EQUAL("error", parse("tru"));
+    CHECK_EQUAL("error", parse("truex"));
+    CHECK_EQUAL("error", parse("{\"a\":1}}"));
+    CHECK_EQUAL("error", parse("[-]"));
+    CHECK_EQUAL("error", parse("\"abc"));
+    CHECK_EQUAL("error", parse("\"\\ud800x\""));
+    CHECK_EQUAL("error", parse("\"\\q\""));
+}
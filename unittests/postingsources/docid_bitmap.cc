@@ -0,0 +1,92 @@
+/** @file docid_bitmap.cc
+ * @brief Tests for compressed sets of document IDs.
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "UnitTest++.h"
+#include "postingsources/docid_bitmap.h"
+#include <vector>
+
+using namespace RestPose;
+using namespace std;
+
+TEST(DocidBitmapIterate)
+{
+    // A sparse chunk, a dense chunk, and IDs on the chunk boundaries.
+    vector<Xapian::docid> docids;
+    for (Xapian::docid did = 1; did < 65536; did += 100) {
+	docids.push_back(did);
+    }
+    docids.push_back(65535);
+    for (Xapian::docid did = 65536; did < 131072; did += 4) {
+	docids.push_back(did);
+    }
+    docids.push_back(131071);
+    docids.push_back(1000000);
+    DocidBitmap bitmap(docids);
+    CHECK_EQUAL(docids.size(), bitmap.size());
+
+    DocidBitmap::Cursor cursor(bitmap);
+    for (vector<Xapian::docid>::const_iterator i = docids.begin();
+	 i != docids.end(); ++i) {
+	CHECK(cursor.next());
+	CHECK_EQUAL(*i, cursor.get_docid());
+	CHECK(bitmap.contains(*i));
+    }
+    CHECK(!cursor.next());
+    CHECK(cursor.at_end());
+
+    CHECK(!bitmap.contains(2));
+    CHECK(!bitmap.contains(65537));
+    CHECK(!bitmap.contains(999999));
+    CHECK(!bitmap.contains(2000000));
+}
+
+TEST(DocidBitmapSkipTo)
+{
+    vector<Xapian::docid> docids;
+    for (Xapian::docid did = 70000; did < 80000; did += 2) {
+	docids.push_back(did);
+    }
+    docids.push_back(300000);
+    DocidBitmap bitmap(docids);
+
+    DocidBitmap::Cursor cursor(bitmap);
+    CHECK(cursor.skip_to(5));
+    CHECK_EQUAL(70000u, cursor.get_docid());
+    CHECK(cursor.skip_to(70001));
+    CHECK_EQUAL(70002u, cursor.get_docid());
+    // Never moves backwards.
+    CHECK(cursor.skip_to(10));
+    CHECK_EQUAL(70002u, cursor.get_docid());
+    CHECK(cursor.skip_to(79999));
+    CHECK_EQUAL(300000u, cursor.get_docid());
+    CHECK(!cursor.skip_to(300001));
+    CHECK(cursor.at_end());
+
+    DocidBitmap empty((vector<Xapian::docid>()));
+    DocidBitmap::Cursor empty_cursor(empty);
+    CHECK(!empty_cursor.next());
+    CHECK(empty_cursor.at_end());
+    CHECK(empty.bytes() < bitmap.bytes());
+}
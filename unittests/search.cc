@@ -30,6 +30,7 @@
 #include "jsonxapian/doctojson.h"
 #include "jsonxapian/indexing.h"
 #include "jsonxapian/schema.h"
+#include "jsonxapian/search_template.h"
 #include "utils/rmdir.h"
 #include "utils/rsperrors.h"
 #include "utils/jsonutils.h"
@@ -153,6 +154,183 @@ TEST(SearchIntegerExactFields)
 		    json_serialise(search_results));
     }
 
+    // Check a search using a template, with the type filter built in advance
+    {
+	SearchTemplate tmpl;
+	string tmpl_str = "{\"query\":{\"and\":[{\"field\":[\"type\",\"is\",[\"testtype\"]]},{\"field\":[\"intid\",\"is\",{\"$param\":\"intid\"}]}]},\"size\":{\"$param\":\"size\",\"default\":10}}";
+	tmpl.from_json(json_unserialise(tmpl_str, tmp));
+	coll.set_search_template("byintid", tmpl);
+	CHECK_THROW(coll.get_search_plan("missing", ""), InvalidValueError);
+
+	const SearchTemplatePlan & plan(coll.get_search_plan("byintid", ""));
+	Json::Value params, search;
+	CompiledQuery compiled;
+	CHECK_THROW(plan.expand(params, search, compiled), InvalidValueError);
+	plan.expand(json_unserialise("{\"intid\":[31]}", params), search,
+		    compiled);
+	CHECK_EQUAL(1u, compiled.subqueries->size());
+
+	Json::Value search_results(Json::objectValue);
+	coll.perform_search(search, "", search_results, NULL, 0.0, NULL,
+			    &compiled);
+	CHECK_EQUAL("{\"check_at_least\":0,\"from\":0,\"items\":[{\"intid\":[31]}],\"matches_estimated\":1,\"matches_lower_bound\":1,\"matches_upper_bound\":1,\"size_requested\":10,\"total_docs\":2}",
+		    json_serialise(search_results));
+
+	// Estimating the cost builds the query, which the search then uses.
+	CHECK(!compiled.is_built);
+	(void) coll.estimate_search_cost(search, "", &compiled);
+	CHECK(compiled.is_built);
+	search_results = Json::objectValue;
+	coll.perform_search(search, "", search_results, NULL, 0.0, NULL,
+			    &compiled);
+	CHECK_EQUAL("{\"check_at_least\":0,\"from\":0,\"items\":[{\"intid\":[31]}],\"matches_estimated\":1,\"matches_lower_bound\":1,\"matches_upper_bound\":1,\"size_requested\":10,\"total_docs\":2}",
+		    json_serialise(search_results));
+    }
+
     coll.close();
     rmdir_recursive("tmp_testdir");
 }
+
+/// Add a document to a collection, from its JSON representation.
+static void
+add_doc(Collection & coll, const string & doc_str)
+{
+    Json::Value value;
+    string idterm;
+    IndexingErrors errors;
+    bool new_fields(false);
+    Xapian::Document doc(coll.get_config().process_doc(
+	json_unserialise(doc_str, value), "", "", idterm, errors, new_fields));
+    CHECK_EQUAL(0u, errors.errors.size());
+    coll.raw_update_doc(doc, idterm);
+}
+
+/// Test searches which match their filters from the filter cache.
+TEST(SearchCachedFilters)
+{
+    rmdir_recursive("tmp_testdir");
+    mkdir("tmp_testdir", 0777);
+    Collection writer("test", "tmp_testdir/test");
+    Json::Value tmp;
+    Schema s("testtype");
+    s.set("id", new IDFieldConfig(""));
+    s.set("type", new ExactFieldConfig("type", 30, ExactFieldConfig::TOOLONG_ERROR, "", 0, false));
+    s.set("intid", new ExactFieldConfig("intid", 30, ExactFieldConfig::TOOLONG_ERROR, "intid", 0, false));
+    writer.open_writable();
+    writer.set_schema("testtype", s);
+    add_doc(writer, "{\"id\": 1, \"intid\": 1, \"type\": \"testtype\"}");
+    add_doc(writer, "{\"id\": 2, \"intid\": 2, \"type\": \"testtype\"}");
+    add_doc(writer, "{\"id\": 3, \"intid\": 3, \"type\": \"testtype\"}");
+    writer.commit();
+
+    Collection reader("test", "tmp_testdir/test");
+    reader.set_filter_cache_size(1024 * 1024);
+    reader.open_readonly();
+
+    string search_str = "{\"query\":{\"filter\":[{\"matchall\":true},{\"field\":[\"intid\",\"is\",[1,2]]}]}}";
+    string verbose_str = "{\"query\":{\"filter\":[{\"matchall\":true},{\"field\":[\"intid\",\"is\",[1,2]]}]},\"verbose\":true}";
+
+    // The first use of the filters doesn't cache them.
+    Json::Value uncached_results(Json::objectValue);
+    reader.perform_search(json_unserialise(search_str, tmp), "testtype",
+			  uncached_results);
+    CHECK_EQUAL("[{\"intid\":[1]},{\"intid\":[2]}]",
+		json_serialise(uncached_results["items"]));
+
+    // The second use does.
+    {
+	Json::Value search_results(Json::objectValue);
+	reader.perform_search(json_unserialise(verbose_str, tmp), "testtype",
+			      search_results);
+	CHECK(search_results["query_description"].asString().find(
+		"FilterBitmapSource") != string::npos);
+    }
+
+    // Searches matching from the cache get the same results.
+    for (int i = 0; i != 2; ++i) {
+	Json::Value search_results(Json::objectValue);
+	reader.perform_search(json_unserialise(search_str, tmp), "testtype",
+			      search_results);
+	CHECK_EQUAL(json_serialise(uncached_results),
+		    json_serialise(search_results));
+    }
+
+    // After a change is committed and the reader reopened, the cached
+    // documents are rebuilt.
+    add_doc(writer, "{\"id\": 4, \"intid\": 2, \"type\": \"testtype\"}");
+    writer.commit();
+    reader.open_readonly();
+    {
+	Json::Value search_results(Json::objectValue);
+	reader.perform_search(json_unserialise(verbose_str, tmp), "testtype",
+			      search_results);
+	CHECK(search_results["query_description"].asString().find(
+		"FilterBitmapSource") != string::npos);
+	CHECK_EQUAL("[{\"intid\":[1]},{\"intid\":[2]},{\"intid\":[2]}]",
+		    json_serialise(search_results["items"]));
+	CHECK_EQUAL(3, search_results["matches_estimated"].asInt());
+	CHECK_EQUAL(4, search_results["total_docs"].asInt());
+    }
+
+    reader.close();
+    writer.close();
+    rmdir_recursive("tmp_testdir");
+}
+
+/// Test that filters whose bitmaps don't fit in the cache stop being cached.
+TEST(SearchCachedFiltersOverBudget)
+{
+    rmdir_recursive("tmp_testdir");
+    mkdir("tmp_testdir", 0777);
+    Collection writer("test", "tmp_testdir/test");
+    Json::Value tmp;
+    Schema s("testtype");
+    s.set("id", new IDFieldConfig(""));
+    s.set("type", new ExactFieldConfig("type", 30, ExactFieldConfig::TOOLONG_ERROR, "", 0, false));
+    s.set("intid", new ExactFieldConfig("intid", 30, ExactFieldConfig::TOOLONG_ERROR, "intid", 0, false));
+    writer.open_writable();
+    writer.set_schema("testtype", s);
+    add_doc(writer, "{\"id\": 1, \"intid\": 1, \"type\": \"testtype\"}");
+    add_doc(writer, "{\"id\": 2, \"intid\": 2, \"type\": \"testtype\"}");
+    add_doc(writer, "{\"id\": 3, \"intid\": 3, \"type\": \"testtype\"}");
+    writer.commit();
+
+    // Too small for any bitmap.
+    Collection reader("test", "tmp_testdir/test");
+    reader.set_filter_cache_size(1);
+    reader.open_readonly();
+
+    string verbose_str = "{\"query\":{\"filter\":[{\"matchall\":true},{\"field\":[\"intid\",\"is\",[1,2]]}]},\"verbose\":true}";
+
+    // The second use tries to match from the cache, and finds that the
+    // bitmap doesn't fit; later uses match the filter directly.
+    for (int i = 0; i != 4; ++i) {
+	Json::Value search_results(Json::objectValue);
+	reader.perform_search(json_unserialise(verbose_str, tmp), "testtype",
+			      search_results);
+	CHECK_EQUAL(i == 1, search_results["query_description"].asString().find(
+		"FilterBitmapSource") != string::npos);
+	CHECK_EQUAL("[{\"intid\":[1]},{\"intid\":[2]}]",
+		    json_serialise(search_results["items"]));
+    }
+
+    // Reopening the reader gives the filter another chance to be cached.
+    // Its earlier uses still count, so it is cached straight away.
+    reader.set_filter_cache_size(1024 * 1024);
+    add_doc(writer, "{\"id\": 4, \"intid\": 2, \"type\": \"testtype\"}");
+    writer.commit();
+    reader.open_readonly();
+    for (int i = 0; i != 2; ++i) {
+	Json::Value search_results(Json::objectValue);
+	reader.perform_search(json_unserialise(verbose_str, tmp), "testtype",
+			      search_results);
+	CHECK(search_results["query_description"].asString().find(
+		"FilterBitmapSource") != string::npos);
+	CHECK_EQUAL("[{\"intid\":[1]},{\"intid\":[2]},{\"intid\":[2]}]",
+		    json_serialise(search_results["items"]));
+    }
+
+    reader.close();
+    writer.close();
+    rmdir_recursive("tmp_testdir");
+}
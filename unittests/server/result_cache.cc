@@ -0,0 +1,99 @@
+/** @file result_cache.cc
+ * @brief Tests for the search result cache
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <config.h>
+#include <json/json.h>
+#include "server/result_cache.h"
+#include "UnitTest++.h"
+#include "utils/jsonutils.h"
+
+using namespace RestPose;
+using namespace std;
+
+TEST(SearchResultCacheGeneration)
+{
+    SearchResultCache cache(100000);
+    Json::Value search(Json::objectValue);
+    search["size"] = 10;
+    string key = SearchResultCache::make_key("coll", "type", search);
+    string body;
+
+    CHECK(!cache.get(key, 1, body));
+    cache.set(key, 1, "{\"items\":[]}");
+    CHECK(cache.get(key, 1, body));
+    CHECK_EQUAL("{\"items\":[]}", body);
+
+    // A later generation invalidates the entry.
+    CHECK(!cache.get(key, 2, body));
+    CHECK(!cache.get(key, 1, body));
+
+    // Results for other document types are separate.
+    cache.set(key, 2, "{\"items\":[1]}");
+    CHECK(!cache.get(SearchResultCache::make_key("coll", "type2", search),
+		     2, body));
+
+    Json::Value tmp;
+    cache.get_status(tmp);
+    CHECK_EQUAL(1u, tmp["hits"].asUInt());
+    CHECK_EQUAL(4u, tmp["misses"].asUInt());
+    CHECK_EQUAL(1u, tmp["invalidations"].asUInt());
+    CHECK_EQUAL(1u, tmp["entries"].asUInt());
+}
+
+TEST(SearchResultCacheEviction)
+{
+    SearchResultCache cache(8000);
+    string body(900, 'x');
+    string out;
+
+    cache.set("a", 1, body);
+    cache.set("b", 1, body);
+    CHECK(cache.get("a", 1, out));
+    for (int i = 0; i != 10; ++i) {
+	cache.set(string(1, char('c' + i)), 1, body);
+	CHECK(cache.get("a", 1, out));
+    }
+    // "a" was kept in use, so "b" was evicted first.
+    CHECK(!cache.get("b", 1, out));
+
+    // Results which are too large are not cached.
+    cache.set("big", 1, string(2000, 'x'));
+    CHECK(!cache.get("big", 1, out));
+
+    SearchResultCache disabled(0);
+    CHECK(!disabled.is_enabled());
+    disabled.set("a", 1, "x");
+    CHECK(!disabled.get("a", 1, out));
+}
+
+TEST(SearchResultCacheKeyIgnoresTimeout)
+{
+    Json::Value search(Json::objectValue);
+    search["size"] = 10;
+    string key = SearchResultCache::make_key("coll", "", search);
+    search["timeout"] = 1.5;
+    CHECK_EQUAL(key, SearchResultCache::make_key("coll", "", search));
+    CHECK_EQUAL(1.5, search["timeout"].asDouble());
+    search["size"] = 20;
+    CHECK(key != SearchResultCache::make_key("coll", "", search));
+}
@@ -0,0 +1,232 @@
+/** @file task_queue_group.cc
+ * @brief Tests for scheduling in TaskQueueGroup
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "server/task_queue_group.h"
+
+#include "UnitTest++.h"
+#include <string>
+#include "str.h"
+
+using namespace RestPose;
+
+class TestTask : public Task {
+  public:
+    std::string name;
+    TestTask(const std::string & name_, TaskPriority priority_)
+	    : Task(), name(name_)
+    {
+	priority = priority_;
+    }
+};
+
+/** Pop a task, and return its name.  The previous task is marked completed.
+ */
+static std::string
+pop_name(TaskQueueGroup & group, std::string & key, Task * & task)
+{
+    Task * newtask = group.pop_any(key, task);
+    delete task;
+    task = newtask;
+    if (task == NULL) {
+	return "";
+    }
+    return static_cast<TestTask *>(task)->name;
+}
+
+/** Test that tasks are popped in priority order. */
+TEST(TaskQueueGroupPriorities)
+{
+    TaskQueueGroup group(100, 200);
+    group.push("search", new TestTask("b1", PRIORITY_BATCH), false);
+    group.push("search", new TestTask("i1", PRIORITY_INTERACTIVE), false);
+    group.push("status", new TestTask("a1", PRIORITY_ADMIN), false);
+    group.push("search", new TestTask("i2", PRIORITY_INTERACTIVE), false);
+    group.close();
+
+    std::string key;
+    Task * task = NULL;
+    CHECK_EQUAL("a1", pop_name(group, key, task));
+    CHECK_EQUAL("status", key);
+    CHECK_EQUAL("i1", pop_name(group, key, task));
+    CHECK_EQUAL("i2", pop_name(group, key, task));
+    CHECK_EQUAL("b1", pop_name(group, key, task));
+    CHECK_EQUAL("", pop_name(group, key, task));
+}
+
+/** Test that batch tasks get a turn even while interactive tasks wait. */
+TEST(TaskQueueGroupBatchProgress)
+{
+    TaskQueueGroup group(100, 200);
+    group.push("search", new TestTask("b1", PRIORITY_BATCH), false);
+    for (int i = 1; i <= 6; ++i) {
+	group.push("search",
+		   new TestTask("i" + str(i), PRIORITY_INTERACTIVE), false);
+    }
+    group.close();
+
+    std::string key;
+    Task * task = NULL;
+    std::string order;
+    while (true) {
+	std::string name = pop_name(group, key, task);
+	if (name.empty()) {
+	    break;
+	}
+	order += name + ",";
+    }
+    CHECK_EQUAL("i1,i2,i3,i4,b1,i5,i6,", order);
+}
+
+/** Test the limit on the number of batch tasks in progress. */
+TEST(TaskQueueGroupBatchLimit)
+{
+    TaskQueueGroup group(100, 200);
+    group.set_batch_limit(1);
+    group.push("search", new TestTask("b1", PRIORITY_BATCH), false);
+    group.push("search", new TestTask("b2", PRIORITY_BATCH), false);
+
+    std::string key;
+    Task * b1 = group.pop_any(key, NULL);
+    CHECK_EQUAL("b1", static_cast<TestTask *>(b1)->name);
+
+    // b2 can't start while b1 is in progress, but an interactive task can.
+    group.push("search", new TestTask("i1", PRIORITY_INTERACTIVE), false);
+    Task * i1 = group.pop_any(key, NULL);
+    CHECK_EQUAL("i1", static_cast<TestTask *>(i1)->name);
+    group.completed(key, i1);
+    delete i1;
+
+    // Completing b1 lets b2 start.
+    Task * task = b1;
+    CHECK_EQUAL("b2", pop_name(group, key, task));
+    group.close();
+    CHECK_EQUAL("", pop_name(group, key, task));
+}
+
+/** Pop a task for a worker, and return its name.  The previous task is
+ *  marked completed.
+ */
+static std::string
+pop_worker_name(TaskQueueGroup & group, TaskQueueGroup::Worker & worker,
+		std::string & key, Task * & task)
+{
+    Task * newtask = group.pop_any(worker, key, task);
+    delete task;
+    task = newtask;
+    if (task == NULL) {
+	return "";
+    }
+    return static_cast<TestTask *>(task)->name;
+}
+
+/** Test that workers claim runs of tasks, and steal from each other. */
+TEST(TaskQueueGroupWorkers)
+{
+    TaskQueueGroup group(100, 200);
+    TaskQueueGroup::Worker worker1;
+    TaskQueueGroup::Worker worker2;
+    group.add_worker(worker1);
+    group.add_worker(worker2);
+    for (int i = 1; i <= 4; ++i) {
+	group.push("search",
+		   new TestTask("i" + str(i), PRIORITY_INTERACTIVE), false);
+    }
+    group.close();
+
+    // worker1 claims half of the queue, and worker2 half of the rest.
+    std::string key1, key2;
+    Task * task1 = NULL;
+    Task * task2 = NULL;
+    CHECK_EQUAL("i1", pop_worker_name(group, worker1, key1, task1));
+    CHECK_EQUAL("search", key1);
+    CHECK_EQUAL("i3", pop_worker_name(group, worker2, key2, task2));
+    CHECK_EQUAL("i4", pop_worker_name(group, worker2, key2, task2));
+
+    // The queue is now empty, so worker2 steals from worker1.
+    CHECK_EQUAL("i2", pop_worker_name(group, worker2, key2, task2));
+    CHECK_EQUAL("search", key2);
+
+    Json::Value status;
+    group.get_status(status);
+    CHECK_EQUAL(2u, status["search"]["in_progress"].asUInt());
+
+    CHECK_EQUAL("", pop_worker_name(group, worker1, key1, task1));
+    CHECK_EQUAL("", pop_worker_name(group, worker2, key2, task2));
+    group.get_status(status);
+    CHECK_EQUAL(0u, status.size());
+
+    group.remove_worker(worker1, NULL);
+    group.remove_worker(worker2, NULL);
+}
+
+/** Test several handlers on a queue, with tasks kept in sequence. */
+TEST(TaskQueueGroupHandlers)
+{
+    TaskQueueGroup group(100, 200);
+    group.set_max_handlers(2);
+    TestTask * task1 = new TestTask("t1", PRIORITY_INTERACTIVE);
+    task1->sequence_key = 5;
+    TestTask * task2 = new TestTask("t2", PRIORITY_INTERACTIVE);
+    task2->sequence_key = 7;
+    TestTask * task3 = new TestTask("t3", PRIORITY_INTERACTIVE);
+    task3->sequence_key = 5;
+    group.push("coll", task1, false);
+    group.push("coll", task2, false);
+    group.push("coll", task3, false);
+
+    std::string assignment1, assignment2;
+    bool is_finished;
+    CHECK(group.assign_handler(assignment1));
+    CHECK_EQUAL("coll", assignment1);
+    Task * popped1 = group.pop_from("coll", RealTime::now() + 1.0,
+				    is_finished, NULL, "");
+    CHECK_EQUAL(task1, popped1);
+
+    // A second handler is assigned, since t2 can run alongside t1.
+    CHECK(group.assign_handler(assignment2));
+    CHECK_EQUAL("coll", assignment2);
+    Task * popped2 = group.pop_from("coll", RealTime::now() + 1.0,
+				    is_finished, NULL, "");
+    CHECK_EQUAL(task2, popped2);
+
+    // t3 has the same sequence key as t1, so must wait for it.
+    Task * popped3 = group.pop_from("coll", RealTime::now() + 0.01,
+				    is_finished, popped2, "coll");
+    CHECK(popped3 == NULL);
+    CHECK(!is_finished);
+    delete popped2;
+    popped3 = group.pop_from("coll", RealTime::now() + 1.0,
+			     is_finished, popped1, "coll");
+    CHECK_EQUAL(task3, popped3);
+    delete popped1;
+
+    group.completed("coll", popped3);
+    delete popped3;
+    group.unassign_handler(assignment1);
+    group.unassign_handler(assignment2);
+    Json::Value status;
+    group.get_status(status);
+    CHECK_EQUAL(0u, status.size());
+}
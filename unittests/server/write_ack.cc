@@ -0,0 +1,75 @@
+/** @file write_ack.cc
+ * @brief Tests for acknowledgements of write requests
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "httpserver/response.h"
+#include "server/write_ack.h"
+#include "UnitTest++.h"
+
+using namespace RestPose;
+using namespace std;
+
+TEST(WriteAckSucceeded)
+{
+    ResultHandle handle;
+    {
+	WriteAck ack(handle, ACK_PROCESSED);
+	CHECK(!handle.is_ready());
+	ack.succeeded();
+	CHECK(handle.is_ready());
+    }
+    CHECK_EQUAL(200, handle.response().get_status_code());
+}
+
+TEST(WriteAckDestroyedPending)
+{
+    ResultHandle handle;
+    {
+	WriteAck ack(handle, ACK_COMMITTED);
+	WriteAck * copy = new WriteAck(ack);
+
+	// Another copy remains, which may still respond.
+	delete copy;
+	CHECK(!handle.is_ready());
+    }
+
+    // The last copy was destroyed without responding.
+    CHECK(handle.is_ready());
+    CHECK_EQUAL(500, handle.response().get_status_code());
+}
+
+TEST(WriteAckCopyResponds)
+{
+    ResultHandle handle;
+    WriteAck * copy = NULL;
+    {
+	WriteAck ack(handle, ACK_COMMITTED);
+	copy = new WriteAck(ack);
+    }
+    CHECK(!handle.is_ready());
+    copy->committed();
+    delete copy;
+    CHECK(handle.is_ready());
+    CHECK_EQUAL(200, handle.response().get_status_code());
+}
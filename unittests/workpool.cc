@@ -0,0 +1,87 @@
+/** @file workpool.cc
+ * @brief Tests for WorkPool
+ */
+/* Copyright (c) 2011 Richard Boulton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "utils/workpool.h"
+
+#include "UnitTest++.h"
+#include "utils/rsperrors.h"
+#include <vector>
+
+/** A job which records that it was run, and optionally fails.
+ */
+class FlagJob : public WorkJob {
+  public:
+    int runs;
+    bool fail;
+
+    FlagJob(bool fail_ = false) : runs(0), fail(fail_) {}
+
+    void run() {
+	++runs;
+	if (fail) {
+	    throw RestPose::InvalidValueError("Job failed");
+	}
+    }
+};
+
+static void
+run_batch(WorkPool & pool, size_t count, bool fail_one, bool expected)
+{
+    std::vector<FlagJob> jobs(count);
+    if (fail_one) {
+	jobs[count / 2].fail = true;
+    }
+    std::vector<WorkJob *> ptrs;
+    for (size_t i = 0; i != count; ++i) {
+	ptrs.push_back(&jobs[i]);
+    }
+    CHECK_EQUAL(expected, pool.run_jobs(ptrs));
+    for (size_t i = 0; i != count; ++i) {
+	CHECK_EQUAL(1, jobs[i].runs);
+    }
+}
+
+/// Test running jobs in a pool without threads, which runs them inline.
+TEST(WorkPoolNoThreads)
+{
+    WorkPool pool;
+    CHECK_EQUAL(0u, pool.size());
+    run_batch(pool, 10, false, true);
+    run_batch(pool, 10, true, false);
+}
+
+/// Test that each job in a batch is run exactly once.
+TEST(WorkPoolThreads)
+{
+    WorkPool pool;
+    CHECK(pool.start(4));
+    CHECK_EQUAL(4u, pool.size());
+    for (int i = 0; i != 100; ++i) {
+	run_batch(pool, 1 + i % 17, i % 5 == 0, i % 5 != 0);
+    }
+    pool.stop();
+    CHECK_EQUAL(0u, pool.size());
+    run_batch(pool, 3, false, true);
+}